@@ -29,10 +29,14 @@ void set_control_parameter(const char* parameter_name, const char* val, ControlI
     else if (strcmp("bootstrapping_full_output_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->bootstrapping_full_output_flag);
     else if (strcmp("bootstrapping_num_estimates", parameter_name) == 0) sscanf(val, "%d", &control_input->bootstrapping_num_estimates);
     else if (strcmp("bootstrapping_num_subsamples", parameter_name) == 0) sscanf(val, "%d", &control_input->bootstrapping_num_subsamples);
+    else if (strcmp("bootstrapping_block_size", parameter_name) == 0) sscanf(val, "%d", &control_input->bootstrapping_block_size);
+    else if (strcmp("bootstrapping_weight_style", parameter_name) == 0) sscanf(val, "%d", &control_input->bootstrapping_weight_style);
     else if (strcmp("random_num_seed", parameter_name) == 0) sscanf(val, "%lu", &control_input->random_num_seed);
     else if (strcmp("constrain_pressure_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->pressure_constraint_flag);
     else if (strcmp("volume_weighting_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->volume_weighting_flag);
     else if (strcmp("position_dimension", parameter_name) == 0) sscanf(val, "%d", &control_input->position_dimension);
+    else if (strcmp("site_reordering_style", parameter_name) == 0) sscanf(val, "%d", &control_input->site_reordering_style);
+    else if (strcmp("site_reordering_by_type", parameter_name) == 0) sscanf(val, "%d", &control_input->site_reordering_by_type);
     else if (strcmp("start_frame", parameter_name) == 0) sscanf(val, "%d", &control_input->starting_frame);
     else if (strcmp("n_frames", parameter_name) == 0) sscanf(val, "%d", &control_input->n_frames);
     else if (strcmp("nonbonded_cutoff", parameter_name) == 0) sscanf(val, "%lf", &control_input->pair_nonbonded_cutoff);
@@ -53,8 +57,32 @@ void set_control_parameter(const char* parameter_name, const char* val, ControlI
     else if (strcmp("primary_output_style", parameter_name) == 0) sscanf(val, "%d", &control_input->output_style);
     else if (strcmp("itnlim", parameter_name) == 0) sscanf(val, "%d", &control_input->itnlim);
     else if (strcmp("rcond", parameter_name) == 0) sscanf(val, "%lf", &control_input->rcond);
+    else if (strcmp("dense_solver_style", parameter_name) == 0) sscanf(val, "%d", &control_input->dense_solver_style);
+    else if (strcmp("normal_matrix_storage_style", parameter_name) == 0) sscanf(val, "%d", &control_input->normal_matrix_storage_style);
+    else if (strcmp("normal_summation_style", parameter_name) == 0) sscanf(val, "%d", &control_input->normal_summation_style);
+    else if (strcmp("frame_normal_form_precision", parameter_name) == 0) sscanf(val, "%d", &control_input->frame_normal_form_precision);
+    else if (strcmp("accumulation_accuracy_report_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->accumulation_accuracy_report_flag);
+    else if (strcmp("sparse_solver_style", parameter_name) == 0) sscanf(val, "%d", &control_input->sparse_solver_style);
+    else if (strcmp("krylov_max_iterations", parameter_name) == 0) sscanf(val, "%d", &control_input->krylov_max_iterations);
+    else if (strcmp("krylov_tolerance", parameter_name) == 0) sscanf(val, "%lf", &control_input->krylov_tolerance);
+    else if (strcmp("krylov_warm_start_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->krylov_warm_start_flag);
 	else if (strcmp("sparse_safety_factor", parameter_name) == 0) sscanf(val, "%lf", &control_input->sparse_safety_factor);
 	else if (strcmp("num_sparse_threads", parameter_name) == 0) sscanf(val, "%d", &control_input->num_sparse_threads);
+	else if (strcmp("num_solver_threads", parameter_name) == 0) sscanf(val, "%d", &control_input->num_solver_threads);
+	else if (strcmp("num_reduction_threads", parameter_name) == 0) sscanf(val, "%d", &control_input->num_reduction_threads);
+	else if (strcmp("accumulation_qr_threads", parameter_name) == 0) sscanf(val, "%d", &control_input->accumulation_qr_threads);
+	else if (strcmp("block_pipeline_depth", parameter_name) == 0) sscanf(val, "%d", &control_input->block_pipeline_depth);
+	else if (strcmp("checkpoint_interval_blocks", parameter_name) == 0) sscanf(val, "%d", &control_input->checkpoint_interval_blocks);
+	else if (strcmp("checkpoint_interval_minutes", parameter_name) == 0) sscanf(val, "%lf", &control_input->checkpoint_interval_minutes);
+	else if (strcmp("plan_memory_budget", parameter_name) == 0) sscanf(val, "%lf", &control_input->plan_memory_budget);
+	else if (strcmp("plan_auto_select_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->plan_auto_select_flag);
+	else if (strcmp("frame_store_style", parameter_name) == 0) sscanf(val, "%d", &control_input->frame_store_style);
+	else if (strcmp("model_variants_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->model_variants_flag);
+	else if (strcmp("range_finding_frames", parameter_name) == 0) sscanf(val, "%d", &control_input->range_finding_frames);
+	else if (strcmp("range_lower_quantile", parameter_name) == 0) sscanf(val, "%lf", &control_input->range_lower_quantile);
+	else if (strcmp("range_upper_quantile", parameter_name) == 0) sscanf(val, "%lf", &control_input->range_upper_quantile);
+	else if (strcmp("range_min_bin_count", parameter_name) == 0) sscanf(val, "%d", &control_input->range_min_bin_count);
+	else if (strcmp("num_range_finding_threads", parameter_name) == 0) sscanf(val, "%d", &control_input->num_range_finding_threads);
     else if (strcmp("max_pair_bonds_per_site", parameter_name) == 0) sscanf(val, "%d", &control_input->max_pair_bonds_per_site);
     else if (strcmp("max_angles_per_site", parameter_name) == 0) sscanf(val, "%d", &control_input->max_angles_per_site);
     else if (strcmp("max_dihedrals_per_site", parameter_name) == 0) sscanf(val, "%d", &control_input->max_dihedrals_per_site);
@@ -62,6 +90,10 @@ void set_control_parameter(const char* parameter_name, const char* val, ControlI
     else if (strcmp("lanyuan_iterative_method_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->iterative_calculation_flag);
     else if (strcmp("regularization_scalar", parameter_name) == 0) sscanf(val, "%lf", &control_input->tikhonov_regularization_param);
     else if (strcmp("regularization_style", parameter_name) == 0) sscanf(val, "%d", &control_input->regularization_style);
+    else if (strcmp("regularization_path_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->regularization_path_flag);
+    else if (strcmp("regularization_path_points", parameter_name) == 0) sscanf(val, "%d", &control_input->regularization_path_points);
+    else if (strcmp("regularization_path_min", parameter_name) == 0) sscanf(val, "%lf", &control_input->regularization_path_min);
+    else if (strcmp("regularization_path_max", parameter_name) == 0) sscanf(val, "%lf", &control_input->regularization_path_max);
     else if (strcmp("angle_type", parameter_name) == 0) sscanf(val, "%d", &control_input->angle_interaction_style);
     else if (strcmp("dihedral_type", parameter_name) == 0) sscanf(val, "%d", &control_input->dihedral_interaction_style);
     else if (strcmp("three_body_nonbonded_style", parameter_name) == 0) sscanf(val, "%d", &control_input->three_body_flag);
@@ -77,12 +109,14 @@ void set_control_parameter(const char* parameter_name, const char* val, ControlI
     else if (strcmp("output_residual_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->output_residual);
     else if (strcmp("bayesian_mscg_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->bayesian_flag);
     else if (strcmp("bayesian_max_iterations", parameter_name) == 0) sscanf(val, "%d", &control_input->bayesian_max_iter);
+    else if (strcmp("bayesian_solver_style", parameter_name) == 0) sscanf(val, "%d", &control_input->bayesian_solver_style);
     else if (strcmp("stillinger_weber_gamma", parameter_name) == 0) sscanf(val, "%lf", &control_input->gamma);
     else if (strcmp("three_body_nonbonded_exclusion_type", parameter_name) == 0) sscanf(val, "%d", &control_input->three_body_nonbonded_exclusion_flag);
 	else if (strcmp("excluded_style", parameter_name) == 0) sscanf(val, "%d", &control_input->excluded_style);
 	else if (strcmp("density_excluded_style", parameter_name) == 0) sscanf(val, "%d", &control_input->density_excluded_style);
     else if (strcmp("output_spline_coeffs_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->output_spline_coeffs_flag);
     else if (strcmp("output_normal_equations_rhs_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->output_normal_equations_rhs_flag);
+    else if (strcmp("output_BI_equations_flag", parameter_name) == 0) sscanf(val, "%d", &control_input->output_BI_equations_flag);
     else if (strcmp("output_pair_nonbonded_parameter_distribution", parameter_name) == 0) sscanf(val, "%d", &control_input->output_pair_nonbonded_parameter_distribution);
     else if (strcmp("output_pair_bond_parameter_distribution", parameter_name) == 0) sscanf(val, "%d", &control_input->output_pair_bond_parameter_distribution);
     else if (strcmp("output_angle_parameter_distribution", parameter_name) == 0) sscanf(val, "%d", &control_input->output_angle_parameter_distribution);
@@ -119,6 +153,8 @@ ControlInputs::ControlInputs(void)
     pressure_constraint_flag = 0;
     volume_weighting_flag = 0;
     position_dimension = 3;
+    site_reordering_style = 0;
+    site_reordering_by_type = 0;
     dynamic_types = 0;
     molecule_flag = 0;
     dynamic_state_sampling = 0;
@@ -127,6 +163,8 @@ ControlInputs::ControlInputs(void)
     bootstrapping_full_output_flag = 0;
 	bootstrapping_num_estimates = 1;
 	bootstrapping_num_subsamples = 1;
+	bootstrapping_block_size = 1;
+	bootstrapping_weight_style = 0;
     random_num_seed = 1;
     starting_frame = 1;
     n_frames = 10;
@@ -148,8 +186,32 @@ ControlInputs::ControlInputs(void)
     output_style = 0;
     itnlim = 0;
     rcond = -1.0;
+    dense_solver_style = 0;
+    normal_matrix_storage_style = 0;
+    normal_summation_style = 0;
+    frame_normal_form_precision = 0;
+    accumulation_accuracy_report_flag = 0;
+    sparse_solver_style = 0;
+    krylov_max_iterations = 0;
+    krylov_tolerance = 1.0e-12;
+    krylov_warm_start_flag = 0;
 	sparse_safety_factor = 0.20;
     num_sparse_threads = 1;
+    num_solver_threads = 1;
+    num_reduction_threads = 1;
+    accumulation_qr_threads = 1;
+    block_pipeline_depth = 0;
+    checkpoint_interval_blocks = 0;
+    checkpoint_interval_minutes = 0.0;
+    plan_memory_budget = 0.0;
+    plan_auto_select_flag = 0;
+    frame_store_style = 0;
+    model_variants_flag = 0;
+    range_finding_frames = 0;
+    range_lower_quantile = 0.0;
+    range_upper_quantile = 1.0;
+    range_min_bin_count = 0;
+    num_range_finding_threads = 1;
     max_pair_bonds_per_site = 4;
     max_angles_per_site = 12;
     max_dihedrals_per_site = 36;
@@ -157,6 +219,10 @@ ControlInputs::ControlInputs(void)
     iterative_calculation_flag = 0;
     tikhonov_regularization_param = 0.0;
     regularization_style = 0;
+    regularization_path_flag = 0;
+    regularization_path_points = 41;
+    regularization_path_min = 1.0e-6;
+    regularization_path_max = 1.0;
     angle_interaction_style = 0;
     dihedral_interaction_style = 0;
     three_body_flag = 0;
@@ -172,12 +238,14 @@ ControlInputs::ControlInputs(void)
     output_residual = 0;
     bayesian_flag = 0;
     bayesian_max_iter = 1;
+    bayesian_solver_style = 0;
     gamma = 0.12;
     three_body_nonbonded_exclusion_flag = 0;
     excluded_style = 2;
 	density_excluded_style = 0;
     output_spline_coeffs_flag = 0;
     output_normal_equations_rhs_flag = 0;
+    output_BI_equations_flag = 0;
     output_pair_nonbonded_parameter_distribution = 0;
     output_pair_bond_parameter_distribution = 0;
     output_angle_parameter_distribution = 0;
@@ -204,6 +272,13 @@ ControlInputs::ControlInputs(void)
         std::getline(control_in, line);
     }
     control_in.close();
+    
+    // The regularization path eigendecomposes a dense normal matrix, which only
+    // matrix_type 0 (dense) and 3 (sparse, dense normal) build.
+    if ( (regularization_path_flag != 0) && (matrix_type != 0) && (matrix_type != 3) ) {
+        fprintf(stderr, "The regularization path is only available for matrix_type 0 and 3, not matrix_type %d.\n", matrix_type);
+        exit(EXIT_FAILURE);
+    }
 }
 
 ControlInputs::~ControlInputs() 
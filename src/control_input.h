@@ -23,6 +23,8 @@ typedef struct ControlInputs {
     int use_statistical_reweighting;
 	int pressure_constraint_flag;
 	int position_dimension;
+	int site_reordering_style;
+	int site_reordering_by_type;
 	
 	// Additional features
 	int dynamic_types;
@@ -33,6 +35,8 @@ typedef struct ControlInputs {
     int bootstrapping_full_output_flag;
 	int bootstrapping_num_estimates;
 	int bootstrapping_num_subsamples;
+	int bootstrapping_block_size;
+	int bootstrapping_weight_style;
     uint_fast32_t random_num_seed;					// Only used when dynamic_state_sampling or bootstrapping_flag is 1
 
     // Interaction style specifications.
@@ -68,10 +72,12 @@ typedef struct ControlInputs {
     int output_style;
     int bayesian_flag;
 	int bayesian_max_iter;
+	int bayesian_solver_style;
     int output_solution_flag;    
     int output_residual;
     int output_spline_coeffs_flag;
     int output_normal_equations_rhs_flag;
+    int output_BI_equations_flag;
     double pair_nonbonded_output_binwidth;
     double pair_bond_output_binwidth;
     double angle_output_binwidth;
@@ -99,9 +105,37 @@ typedef struct ControlInputs {
     int iterative_calculation_flag;
     double tikhonov_regularization_param;
     int regularization_style;
+    int regularization_path_flag;
+    int regularization_path_points;
+    double regularization_path_min;
+    double regularization_path_max;
     double rcond;
+    int dense_solver_style;
+    int normal_matrix_storage_style;
+    int normal_summation_style;
+    int frame_normal_form_precision;
+    int accumulation_accuracy_report_flag;
+    int sparse_solver_style;
+    int krylov_max_iterations;
+    double krylov_tolerance;
+    int krylov_warm_start_flag;
 	double sparse_safety_factor; 
 	int num_sparse_threads;
+	int num_solver_threads;
+	int num_reduction_threads;
+	int accumulation_qr_threads;
+	int block_pipeline_depth;
+	int checkpoint_interval_blocks;
+	double checkpoint_interval_minutes;
+	double plan_memory_budget;
+	int plan_auto_select_flag;
+	int frame_store_style;
+	int model_variants_flag;
+	int range_finding_frames;
+	double range_lower_quantile;
+	double range_upper_quantile;
+	int range_min_bin_count;
+	int num_range_finding_threads;
 	
 	ControlInputs(void);
 	~ControlInputs(void);
@@ -22,6 +22,12 @@ extern "C" {
 
 extern double cblas_ddot(const int n, const double* dx, const int incx, const double* dy, const int incy);
 
+# if _openblas_flag == 1
+// Thread control for builds linked against OpenBLAS
+extern void openblas_set_num_threads(int num_threads);
+extern int openblas_get_num_threads(void);
+# endif
+
 	
 # if _mkl_flag == 0
 // Exclude these function definitions when compiling with MKL
@@ -43,6 +49,29 @@ extern void dgelss_(int* m, int* n, int* nrhs, double* a, int* lda, double* b, i
 
 extern void dgetri_(const int* n, double* a, const int* lda, int* ipiv, double* work, const int* lwork, int *info);
 
+extern void dpotrf_(char* uplo, const int* n, double* a, const int* lda, int* info);
+
+extern void dpotrs_(char* uplo, const int* n, const int* nrhs, const double* a, const int* lda, double* b, const int* ldb, int* info);
+
+extern void dpotri_(char* uplo, const int* n, double* a, const int* lda, int* info);
+
+extern void dsyev_(char* jobz, char* uplo, const int* n, double* a, const int* lda, double* w, double* work, const int* lwork, int* info);
+
+extern void dpocon_(char* uplo, const int* n, const double* a, const int* lda, const double* anorm, double* rcond,
+                    double* work, int* iwork, int* info);
+
+extern void dsytrf_(char* uplo, const int* n, double* a, const int* lda, int* ipiv, double* work, const int* lwork, int* info);
+
+extern void dsytrs_(char* uplo, const int* n, const int* nrhs, const double* a, const int* lda, const int* ipiv, double* b, const int* ldb, int* info);
+
+extern void dsfrk_(char* transr, char* uplo, char* trans, const int* n, const int* k, const double* alpha, const double* a, const int* lda,
+                   const double* beta, double* c);
+
+extern void dtfttr_(char* transr, char* uplo, const int* n, const double* arf, double* a, const int* lda, int* info);
+
+extern void dsycon_(char* uplo, const int* n, const double* a, const int* lda, const int* ipiv, const double* anorm, double* rcond,
+                    double* work, int* iwork, int* info);
+
 # endif
 					
 #ifdef __cplusplus
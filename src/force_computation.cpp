@@ -104,6 +104,44 @@ void InteractionClassComputer::set_up_computer(InteractionClassSpec* const ispec
     // Define the interaction class's geometric definition.
     cutoff2 = ispec->cutoff * ispec->cutoff;
     class_set_up_computer();
+    
+    // Density interactions are indexed by density group rather than by type hash.
+    if (ispec->class_type != kDensity) set_up_type_index_table();
+}
+
+// Tabulate the defined, matched, and tabulated indices for every possible
+// type hash of this class once, after the interaction ranges are known.
+
+void InteractionClassComputer::set_up_type_index_table(void)
+{
+    int n_possible_interactions = 0;
+    if (ispec->get_n_defined() > 0) {
+        switch (ispec->get_n_body()) {
+            case 2:
+                n_possible_interactions = calc_n_distinct_pairs(ispec->n_cg_types);
+                break;
+            case 3:
+                n_possible_interactions = calc_n_distinct_triples(ispec->n_cg_types);
+                break;
+            case 4:
+                n_possible_interactions = calc_n_distinct_quadruples(ispec->n_cg_types);
+                break;
+            default:
+                break;
+        }
+    }
+    
+    InteractionTypeIndices undefined_entry = {-1, 0, 0};
+    type_index_table = std::vector<InteractionTypeIndices>(n_possible_interactions, undefined_entry);
+    for (int hash_val = 0; hash_val < n_possible_interactions; hash_val++) {
+        int index_among_defined = ispec->get_index_from_hash(hash_val);
+        if (index_among_defined < 0 || index_among_defined >= ispec->get_n_defined()) continue;
+        type_index_table[hash_val].index_among_defined_intrxns = index_among_defined;
+        type_index_table[hash_val].index_among_matched_interactions = ispec->defined_to_matched_intrxn_index_map[index_among_defined];
+        if (unsigned(index_among_defined) < ispec->defined_to_tabulated_intrxn_index_map.size()) {
+            type_index_table[hash_val].index_among_tabulated_interactions = ispec->defined_to_tabulated_intrxn_index_map[index_among_defined];
+        }
+    }
 }
 
 void PairNonbondedClassComputer::class_set_up_computer(void) 
@@ -250,6 +288,7 @@ void ThreeBodyNonbondedClassComputer::special_set_up_computer(InteractionClassSp
     if (ispec->class_subtype > 0) {
         interaction_class_column_index = *curr_iclass_col_index;
         *curr_iclass_col_index += ispec->interaction_column_indices[ispec->n_to_force_match];
+        set_up_type_index_table();
     }
     fm_s_comp = new BSplineAndDerivComputer(ispec);
 }
@@ -260,23 +299,37 @@ void ThreeBodyNonbondedClassComputer::special_set_up_computer(InteractionClassSp
 
 void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList pair_cell_list, ThreeBCellList three_body_cell_list, int trajectory_block_frame_index)
 {
-    // Each frame is a set of contiguous rows in the FM matrix; get the starting row for this frame.
-    int current_frame_starting_row = trajectory_block_frame_index * cg->n_cg_sites; //shift row number after each frame within one block
-    
     // Wrap all coordinates to ensure they are within a single image of
-    // the periodic domain and get the target forces for the calculation.
-    for (unsigned l = 0; l < cg->topo_data.n_cg_sites; l++) {
-        // Enforce consequences of periodic boundary conditions.
+    // the periodic domain, then set up a cell list for the calculation.
+    prepare_frame_cell_lists(frame_config, pair_cell_list, three_body_cell_list, cg->three_body_nonbonded_interactions.class_subtype > 0);
+    calculate_frame_fm_matrix_elements(cg, mat, frame_config, pair_cell_list, three_body_cell_list, trajectory_block_frame_index);
+}
+
+// Wrap a frame's coordinates into the periodic domain and populate the cell lists
+// used for its nonbonded interactions. Cell lists set up with the largest cutoff
+// of several models can be shared by all of them.
+
+void prepare_frame_cell_lists(FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, const bool three_body_flag)
+{
+    for (int l = 0; l < frame_config->current_n_sites; l++) {
         get_minimum_image(l, frame_config->x, frame_config->simulation_box_half_lengths);
-        add_target_force_from_trajectory(current_frame_starting_row, l, mat, frame_config->f);
     }
-    
-    // Set up a cell list and initialize the calculation temps for pair 
-    // nonbonded matrix element computations.
     pair_cell_list.populateList(frame_config->current_n_sites, frame_config->x);
-    if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
+    if (three_body_flag) {
         three_body_cell_list.populateList(frame_config->current_n_sites, frame_config->x);
     }
+}
+
+// Calculate the target forces and matrix elements for a frame whose cell lists have been prepared.
+
+void calculate_frame_fm_matrix_elements(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, const PairCellList &pair_cell_list, const ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index)
+{
+    // Each frame is a set of contiguous rows in the FM matrix; get the starting row for this frame.
+    int current_frame_starting_row = trajectory_block_frame_index * cg->n_cg_sites; //shift row number after each frame within one block
+    
+    for (unsigned l = 0; l < cg->topo_data.n_cg_sites; l++) {
+        add_target_force_from_trajectory(current_frame_starting_row, l, mat, frame_config->f);
+    }
     
     // Calculate matrix elements by looking through interaction (cell and topology) lists to find active (and non-excluded) interactions.
     std::list<InteractionClassComputer*>::iterator icomp_iterator;
@@ -555,19 +608,19 @@ inline bool check_density_excluded_list(const TopologyData* const topo_data, con
 
 void order_pair_nonbonded_fm_matrix_element_calculation(InteractionClassComputer* const info, calc_pair_matrix_elements calc_matrix_elements, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
 {
-    // Calculate the appropriate matrix elements.
-    info->index_among_defined_intrxns = info->ispec->get_index_from_hash(calc_two_body_interaction_hash(cg_site_types[info->k], cg_site_types[info->l], n_cg_types));
-    info->set_indices();
+    // Look up the interaction and skip it before any geometry is computed if it is not in the model.
+    if (!info->set_indices_from_hash(calc_two_body_interaction_hash(cg_site_types[info->k], cg_site_types[info->l], n_cg_types))) return;
 
+    // Calculate the appropriate matrix elements.
     calc_matrix_elements(info, x, simulation_box_half_lengths, mat);
 }
 
 void order_bonded_fm_matrix_element_calculation(InteractionClassComputer* const info, int* const cg_site_types, const int n_cg_types, MATRIX_DATA* const mat, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths)
 {
-     // Calculate the appropriate matrix elements.    
-    info->index_among_defined_intrxns = info->ispec->get_index_from_hash(info->calculate_hash_number(cg_site_types, n_cg_types));
-    info->set_indices();
+    // Look up the interaction and skip it before any geometry is computed if it is not in the model.
+    if (!info->set_indices_from_hash(info->calculate_hash_number(cg_site_types, n_cg_types))) return;
 
+    // Calculate the appropriate matrix elements.
     (*info->calculate_fm_matrix_elements)(info, x, simulation_box_half_lengths, mat);
 }
 
@@ -576,14 +629,10 @@ void order_three_body_nonbonded_fm_matrix_element_calculation(InteractionClassCo
     ThreeBodyNonbondedClassComputer* icomp = static_cast<ThreeBodyNonbondedClassComputer*>(info);
     ThreeBodyNonbondedClassSpec* ispec = static_cast<ThreeBodyNonbondedClassSpec*>(icomp->ispec);
     
-    // Calculate the appropriate matrix elements.
-    icomp->index_among_defined_intrxns = info->ispec->get_index_from_hash(icomp->calculate_hash_number(cg_site_types, n_cg_types));
-    if (icomp->index_among_defined_intrxns == -1) return; // if the index is -1, it is not present in the model and should be ignored.
-    
-    icomp->index_among_matched_interactions = ispec->defined_to_matched_intrxn_index_map[icomp->index_among_defined_intrxns];
-    icomp->index_among_tabulated_interactions = ispec->defined_to_tabulated_intrxn_index_map[icomp->index_among_defined_intrxns];
-    if ((icomp->index_among_matched_interactions == 0) && (icomp->index_among_tabulated_interactions == 0)) return; // if the index is zero, it is not present in the model and should be ignored.
+    // Look up the interaction; if it is neither matched nor tabulated, it is not present in the model and should be ignored.
+    if (!icomp->set_indices_from_hash(icomp->calculate_hash_number(cg_site_types, n_cg_types))) return;
     
+    // Calculate the appropriate matrix elements.
     icomp->cutoff2 = ispec->three_body_nonbonded_cutoffs[icomp->index_among_defined_intrxns] * ispec->three_body_nonbonded_cutoffs[icomp->index_among_defined_intrxns];
     icomp->stillinger_weber_angle_parameter = ispec->stillinger_weber_angle_parameters_by_type[icomp->index_among_defined_intrxns];
     (*icomp->calculate_fm_matrix_elements)(icomp, x, simulation_box_half_lengths, mat); 
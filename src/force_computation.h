@@ -20,6 +20,8 @@ void set_up_force_computers(CG_MODEL_DATA* const cg);
 
 // Main routine calling all other matrix element calculation routines
 void calculate_frame_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, PairCellList pair_cell_list, ThreeBCellList three_body_cell_list, int trajectory_block_frame_index);
+void prepare_frame_cell_lists(FrameConfig* const frame_config, PairCellList &pair_cell_list, ThreeBCellList &three_body_cell_list, const bool three_body_flag);
+void calculate_frame_fm_matrix_elements(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameConfig* const frame_config, const PairCellList &pair_cell_list, const ThreeBCellList &three_body_cell_list, int trajectory_block_frame_index);
 
 // Functions for calculating density values
 void calc_gaussian_density_values(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat);
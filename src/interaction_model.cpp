@@ -147,6 +147,15 @@ void check_input_values(CG_MODEL_DATA* cg)
 			 printf("Invalid output_parameter_distribution (%d) for %s!\n", (*iclass_iterator)->output_parameter_distribution, (*iclass_iterator)->get_full_name().c_str());
 			 (*iclass_iterator)->output_parameter_distribution = 0;
 		}
+		if ( (*iclass_iterator)->range_lower_quantile < 0.0 || (*iclass_iterator)->range_upper_quantile > 1.0 ||
+		     (*iclass_iterator)->range_lower_quantile >= (*iclass_iterator)->range_upper_quantile ) {
+			printf("Invalid range_lower_quantile (%lf) and range_upper_quantile (%lf)!\n", (*iclass_iterator)->range_lower_quantile, (*iclass_iterator)->range_upper_quantile);
+			exit(EXIT_FAILURE);
+		}
+		if ( (*iclass_iterator)->range_min_bin_count < 0 ) {
+			printf("Invalid range_min_bin_count (%d)!\n", (*iclass_iterator)->range_min_bin_count);
+			exit(EXIT_FAILURE);
+		}
 	}
 	
 	if (cg->three_body_nonbonded_interactions.class_subtype < 0 || cg->three_body_nonbonded_interactions.class_subtype > 3) {
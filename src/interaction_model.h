@@ -9,6 +9,7 @@
 #define _interaction_model_h
 
 #include <array>
+#include <cmath>
 #include <fstream>
 #include <list>
 #include <string>
@@ -49,6 +50,55 @@ typedef void (*calc_interaction_matrix_elements)(InteractionClassComputer* const
 // Interaction-model-related type definitions
 //-------------------------------------------------------------
 
+// Number of grid bins in each parameter distribution histogram bin.
+#define PARAMETER_HISTOGRAM_SUBDIVISIONS 64
+
+// Counts of an interaction parameter's sampled values on a fixed grid of bins,
+// kept by rangefinder in place of the sampled values themselves. The grid covers
+// only the sampled values and grows as needed.
+
+struct ParameterHistogram {
+	double bin_width;						// Width of the grid bins
+	int first_bin;							// Grid index of counts[0]
+	std::vector<unsigned long> counts;		// Samples in each grid bin from first_bin on
+	
+	inline ParameterHistogram() : bin_width(1.0), first_bin(0) {};
+	
+	inline void add(const double value) {
+		int bin = (int)(floor(value / bin_width));
+		if (counts.empty()) {
+			first_bin = bin;
+		} else if (bin < first_bin) {
+			counts.insert(counts.begin(), first_bin - bin, 0);
+			first_bin = bin;
+		}
+		if (bin - first_bin >= (int)(counts.size())) counts.resize(bin - first_bin + 1, 0);
+		counts[bin - first_bin]++;
+	};
+	
+	// Add the counts of another histogram on the same grid.
+	inline void merge(const ParameterHistogram &other) {
+		if (other.counts.empty()) return;
+		if (counts.empty()) {
+			first_bin = other.first_bin;
+		} else if (other.first_bin < first_bin) {
+			counts.insert(counts.begin(), first_bin - other.first_bin, 0);
+			first_bin = other.first_bin;
+		}
+		int other_end = other.first_bin + (int)(other.counts.size());
+		if (other_end - first_bin > (int)(counts.size())) counts.resize(other_end - first_bin, 0);
+		for (unsigned j = 0; j < other.counts.size(); j++) counts[other.first_bin - first_bin + j] += other.counts[j];
+	};
+};
+
+// An interaction's parameter distribution on the FM half-bin grid, as written
+// to its .hist file and used for Boltzmann inversion.
+
+struct ParameterDistribution {
+	std::vector<double> bin_centers;
+	std::vector<unsigned long> bin_counts;
+};
+
 // This stores parameters that define an interaction class.
 
 struct InteractionClassSpec {
@@ -67,6 +117,16 @@ struct InteractionClassSpec {
     double output_binwidth;
 	int output_parameter_distribution;
 	FILE** output_range_file_handles;
+	ParameterHistogram* parameter_histograms;
+	ParameterDistribution* parameter_distributions;
+	
+	// Range trimming parameters used by rangefinder; the found range
+	// drops the sampled values below range_lower_quantile and above
+	// range_upper_quantile, then FM bins at either end with fewer than
+	// range_min_bin_count samples.
+	double range_lower_quantile;
+	double range_upper_quantile;
+	int range_min_bin_count;
 
 	// n_defined is the number of unique type combinations for n_cg_sites and the interaction type.
 	// defined_to_possible is used for bonded-type interactions and converts the type combination hash
@@ -159,15 +219,25 @@ struct InteractionClassSpec {
 		return fm_binwidth;
 	};
 
+	inline bool trims_ranges(void) const {
+		return (range_lower_quantile > 0.0 || range_upper_quantile < 1.0 || range_min_bin_count > 0);
+	};
+
 	InteractionClassSpec() {
 		n_tabulated = n_to_force_match = n_from_table = 0;
 		n_defined = 0;
 		class_subtype = 0;
+		parameter_histograms = NULL;
+		parameter_distributions = NULL;
+		range_lower_quantile = 0.0;
+		range_upper_quantile = 1.0;
+		range_min_bin_count = 0;
 	};
 	
 	~InteractionClassSpec() {
 		delete [] lower_cutoffs;
 		delete [] upper_cutoffs;
+		delete [] parameter_distributions;
 		
 	    if (n_tabulated > 0) {
     	    for (int i = 0; i < n_tabulated; i++) {
@@ -178,6 +248,15 @@ struct InteractionClassSpec {
 	}
 };
 
+// Indices of a single interaction type combination within its class.
+// An index_among_defined_intrxns of -1 marks a combination that is not defined.
+
+struct InteractionTypeIndices {
+    int index_among_defined_intrxns;
+    int index_among_matched_interactions;
+    int index_among_tabulated_interactions;
+};
+
 // Info needed for FM calculation of each interaction class, very closely
 // related to the below struct. (Will be rebuilt from the below struct later.)
 
@@ -207,6 +286,10 @@ struct InteractionClassComputer {
     int index_among_matched_interactions;
     int index_among_tabulated_interactions;
     
+    // Dense table of the above indices for every possible type hash of this class,
+    // replacing a binary search and two map lookups per interaction.
+    std::vector<InteractionTypeIndices> type_index_table;
+    
     // Calculation intermediates for the interaction
     double intrxn_param;                       // The interaction parameter for any single-parameter interaction (ie distance, angle, dihedral angle)
     double intrxn_param_less_lower_cutoff;     // Pair distance from the pair_nonbonded_interaction_lower_cutoffs_XOR_lower_cutoffs
@@ -240,6 +323,18 @@ struct InteractionClassComputer {
 		index_among_matched_interactions   = ispec->defined_to_matched_intrxn_index_map[index_among_defined_intrxns];
 		index_among_tabulated_interactions = ispec->defined_to_tabulated_intrxn_index_map[index_among_defined_intrxns];
 	};
+
+	void set_up_type_index_table(void);
+	
+	// Set all indices from the type hash of the current interaction.
+	// Returns false if the interaction is neither matched nor tabulated.
+	inline bool set_indices_from_hash(const int hash_val) {
+		const InteractionTypeIndices &entry = type_index_table[hash_val];
+		index_among_defined_intrxns        = entry.index_among_defined_intrxns;
+		index_among_matched_interactions   = entry.index_among_matched_interactions;
+		index_among_tabulated_interactions = entry.index_among_tabulated_interactions;
+		return (index_among_matched_interactions > 0 || index_among_tabulated_interactions > 0);
+	};
 	
     // Spline computation objects for force matched and
     // tabulated interactions.
@@ -712,6 +807,12 @@ struct CG_MODEL_DATA {
 		icomp_list.push_back(&dihedral_computer);
 		icomp_list.push_back(&density_computer);
 		
+		std::list<InteractionClassSpec*>::iterator iclass_iterator;
+		for (iclass_iterator = iclass_list.begin(); iclass_iterator != iclass_list.end(); iclass_iterator++) {
+			(*iclass_iterator)->range_lower_quantile = control_input->range_lower_quantile;
+			(*iclass_iterator)->range_upper_quantile = control_input->range_upper_quantile;
+			(*iclass_iterator)->range_min_bin_count = control_input->range_min_bin_count;
+		}
 		check_input_values(this);
 	}
 		
@@ -6,12 +6,26 @@
 //
 
 #include <cassert>
+#include <cfloat>
 #include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
 #include <array>
+#include <atomic>
+#include <mutex>
+#include <thread>
+
+#ifdef _OPENMP
+#include <omp.h>
+#endif
 
 #include "control_input.h"
 #include "interaction_model.h"
@@ -34,10 +48,13 @@ void initialize_dummy_matrix(MATRIX_DATA* const mat, ControlInputs* const contro
 // Helper matrix initialization routines
 
 void matrix_sanity_checks(ControlInputs* const control_input);
+int plan_matrix_type_is_available(ControlInputs* const control_input, const int matrix_type);
+int estimate_fm_matrix_plan(ControlInputs* const control_input, const int fm_matrix_columns, const int n_cg_sites, const double frame_elements, const double frame_row_products, const double pattern_elements, const int total_frame_samples, fm_matrix_plan* const plan);
 void determine_matrix_columns_and_rows(MATRIX_DATA* const mat, CG_MODEL_DATA* const cg, int const frames_per_traj_block, int const pressure_constraint_flag);
 void estimate_number_of_sparse_elements(MATRIX_DATA* const mat, CG_MODEL_DATA* const cg);
 void log_n_basis_functions(InteractionClassSpec &ispec);
-void determine_BI_interaction_rows_and_cols(MATRIX_DATA* mat, InteractionClassComputer* const icomp);
+inline uint64_t hash_binary_words(uint64_t hash, const void* const data, const size_t n_words);
+inline uint64_t hash_column_layout(uint64_t hash, InteractionClassSpec &ispec);
 
 // Matrix reset routines
 
@@ -46,6 +63,7 @@ void set_sparse_matrix_to_zero(MATRIX_DATA* const mat);
 void set_sparse_accumulation_matrix_to_zero(MATRIX_DATA* const mat);
 void set_accumulation_matrix_to_zero(MATRIX_DATA* const mat);
 void set_accumulation_matrix_to_zero(MATRIX_DATA* const mat, dense_matrix* const dense_fm_matrix);
+void set_accumulation_block_to_zero(MATRIX_DATA* const mat);
 void set_dummy_matrix_to_zero(MATRIX_DATA* const mat);
 
 // Interface-level functions that convert force magnitude and derivatives to matrix elements.
@@ -83,11 +101,38 @@ void calculate_target_force_accumulation_vector(int shift_i, int site_i, MATRIX_
 // Post-frame-block routines
 
 void convert_dense_fm_equation_to_normal_form_and_accumulate(MATRIX_DATA* const mat);
+void convert_dense_fm_equation_to_normal_form_and_accumulate_carefully(MATRIX_DATA* const mat);
+void create_single_precision_normal_form(MATRIX_DATA* const mat);
+void add_single_precision_normal_form(MATRIX_DATA* const mat, const double frame_weight);
+inline void add_frame_normal_value(double* const sum, double* const compensation, const double x);
+void write_accumulation_accuracy_report(MATRIX_DATA* const mat);
+void write_accumulation_accuracy_residual(MATRIX_DATA* const mat);
 void convert_dense_target_force_vector_to_normal_form_and_accumulate(MATRIX_DATA* const mat);
 void accumulate_accumulation_matrices(MATRIX_DATA* const mat);
+void accumulate_accumulation_matrices_in_parallel(MATRIX_DATA* const mat);
+void factor_accumulation_qr_lane(dense_matrix* const lane_matrix, int block_rows, int columns);
+void combine_accumulation_qr_lanes(MATRIX_DATA* const mat);
+void merge_accumulation_r_factors(dense_matrix* const r_matrix, const dense_matrix* const other_r_matrix, const double scale, int columns);
+void merge_accumulation_qr_lane_pair(MATRIX_DATA* const mat, const int pair);
+void merge_accumulation_bootstrapping_factor(MATRIX_DATA* const mat, const int i);
 void solve_sparse_matrix(MATRIX_DATA* const mat);
 void convert_sparse_fm_equation_to_sparse_normal_form_and_accumulate(MATRIX_DATA* const mat);
 void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA* const mat);
+void accumulate_sparse_fm_block_into_sparse_normal_form(MATRIX_DATA* const mat, sparse_fm_block* const block);
+void accumulate_sparse_fm_block_into_sparse_normal_form_and_bootstrap(MATRIX_DATA* const mat, sparse_fm_block* const block);
+void accumulate_sparse_fm_block_into_dense_normal_form(MATRIX_DATA* const mat, sparse_fm_block* const block);
+inline void get_current_sparse_fm_block(MATRIX_DATA* const mat, sparse_fm_block* const block);
+void initialize_block_pipeline(MATRIX_DATA* const mat);
+void hand_off_sparse_fm_block(MATRIX_DATA* const mat);
+void accumulate_pipelined_sparse_fm_block(MATRIX_DATA* const mat, sparse_fm_block* const block, const int position);
+inline void wait_for_sparse_fm_block(sparse_fm_block* const block);
+inline void record_sparse_fm_block_bootstrapping_weights(MATRIX_DATA* const mat, sparse_fm_block* const block);
+void finish_pipelined_fm(MATRIX_DATA* const mat);
+void build_sparse_normal_matrix_pattern(MATRIX_DATA* const mat, CG_MODEL_DATA* const cg);
+void add_interaction_class_pattern_blocks(InteractionClassSpec* const ispec, const int class_column_index, std::vector<int>& block_starts, std::vector<int>& block_ends, std::vector< std::vector<int> >& block_types);
+csr_matrix* copy_sparse_normal_matrix_pattern(const csr_matrix* const pattern);
+void accumulate_sparse_fm_normal_form(MATRIX_DATA* const mat, sparse_fm_block* const block, const double weight, csr_matrix* const sparse_normal_matrix, double* const normal_matrix_values, double* const normal_rhs_vector);
+inline void accumulate_sparse_normal_row(MATRIX_DATA* const mat, const double weight, const int n_in_row, const int n_components, const int* const columns, const double* const values, const double* const rhs_values, csr_matrix* const sparse_normal_matrix, double* const normal_matrix_values, double* const normal_rhs_vector);
 void do_nothing_to_fm_matrix(MATRIX_DATA* const mat);
 
 // Helper solver routines
@@ -100,15 +145,37 @@ void regularize_sparse_matrix(MATRIX_DATA* const mat);
 void regularize_vector_sparse_matrix(MATRIX_DATA* const mat, double* regularization_vector);
 void regularize_sparse_matrix(MATRIX_DATA* const mat, csr_matrix* csr_matrix);
 void regularize_vector_sparse_matrix(MATRIX_DATA* const mat, csr_matrix* csr_normal_matrix, double* regularization_vector);
-void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector);
+void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector, double* const solution);
+void solve_sparse_normal_form(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector);
+void solve_sparse_normal_form(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector, double* const h, double* const solution);
+inline void apply_scaled_normal_matrix(const int n, csr_matrix* const sparse_matrix, dense_matrix* const dense_normal_matrix, const int upper_scaled, const double* const h, const double* const x, double* const y);
+int calculate_pcg_solution(MATRIX_DATA* const mat, const int n, csr_matrix* const sparse_matrix, dense_matrix* const dense_normal_matrix, const double* const rhs, const double* const h, double* const solution);
 void solve_this_sparse_matrix(MATRIX_DATA* const mat);
 inline void create_sparse_normal_form_matrix(MATRIX_DATA* const mat, const int nnzmax, csr_matrix& csr_fm_matrix, csr_matrix& csr_normal_matrix, double* const dense_fm_rhs_vector, double* const dense_rhs_normal_vector);
-inline void create_dense_normal_form(MATRIX_DATA* const mat, const double frame_weight, dense_matrix* const dense_fm_matrix, dense_matrix* normal_matrix, double* const dense_fm_rhs_vector, double* dense_fm_normal_rhs_vector);
+inline void create_dense_normal_form(MATRIX_DATA* const mat, const double frame_weight, dense_matrix* const dense_fm_matrix, double* const normal_matrix_values, double* const dense_fm_rhs_vector, double* dense_fm_normal_rhs_vector);
 inline double calculate_dense_residual(MATRIX_DATA* const mat, dense_matrix* const dense_fm_normal_matrix, double* const dense_fm_rhs_vector, std::vector<double> &fm_solution, double normalziation);
 inline double calculate_sparse_residual(MATRIX_DATA* const mat, csr_matrix* sparse_fm_normal_matrix, double* const dense_fm_rhs_vector, std::vector<double> &fm_solution, double normalization);
 inline void calculate_and_apply_dense_preconditioning(MATRIX_DATA* mat, dense_matrix* dense_fm_normal_matrix, double* h);
+inline void calculate_and_apply_out_of_core_preconditioning(MATRIX_DATA* mat, dense_matrix* dense_fm_normal_matrix, double* h);
+inline double get_tikhonov_diagonal_term(MATRIX_DATA* const mat, const double squared_regularization_parameter, const double h_i);
 inline void calculate_dense_svd(MATRIX_DATA* mat, int fm_matrix_columns, dense_matrix* dense_fm_normal_matrix, double* dense_fm_normal_rhs_vector, double* singular_values);
 inline void calculate_dense_svd(MATRIX_DATA* mat, int fm_matrix_columns, int fm_matrix_rows, dense_matrix* dense_fm_normal_matrix, double* dense_fm_normal_rhs_vector, double* singular_values);
+inline int calculate_dense_factored_solution(MATRIX_DATA* mat, int fm_matrix_columns, dense_matrix* dense_fm_normal_matrix, double* dense_fm_normal_rhs_vector, double* h, double* singular_values, double* rcond_estimate);
+inline void print_dense_solver_info(FILE* solution_file, const int solver_used, const double rcond_estimate, const int fm_matrix_columns, double* singular_values);
+inline void calculate_bayesian_cholesky_terms(const int n, dense_matrix* const normal_matrix, const double* const rhs, const double* const reg_vec, dense_matrix* const inverse_matrix, double* const solution, double* const inverse_diagonal, double* const trace_product);
+void calculate_dense_eigendecomposition(const int n, dense_matrix* const normal_matrix, const double* const rhs, dense_matrix* const eigenvectors, double* const eigenvalues, double* const projected_rhs);
+inline void calculate_bayesian_eigen_terms(const int n, dense_matrix* const eigenvectors, const double* const eigenvalues, const double* const projected_rhs, const double regularization, double* const solution, double* const inverse_diagonal, double* const trace_product, dense_matrix* const inverse_matrix);
+inline void calculate_path_solution(const int n, dense_matrix* const eigenvectors, const double* const coefficients, const double* const sqrt_h, double* const solution);
+void calculate_regularization_path(MATRIX_DATA* const mat, dense_matrix* const normal_matrix, double* const rhs, const double* const h);
+void allocate_dense_normal_matrix(MATRIX_DATA* const mat);
+dense_matrix* allocate_normal_storage_matrix(MATRIX_DATA* const mat, const int rows, const int cols);
+inline int get_normal_matrix_size(MATRIX_DATA* const mat);
+inline double* get_normal_matrix_values(MATRIX_DATA* const mat);
+inline double* get_bootstrapping_normal_matrix_values(MATRIX_DATA* const mat, const int i);
+inline void add_normal_matrix_element(MATRIX_DATA* const mat, double* const normal_matrix_values, const int row, const int col, const double x);
+inline double get_normal_matrix_element(MATRIX_DATA* const mat, const int row, const int col);
+inline void assign_normal_matrix_element(MATRIX_DATA* const mat, const int row, const int col, const double x);
+void unpack_normal_matrix(const int n, packed_symmetric_matrix* const packed_matrix, dense_matrix* const dense_normal_matrix);
 
 // After-full-trajectory routines
 
@@ -128,16 +195,52 @@ void average_sparse_bootstrapping_solutions(MATRIX_DATA* const mat);
 void solve_sparse_fm_bootstrapping_equations(MATRIX_DATA* const mat);
 void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat);
 void solve_accumulation_form_bootstrapping_equations(MATRIX_DATA* const mat);
+inline double* get_bootstrapping_block_values(MATRIX_DATA* const mat);
+void combine_bootstrapping_block_buffer(MATRIX_DATA* const mat);
+void run_concurrent_solve_worker(MATRIX_DATA* const mat, const int n_tasks, void (*solve_task)(MATRIX_DATA* const, const int), std::atomic<int>* const next_task);
+void run_concurrent_tasks(MATRIX_DATA* const mat, const int n_tasks, const int n_threads, void (*solve_task)(MATRIX_DATA* const, const int));
+void run_concurrent_solves(MATRIX_DATA* const mat, const int n_tasks, const int n_threads, void (*solve_task)(MATRIX_DATA* const, const int));
+void solve_BI_system(MATRIX_DATA* const mat, const int i);
+void solve_dense_bootstrapping_estimate(MATRIX_DATA* const mat, const int k);
+void solve_sparse_bootstrapping_estimate(MATRIX_DATA* const mat, const int i);
+void solve_accumulation_bootstrapping_estimate(MATRIX_DATA* const mat, const int k);
 
 // Matrix-implementation-dependent functions for reading 
 // batches of FM matrices.
 
 int read_res_av_file(std::string* &filenames);
+void open_binary_equations(MATRIX_DATA* const mat, binary_equations_writer* const writer, const char* filename, const int rhs_size, const int n_sets);
+void write_binary_equations_values(binary_equations_writer* const writer, const double* const values, const int n_values);
+void end_binary_equations_section(binary_equations_writer* const writer);
+void close_binary_equations(binary_equations_writer* const writer);
+int map_binary_equations(MATRIX_DATA* const mat, binary_equations_file* const file, const char* filename, const int rhs_size);
+void unmap_binary_equations(binary_equations_file* const file);
+inline const double* get_binary_equations_matrix(binary_equations_file* const file, const int set);
+inline const double* get_binary_equations_rhs(binary_equations_file* const file, const int set);
+void add_upper_columns_to_normal_matrix(MATRIX_DATA* const mat, const double* const upper_columns, const double weight);
+void add_binary_equations_file_to_partial_sum(MATRIX_DATA* const mat, const char* filename, binary_equations_partial_sum* const partial);
+void read_binary_equations_file_range(MATRIX_DATA* const mat, std::string* const filenames, const int first_file, const int last_file, binary_equations_partial_sum* const partial);
+void merge_binary_equations_partial_sums(const size_t n_values, binary_equations_partial_sum* const partial, binary_equations_partial_sum* const other);
+double reduce_binary_equations_in_parallel(MATRIX_DATA* const mat, std::string* const filenames, const int n_batch);
 void read_binary_dense_fm_matrix(MATRIX_DATA* const mat);
 void read_binary_accumulation_fm_matrix(MATRIX_DATA* const mat);
 void read_binary_sparse_fm_matrix(MATRIX_DATA* const mat);
 void read_regularization_vector(MATRIX_DATA* const mat);
 
+// Checkpoint routines.
+
+inline void copy_fm_checkpoint_section(double* const state, const size_t n, double* const checkpoint_values, size_t &n_values, const int restore);
+size_t copy_fm_checkpoint_values(MATRIX_DATA* const mat, double* const checkpoint_values, const int restore);
+void write_fm_checkpoint_file(fm_checkpoint_state* const checkpoint);
+
+// Frame store routines.
+
+void record_fm_matrix_element(const int i, const int j, double* const x, MATRIX_DATA* const mat);
+void record_target_force_element(MATRIX_DATA* mat, int particle_index, double* force_element);
+inline void append_frame_store_index(std::vector<unsigned char> &stream, const int difference);
+inline void append_frame_store_bytes(std::vector<unsigned char> &stream, const void* const values, const size_t n_bytes);
+inline int read_frame_store_index(const unsigned char* &position);
+
 // Output functions.
 
 void write_iteration(const double* alpha_vec, const double beta, std::vector<double> fm_solution, const double residual, const int iteration, FILE* alpha_fp, FILE* beta_fp, FILE* sol_fp, FILE* res_fp);
@@ -157,9 +260,35 @@ MATRIX_DATA::MATRIX_DATA(ControlInputs* const control_input, CG_MODEL_DATA *cons
     output_style 					= control_input->output_style;
     output_normal_equations_rhs_flag= control_input->output_normal_equations_rhs_flag;
     output_solution_flag 			= control_input->output_solution_flag;
+    output_BI_equations_flag		= control_input->output_BI_equations_flag;
     rcond							= control_input->rcond;
+    dense_solver_style				= control_input->dense_solver_style;
+    normal_matrix_storage_style		= control_input->normal_matrix_storage_style;
+    normal_summation_style			= control_input->normal_summation_style;
+    frame_normal_form_precision		= control_input->frame_normal_form_precision;
+    accumulation_accuracy_report_flag	= control_input->accumulation_accuracy_report_flag;
+    reference_normal_values			= NULL;
+    sparse_solver_style				= control_input->sparse_solver_style;
+    krylov_max_iterations			= control_input->krylov_max_iterations;
+    krylov_tolerance				= control_input->krylov_tolerance;
+    krylov_warm_start_flag			= control_input->krylov_warm_start_flag;
+    krylov_solve_count				= 0;
     itnlim 							= control_input->itnlim;
 	num_sparse_threads 				= control_input->num_sparse_threads;
+	sparse_block_normal_matrix		= NULL;
+	num_solver_threads				= control_input->num_solver_threads;
+	num_reduction_threads			= control_input->num_reduction_threads;
+	accumulation_qr_threads			= control_input->accumulation_qr_threads;
+	accumulation_qr_lane_matrices	= NULL;
+	accumulation_qr_merge_stride	= 1;
+	accumulation_qr_blas_threads	= 1;
+	block_pipeline_depth			= control_input->block_pipeline_depth;
+	pipelined_blocks				= NULL;
+	checkpoint_interval_blocks		= control_input->checkpoint_interval_blocks;
+	checkpoint_interval_minutes		= control_input->checkpoint_interval_minutes;
+	checkpoint						= NULL;
+	frame_store_style				= control_input->frame_store_style;
+	frame_store_data				= NULL;
 	position_dimension 				= control_input->position_dimension;
 	volume_weighting_flag 			= control_input->volume_weighting_flag;
 
@@ -171,12 +300,22 @@ MATRIX_DATA::MATRIX_DATA(ControlInputs* const control_input, CG_MODEL_DATA *cons
 	bootstrapping_flag 				= control_input->bootstrapping_flag;
 	bootstrapping_full_output_flag 	= control_input->bootstrapping_full_output_flag;
 	bootstrapping_num_estimates 	= control_input->bootstrapping_num_estimates;
+	bootstrapping_block_size		= control_input->bootstrapping_block_size;
+	bootstrapping_buffer_size		= 0;
+	bootstrapping_buffered_blocks	= 0;
+	bootstrapping_normal_storage	= NULL;
+	bootstrapping_rhs_storage		= NULL;
 	
 	// Copy residual, regularization, and bayesian options.
 	regularization_style 			= control_input->regularization_style;
     tikhonov_regularization_param 	= control_input->tikhonov_regularization_param;
+	regularization_path_flag		= control_input->regularization_path_flag;
+	regularization_path_points		= control_input->regularization_path_points;
+	regularization_path_min			= control_input->regularization_path_min;
+	regularization_path_max			= control_input->regularization_path_max;
 	bayesian_flag					= control_input->bayesian_flag;
 	bayesian_max_iter				= control_input->bayesian_max_iter;
+	bayesian_solver_style			= control_input->bayesian_solver_style;
     output_residual                 = control_input->output_residual;
     force_sq_total					= 0.0;
  
@@ -190,6 +329,8 @@ MATRIX_DATA::MATRIX_DATA(ControlInputs* const control_input, CG_MODEL_DATA *cons
     // Set normalization based on the default frame weight of 1.0 now, but overwrite later if needed.
     // Will be changed in newfm.cpp if there is another value from read_frame_weights
     normalization = 1.0 /  (double) control_input->n_frames;
+    n_frames = control_input->n_frames;
+    column_layout_hash = 0;
     
     // Set accumulate_*_forces function pointers
     accumulate_matching_forces 				= accumulate_vector_matching_forces;
@@ -246,10 +387,6 @@ void matrix_sanity_checks(ControlInputs* const control_input) {
 	if (MatrixType(control_input->matrix_type) == kSparse || MatrixType(control_input->matrix_type) == kSparseSparse) {
         printf("Cannot use sparse solving (matrix_type 1 or 4) unless compiling with MKL (use newfm_mkl.x in makefile).\n");
 		exit(EXIT_FAILURE);
-    }
-	if (MatrixType(control_input->matrix_type) == kSparseNormal) {
-        printf("Cannot use sparse accumulation (matrix_type 3) unless compiling with MKL for the time being (use newfm_mkl.x in makefile).\n");
-		exit(EXIT_FAILURE);
     }
 	#endif
     
@@ -273,6 +410,13 @@ void matrix_sanity_checks(ControlInputs* const control_input) {
 		exit(EXIT_FAILURE);
 	}
 	
+	if ( (control_input->bootstrapping_flag == 1) && (control_input->bootstrapping_block_size > 1) && 
+		 ( (control_input->use_statistical_reweighting == 1) || (control_input->volume_weighting_flag == 1) ) ) {
+		printf("Cannot use a bootstrapping_block_size of %d with statistical reweighting or volume weighting.\n", control_input->bootstrapping_block_size);
+		printf("Please change the bootstrapping block size to 1 and recheck your inputs before rerunning.\n");
+		exit(EXIT_FAILURE);
+	}
+	
 	if ( (control_input->volume_weighting_flag == 1) && (control_input->frames_per_traj_block != 1) ) {
 		printf("Cannot use volume weighting with %d frames per trajectory block.\n", control_input->bootstrapping_flag);
 		printf("Please change the block size to 1 and recheck your inputs before rerunning.\n");
@@ -289,7 +433,171 @@ void matrix_sanity_checks(ControlInputs* const control_input) {
 		printf("Please change the block size to a positive number and recheck your inputs before rerunning.\n");
 		exit(EXIT_FAILURE);
 	}
+
+	if ( (control_input->dense_solver_style < 0) || (control_input->dense_solver_style > 2) ) {
+		printf("Unrecognized dense_solver_style %d; please use 0 (SVD), 1 (Cholesky/LDLT with SVD fallback), or 2 (preconditioned CG).\n", control_input->dense_solver_style);
+		exit(EXIT_FAILURE);
+	}
+	
+	// Dense CG still needs the whole normal matrix, so for matrix_type 0 it is only
+	// allowed when that matrix is kept out of core.
+	if ( (control_input->dense_solver_style == 2) && ((MatrixType)(control_input->matrix_type) == kDense) && (control_input->normal_matrix_storage_style != 2) ) {
+		printf("dense_solver_style 2 with matrix_type 0 still holds the full normal matrix in memory.\n");
+		printf("Please use normal_matrix_storage_style 2 to keep it out of core, or a sparse matrix_type with sparse_solver_style 1.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	if ( (control_input->normal_matrix_storage_style < 0) || (control_input->normal_matrix_storage_style > 2) ) {
+		printf("Unrecognized normal_matrix_storage_style %d; please use 0 (full), 1 (packed upper triangle), or 2 (out of core).\n", control_input->normal_matrix_storage_style);
+		exit(EXIT_FAILURE);
+	}
+	
+	if ( (control_input->normal_matrix_storage_style == 1) && ((MatrixType)(control_input->matrix_type) != kDense) && ((MatrixType)(control_input->matrix_type) != kSparseNormal) && ((MatrixType)(control_input->matrix_type) != kDummy) ) {
+		printf("Packed normal matrix storage is only available for matrix_type 0 and 3.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	if (control_input->normal_matrix_storage_style == 2) {
+		if ( ((MatrixType)(control_input->matrix_type) != kDense) && ((MatrixType)(control_input->matrix_type) != kSparseNormal) && ((MatrixType)(control_input->matrix_type) != kDummy) ) {
+			printf("Out-of-core normal matrix storage is only available for matrix_type 0 and 3.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (control_input->dense_solver_style != 2) {
+			printf("Out-of-core normal matrix storage requires dense_solver_style 2 since the other solvers factor the matrix in memory.\n");
+			exit(EXIT_FAILURE);
+		}
+		if ( (control_input->regularization_path_flag != 0) || (control_input->output_residual == 1) || (control_input->bayesian_flag != 0) ||
+			 (control_input->normal_summation_style != 0) || (control_input->frame_normal_form_precision != 0) || (control_input->accumulation_accuracy_report_flag != 0) ) {
+			printf("Out-of-core normal matrix storage cannot be used with regularization paths, residual output, Bayesian estimates, or compensated and single precision accumulation since they keep in-memory copies of the normal matrix.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	if ( (control_input->normal_summation_style < 0) || (control_input->normal_summation_style > 1) ) {
+		printf("Unrecognized normal_summation_style %d.\n", control_input->normal_summation_style);
+		exit(EXIT_FAILURE);
+	}
+	
+	if ( (control_input->frame_normal_form_precision < 0) || (control_input->frame_normal_form_precision > 1) ) {
+		printf("Unrecognized frame_normal_form_precision %d.\n", control_input->frame_normal_form_precision);
+		exit(EXIT_FAILURE);
+	}
+	
+	if ( (control_input->normal_summation_style != 0) || (control_input->frame_normal_form_precision != 0) || (control_input->accumulation_accuracy_report_flag != 0) ) {
+		if ( ((MatrixType)(control_input->matrix_type) != kDense) || (control_input->bootstrapping_flag == 1) || (control_input->iterative_calculation_flag == 1) ) {
+			printf("Compensated and single precision accumulation are only available for matrix_type 0 without bootstrapping or iterative calculations.\n");
+			exit(EXIT_FAILURE);
+		}
+		if ( (control_input->accumulation_accuracy_report_flag == 1) && ( (control_input->checkpoint_interval_blocks > 0) || (control_input->checkpoint_interval_minutes > 0.0) ) ) {
+			printf("The accumulation accuracy report is not available with checkpoints.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	if (control_input->num_solver_threads < 1) {
+		printf("num_solver_threads must be at least 1 (%d).\n", control_input->num_solver_threads);
+		exit(EXIT_FAILURE);
+	}
+	
+	if (control_input->num_reduction_threads < 1) {
+		printf("num_reduction_threads must be at least 1 (%d).\n", control_input->num_reduction_threads);
+		exit(EXIT_FAILURE);
+	}
+	
+	if (control_input->accumulation_qr_threads < 1) {
+		printf("accumulation_qr_threads must be at least 1 (%d).\n", control_input->accumulation_qr_threads);
+		exit(EXIT_FAILURE);
+	}
+	
+	if ( (control_input->block_pipeline_depth < 0) || (control_input->block_pipeline_depth > 3) ) {
+		printf("block_pipeline_depth must be between 0 and 3 (%d).\n", control_input->block_pipeline_depth);
+		exit(EXIT_FAILURE);
+	}
+	if (control_input->block_pipeline_depth > 0) {
+		if ( (MatrixType(control_input->matrix_type) != kSparseNormal) && (MatrixType(control_input->matrix_type) != kSparseSparse) ) {
+			printf("block_pipeline_depth is only available for matrix_type 3 and 4.\n");
+			exit(EXIT_FAILURE);
+		}
+		if ( (MatrixType(control_input->matrix_type) == kSparseNormal) && (control_input->bootstrapping_flag == 1) ) {
+			printf("block_pipeline_depth is not available for matrix_type 3 with bootstrapping.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	if ( (control_input->checkpoint_interval_blocks < 0) || (control_input->checkpoint_interval_minutes < 0.0) ) {
+		printf("Checkpoint intervals cannot be negative.\n");
+		exit(EXIT_FAILURE);
+	}
+	if ( (control_input->checkpoint_interval_blocks > 0) || (control_input->checkpoint_interval_minutes > 0.0) ) {
+		if ( (MatrixType(control_input->matrix_type) != kDense) && (MatrixType(control_input->matrix_type) != kAccumulation) ) {
+			printf("Checkpoints are only available for matrix_type 0 and 2.\n");
+			exit(EXIT_FAILURE);
+		}
+		if (control_input->dynamic_state_sampling == 1) {
+			printf("Checkpoints are not available with dynamic_state_sampling.\n");
+			exit(EXIT_FAILURE);
+		}
+		if ( (MatrixType(control_input->matrix_type) == kAccumulation) && ( (control_input->accumulation_qr_threads > 1) || (control_input->bootstrapping_flag == 1) ) ) {
+			printf("Checkpoints of accumulation matrices are only available with one accumulation_qr_thread and without bootstrapping.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	if ( (control_input->frame_store_style < 0) || (control_input->frame_store_style > 3) ) {
+		printf("Unrecognized frame_store_style %d; please use 0 (none), 1 (record), 2 (replay), or 3 (replay with trajectory forces).\n", control_input->frame_store_style);
+		exit(EXIT_FAILURE);
+	}
+	if (control_input->frame_store_style != 0) {
+		if ( (control_input->pressure_constraint_flag != 0) || (control_input->dynamic_state_sampling == 1) || (control_input->site_reordering_style != 0) ) {
+			printf("Frame stores are not available with pressure_constraint_flag, dynamic_state_sampling, or site_reordering_style.\n");
+			exit(EXIT_FAILURE);
+		}
+		if ( (control_input->frame_store_style == 1) && (control_input->use_statistical_reweighting == 1) ) {
+			printf("Frame stores are recorded without use_statistical_reweighting, since frames with zero weight are skipped; apply the weights when replaying the store.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	if (control_input->model_variants_flag != 0) {
+		if ( (control_input->pressure_constraint_flag != 0) || (control_input->dynamic_state_sampling == 1) || (control_input->site_reordering_style != 0) || (control_input->frame_store_style != 0) ) {
+			printf("Model variants are not available with pressure_constraint_flag, dynamic_state_sampling, site_reordering_style, or frame_store_style.\n");
+			exit(EXIT_FAILURE);
+		}
+		if ( (control_input->checkpoint_interval_blocks > 0) || (control_input->checkpoint_interval_minutes > 0.0) || (control_input->plan_auto_select_flag != 0) ) {
+			printf("Model variants are not available with checkpoints or plan_auto_select_flag.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	if (control_input->regularization_path_flag != 0) {
+		if ( (control_input->regularization_path_flag < 0) || (control_input->regularization_path_flag > 3) ) {
+			printf("Unrecognized regularization_path_flag %d.\n", control_input->regularization_path_flag);
+			exit(EXIT_FAILURE);
+		}
+		if (control_input->regularization_style == 2) {
+			printf("The regularization path scans scalar Tikhonov regularization and cannot be combined with regularization_style 2.\n");
+			exit(EXIT_FAILURE);
+		}
+		if ( (control_input->regularization_path_points < 3) || (control_input->regularization_path_min <= 0.0) || (control_input->regularization_path_max <= control_input->regularization_path_min) ) {
+			printf("The regularization path needs at least 3 points and 0 < regularization_path_min < regularization_path_max.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	if ( (control_input->bayesian_solver_style < 0) || (control_input->bayesian_solver_style > 2) ) {
+		printf("Unrecognized bayesian_solver_style %d; please use 0 (SVD), 1 (Cholesky), or 2 (scalar alpha with eigendecomposition).\n", control_input->bayesian_solver_style);
+		exit(EXIT_FAILURE);
+	}
+	
+	if ( (control_input->sparse_solver_style < 0) || (control_input->sparse_solver_style > 1) ) {
+		printf("Unrecognized sparse_solver_style %d; please use 0 (PARDISO) or 1 (preconditioned CG).\n", control_input->sparse_solver_style);
+		exit(EXIT_FAILURE);
+	}
 	
+	if (control_input->krylov_max_iterations < 0 || control_input->krylov_tolerance <= 0.0) {
+		printf("krylov_max_iterations must be non-negative and krylov_tolerance must be positive.\n");
+		exit(EXIT_FAILURE);
+	}
+
 	if (control_input->position_dimension <= 0) {
 		printf("Position dimension must be a positive integer\n");
 		exit(EXIT_FAILURE);
@@ -314,7 +622,8 @@ void initialize_dense_matrix(MATRIX_DATA* const mat, ControlInputs* const contro
     if (control_input->bootstrapping_flag == 1) {
     	mat->do_end_of_frameblock_matrix_manipulations = convert_dense_fm_equation_to_normal_form_and_bootstrap;
     } else { 
-	    if (control_input->iterative_calculation_flag == 0) mat->do_end_of_frameblock_matrix_manipulations = convert_dense_fm_equation_to_normal_form_and_accumulate;
+	    if ( (control_input->normal_summation_style != 0) || (control_input->frame_normal_form_precision != 0) || (control_input->accumulation_accuracy_report_flag != 0) ) mat->do_end_of_frameblock_matrix_manipulations = convert_dense_fm_equation_to_normal_form_and_accumulate_carefully;
+	    else if (control_input->iterative_calculation_flag == 0) mat->do_end_of_frameblock_matrix_manipulations = convert_dense_fm_equation_to_normal_form_and_accumulate;
 	    else if (control_input->iterative_calculation_flag == 1) mat->do_end_of_frameblock_matrix_manipulations = convert_dense_target_force_vector_to_normal_form_and_accumulate;
 	}
     
@@ -339,8 +648,10 @@ void initialize_dense_matrix(MATRIX_DATA* const mat, ControlInputs* const contro
     // memory diagnostics if so. These are checks for integer 
     // overflow when calculating the size of the matrices.
 
+    // Out-of-core normal matrices are only limited by their int element indices.
+    int normal_element_size = (mat->normal_matrix_storage_style == 2) ? 1 : (int)(sizeof(double));
     if ( ( (int)(INT_MAX) / mat->fm_matrix_columns) <
-        (mat->fm_matrix_columns * (int)(sizeof(double)))) {
+        (mat->fm_matrix_columns * normal_element_size)) {
         printf("Using this number of columns will lead to integer overflow in memory allocation for the normal matrix equations. Decrease the number of basis functions.\n");
         exit(EXIT_FAILURE);
     }
@@ -352,7 +663,7 @@ void initialize_dense_matrix(MATRIX_DATA* const mat, ControlInputs* const contro
     }
     
     printf("Size of per-frame matrix: %lu bytes \n", mat->fm_matrix_rows * mat->fm_matrix_columns * sizeof(double));
-    printf("Size of normal matrix: %lu bytes \n", mat->fm_matrix_columns * mat->fm_matrix_columns * sizeof(double));
+    printf("Size of normal matrix: %lu bytes \n", get_normal_matrix_size(mat) * sizeof(double));
 
     // Allocate memory for the FM matrix and target vector as well as their normal form
     mat->accumulation_matrix_columns = mat->fm_matrix_columns;
@@ -362,9 +673,21 @@ void initialize_dense_matrix(MATRIX_DATA* const mat, ControlInputs* const contro
     
     if (control_input->bootstrapping_flag == 1) {
 		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);
+		allocate_bootstrapping_block_buffer(mat, control_input);
     }
-	mat->dense_fm_normal_matrix = new dense_matrix(mat->fm_matrix_columns , mat->fm_matrix_columns);
+	allocate_dense_normal_matrix(mat);
     mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
+    if (mat->do_end_of_frameblock_matrix_manipulations == convert_dense_fm_equation_to_normal_form_and_accumulate_carefully) {
+    	int normal_size = get_normal_matrix_size(mat) + mat->fm_matrix_columns;
+    	if (mat->frame_normal_form_precision != 1) mat->frame_normal_values = new double[normal_size]();
+    	if (mat->normal_summation_style == 1) mat->normal_compensation_values = new double[normal_size]();
+    	if (mat->accumulation_accuracy_report_flag == 1) mat->reference_normal_values = new double[normal_size]();
+    	if (mat->frame_normal_form_precision == 1) {
+    		printf("Size of single precision per-frame matrix: %lu bytes \n", mat->fm_matrix_rows * mat->fm_matrix_columns * sizeof(float));
+    		mat->single_fm_values = new float[(mat->fm_matrix_columns + 1) * mat->fm_matrix_rows]();
+    		mat->single_normal_values = new float[(mat->fm_matrix_columns + 1) * mat->fm_matrix_columns]();
+    	}
+    }
     // Initialized the matrix and vector to zero.
     printf("Initialized a dense FM matrix.\n");
 }
@@ -380,7 +703,10 @@ void initialize_accumulation_matrix(MATRIX_DATA* const mat, ControlInputs* const
     mat->accumulate_target_constraint_element = accumulate_constraint_into_accumulation_target_vector;
     
     if (control_input->bootstrapping_flag == 1) {
+    	mat->set_fm_matrix_to_zero = set_accumulation_block_to_zero;
     	mat->do_end_of_frameblock_matrix_manipulations = accumulate_accumulation_matrices_for_bootstrap;
+    } else if (control_input->accumulation_qr_threads > 1) {
+		mat->do_end_of_frameblock_matrix_manipulations = accumulate_accumulation_matrices_in_parallel;
     } else {
 		mat->do_end_of_frameblock_matrix_manipulations = accumulate_accumulation_matrices;
     }
@@ -407,10 +733,11 @@ void initialize_accumulation_matrix(MATRIX_DATA* const mat, ControlInputs* const
     printf("Number of columns for accumulation matrix algorithm: %d \n", mat->accumulation_matrix_rows);
     
     // Allocate memory for the FM matrix and target vector as well as temp space for the accumulation operation.
+    // Each bootstrapping estimate keeps only its triangular factor, stacked above
+    // space for the weighted factor of the current block.
     if (control_input->bootstrapping_flag == 1) {
-		printf("Bootstrapping is not currently supported for accumulation matrix type.\n");
-		exit(EXIT_FAILURE);
- 		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);
+ 		allocate_bootstrapping(mat, control_input, 2 * mat->accumulation_matrix_columns, mat->accumulation_matrix_columns);
+ 		mat->accumulation_r_matrix = new dense_matrix(2 * mat->accumulation_matrix_columns, mat->accumulation_matrix_columns);
     }
 	mat->dense_fm_matrix = new dense_matrix(mat->accumulation_matrix_rows, mat->accumulation_matrix_columns);
 	mat->dense_fm_normal_rhs_vector = new double[mat->accumulation_matrix_columns]();
@@ -559,8 +886,10 @@ void initialize_sparse_dense_normal_matrix(MATRIX_DATA* const mat, ControlInputs
     // memory diagnostics if so. These are checks for integer 
     // overflow when calculating the size of the matrices.
 
+    // Out-of-core normal matrices are only limited by their int element indices.
+    int normal_element_size = (mat->normal_matrix_storage_style == 2) ? 1 : (int)(sizeof(double));
     if ( (int(INT_MAX) / mat->fm_matrix_columns) <
-        (mat->fm_matrix_columns * (int)(sizeof(double))) ) {
+        (mat->fm_matrix_columns * normal_element_size) ) {
         printf("Using this number of columns will lead to integer overflow in memory allocation for the normal matrix equations. Decrease the number of basis functions.\n");
         exit(EXIT_FAILURE);
     }
@@ -582,9 +911,11 @@ void initialize_sparse_dense_normal_matrix(MATRIX_DATA* const mat, ControlInputs
     // These matrices are used for accumulation of normal form before solving
     if (control_input->bootstrapping_flag == 1) {
 		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);
+		allocate_bootstrapping_block_buffer(mat, control_input);
     }
-	mat->dense_fm_normal_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
+	allocate_dense_normal_matrix(mat);
 	mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
+	if (mat->block_pipeline_depth > 0) initialize_block_pipeline(mat);
 	printf("Initialized a sparse normal FM matrix.\n");
 }
 
@@ -613,13 +944,7 @@ void initialize_sparse_sparse_normal_matrix(MATRIX_DATA* const mat, ControlInput
 	    mat->finish_fm = solve_sparse_fm_normal_equations;
 	}
 	
-	mat->sparse_safety_factor = control_input->sparse_safety_factor;
-	
-	// Also, determine maximum and minimium number of entries in normal form matrix
-	estimate_number_of_sparse_elements(mat, cg);
 	printf("Fully dense normal matrix has %d entries.\n", mat->fm_matrix_columns * mat->fm_matrix_columns);
-	printf("Maximum number of non-zero entries is %d; sparsity is at least %.2lf percent\n", mat->max_nonzero_normal_elements, 100.0 * (1.0 -  (double) mat->max_nonzero_normal_elements / (double) (mat->fm_matrix_columns * mat->fm_matrix_columns)) );
-	printf("Lower bound for number of non-zero entries is %d; sparsity is at least %.2lf percent.\n", mat->min_nonzero_normal_elements, 100.0 * (1.0 -  (double) mat->min_nonzero_normal_elements / (double) (mat->fm_matrix_columns * mat->fm_matrix_columns)) );
     
     // Check that the matrix dimensions are enough that that the equations
     // will be overdetermined (in a perfect world where all the data is 
@@ -669,12 +994,19 @@ void initialize_sparse_sparse_normal_matrix(MATRIX_DATA* const mat, ControlInput
     // Chapt 25 for details.
     mat->h = new double[mat->fm_matrix_columns]();
     
+	// The normal matrix pattern is determined once, so each block only adds values.
 	// These matrices are used for accumulation of sparse normal form before solving
+	build_sparse_normal_matrix_pattern(mat, cg);
+	mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
 	if (control_input->bootstrapping_flag == 1) {
-		allocate_bootstrapping(mat, control_input, mat->fm_matrix_columns, mat->fm_matrix_columns);
+		allocate_bootstrapping(mat, control_input, 1, mat->fm_matrix_columns);
+		mat->sparse_block_normal_matrix = copy_sparse_normal_matrix_pattern(mat->sparse_matrix);
+		mat->bootstrapping_sparse_fm_normal_matrices = new csr_matrix*[control_input->bootstrapping_num_estimates];
+		for (int i = 0; i < control_input->bootstrapping_num_estimates; i++) {
+			mat->bootstrapping_sparse_fm_normal_matrices[i] = copy_sparse_normal_matrix_pattern(mat->sparse_matrix);
+		}
 	}
-	mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
-    mat->sparse_matrix = new csr_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns, mat->max_nonzero_normal_elements);
+	if (mat->block_pipeline_depth > 0) initialize_block_pipeline(mat);
     
 	printf("Initialized a sparse-sparse normal FM matrix.\n");
 }
@@ -694,6 +1026,199 @@ void initialize_dummy_matrix(MATRIX_DATA* const mat, ControlInputs* const contro
     mat->boltzmann = control_input->boltzmann;
 }
 
+// Prepare a dummy matrix that records one frame's FM equations in linked-list
+// form, so that the planner sees their sparsity without allocating an FM matrix.
+
+void initialize_plan_counting_matrix(MATRIX_DATA* const mat, CG_MODEL_DATA* const cg)
+{
+	determine_matrix_columns_and_rows(mat, cg, 1, 0);
+	mat->ll_sparse_matrix_row_heads = new linked_list_sparse_matrix_row_head[mat->rows_less_constraint_rows];
+	for (int i = 0; i < mat->rows_less_constraint_rows; i++) {
+		mat->ll_sparse_matrix_row_heads[i].n = 0;
+		mat->ll_sparse_matrix_row_heads[i].h = NULL;
+	}
+	mat->accumulate_fm_matrix_element = insert_sparse_matrix_element;
+	mat->accumulate_target_force_element = accumulate_force_into_dense_target_vector;
+	mat->accumulate_virial_constraint_matrix_element = insert_sparse_matrix_virial_element;
+}
+
+// Predict the peak memory and floating point work of each matrix_type and block size
+// from the sparsity of one frame's equations, and recommend the fastest configuration
+// that fits within plan_memory_budget. With plan_auto_select_flag, the recommendation
+// replaces matrix_type and block_size in control_input.
+
+void plan_fm_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg)
+{
+	// Gather the frame's row lengths and free the linked lists.
+	double frame_elements = 0.0;
+	double frame_row_products = 0.0;
+	struct linked_list_sparse_matrix_element* curr_elem, *prev_elem;
+	for (int k = 0; k < mat->rows_less_constraint_rows; k++) {
+		double n_in_row = (double)(mat->ll_sparse_matrix_row_heads[k].n);
+		frame_elements += n_in_row;
+		frame_row_products += n_in_row * n_in_row;
+		curr_elem = mat->ll_sparse_matrix_row_heads[k].h;
+		while (curr_elem != NULL) {
+			prev_elem = curr_elem;
+			curr_elem = prev_elem->next;
+			delete prev_elem;
+		}
+	}
+	delete [] mat->ll_sparse_matrix_row_heads;
+	mat->ll_sparse_matrix_row_heads = NULL;
+	
+	// Size the fixed normal matrix pattern of matrix_type 4.
+	if (control_input->pressure_constraint_flag != 0) mat->virial_constraint_rows = 1;
+	build_sparse_normal_matrix_pattern(mat, cg);
+	double pattern_elements = (double)(mat->max_nonzero_normal_elements);
+	delete mat->sparse_matrix;
+	mat->sparse_matrix = NULL;
+	mat->virial_constraint_rows = 0;
+	
+	// Block sizes must divide the number of frame samples.
+	int total_frame_samples = control_input->n_frames;
+	if (control_input->dynamic_state_sampling == 1) total_frame_samples *= control_input->dynamic_state_samples_per_frame;
+	int max_block_size = total_frame_samples;
+	if ( (control_input->use_statistical_reweighting == 1) || (control_input->bootstrapping_flag == 1) || (control_input->volume_weighting_flag == 1) ) max_block_size = 1;
+	const int n_block_sizes = 11;
+	int block_sizes[n_block_sizes] = {1, 2, 5, 10, 20, 50, 100, 200, 500, 1000, control_input->frames_per_traj_block};
+	
+	std::vector<fm_matrix_plan> plans;
+	for (int matrix_type = kDense; matrix_type <= kSparseSparse; matrix_type++) {
+		if (plan_matrix_type_is_available(control_input, matrix_type) == 0) continue;
+		for (int i = 0; i < n_block_sizes; i++) {
+			if ( (block_sizes[i] < 1) || (block_sizes[i] > max_block_size) || (total_frame_samples % block_sizes[i] != 0) ) continue;
+			if ( (matrix_type == kDense) && (block_sizes[i] != 1) ) continue;
+			if ( (i == n_block_sizes - 1) && (std::find(block_sizes, block_sizes + n_block_sizes - 1, block_sizes[i]) != block_sizes + n_block_sizes - 1) ) continue;
+			
+			fm_matrix_plan plan;
+			plan.matrix_type = matrix_type;
+			plan.block_size = block_sizes[i];
+			if (estimate_fm_matrix_plan(control_input, mat->fm_matrix_columns, cg->n_cg_sites, frame_elements, frame_row_products, pattern_elements, total_frame_samples, &plan) == 1) {
+				plans.push_back(plan);
+			}
+		}
+	}
+	if (plans.size() == 0) {
+		printf("No matrix_type can be planned with these control parameters.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	// Report every candidate and pick the least total work within the budget.
+	double budget_bytes = control_input->plan_memory_budget * 1024.0 * 1024.0;
+	int best = -1;
+	printf("Memory plan for %d columns and %d sites (%.0lf nonzero row entries in the first frame):\n", mat->fm_matrix_columns, cg->n_cg_sites, frame_elements);
+	printf("matrix_type block_size peak_memory_MB flops_per_frame total_flops\n");
+	for (unsigned i = 0; i < plans.size(); i++) {
+		int fits = (budget_bytes <= 0.0) || (plans[i].peak_bytes <= budget_bytes);
+		printf("%11d %10d %14.1lf %15.3le %11.3le%s\n", plans[i].matrix_type, plans[i].block_size, plans[i].peak_bytes / (1024.0 * 1024.0), plans[i].frame_cost, plans[i].total_cost, fits ? "" : " (over budget)");
+		if ( fits && ( (best < 0) || (plans[i].total_cost < plans[best].total_cost) ) ) best = i;
+	}
+	if (best < 0) {
+		printf("No configuration fits within a plan_memory_budget of %.1lf MB.\n", control_input->plan_memory_budget);
+		exit(EXIT_FAILURE);
+	}
+	printf("Recommended configuration: matrix_type %d with block_size %d.\n", plans[best].matrix_type, plans[best].block_size);
+	
+	if (control_input->plan_auto_select_flag == 1) {
+		printf("Using matrix_type %d with block_size %d.\n", plans[best].matrix_type, plans[best].block_size);
+		control_input->matrix_type = plans[best].matrix_type;
+		control_input->frames_per_traj_block = plans[best].block_size;
+	}
+}
+
+// Check whether the other control parameters allow a matrix_type to be chosen.
+// matrix_type 1 averages blockwise solutions, so it is never substituted for the others.
+
+int plan_matrix_type_is_available(ControlInputs* const control_input, const int matrix_type)
+{
+	if (matrix_type == kSparse) return 0;
+	#if _mkl_flag != 1
+	if (matrix_type == kSparseSparse) return 0;
+	#endif
+	int dense_normal = (matrix_type == kDense) || (matrix_type == kSparseNormal);
+	if ( (matrix_type == kDense) && (control_input->dense_solver_style == 2) && (control_input->normal_matrix_storage_style != 2) ) return 0;
+	if ( (control_input->output_normal_equations_rhs_flag != 0) && !dense_normal ) return 0;
+	if ( (control_input->normal_matrix_storage_style != 0) && !dense_normal ) return 0;
+	if ( (control_input->regularization_path_flag != 0) && !dense_normal ) return 0;
+	if ( (control_input->iterative_calculation_flag == 1) && !dense_normal ) return 0;
+	if ( (control_input->bayesian_flag != 0) && (matrix_type == kAccumulation) ) return 0;
+	if ( ( (control_input->normal_summation_style != 0) || (control_input->frame_normal_form_precision != 0) || (control_input->accumulation_accuracy_report_flag != 0) ) && (matrix_type != kDense) ) return 0;
+	if (control_input->block_pipeline_depth > 0) {
+		if ( (matrix_type != kSparseNormal) && (matrix_type != kSparseSparse) ) return 0;
+		if ( (matrix_type == kSparseNormal) && (control_input->bootstrapping_flag == 1) ) return 0;
+	}
+	if ( (control_input->checkpoint_interval_blocks > 0) || (control_input->checkpoint_interval_minutes > 0.0) ) {
+		if ( (matrix_type != kDense) && (matrix_type != kAccumulation) ) return 0;
+		if ( (matrix_type == kAccumulation) && ( (control_input->accumulation_qr_threads > 1) || (control_input->bootstrapping_flag == 1) ) ) return 0;
+	}
+	return 1;
+}
+
+// Estimate peak memory in bytes and floating point work for one configuration from the
+// allocations made by its initialization and solve routines. Returns 0 if the
+// configuration cannot be used with this many rows.
+
+int estimate_fm_matrix_plan(ControlInputs* const control_input, const int fm_matrix_columns, const int n_cg_sites, const double frame_elements, const double frame_row_products, const double pattern_elements, const int total_frame_samples, fm_matrix_plan* const plan)
+{
+	double columns = (double)(fm_matrix_columns);
+	double block_size = (double)(plan->block_size);
+	double frame_rows = (double)(DIMENSION * n_cg_sites);
+	if (control_input->pressure_constraint_flag != 0) frame_rows += 1.0;
+	double rows = frame_rows * block_size;
+	if (frame_rows * (double)(control_input->n_frames) < columns) return 0;
+	
+	double estimates = 0.0;
+	if (control_input->bootstrapping_flag == 1) estimates = (double)(control_input->bootstrapping_num_estimates);
+	double normal_size = columns * columns;
+	if (control_input->normal_matrix_storage_style == 1) normal_size = columns * (columns + 1.0) / 2.0;
+	double solve_workspace_size = 2.0 * columns * columns;
+	// Out-of-core normal matrices live in mapped files and are solved in place.
+	if (control_input->normal_matrix_storage_style == 2) normal_size = solve_workspace_size = 0.0;
+	double list_bytes = frame_elements * block_size * (double)(sizeof(linked_list_sparse_matrix_element));
+	double pipeline_copies = 1.0 + (double)(control_input->block_pipeline_depth);
+	double dense_solve_cost = 10.0 * columns * columns * columns;
+	
+	double assembly_bytes, solve_bytes, solve_cost;
+	if (plan->matrix_type == kDense) {
+		assembly_bytes = sizeof(double) * (rows * columns + rows + (1.0 + estimates) * (normal_size + columns));
+		solve_bytes = sizeof(double) * ((1.0 + estimates) * (normal_size + columns) + solve_workspace_size);
+		plan->frame_cost = frame_rows * columns * columns + estimates * normal_size;
+		solve_cost = (1.0 + estimates) * dense_solve_cost;
+	} else if (plan->matrix_type == kAccumulation) {
+		double accumulation_columns = columns + 1.0;
+		double accumulation_size = (rows + accumulation_columns) * accumulation_columns;
+		double lanes = (double)(control_input->accumulation_qr_threads);
+		if (control_input->bootstrapping_flag == 1) lanes = 1.0;
+		double factor_size = 2.0 * accumulation_columns * accumulation_columns;
+		assembly_bytes = sizeof(double) * (lanes * accumulation_size + estimates * factor_size);
+		if (control_input->bootstrapping_flag == 1) assembly_bytes += sizeof(double) * factor_size;
+		solve_bytes = assembly_bytes + sizeof(double) * 2.0 * accumulation_columns * accumulation_columns;
+		double block_cost = 2.0 * accumulation_columns * accumulation_columns * (rows + accumulation_columns) - 2.0 / 3.0 * accumulation_columns * accumulation_columns * accumulation_columns;
+		plan->frame_cost = (block_cost + estimates * 2.0 * factor_size * accumulation_columns) / block_size;
+		solve_cost = (1.0 + estimates) * 10.0 * accumulation_columns * accumulation_columns * accumulation_columns;
+	} else if (plan->matrix_type == kSparseNormal) {
+		if (columns > rows) return 0;
+		assembly_bytes = pipeline_copies * (list_bytes + sizeof(double) * rows) + sizeof(double) * (1.0 + estimates) * (normal_size + columns);
+		solve_bytes = sizeof(double) * ((1.0 + estimates) * (normal_size + columns) + solve_workspace_size);
+		plan->frame_cost = (1.0 + 2.0 * DIMENSION) * frame_row_products + estimates * normal_size / block_size;
+		solve_cost = (1.0 + estimates) * dense_solve_cost;
+	} else {
+		if (columns > rows) return 0;
+		double pattern_bytes = pattern_elements * (sizeof(double) + sizeof(int)) + sizeof(int) * (columns + 1.0);
+		double pattern_copies = 1.0 + estimates;
+		if (control_input->bootstrapping_flag == 1) pattern_copies += 1.0;
+		assembly_bytes = pipeline_copies * (list_bytes + sizeof(double) * rows) + pattern_copies * pattern_bytes + sizeof(double) * (1.0 + estimates) * columns;
+		solve_bytes = (pattern_copies + 1.0) * pattern_bytes + sizeof(double) * (1.0 + estimates) * columns;
+		plan->frame_cost = (1.0 + 2.0 * DIMENSION) * frame_row_products + frame_elements * pattern_elements / columns;
+		if (control_input->bootstrapping_flag == 1) plan->frame_cost += 2.0 * (1.0 + estimates) * pattern_elements / block_size;
+		solve_cost = (1.0 + estimates) * fmin(pattern_elements * pattern_elements / columns, dense_solve_cost);
+	}
+	plan->peak_bytes = fmax(assembly_bytes, solve_bytes);
+	plan->total_cost = plan->frame_cost * (double)(total_frame_samples) + solve_cost;
+	return 1;
+}
+
 void initialize_first_BI_matrix(MATRIX_DATA* const mat, CG_MODEL_DATA* const cg)
 {
   determine_matrix_columns_and_rows(mat, cg, 1, 0);
@@ -703,41 +1228,186 @@ void initialize_first_BI_matrix(MATRIX_DATA* const mat, CG_MODEL_DATA* const cg)
   mat->accumulate_tabulated_forces = accumulate_tabulated_error; // does nothing
   mat->accumulate_target_force_element = accumulate_scalar_into_dense_target_vector;
   
+  // Each interaction's equations get their own matrix and target vector.
+  delete [] mat->dense_fm_rhs_vector;
+  delete [] mat->dense_fm_normal_rhs_vector;
+  mat->dense_fm_rhs_vector = NULL;
+  mat->dense_fm_normal_rhs_vector = NULL;
+  mat->BI_systems.clear();
+  
   // reset output files
-  FILE* BI_matrix = fopen("BI_matrix.dat","w");
-  FILE* BI_vector = fopen("BI_vector.dat","w");
+  if (mat->output_BI_equations_flag == 1) {
+    FILE* BI_matrix = open_file("BI_matrix.dat", "w");
+    FILE* BI_vector = open_file("BI_vector.dat", "w");
+    fclose(BI_matrix);
+    fclose(BI_vector);
+  }
+}
+
+// Start the equations for the next interaction; the accumulation routines
+// add to this system until the next one is started.
+
+void initialize_next_BI_system(MATRIX_DATA* const mat, const int rows, const int columns, const int solution_offset)
+{
+  BI_system system;
+  system.rows = rows;
+  system.columns = columns;
+  system.solution_offset = solution_offset;
+  
+  // The svd solver puts the solution vector into the target vector,
+  // so it must be at least as long as the number of columns.
+  // Avoid allocation errors if this interaction is not actually active.
+  system.matrix = new dense_matrix(std::max(rows, 1), std::max(columns, 1));
+  system.rhs_vector = new double[std::max(std::max(rows, columns), 1)]();
+  mat->BI_systems.push_back(system);
+  
+  mat->dense_fm_matrix = system.matrix;
+  mat->dense_fm_rhs_vector = system.rhs_vector;
+}  
+
+// Append the BI systems from first_system on, which together cover one interaction
+// class, to BI_matrix.dat and BI_vector.dat as a single block-diagonal system with
+// n_columns columns starting at fm_solution column first_column.
+
+void write_BI_equations(MATRIX_DATA* const mat, const int first_system, const int first_column, const int n_columns)
+{
+  FILE* BI_matrix = open_file("BI_matrix.dat", "a");
+  FILE* BI_vector = open_file("BI_vector.dat", "a");
+  int n_rows = 0;
+  for (int k = first_system; k < (int)(mat->BI_systems.size()); k++) n_rows += mat->BI_systems[k].rows;
+  
+  // A class without equations is written as a single zero so that every class has an entry.
+  if (n_rows == 0 || n_columns == 0) {
+    fprintf(BI_matrix, "%lf\t\n", 0.0);
+  }
+  for (int k = first_system; k < (int)(mat->BI_systems.size()) && n_columns > 0; k++) {
+    BI_system &system = mat->BI_systems[k];
+    int offset = system.solution_offset - first_column;
+    for (int i = 0; i < system.rows; i++) {
+      for (int j = 0; j < n_columns; j++) {
+        double value = 0.0;
+        if (j >= offset && j < offset + system.columns) value = system.matrix->get_scalar(i, j - offset);
+        fprintf(BI_matrix, "%lf\t", value);
+      }
+      fprintf(BI_matrix, "\n");
+      fprintf(BI_vector, "%lf\n", system.rhs_vector[i]);
+    }
+  }
   fclose(BI_matrix);
   fclose(BI_vector);
 }
 
-void initialize_next_BI_matrix(MATRIX_DATA* const mat, InteractionClassComputer* const icomp)
+//--------------------------------------------------------------------
+// Normal matrix storage helper routines
+//--------------------------------------------------------------------
+
+// Allocate the normal matrix for matrix_type 0 and 3. Packed storage keeps
+// only the upper triangle until the equations are solved.
+
+void allocate_dense_normal_matrix(MATRIX_DATA* const mat)
+{
+	if (mat->normal_matrix_storage_style == 1) {
+		mat->packed_fm_normal_matrix = new packed_symmetric_matrix(mat->fm_matrix_columns);
+		mat->dense_fm_normal_matrix = NULL;
+	} else {
+		mat->packed_fm_normal_matrix = NULL;
+		mat->dense_fm_normal_matrix = allocate_normal_storage_matrix(mat, mat->fm_matrix_columns, mat->fm_matrix_columns);
+	}
+}
+
+// Allocate a zeroed dense matrix of normal equations. For out-of-core storage 
+// (normal_matrix_storage_style 2) its values live in an unlinked temporary file in the
+// working directory that is mapped into memory, so the page cache holds the tiles in use
+// and the rest stays on disk. The file is sparse, so untouched tiles take no disk space.
+
+dense_matrix* allocate_normal_storage_matrix(MATRIX_DATA* const mat, const int rows, const int cols)
+{
+	if (mat->normal_matrix_storage_style != 2) return new dense_matrix(rows, cols);
+	
+	char filename[] = "out_of_core_normal_matrix.XXXXXX";
+	size_t mapped_size = (size_t)(rows) * (size_t)(cols) * sizeof(double);
+	int fd = mkstemp(filename);
+	if (fd < 0) {
+		printf("Could not create an out-of-core normal matrix file in the working directory.\n");
+		exit(EXIT_FAILURE);
+	}
+	unlink(filename);
+	if (ftruncate(fd, mapped_size) != 0) {
+		printf("Could not extend the out-of-core normal matrix file to %lu bytes.\n", mapped_size);
+		exit(EXIT_FAILURE);
+	}
+	void* mapping = mmap(NULL, mapped_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mapping == MAP_FAILED) {
+		printf("Failed to map an out-of-core normal matrix of %lu bytes.\n", mapped_size);
+		exit(EXIT_FAILURE);
+	}
+	dense_matrix* matrix = new dense_matrix(rows, cols, (double*)(mapping));
+	matrix->mapped_size = mapped_size;
+	return matrix;
+}
+
+// Number of stored elements in each normal matrix.
+
+inline int get_normal_matrix_size(MATRIX_DATA* const mat)
 {
-  determine_BI_interaction_rows_and_cols(mat, icomp);
+	if (mat->normal_matrix_storage_style == 1) return mat->fm_matrix_columns * (mat->fm_matrix_columns + 1) / 2;
+	else return mat->fm_matrix_columns * mat->fm_matrix_columns;
+}
 
-  printf("%s matrix rows = %d, cols = %d\n",icomp->ispec->get_full_name().c_str(), mat->fm_matrix_rows, mat->fm_matrix_columns);fflush(stdout);
-  
-  // To store the dense RHS, this array only need to be of size mat->fm_matrix_rows.
-  // However, the svd solver puts the solution vector into this array,
-  // and  the solution vetor is of size mat->fm_matrix_columns.
-  delete [] mat->dense_fm_rhs_vector;
-  delete [] mat->dense_fm_normal_rhs_vector;
+inline double* get_normal_matrix_values(MATRIX_DATA* const mat)
+{
+	if (mat->normal_matrix_storage_style == 1) return mat->packed_fm_normal_matrix->values;
+	else return mat->dense_fm_normal_matrix->values;
+}
 
-  // avoid allocation errors if this interactions is not actually active.
-  if(mat->fm_matrix_columns == 0 || mat->fm_matrix_rows == 0) {
-  	mat->dense_fm_normal_rhs_vector = new double[1]();
-  	mat->dense_fm_rhs_vector = new double[1]();
-  	mat->dense_fm_matrix =  new dense_matrix(1, 1);
-  } else {
-  	if (mat->fm_matrix_rows >= mat->fm_matrix_columns) {
-		mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_rows]();
-  		mat->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
-	  } else {
-  		mat->dense_fm_normal_rhs_vector = new double[mat->fm_matrix_columns]();
-  		mat->dense_fm_rhs_vector = new double[mat->fm_matrix_columns]();
-  	}
- 	mat->dense_fm_matrix =  new dense_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns);
-  }
-}  
+inline double* get_bootstrapping_normal_matrix_values(MATRIX_DATA* const mat, const int i)
+{
+	if (mat->normal_matrix_storage_style == 1) return mat->bootstrapping_packed_fm_normal_matrices[i]->values;
+	else return mat->bootstrapping_dense_fm_normal_matrices[i]->values;
+}
+
+// Add an element of a symmetric normal matrix to values in any storage.
+// Packed and out-of-core storage only hold the upper triangle, so lower elements are skipped.
+
+inline void add_normal_matrix_element(MATRIX_DATA* const mat, double* const normal_matrix_values, const int row, const int col, const double x)
+{
+	if (mat->normal_matrix_storage_style == 1) {
+		if (row <= col) normal_matrix_values[get_packed_symmetric_index(mat->fm_matrix_columns, row, col)] += x;
+	} else if (mat->normal_matrix_storage_style == 2) {
+		// Out-of-core storage also keeps only the upper triangle to halve its disk traffic.
+		if (row <= col) normal_matrix_values[col * mat->fm_matrix_columns + row] += x;
+	} else {
+		normal_matrix_values[col * mat->fm_matrix_columns + row] += x;
+	}
+}
+
+inline double get_normal_matrix_element(MATRIX_DATA* const mat, const int row, const int col)
+{
+	if (mat->normal_matrix_storage_style == 1) return mat->packed_fm_normal_matrix->get_scalar(row, col);
+	else return mat->dense_fm_normal_matrix->get_scalar(row, col);
+}
+
+inline void assign_normal_matrix_element(MATRIX_DATA* const mat, const int row, const int col, const double x)
+{
+	if (mat->normal_matrix_storage_style == 1) mat->packed_fm_normal_matrix->assign_scalar(row, col, x);
+	else mat->dense_fm_normal_matrix->assign_scalar(row, col, x);
+}
+
+// Expand a packed normal matrix into a full symmetric dense matrix for the solvers.
+
+void unpack_normal_matrix(const int n, packed_symmetric_matrix* const packed_matrix, dense_matrix* const dense_normal_matrix)
+{
+	char transr = 'n';
+	char uplo = 'u';
+	int info = 0;
+	dtfttr_(&transr, &uplo, &n, packed_matrix->values, dense_normal_matrix->values, &n, &info);
+	for (int i = 0; i < n; i++) {
+		for (int j = 0; j < i; j++) {
+			dense_normal_matrix->assign_scalar(i, j, dense_normal_matrix->get_scalar(j, i));
+		}
+	}
+}
 
 //--------------------------------------------------------------------
 // Bootstrapping helper routines
@@ -762,6 +1432,124 @@ void set_bootstrapping_normalization(MATRIX_DATA* mat, double** const bootstrapp
 	}	
 }
 
+// Allocate the buffer of per-block normal equations for matrix_type 0 and 3.
+// At most one block per estimate is buffered so that the buffer is never larger
+// than the estimates themselves.
+
+void allocate_bootstrapping_block_buffer(MATRIX_DATA* mat, ControlInputs* const control_input)
+{
+	const int max_buffered_blocks = 16;
+	int num_blocks = (control_input->n_frames + mat->bootstrapping_block_size - 1) / mat->bootstrapping_block_size;
+	mat->bootstrapping_buffer_size = std::max(1, std::min(max_buffered_blocks, std::min(num_blocks, mat->bootstrapping_num_estimates)));
+	mat->bootstrapping_buffered_blocks = 0;
+	mat->bootstrapping_buffer_weights = new double[mat->bootstrapping_buffer_size * (mat->bootstrapping_num_estimates + 1)]();
+	mat->bootstrapping_block_buffer = allocate_normal_storage_matrix(mat, get_normal_matrix_size(mat) + mat->fm_matrix_columns, mat->bootstrapping_buffer_size);
+}
+
+// Return the buffered normal equations of the resampling block holding the current frame,
+// combining the full buffer into the estimates first when a new block starts.
+
+inline double* get_bootstrapping_block_values(MATRIX_DATA* const mat)
+{
+	int block_size = mat->bootstrapping_block_buffer->n_rows;
+	if ( (mat->bootstrapping_buffered_blocks == 0) || (mat->trajectory_block_index % mat->bootstrapping_block_size == 0) ) {
+		if (mat->bootstrapping_buffered_blocks == mat->bootstrapping_buffer_size) combine_bootstrapping_block_buffer(mat);
+		int slot = mat->bootstrapping_buffered_blocks;
+		double* block_values = mat->bootstrapping_block_buffer->values + (size_t)(slot) * block_size;
+		for (int i = 0; i < block_size; i++) block_values[i] = 0.0;
+		
+		// Record the block weights now since the frame weights are freed before the final combination.
+		double* slot_weights = mat->bootstrapping_buffer_weights + slot * (mat->bootstrapping_num_estimates + 1);
+		slot_weights[0] = mat->get_frame_weight() * mat->normalization;
+		for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
+			slot_weights[i + 1] = mat->bootstrapping_weights[i][mat->trajectory_block_index] * mat->bootstrapping_normalization[i];
+		}
+		mat->bootstrapping_buffered_blocks++;
+	}
+	return mat->bootstrapping_block_buffer->values + (size_t)(mat->bootstrapping_buffered_blocks - 1) * block_size;
+}
+
+// Add the buffered blocks to the full-trajectory normal equations and to every bootstrapping estimate.
+// The estimates are stored as the columns of one matrix, so all of them are updated by a single
+// matrix product of the buffer with the block weights of every estimate.
+
+void combine_bootstrapping_block_buffer(MATRIX_DATA* const mat)
+{
+	int n_blocks = mat->bootstrapping_buffered_blocks;
+	if (n_blocks == 0) return;
+	int matrix_size = get_normal_matrix_size(mat);
+	int block_size = mat->bootstrapping_block_buffer->n_rows;
+	int weight_stride = mat->bootstrapping_num_estimates + 1;
+	double* buffer = mat->bootstrapping_block_buffer->values;
+	
+	cblas_dgemv(CblasColMajor, CblasNoTrans, matrix_size, n_blocks, 1.0, buffer, block_size, mat->bootstrapping_buffer_weights, weight_stride, 1.0, get_normal_matrix_values(mat), 1);
+	cblas_dgemv(CblasColMajor, CblasNoTrans, mat->fm_matrix_columns, n_blocks, 1.0, buffer + matrix_size, block_size, mat->bootstrapping_buffer_weights, weight_stride, 1.0, mat->dense_fm_normal_rhs_vector, 1);
+	
+	// The weights of estimate i for the buffered blocks are row i of the weight matrix
+	// starting at the second weight of each block.
+	double* estimate_weights = mat->bootstrapping_buffer_weights + 1;
+	cblas_dgemm(CblasColMajor, CblasNoTrans, CblasTrans, matrix_size, mat->bootstrapping_num_estimates, n_blocks, 1.0, buffer, block_size, estimate_weights, weight_stride, 1.0, mat->bootstrapping_normal_storage->values, matrix_size);
+	cblas_dgemm(CblasColMajor, CblasNoTrans, CblasTrans, mat->fm_matrix_columns, mat->bootstrapping_num_estimates, n_blocks, 1.0, buffer + matrix_size, block_size, estimate_weights, weight_stride, 1.0, mat->bootstrapping_rhs_storage->values, mat->fm_matrix_columns);
+	mat->bootstrapping_buffered_blocks = 0;
+}
+
+// Serializes output written by concurrent bootstrapping solves.
+std::mutex bootstrapping_output_mutex;
+
+// Take task indices from next_task until all tasks have been claimed.
+
+void run_concurrent_solve_worker(MATRIX_DATA* const mat, const int n_tasks, void (*solve_task)(MATRIX_DATA* const, const int), std::atomic<int>* const next_task)
+{
+	#if _mkl_flag == 1
+	mkl_set_num_threads_local(1);
+	#elif defined(_OPENMP)
+	omp_set_num_threads(1);
+	#endif
+	for (int i = (*next_task)++; i < n_tasks; i = (*next_task)++) solve_task(mat, i);
+}
+
+// Run solve_task for every index in [0, n_tasks) on up to n_threads threads.
+// Each task allocates its own LAPACK workspaces, and BLAS is kept single-threaded
+// within a task when several tasks run at once (for MKL, OpenMP-threaded BLAS,
+// and OpenBLAS built with _openblas_flag) so the tasks do not oversubscribe the cores.
+
+void run_concurrent_solves(MATRIX_DATA* const mat, const int n_tasks, const int n_threads, void (*solve_task)(MATRIX_DATA* const, const int))
+{
+	int thread_count = std::min(n_threads, n_tasks);
+	if (thread_count > 1) {
+		printf("Solving %d estimates on %d threads.\n", n_tasks, thread_count);
+		fflush(stdout);
+	}
+	run_concurrent_tasks(mat, n_tasks, n_threads, solve_task);
+}
+
+void run_concurrent_tasks(MATRIX_DATA* const mat, const int n_tasks, const int n_threads, void (*solve_task)(MATRIX_DATA* const, const int))
+{
+	int thread_count = std::min(n_threads, n_tasks);
+	if (thread_count <= 1) {
+		for (int i = 0; i < n_tasks; i++) solve_task(mat, i);
+		return;
+	}
+	
+	// OpenBLAS has a single thread count for the whole process, so it is
+	// lowered while the tasks run and restored afterwards.
+	#if _openblas_flag == 1
+	int blas_threads = openblas_get_num_threads();
+	openblas_set_num_threads(1);
+	#endif
+	
+	std::atomic<int> next_task(0);
+	std::vector<std::thread> threads;
+	for (int t = 0; t < thread_count; t++) {
+		threads.push_back(std::thread(run_concurrent_solve_worker, mat, n_tasks, solve_task, &next_task));
+	}
+	for (int t = 0; t < thread_count; t++) threads[t].join();
+	
+	#if _openblas_flag == 1
+	openblas_set_num_threads(blas_threads);
+	#endif
+}
+
 //--------------------------------------------------------------------
 // Initialization helper routines
 //--------------------------------------------------------------------
@@ -783,14 +1571,17 @@ void determine_matrix_columns_and_rows( MATRIX_DATA* const mat, CG_MODEL_DATA* c
 	mat->virial_constraint_rows = 0;
 	printf("Number of basis functions by interaction class:\n");
 	std::list<InteractionClassSpec*>::iterator iclass_iterator;
+	mat->column_layout_hash = 14695981039346656037ULL;
 	for(iclass_iterator=cg->iclass_list.begin(); iclass_iterator != cg->iclass_list.end(); iclass_iterator++) {
 		mat->fm_matrix_columns += (*iclass_iterator)->get_num_basis_func();
 		log_n_basis_functions(**(iclass_iterator));
+		mat->column_layout_hash = hash_column_layout(mat->column_layout_hash, **(iclass_iterator));
 	}    
 	
 	if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
 		mat->fm_matrix_columns += cg->three_body_nonbonded_interactions.get_num_basis_func();
 		log_n_basis_functions(cg->three_body_nonbonded_interactions);
+		mat->column_layout_hash = hash_column_layout(mat->column_layout_hash, cg->three_body_nonbonded_interactions);
 	}
 
     // Determine the number of rows by seeing the number of particles and the number of auxiliary scalar restraints,
@@ -803,32 +1594,77 @@ void determine_matrix_columns_and_rows( MATRIX_DATA* const mat, CG_MODEL_DATA* c
 	mat->fm_matrix_rows = mat->rows_less_constraint_rows * DIMENSION + mat->virial_constraint_rows;
 }
 
-void determine_BI_interaction_rows_and_cols(MATRIX_DATA* mat, InteractionClassComputer* const icomp)
+// 64-bit FNV-1a hash of the bytes of n_words 64-bit words, used for the column
+// layout and for binary equation and checkpoint file checksums. Hashing byte by
+// byte lets every input bit reach every bit of the hash.
+
+inline uint64_t hash_binary_words(uint64_t hash, const void* const data, const size_t n_words)
 {
-  int num_entries = 0;
-  // Skip if it does not have a parameter distribution to use
-  if (icomp->ispec->output_parameter_distribution !=  0) {
-    // For every defined interaction,
-    for (unsigned i = 0; i < icomp->ispec->defined_to_matched_intrxn_index_map.size(); i++) {
-      num_entries += (2 * (int)(0.5 + (icomp->ispec->upper_cutoffs[i] - icomp->ispec->lower_cutoffs[i])/ icomp->ispec->get_fm_binwidth()));
-    }
-  }
-  mat->fm_matrix_rows = num_entries;
-  mat->fm_matrix_columns = icomp->ispec->get_num_basis_func();
+	const unsigned char* bytes = (const unsigned char*)data;
+	size_t n_bytes = 8 * n_words;
+	for (size_t i = 0; i < n_bytes; i++) {
+		hash ^= bytes[i];
+		hash *= 1099511628211ULL;
+	}
+	return hash;
 }
 
-void allocate_bootstrapping(MATRIX_DATA* mat, ControlInputs* const control_input, const int rows, const int cols)
+// Add the parameters that fix the meaning of an interaction class's columns to the layout hash.
+
+inline uint64_t hash_column_layout(uint64_t hash, InteractionClassSpec &ispec)
 {
-	// matrices
-	mat->bootstrapping_dense_fm_normal_matrices = new dense_matrix*[control_input->bootstrapping_num_estimates];
-  	for (int i = 0; i < control_input->bootstrapping_num_estimates; i++) {
-		mat->bootstrapping_dense_fm_normal_matrices[i] = new dense_matrix(rows, cols);
+	int64_t words[7] = {ispec.class_type, ispec.class_subtype, ispec.get_basis_type(), ispec.get_bspline_k(), ispec.n_defined, ispec.n_to_force_match, ispec.get_num_basis_func()};
+	hash = hash_binary_words(hash, words, 7);
+	double binwidth = ispec.get_fm_binwidth();
+	hash = hash_binary_words(hash, &binwidth, 1);
+	for (int i = 0; i < ispec.n_defined; i++) {
+		if (i >= (int)ispec.defined_to_matched_intrxn_index_map.size() || ispec.defined_to_matched_intrxn_index_map[i] == 0) continue;
+		int64_t index_words[2] = {i, ispec.defined_to_matched_intrxn_index_map[i]};
+		hash = hash_binary_words(hash, index_words, 2);
+		double cutoffs[2] = {ispec.lower_cutoffs[i], ispec.upper_cutoffs[i]};
+		hash = hash_binary_words(hash, cutoffs, 2);
+	}
+	for (unsigned i = 0; i < ispec.interaction_column_indices.size(); i++) {
+		int64_t column = ispec.interaction_column_indices[i];
+		hash = hash_binary_words(hash, &column, 1);
+	}
+	return hash;
+}
+
+void allocate_bootstrapping(MATRIX_DATA* mat, ControlInputs* const control_input, const int rows, const int cols)
+{
+	// matrix_type 0 and 3 add buffered blocks to all estimates with one matrix product,
+	// so their estimates are stored together, one per column, and each estimate's
+	// matrix and rhs vector only point into that storage.
+	int stored_together = (mat->matrix_type == kDense) || (mat->matrix_type == kSparseNormal);
+	size_t matrix_size = (mat->normal_matrix_storage_style == 1) ? (size_t)(cols) * (size_t)(cols + 1) / 2 : (size_t)(rows) * (size_t)(cols);
+	if (stored_together) {
+		mat->bootstrapping_normal_storage = allocate_normal_storage_matrix(mat, (int)(matrix_size), control_input->bootstrapping_num_estimates);
+		mat->bootstrapping_rhs_storage = new dense_matrix(cols, control_input->bootstrapping_num_estimates);
+	}
+	
+	// matrices
+	mat->bootstrapping_dense_fm_normal_matrices = new dense_matrix*[control_input->bootstrapping_num_estimates];
+	if (mat->normal_matrix_storage_style == 1) {
+		// Packed estimates are expanded one at a time when they are solved.
+		mat->bootstrapping_packed_fm_normal_matrices = new packed_symmetric_matrix*[control_input->bootstrapping_num_estimates];
+		for (int i = 0; i < control_input->bootstrapping_num_estimates; i++) {
+			if (stored_together) mat->bootstrapping_packed_fm_normal_matrices[i] = new packed_symmetric_matrix(cols, mat->bootstrapping_normal_storage->values + i * matrix_size);
+			else mat->bootstrapping_packed_fm_normal_matrices[i] = new packed_symmetric_matrix(cols);
+			mat->bootstrapping_dense_fm_normal_matrices[i] = NULL;
+		}
+	} else {
+	  	for (int i = 0; i < control_input->bootstrapping_num_estimates; i++) {
+			if (stored_together) mat->bootstrapping_dense_fm_normal_matrices[i] = new dense_matrix(rows, cols, mat->bootstrapping_normal_storage->values + i * matrix_size);
+			else mat->bootstrapping_dense_fm_normal_matrices[i] = allocate_normal_storage_matrix(mat, rows, cols);
+		}
 	}
 	
 	// rhs vectors
 	mat->bootstrapping_dense_fm_normal_rhs_vectors = new double*[control_input->bootstrapping_num_estimates];
   	for (int i = 0; i < control_input->bootstrapping_num_estimates; i++) {
-		mat->bootstrapping_dense_fm_normal_rhs_vectors[i] = new double[cols]();
+		if (stored_together) mat->bootstrapping_dense_fm_normal_rhs_vectors[i] = mat->bootstrapping_rhs_storage->values + (size_t)(i) * cols;
+		else mat->bootstrapping_dense_fm_normal_rhs_vectors[i] = new double[cols]();
 	}
 	
 	// solutions
@@ -899,7 +1735,7 @@ inline void set_sparse_matrix_to_zero(MATRIX_DATA* const mat)
 
 inline void set_sparse_accumulation_matrix_to_zero(MATRIX_DATA* const mat)
 {
-	// The row head and element information is cleared in convert_linked_list_to_csr_matrix.
+	// The row head and element information is cleared in accumulate_sparse_fm_normal_form.
 
     // Set the elements of the dense part of the matrix to zero.
    for (int k = 0; k < mat->virial_constraint_rows * mat->fm_matrix_columns; k++) {
@@ -930,17 +1766,24 @@ void set_accumulation_matrix_to_zero(MATRIX_DATA* const mat, dense_matrix* const
     int k, l;
     for (k = 0; k < mat->accumulation_matrix_columns; k++) {
         for (l = 0; l < k; l++) {
-            dense_fm_matrix->values[l * mat->accumulation_matrix_rows + k] = 0.0;
+            dense_fm_matrix->values[l * dense_fm_matrix->n_rows + k] = 0.0;
         }
     }
     
-    for (k = mat->accumulation_matrix_columns; k < mat->accumulation_matrix_rows; k++) {
+    for (k = mat->accumulation_matrix_columns; k < dense_fm_matrix->n_rows; k++) {
         for (l = 0; l < mat->accumulation_matrix_columns; l++) {
-           dense_fm_matrix->values[l * mat->accumulation_matrix_rows + k] = 0.0;
+           dense_fm_matrix->values[l * dense_fm_matrix->n_rows + k] = 0.0;
         }
     }
 }
 
+// With bootstrapping, every block is factored on its own, so the whole matrix is cleared.
+
+void set_accumulation_block_to_zero(MATRIX_DATA* const mat)
+{
+	memset(mat->dense_fm_matrix->values, 0, (size_t)mat->accumulation_matrix_rows * mat->accumulation_matrix_columns * sizeof(double));
+}
+
 void set_dummy_matrix_to_zero(MATRIX_DATA* const mat) {}
 
 //---------------------------------------------------------------------
@@ -996,7 +1839,8 @@ void accumulate_vector_matching_forces(InteractionClassComputer* const info, con
 void accumulate_BI_elements(InteractionClassComputer* const info, const int first_nonzero_basis_index, const std::vector<double> &basis_fn_vals, const int n_body, const int* particle_ids, std::array<double, DIMENSION>* const &derivatives, MATRIX_DATA * const mat)
 {
   int this_column;
-  int ref_column = info->interaction_class_column_index + info->ispec->interaction_column_indices[info->index_among_matched_interactions - 1];
+  // Columns are counted from the start of the BI system being built.
+  int ref_column = info->interaction_class_column_index + info->ispec->interaction_column_indices[info->index_among_matched_interactions - 1] - mat->BI_systems.back().solution_offset;
   int basis_columns = info->ispec->interaction_column_indices[info->index_among_matched_interactions] - info->ispec->interaction_column_indices[info->index_among_matched_interactions - 1];
 
   for (unsigned k = 0; k < basis_fn_vals.size(); k++) {
@@ -1241,41 +2085,105 @@ void accumulate_scalar_into_dense_target_vector(MATRIX_DATA* mat, int particle_i
 void convert_dense_fm_equation_to_normal_form_and_accumulate(MATRIX_DATA* const mat)
 {
     double frame_weight = mat->get_frame_weight() * mat->normalization;
- 	create_dense_normal_form(mat, frame_weight, mat->dense_fm_matrix,mat->dense_fm_normal_matrix, mat->dense_fm_rhs_vector, mat->dense_fm_normal_rhs_vector);
+ 	create_dense_normal_form(mat, frame_weight, mat->dense_fm_matrix, get_normal_matrix_values(mat), mat->dense_fm_rhs_vector, mat->dense_fm_normal_rhs_vector);
 }
 
 void convert_dense_fm_equation_to_normal_form_and_bootstrap(MATRIX_DATA* const mat)
 {
-	int onei = 1.0;
-	int matrix_size = mat->fm_matrix_columns * mat->fm_matrix_columns;
+	// Add this frame's unweighted normal equations to its resampling block.
+	// Frame and bootstrapping weights are applied when the buffered blocks are combined.
+	double* block_values = get_bootstrapping_block_values(mat);
+	create_dense_normal_form(mat, 1.0, mat->dense_fm_matrix, block_values, mat->dense_fm_rhs_vector, block_values + get_normal_matrix_size(mat));
+}
 
-	// Create temp normal matrix and rhs vector.
-	dense_matrix* temp_normal_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
-	double* temp_normal_rhs_vector = new double[mat->fm_matrix_columns]();
+// As above, but the frame's normal form is taken on its own, in single precision if requested,
+// and then added to the normal equations with compensated summation if requested. The
+// default normal equations are also accumulated if the accuracy report was requested.
 
-	create_dense_normal_form(mat, 1.0, mat->dense_fm_matrix, temp_normal_matrix, mat->dense_fm_rhs_vector, temp_normal_rhs_vector);
-	
-	// Add the matrix to the master 
-	double frame_weight = mat->get_frame_weight() * mat->normalization;
-	cblas_daxpy( matrix_size, frame_weight, temp_normal_matrix->values, onei, mat->dense_fm_normal_matrix->values, onei);	    
-	cblas_daxpy( mat->fm_matrix_columns, frame_weight, temp_normal_rhs_vector, onei, mat->dense_fm_normal_rhs_vector, onei);
+void convert_dense_fm_equation_to_normal_form_and_accumulate_carefully(MATRIX_DATA* const mat)
+{
+    double frame_weight = mat->get_frame_weight() * mat->normalization;
+    if (mat->reference_normal_values != NULL) {
+    	create_dense_normal_form(mat, frame_weight, mat->dense_fm_matrix, mat->reference_normal_values, mat->dense_fm_rhs_vector, mat->reference_normal_values + get_normal_matrix_size(mat));
+    }
+    
+    // A single precision normal form is added straight from its single precision scratch.
+    if (mat->frame_normal_form_precision == 1) {
+    	create_single_precision_normal_form(mat);
+    	add_single_precision_normal_form(mat, frame_weight);
+    	return;
+    }
+    
+    int normal_size = get_normal_matrix_size(mat) + mat->fm_matrix_columns;
+    memset(mat->frame_normal_values, 0, normal_size * sizeof(double));
+    create_dense_normal_form(mat, 1.0, mat->dense_fm_matrix, mat->frame_normal_values, mat->dense_fm_rhs_vector, mat->frame_normal_values + get_normal_matrix_size(mat));
+    
+    // The normal matrix and rhs vector are added as one array each.
+    double* sums[2] = {get_normal_matrix_values(mat), mat->dense_fm_normal_rhs_vector};
+    int offsets[3] = {0, get_normal_matrix_size(mat), normal_size};
+    for (int part = 0; part < 2; part++) {
+    	double* frame_values = mat->frame_normal_values + offsets[part];
+    	double* compensation = (mat->normal_summation_style == 1) ? mat->normal_compensation_values + offsets[part] : NULL;
+    	int n_values = offsets[part + 1] - offsets[part];
+    	if (compensation != NULL) {
+    		for (int i = 0; i < n_values; i++) add_frame_normal_value(sums[part] + i, compensation + i, frame_weight * frame_values[i]);
+    	} else {
+    		for (int i = 0; i < n_values; i++) sums[part][i] += frame_weight * frame_values[i];
+    	}
+    }
+}
+
+// Add x to a running normal equation element, with compensated (Kahan) summation
+// when a compensation term is given.
+
+inline void add_frame_normal_value(double* const sum, double* const compensation, const double x)
+{
+	if (compensation == NULL) {
+		*sum += x;
+		return;
+	}
+	double y = x - *compensation;
+	double t = *sum + y;
+	*compensation = (t - *sum) - y;
+	*sum = t;
+}
+
+// Take the unweighted normal form of the current frame in single precision in
+// single_normal_values.
+
+void create_single_precision_normal_form(MATRIX_DATA* const mat)
+{
+	int n_rows = mat->fm_matrix_rows;
+	int n_cols = mat->fm_matrix_columns;
+	float* single_fm_rhs_vector = mat->single_fm_values + n_cols * n_rows;
+	float* single_normal_rhs_vector = mat->single_normal_values + n_cols * n_cols;
+	for (int i = 0; i < n_cols * n_rows; i++) mat->single_fm_values[i] = (float)(mat->dense_fm_matrix->values[i]);
+	for (int i = 0; i < n_rows; i++) single_fm_rhs_vector[i] = (float)(mat->dense_fm_rhs_vector[i]);
 	
-	// Add the matrix and vector to each of the bootstrap samples based on the weight for that frame for each bootstrap estimate.
-	for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
-		
-		// traj_block_frame_index is the frame number processed since bootstrapping only allows a block size of 1.
-		// Skip processing frame for this estimate if weight is 0.0.
-		frame_weight = mat->bootstrapping_weights[i][mat->trajectory_block_index];
-		if(frame_weight == 0.0) continue;
-		frame_weight *= mat->bootstrapping_normalization[i];
+	cblas_ssyrk(CblasColMajor, CblasUpper, CblasTrans, n_cols, n_rows, 1.0f, mat->single_fm_values, n_rows, 0.0f, mat->single_normal_values, n_cols);
+	cblas_sgemv(CblasColMajor, CblasTrans, n_rows, n_cols, 1.0f, mat->single_fm_values, n_rows, single_fm_rhs_vector, 1, 0.0f, single_normal_rhs_vector, 1);
+}
 
-	   cblas_daxpy( matrix_size, frame_weight, temp_normal_matrix->values, onei, mat->bootstrapping_dense_fm_normal_matrices[i]->values, onei);
+// Add the upper triangle and rhs vector of the frame's single precision normal form,
+// scaled by frame_weight, directly to the running double precision normal equations.
 
-	   cblas_daxpy( mat->fm_matrix_columns, frame_weight, temp_normal_rhs_vector, onei, mat->bootstrapping_dense_fm_normal_rhs_vectors[i], onei);
+void add_single_precision_normal_form(MATRIX_DATA* const mat, const double frame_weight)
+{
+	int n_cols = mat->fm_matrix_columns;
+	double* normal_values = get_normal_matrix_values(mat);
+	double* compensation = (mat->normal_summation_style == 1) ? mat->normal_compensation_values : NULL;
+	for (int j = 0; j < n_cols; j++) {
+		for (int i = 0; i <= j; i++) {
+			int index = (mat->normal_matrix_storage_style == 1) ? get_packed_symmetric_index(n_cols, i, j) : j * n_cols + i;
+			add_frame_normal_value(normal_values + index, (compensation == NULL) ? NULL : compensation + index, frame_weight * (double)(mat->single_normal_values[j * n_cols + i]));
+		}
 	}
 	
-	delete temp_normal_matrix;
-	delete [] temp_normal_rhs_vector;
+	const float* single_normal_rhs_vector = mat->single_normal_values + n_cols * n_cols;
+	double* rhs_compensation = (compensation == NULL) ? NULL : compensation + get_normal_matrix_size(mat);
+	for (int i = 0; i < n_cols; i++) {
+		add_frame_normal_value(mat->dense_fm_normal_rhs_vector + i, (rhs_compensation == NULL) ? NULL : rhs_compensation + i, frame_weight * (double)(single_normal_rhs_vector[i]));
+	}
 }
 
 // As above, but ignoring the FM matrix.
@@ -1315,24 +2223,166 @@ void accumulate_accumulation_matrices(MATRIX_DATA* const mat)
 
 void accumulate_accumulation_matrices_for_bootstrap(MATRIX_DATA* const mat)
 {
-	printf("Bootstrapping is not implemented for accumulation matrices.\n");
-	exit(EXIT_FAILURE);
-	
     int info_in;
 
-    // Initialize the operation if this is the first block.
+    // Size the QR workspace on the first block.
     if (mat->trajectory_block_index == 0) {
-        mat->lapack_temp_workspace = new double[1];
+        double workspace_size;
         mat->lapack_setup_flag = -1;
-        dgeqrf_(&mat->fm_matrix_rows, &mat->accumulation_matrix_columns, mat->dense_fm_matrix->values, &mat->accumulation_matrix_rows, mat->lapack_tau, mat->lapack_temp_workspace, &mat->lapack_setup_flag, &info_in);
-        mat->lapack_setup_flag = mat->lapack_temp_workspace[0];
-        delete [] mat->lapack_temp_workspace;
+        dgeqrf_(&mat->fm_matrix_rows, &mat->accumulation_matrix_columns, mat->dense_fm_matrix->values, &mat->accumulation_matrix_rows, mat->lapack_tau, &workspace_size, &mat->lapack_setup_flag, &info_in);
+        mat->lapack_setup_flag = workspace_size;
         mat->lapack_temp_workspace = new double[mat->lapack_setup_flag];
-        dgeqrf_(&mat->fm_matrix_rows, &mat->accumulation_matrix_columns, mat->dense_fm_matrix->values, &mat->accumulation_matrix_rows, mat->lapack_tau, mat->lapack_temp_workspace, &mat->lapack_setup_flag, &info_in);
-        mat->accumulation_row_shift = mat->accumulation_matrix_columns;
-    } else {
-        dgeqrf_(&mat->accumulation_matrix_rows, &mat->accumulation_matrix_columns, mat->dense_fm_matrix->values, &mat->accumulation_matrix_rows, mat->lapack_tau, mat->lapack_temp_workspace, &mat->lapack_setup_flag, &info_in);
     }
+    
+    // Factor this block alone, then merge its factor into the full-trajectory factor
+    // and, scaled by the root of the block's weight, into each estimate's factor.
+    dgeqrf_(&mat->fm_matrix_rows, &mat->accumulation_matrix_columns, mat->dense_fm_matrix->values, &mat->accumulation_matrix_rows, mat->lapack_tau, mat->lapack_temp_workspace, &mat->lapack_setup_flag, &info_in);
+    run_concurrent_tasks(mat, mat->bootstrapping_num_estimates + 1, mat->accumulation_qr_threads, merge_accumulation_bootstrapping_factor);
+}
+
+// Merge the current block's factor into the full-trajectory factor (i = 0)
+// or into the factor of bootstrapping estimate i - 1.
+
+void merge_accumulation_bootstrapping_factor(MATRIX_DATA* const mat, const int i)
+{
+	if (i == 0) {
+		merge_accumulation_r_factors(mat->accumulation_r_matrix, mat->dense_fm_matrix, 1.0, mat->accumulation_matrix_columns);
+	} else {
+		double weight = mat->bootstrapping_weights[i - 1][mat->trajectory_block_index];
+		if (weight > 0.0) merge_accumulation_r_factors(mat->bootstrapping_dense_fm_normal_matrices[i - 1], mat->dense_fm_matrix, sqrt(weight), mat->accumulation_matrix_columns);
+	}
+}
+
+// Deal frame blocks round-robin to accumulation_qr_threads triangular factors.
+// Each block is factored together with its factor on a worker thread while the
+// next block is built; the factors are merged when the trajectory is finished.
+
+void accumulate_accumulation_matrices_in_parallel(MATRIX_DATA* const mat)
+{
+	int n_lanes = mat->accumulation_qr_threads;
+	if (mat->accumulation_qr_lane_matrices == NULL) {
+		// OpenBLAS has a single thread count for the whole process, so it is
+		// lowered while the factor threads run and restored once they are merged.
+		#if _openblas_flag == 1
+		mat->accumulation_qr_blas_threads = openblas_get_num_threads();
+		openblas_set_num_threads(1);
+		#endif
+		mat->accumulation_qr_lane = 0;
+		mat->accumulation_qr_lane_blocks = new int[n_lanes]();
+		mat->accumulation_qr_lane_matrices = new dense_matrix*[n_lanes];
+		mat->accumulation_qr_lane_workers = new std::thread*[n_lanes];
+		mat->accumulation_qr_lane_matrices[0] = mat->dense_fm_matrix;
+		for (int i = 0; i < n_lanes; i++) {
+			if (i > 0) mat->accumulation_qr_lane_matrices[i] = new dense_matrix(mat->accumulation_matrix_rows, mat->accumulation_matrix_columns);
+			mat->accumulation_qr_lane_workers[i] = NULL;
+		}
+	}
+	
+	// A factor's first block starts at the top row; later blocks go below the factor.
+	int lane = mat->accumulation_qr_lane;
+	int block_rows = (mat->accumulation_qr_lane_blocks[lane] == 0) ? mat->fm_matrix_rows : mat->accumulation_matrix_rows;
+	mat->accumulation_qr_lane_workers[lane] = new std::thread(factor_accumulation_qr_lane, mat->accumulation_qr_lane_matrices[lane], block_rows, mat->accumulation_matrix_columns);
+	mat->accumulation_qr_lane_blocks[lane]++;
+	
+	// Build the next block in the next factor once its previous block has been factored.
+	lane = (lane + 1) % n_lanes;
+	if (mat->accumulation_qr_lane_workers[lane] != NULL) {
+		mat->accumulation_qr_lane_workers[lane]->join();
+		delete mat->accumulation_qr_lane_workers[lane];
+		mat->accumulation_qr_lane_workers[lane] = NULL;
+	}
+	mat->accumulation_qr_lane = lane;
+	mat->dense_fm_matrix = mat->accumulation_qr_lane_matrices[lane];
+	mat->accumulation_row_shift = (mat->accumulation_qr_lane_blocks[lane] == 0) ? 0 : mat->accumulation_matrix_columns;
+}
+
+void factor_accumulation_qr_lane(dense_matrix* const lane_matrix, int block_rows, int columns)
+{
+	#if _mkl_flag == 1
+	mkl_set_num_threads_local(1);
+	#elif defined(_OPENMP)
+	omp_set_num_threads(1);
+	#endif
+	int info_in;
+	int lwork = -1;
+	double workspace_size;
+	double* tau = new double[columns];
+	dgeqrf_(&block_rows, &columns, lane_matrix->values, &lane_matrix->n_rows, tau, &workspace_size, &lwork, &info_in);
+	lwork = workspace_size;
+	double* workspace = new double[lwork];
+	dgeqrf_(&block_rows, &columns, lane_matrix->values, &lane_matrix->n_rows, tau, workspace, &lwork, &info_in);
+	delete [] workspace;
+	delete [] tau;
+}
+
+// Replace the factor in the top rows of r_matrix by the factor of it stacked on
+// the scaled factor of other_r_matrix.
+
+void merge_accumulation_r_factors(dense_matrix* const r_matrix, const dense_matrix* const other_r_matrix, const double scale, int columns)
+{
+	int stack_rows = 2 * columns;
+	dense_matrix stack(stack_rows, columns);
+	for (int j = 0; j < columns; j++) {
+		for (int i = 0; i <= j; i++) {
+			stack.values[j * stack_rows + i] = r_matrix->values[j * r_matrix->n_rows + i];
+			stack.values[j * stack_rows + columns + i] = scale * other_r_matrix->values[j * other_r_matrix->n_rows + i];
+		}
+	}
+	
+	int info_in;
+	int lwork = -1;
+	double workspace_size;
+	double* tau = new double[columns];
+	dgeqrf_(&stack_rows, &columns, stack.values, &stack_rows, tau, &workspace_size, &lwork, &info_in);
+	lwork = workspace_size;
+	double* workspace = new double[lwork];
+	dgeqrf_(&stack_rows, &columns, stack.values, &stack_rows, tau, workspace, &lwork, &info_in);
+	for (int j = 0; j < columns; j++) {
+		for (int i = 0; i <= j; i++) r_matrix->values[j * r_matrix->n_rows + i] = stack.values[j * stack_rows + i];
+	}
+	delete [] workspace;
+	delete [] tau;
+}
+
+// Merge the pair-th pair of factors at the current level of the merge tree.
+
+void merge_accumulation_qr_lane_pair(MATRIX_DATA* const mat, const int pair)
+{
+	int lane = 2 * pair * mat->accumulation_qr_merge_stride;
+	int other_lane = lane + mat->accumulation_qr_merge_stride;
+	if (mat->accumulation_qr_lane_blocks[other_lane] > 0) {
+		merge_accumulation_r_factors(mat->accumulation_qr_lane_matrices[lane], mat->accumulation_qr_lane_matrices[other_lane], 1.0, mat->accumulation_matrix_columns);
+	}
+	delete mat->accumulation_qr_lane_matrices[other_lane];
+}
+
+// Wait for the per-thread factors and merge them pairwise into the first,
+// which is the original accumulation matrix.
+
+void combine_accumulation_qr_lanes(MATRIX_DATA* const mat)
+{
+	int n_lanes = mat->accumulation_qr_threads;
+	for (int i = 0; i < n_lanes; i++) {
+		if (mat->accumulation_qr_lane_workers[i] != NULL) {
+			mat->accumulation_qr_lane_workers[i]->join();
+			delete mat->accumulation_qr_lane_workers[i];
+		}
+	}
+	
+	for (int stride = 1; stride < n_lanes; stride *= 2) {
+		mat->accumulation_qr_merge_stride = stride;
+		int n_pairs = (n_lanes - 1 - stride) / (2 * stride) + 1;
+		run_concurrent_tasks(mat, n_pairs, n_lanes, merge_accumulation_qr_lane_pair);
+	}
+	#if _openblas_flag == 1
+	openblas_set_num_threads(mat->accumulation_qr_blas_threads);
+	#endif
+	mat->dense_fm_matrix = mat->accumulation_qr_lane_matrices[0];
+	mat->accumulation_row_shift = mat->accumulation_matrix_columns;
+	delete [] mat->accumulation_qr_lane_matrices;
+	delete [] mat->accumulation_qr_lane_workers;
+	delete [] mat->accumulation_qr_lane_blocks;
+	mat->accumulation_qr_lane_matrices = NULL;
 }
 
 // The sparse matrix is solved after every block, and the number of times each basis function coefficient is nonzero
@@ -1397,130 +2447,56 @@ void solve_sparse_matrix_for_bootstrap(MATRIX_DATA* const mat)
 
 // The sparse matrix is converted to sparse normal form after every block, and 
 // the accumulated normal form equations are solved after the entire trajectory is read.
+// Only numeric values are added since the normal matrix pattern is fixed at initialization.
 
 void convert_sparse_fm_equation_to_sparse_normal_form_and_accumulate(MATRIX_DATA* const mat)
 {
-    // Calculate the weight of this part of the normal equations in the overall equations
-	double frame_weight = mat->get_frame_weight() * mat->normalization;
-
-    // Convert from linked list format to CSR format
-    // Note: These MKL functions use a one-based index for row_sizes and column_indices
-    int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
-    csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-    convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
-	
-   // Convert CSR matrix and dense RHS vector to normal-form    
-   // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
-   // rows of matrix is mat->fm_matrix_rows
-   // cols of matrix is mat->fm_matrix_columns
-   
-   // Resize estimate based on the smaller of previous frame's normal matrix size using the safety factor or the maximum number of non-zero elements
-   int nnzmax = mat->max_nonzero_normal_elements;
-   // Determine size of previous matrix (or 0 if first frame)
-   int new_size_est = mat->sparse_matrix->row_sizes[mat->fm_matrix_columns] * (1.0 + mat->sparse_safety_factor);
-   // Determine which estimate is smaller (if new_size_est is reasonable)
-   if ( (new_size_est > mat->min_nonzero_normal_elements) && (new_size_est < mat->max_nonzero_normal_elements) ) {
-		nnzmax = new_size_est;
-		printf("Estimating number of non-zero normal matrix elements as %d < %d\n", nnzmax, mat->max_nonzero_normal_elements);
-	}
-	
-   // Allocate temporary dense right-hand side normal form vector.
-   double* dense_rhs_normal_vector = new double[mat->fm_matrix_rows]();	// the rows of the normal-form vector is number of basis functions (number of columns in input matrix)
-
-   // Allocate space for normal_form_matrix
-   csr_matrix csr_normal_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns, nnzmax); // the rows of normal matrix is number of basis functions (number of columns in input matrix)
-	
-   // Allocate space for normal_form_matrix.
-   create_sparse_normal_form_matrix(mat, nnzmax, csr_fm_matrix, csr_normal_matrix, mat->dense_fm_rhs_vector, dense_rhs_normal_vector);	
-
-   // Accumulate normal form matrix with previous/future normal form matrices
-   // Frame weight is applied to normal matrix in this step
-   sparse_matrix_addition(mat, frame_weight, nnzmax, csr_normal_matrix, mat->sparse_matrix);
+	sparse_fm_block block;
+	get_current_sparse_fm_block(mat, &block);
+	accumulate_sparse_fm_block_into_sparse_normal_form(mat, &block);
+}
 
-   #if _mkl_flag == 1
-   int onei = 1;	
-   // Accumulate normal form right-hand size vector with previous/future vectors
-   // Frame weight is applied to normal vector in this step
-   cblas_daxpy(mat->fm_matrix_columns, frame_weight,
-		dense_rhs_normal_vector, onei, mat->dense_fm_normal_rhs_vector, onei);
-   #endif
-		
-   // CSR formatted FM and normal temp matrices are freed by destructor at end of function
-   // Free the intermediate normal form matrix and vector
-   delete [] dense_rhs_normal_vector;
+void accumulate_sparse_fm_block_into_sparse_normal_form(MATRIX_DATA* const mat, sparse_fm_block* const block)
+{
+	accumulate_sparse_fm_normal_form(mat, block, block->frame_weight, mat->sparse_matrix, NULL, mat->dense_fm_normal_rhs_vector);
 }
 
 void convert_sparse_fm_equation_to_sparse_normal_form_and_bootstrap(MATRIX_DATA* const mat)
 {
-	double frame_weight = 1.0;
-    // Convert from linked list format to CSR format
-    // Note: These MKL functions use a one-based index for row_sizes and column_indices
-    int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
-    csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-    convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
-   
-   // Convert CSR matrix and dense RHS vector to normal-form    
-   // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
-   // rows of matrix is mat->fm_matrix_rows
-   // cols of matrix is mat->fm_matrix_columns
-   int onei=1;
-
-   // Resize estimate based on the smaller of previous frame's normal matrix size using the safety factor or the maximum number of non-zero elements
-   int nnzmax = mat->max_nonzero_normal_elements;
-   int new_size_est = mat->sparse_matrix->row_sizes[mat->fm_matrix_columns] * (1.0 + mat->sparse_safety_factor);;
-   
-   // Determine size of previous matrix (or 0 if first frame)
-   // Get largest new_size_est of all matrices
-   for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
-   		int temp_size_est = mat->bootstrapping_sparse_fm_normal_matrices[i]->row_sizes[mat->fm_matrix_columns] * (1.0 + mat->sparse_safety_factor);
-   		if (temp_size_est > new_size_est) new_size_est = new_size_est;
-   	}
-   	
-   // Determine which estimate is smaller (if new_size_est is reasonable)
-   if ( (new_size_est > mat->min_nonzero_normal_elements) && (new_size_est < mat->max_nonzero_normal_elements) ) {
-		nnzmax = new_size_est;
-		printf("Estimating number of non-zero normal matrix elements as %d < %d\n", nnzmax, mat->max_nonzero_normal_elements);
-	}
-
-   // Allocate temporary dense right-hand side normal form vector.
-   double* dense_rhs_normal_vector = new double[mat->fm_matrix_rows]();	// the rows of the normal-form vector is number of basis functions (number of columns in input matrix)
-   // Allocate space for normal_form_matrix.
-   csr_matrix csr_normal_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns, nnzmax); // the rows of normal matrix is number of basis functions (number of columns in input matrix)
-
-   // Create normal form matrix
-   create_sparse_normal_form_matrix(mat, nnzmax, csr_fm_matrix, csr_normal_matrix, mat->dense_fm_rhs_vector, dense_rhs_normal_vector);	
-
-   // Accumulate for master.
-   frame_weight = mat->get_frame_weight() * mat->normalization;
-   if (frame_weight != 0.0) {
-	   // Accumulate normal form matrix with previous/future normal form matrices
-   	   // Frame weight is applied to normal matrix in this step
-	   sparse_matrix_addition(mat, frame_weight, nnzmax, csr_normal_matrix, mat->sparse_matrix);
+	sparse_fm_block block;
+	get_current_sparse_fm_block(mat, &block);
+	block.bootstrapping_weights = new double[mat->bootstrapping_num_estimates];
+	record_sparse_fm_block_bootstrapping_weights(mat, &block);
+	accumulate_sparse_fm_block_into_sparse_normal_form_and_bootstrap(mat, &block);
+	delete [] block.bootstrapping_weights;
+}
 
-       // Accumulate normal form right-hand size vector with previous/future vectors
-       // Frame weight is applied to normal vector in this step
-	   cblas_daxpy(mat->fm_matrix_columns, frame_weight, dense_rhs_normal_vector, onei, mat->dense_fm_normal_rhs_vector, onei);
+void accumulate_sparse_fm_block_into_sparse_normal_form_and_bootstrap(MATRIX_DATA* const mat, sparse_fm_block* const block)
+{
+	int onei = 1;
+	int n_values = mat->sparse_matrix->row_sizes[mat->fm_matrix_columns] - 1;
+	
+	// Form this block's unweighted normal equations on the shared pattern.
+	double* dense_rhs_normal_vector = new double[mat->fm_matrix_columns]();
+	for (int k = 0; k < n_values; k++) mat->sparse_block_normal_matrix->values[k] = 0.0;
+	accumulate_sparse_fm_normal_form(mat, block, 1.0, mat->sparse_block_normal_matrix, NULL, dense_rhs_normal_vector);
+
+	// Accumulate for master.
+	double frame_weight = block->frame_weight;
+	if (frame_weight != 0.0) {
+		cblas_daxpy(n_values, frame_weight, mat->sparse_block_normal_matrix->values, onei, mat->sparse_matrix->values, onei);
+		cblas_daxpy(mat->fm_matrix_columns, frame_weight, dense_rhs_normal_vector, onei, mat->dense_fm_normal_rhs_vector, onei);
 	}
    
-   // Accumulate for each bootstrapping estimate.
-   for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
-	   // Get frame weight for this estimate.
-	   frame_weight = mat->bootstrapping_weights[i][mat->trajectory_block_index];
-	   if(frame_weight == 0.0) continue;
-	   frame_weight *= mat->bootstrapping_normalization[i];
-	   
-	   // Accumulate normal form matrix with previous/future normal form matrices
-   	   // Frame weight is applied to normal matrix in this step
-	   sparse_matrix_addition(mat, frame_weight, nnzmax, csr_normal_matrix, mat->bootstrapping_sparse_fm_normal_matrices[i]);
-
-       // Accumulate normal form right-hand size vector with previous/future vectors
-       // Frame weight is applied to normal vector in this step
-	   cblas_daxpy(mat->fm_matrix_columns, frame_weight, dense_rhs_normal_vector, onei, mat->bootstrapping_dense_fm_normal_rhs_vectors[i], onei);
-   }
-   
-   // CSR formatted FM and normal temp matrices are freed by destructor at end of function
-   // Free the intermediate normal form matrix and vector
-   delete [] dense_rhs_normal_vector;
+	// Accumulate for each bootstrapping estimate.
+	for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
+		frame_weight = block->bootstrapping_weights[i];
+		if(frame_weight == 0.0) continue;
+		
+		cblas_daxpy(n_values, frame_weight, mat->sparse_block_normal_matrix->values, onei, mat->bootstrapping_sparse_fm_normal_matrices[i]->values, onei);
+		cblas_daxpy(mat->fm_matrix_columns, frame_weight, dense_rhs_normal_vector, onei, mat->bootstrapping_dense_fm_normal_rhs_vectors[i], onei);
+	}
+	delete [] dense_rhs_normal_vector;
 }
 
 // The sparse matrix is converted to dense normal form after every block, and 
@@ -1528,227 +2504,355 @@ void convert_sparse_fm_equation_to_sparse_normal_form_and_bootstrap(MATRIX_DATA*
 
 void convert_sparse_fm_equation_to_dense_normal_form_and_accumulate(MATRIX_DATA* const mat) 
 {
-	int k, l;
-    // Calculate the weight of this part of the normal equations in the overall equations
-    double frame_weight = mat->get_frame_weight() * mat->normalization; 
+	sparse_fm_block block;
+	get_current_sparse_fm_block(mat, &block);
+	accumulate_sparse_fm_block_into_dense_normal_form(mat, &block);
+} 
 
-   // Convert from linked list format to CSR format
-   // Note: These MKL functions use a one-based index for row_sizes and column_indices
-   int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
-   csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-   convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
-   
-   // Convert CSR matrix and dense RHS vector to normal-form    
-   // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
-   // rows of matrix is mat->fm_matrix_rows
-   // cols of matrix is mat->fm_matrix_columns
-   int nnzmax = mat->max_nonzero_normal_elements;
-   
-   // Form dense right-hand side normal form vector using mkl_dcsrgemv
-   double* dense_rhs_normal_vector = new double[mat->fm_matrix_rows]();	// the rows of the normal-form vector is number of basis functions (number of columns in input matrix)
-   //dense_rhs_normal_vector is oversized in order for matrix-vector operation to work without overwritting (it should be cols instead of rows)
-   #if _mkl_flag == 1
-   char trans='t';	// normal form needs transpose of first matrix times second matrix
-   int request=0;	// calculate full product matrix
-   int sort = 7;	// do NOT sort any matrices
-   int info=0;		// error variable
-   mkl_dcsrgemv(&trans, &(mat->fm_matrix_rows), csr_fm_matrix.values, 
-		csr_fm_matrix.row_sizes, csr_fm_matrix.column_indices,
-   		mat->dense_fm_rhs_vector, dense_rhs_normal_vector);
+void accumulate_sparse_fm_block_into_dense_normal_form(MATRIX_DATA* const mat, sparse_fm_block* const block)
+{
+	accumulate_sparse_fm_normal_form(mat, block, block->frame_weight, NULL, get_normal_matrix_values(mat), mat->dense_fm_normal_rhs_vector);
+}
 
-   // Accumulate normal form right-hand size vector with previous/future vectors
-   // Frame weight is applied to normal vector in this step  
-   cblas_daxpy( mat->fm_matrix_columns, frame_weight,
-		dense_rhs_normal_vector, 1, mat->dense_fm_normal_rhs_vector, 1);
-   #endif
-   
-	// Free the intermediate normal form vector
-	delete [] dense_rhs_normal_vector;
+void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA* const mat) 
+{
+	// This frame's unweighted normal equations are added to its resampling block.
+	// Frame and bootstrapping weights are applied when the buffered blocks are combined.
+	double* block_values = get_bootstrapping_block_values(mat);
+	double* block_rhs_values = block_values + get_normal_matrix_size(mat);
 	
-   // Check if it makes more sense to create intermediate normal form matrix as sparse or dense
-   // Either way frame weight is applied to normal matrix
-   if (nnzmax * 2 > mat->fm_matrix_columns * mat->fm_matrix_columns) {
-      // Process intermediate using dense matrix
-	  // Allocate space for dense normal_form_matrix
-      double* normal_matrix = new double[mat->fm_matrix_columns * mat->fm_matrix_columns]();
-	
-	  #if _mkl_flag == 1
-	  // Form dense normal form matrix using 
-	  mkl_dcsrmultd(&trans, &(mat->fm_matrix_rows), &(mat->fm_matrix_columns), &(mat->fm_matrix_columns),
-	    csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   		csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   	    normal_matrix, &(mat->fm_matrix_columns) );
-	  
-	  // Accumulate normal form matrix with previous/future normal form matrices
-	  // This operation also applies the frame weight
-	  cblas_daxpy( mat->fm_matrix_columns * mat->fm_matrix_columns, frame_weight,
-	  	normal_matrix, 1, mat->dense_fm_normal_matrix->values, 1);
-	  #endif
-	    
-	  // Free the temp normal matrix
-	  delete [] normal_matrix;
-	  
-   } else {
-	  // Process intermediate using sparse matrix
-      // Allocate space for sparse normal_form_matrix
-      csr_matrix csr_normal_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns, nnzmax); // the rows of normal matrix is number of basis functions (number of columns in input matrix)
-   
-      // Form sparse normal form matrix using mkl_dcsrmultcsr
-      #if _mkl_flag == 1
-      mkl_dcsrmultcsr(&trans, &request, &sort, &(mat->fm_matrix_rows), &(mat->fm_matrix_columns), &(mat->fm_matrix_columns), 
-   		csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   		csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   		csr_normal_matrix.values, csr_normal_matrix.column_indices, csr_normal_matrix.row_sizes,
-   		&nnzmax, &info);
-      if(info != 0) {
-   		printf("Error: Value returned from mkl_dcsrmultcsr is %d!\n", info);
-   		exit(EXIT_FAILURE);
-      }
-	  #endif
-	
-	  // Accumulate normal form matrix with previous/future normal form matrices
-	  // It would be nice to have a function that does mixed addition with sparse and dense matrices,
-	  // but for now it is being done manually.
-	  for( k = 0; k < mat->fm_matrix_columns; k++) { // k is actually rows of normal matrix is this context
-		for( l = csr_normal_matrix.row_sizes[k] - 1; l < csr_normal_matrix.row_sizes[k+1] - 1; l++) {
-			mat->dense_fm_normal_matrix->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] ] += csr_normal_matrix.values[l] * frame_weight;
-		}
-	  } 
-      // CSR formatted FM and normal temp matrices are freed by destructor at end of function
-  	 }
-} 
+	sparse_fm_block block;
+	get_current_sparse_fm_block(mat, &block);
+	accumulate_sparse_fm_normal_form(mat, &block, 1.0, NULL, block_values, block_rhs_values);
+}
 
-void convert_sparse_fm_equation_to_dense_normal_form_and_bootstrap(MATRIX_DATA* const mat) 
+// Describe the block currently being assembled in the matrix.
+
+inline void get_current_sparse_fm_block(MATRIX_DATA* const mat, sparse_fm_block* const block)
+{
+	block->ll_sparse_matrix_row_heads = mat->ll_sparse_matrix_row_heads;
+	block->dense_fm_rhs_vector = mat->dense_fm_rhs_vector;
+	block->dense_fm_matrix = mat->dense_fm_matrix;
+	block->frame_weight = mat->get_frame_weight() * mat->normalization;
+	block->block_index = mat->trajectory_block_index;
+	block->bootstrapping_weights = NULL;
+	block->worker = NULL;
+}
+
+// Record the block's frame weight for each bootstrapping estimate.
+
+inline void record_sparse_fm_block_bootstrapping_weights(MATRIX_DATA* const mat, sparse_fm_block* const block)
 {
-   int k, l;
-   // Calculate the weight of this part of the normal equations in the overall equations
-   double frame_weight; 
-   int num_elements = mat->fm_matrix_columns * mat->fm_matrix_columns;
-   int onei=1;
-	
-   // Convert from linked list format to CSR format
-   // Note: These MKL functions use a one-based index for row_sizes and column_indices
-   int n_nonzero_matrix_elements = get_n_nonzero_matrix_elements(mat);
-   csr_matrix csr_fm_matrix(mat->fm_matrix_rows, mat->fm_matrix_columns, n_nonzero_matrix_elements);
-   convert_linked_list_to_csr_matrix(mat, csr_fm_matrix);
-   
-   // Convert CSR matrix and dense RHS vector to normal-form    
-   // Form sparse normal-form left-hand side matrix using mkl_dcsrmultcsr
-   // rows of matrix is mat->fm_matrix_rows
-   // cols of matrix is mat->fm_matrix_columns
-   int nnzmax = mat->max_nonzero_normal_elements;
-   
-   // Form dense right-hand side normal form vector using mkl_dcsrgemv.
-   double* dense_rhs_normal_vector = new double[mat->fm_matrix_rows]();	// the rows of the normal-form vector is number of basis functions (number of columns in input matrix)
-   //dense_rhs_normal_vector is oversized in order for matrix-vector operation to work without overwritting (it should be cols instead of rows)
-   #if _mkl_flag == 1
-   char trans='t';	// normal form needs transpose of first matrix times second matrix
-   int request=0;	// calculate full product matrix
-   int sort = 7;	// do NOT sort any matrices
-   int info=0;		// error variable
-   mkl_dcsrgemv(&trans, &(mat->fm_matrix_rows), csr_fm_matrix.values, 
-		csr_fm_matrix.row_sizes, csr_fm_matrix.column_indices,
-   		mat->dense_fm_rhs_vector, dense_rhs_normal_vector);
-	#endif
-   
-   // Accumulate for master.
-   frame_weight = mat->get_frame_weight() * mat->normalization; 
-   cblas_daxpy(mat->fm_matrix_columns, frame_weight, dense_rhs_normal_vector, onei, mat->dense_fm_normal_rhs_vector, onei);
-   
-   // Accumulate normal form right-hand size vector with previous/future vectors.
-   // Frame weight is applied to normal vector in this step.  
 	for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
-		frame_weight = mat->bootstrapping_weights[i][mat->trajectory_block_index];
-		if(frame_weight == 0.0) continue;
-		frame_weight *= mat->bootstrapping_normalization[i];
-		cblas_daxpy(mat->fm_matrix_columns, frame_weight, dense_rhs_normal_vector, onei, mat->bootstrapping_dense_fm_normal_rhs_vectors[i], onei);
+		block->bootstrapping_weights[i] = mat->bootstrapping_weights[i][block->block_index] * mat->bootstrapping_normalization[i];
 	}
-	// Free the intermediate normal form vector
-	delete [] dense_rhs_normal_vector;
+}
+
+// Pipelined end-of-block processing: the finished block's buffers are swapped with a spare set
+// and its normal form is accumulated on a background thread while the next block is assembled.
+// A buffer is only reused once its previous block has been accumulated, so at most
+// block_pipeline_depth blocks are in flight. Blocks are accumulated in trajectory order.
+
+void initialize_block_pipeline(MATRIX_DATA* const mat)
+{
+	mat->pipelined_blocks = new sparse_fm_block[mat->block_pipeline_depth];
+	for (int i = 0; i < mat->block_pipeline_depth; i++) {
+		sparse_fm_block* block = &mat->pipelined_blocks[i];
+		block->ll_sparse_matrix_row_heads = new linked_list_sparse_matrix_row_head[mat->rows_less_constraint_rows];
+		for (int k = 0; k < mat->rows_less_constraint_rows; k++) {
+			block->ll_sparse_matrix_row_heads[k].n = 0;
+			block->ll_sparse_matrix_row_heads[k].h = NULL;
+		}
+		block->dense_fm_rhs_vector = new double[mat->fm_matrix_rows]();
+		if (mat->virial_constraint_rows > 0) block->dense_fm_matrix = new dense_matrix(mat->virial_constraint_rows, mat->fm_matrix_columns);
+		else block->dense_fm_matrix = NULL;
+		if (mat->bootstrapping_flag == 1) block->bootstrapping_weights = new double[mat->bootstrapping_num_estimates];
+		else block->bootstrapping_weights = NULL;
+		block->worker = NULL;
+	}
+	mat->pipelined_blocks_handed_off = 0;
+	mat->next_pipelined_block = 0;
+	mat->pipeline_mutex = new std::mutex;
+	mat->pipeline_ready = new std::condition_variable;
 	
-   // Check if it makes more sense to create intermediate normal form matrix as sparse or dense.
-   // Either way frame weight is applied to normal matrix.
-   if (nnzmax * 2 > mat->fm_matrix_columns * mat->fm_matrix_columns) {
-      // Process intermediate using dense matrix
-	  // Allocate space for dense normal_form_matrix
-      double* normal_matrix = new double[mat->fm_matrix_columns * mat->fm_matrix_columns]();
-	
-	  #if _mkl_flag == 1
-	  // Form dense normal form matrix using 
-	  mkl_dcsrmultd(&trans, &(mat->fm_matrix_rows), &(mat->fm_matrix_columns), &(mat->fm_matrix_columns),
-	    csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   		csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   	    normal_matrix, &(mat->fm_matrix_columns) );
-	  #endif
-	  
-	  // Accumulate for master.
-	  frame_weight = mat->get_frame_weight() * mat->normalization; 
-	  cblas_daxpy(num_elements, frame_weight, normal_matrix, onei, mat->dense_fm_normal_matrix->values, onei);
-	  
-	  // Accumulate normal form matrix with previous/future normal form matrices.
-	  // This operation also applies the frame weight.
-	  for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
-		frame_weight = mat->bootstrapping_weights[i][mat->trajectory_block_index];
-		if(frame_weight == 0.0) continue;
-		frame_weight *= mat->bootstrapping_normalization[i];
+	mat->accumulate_sparse_fm_block = accumulate_sparse_fm_block_into_dense_normal_form;
+	if (mat->matrix_type == kSparseSparse) {
+		if (mat->bootstrapping_flag == 1) mat->accumulate_sparse_fm_block = accumulate_sparse_fm_block_into_sparse_normal_form_and_bootstrap;
+		else mat->accumulate_sparse_fm_block = accumulate_sparse_fm_block_into_sparse_normal_form;
+	}
+	mat->do_end_of_frameblock_matrix_manipulations = hand_off_sparse_fm_block;
+	mat->pipelined_finish_fm = mat->finish_fm;
+	mat->finish_fm = finish_pipelined_fm;
+}
 
-	  	cblas_daxpy(num_elements, frame_weight, normal_matrix, onei, mat->bootstrapping_dense_fm_normal_matrices[i]->values, onei);
-	  }
-	    
-	  // Free the temp normal matrix
-	  delete [] normal_matrix;
-	  
-   } else {
-	  // Process intermediate using sparse matrix
-      // Allocate space for sparse normal_form_matrix
-      csr_matrix csr_normal_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns, nnzmax); // the rows of normal matrix is number of basis functions (number of columns in input matrix)
-   
-      // Form sparse normal form matrix using mkl_dcsrmultcsr
-      #if _mkl_flag == 1
-      mkl_dcsrmultcsr(&trans, &request, &sort, &(mat->fm_matrix_rows), &(mat->fm_matrix_columns), &(mat->fm_matrix_columns), 
-   		csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   		csr_fm_matrix.values, csr_fm_matrix.column_indices, csr_fm_matrix.row_sizes, 
-   		csr_normal_matrix.values, csr_normal_matrix.column_indices, csr_normal_matrix.row_sizes,
-   		&nnzmax, &info);
-      if(info != 0) {
-   		printf("Error: Value returned from mkl_dcsrmultcsr is %d!\n", info);
-   		exit(EXIT_FAILURE);
-      }
-	  #endif
+void hand_off_sparse_fm_block(MATRIX_DATA* const mat)
+{
+	sparse_fm_block* block = &mat->pipelined_blocks[mat->pipelined_blocks_handed_off % mat->block_pipeline_depth];
+	wait_for_sparse_fm_block(block);
 	
-	  // Accumulate for master.
-	  frame_weight = mat->get_frame_weight() * mat->normalization; 
-	  for( k = 0; k < mat->fm_matrix_columns; k++) { // k is actually rows of normal matrix is this context
-		for( l = csr_normal_matrix.row_sizes[k] - 1; l < csr_normal_matrix.row_sizes[k+1] - 1; l++) {
-			mat->dense_fm_normal_matrix->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] ] += csr_normal_matrix.values[l] * frame_weight;
-		}
-	  } 
-      
-	  // Accumulate normal form matrix with previous/future normal form matrices
-	  // It would be nice to have a function that does mixed addition with sparse and dense matrices,
-	  // but for now it is being done manually.
-	  for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
-		frame_weight = mat->bootstrapping_weights[i][mat->trajectory_block_index];
-		if(frame_weight == 0.0) continue;
-		frame_weight *= mat->bootstrapping_normalization[i];
+	// Exchange the finished block's buffers with the spare ones.
+	struct linked_list_sparse_matrix_row_head* row_heads = block->ll_sparse_matrix_row_heads;
+	block->ll_sparse_matrix_row_heads = mat->ll_sparse_matrix_row_heads;
+	mat->ll_sparse_matrix_row_heads = row_heads;
+	double* rhs = block->dense_fm_rhs_vector;
+	block->dense_fm_rhs_vector = mat->dense_fm_rhs_vector;
+	mat->dense_fm_rhs_vector = rhs;
+	if (mat->virial_constraint_rows > 0) {
+		dense_matrix* virial_rows = block->dense_fm_matrix;
+		block->dense_fm_matrix = mat->dense_fm_matrix;
+		mat->dense_fm_matrix = virial_rows;
+	}
+	
+	block->frame_weight = mat->get_frame_weight() * mat->normalization;
+	block->block_index = mat->trajectory_block_index;
+	if (mat->bootstrapping_flag == 1) record_sparse_fm_block_bootstrapping_weights(mat, block);
+	block->worker = new std::thread(accumulate_pipelined_sparse_fm_block, mat, block, mat->pipelined_blocks_handed_off);
+	mat->pipelined_blocks_handed_off++;
+}
 
-	    for( k = 0; k < mat->fm_matrix_columns; k++) { // k is actually rows of normal matrix is this context
-			for( l = csr_normal_matrix.row_sizes[k] - 1; l < csr_normal_matrix.row_sizes[k+1] - 1; l++) {
-				mat->bootstrapping_dense_fm_normal_matrices[i]->values[ k * mat->fm_matrix_columns + csr_normal_matrix.column_indices[l] ] += csr_normal_matrix.values[l] * frame_weight;
-			}
-	  	}
-	  } 
-      // CSR formatted FM and normal temp matrices are freed by destructor at end of function
-  	 }
+void accumulate_pipelined_sparse_fm_block(MATRIX_DATA* const mat, sparse_fm_block* const block, const int position)
+{
+	std::unique_lock<std::mutex> lock(*mat->pipeline_mutex);
+	while (mat->next_pipelined_block != position) mat->pipeline_ready->wait(lock);
+	lock.unlock();
+	
+	mat->accumulate_sparse_fm_block(mat, block);
+	
+	lock.lock();
+	mat->next_pipelined_block++;
+	lock.unlock();
+	mat->pipeline_ready->notify_all();
 }
 
-void do_nothing_to_fm_matrix(MATRIX_DATA* const mat) {}
+inline void wait_for_sparse_fm_block(sparse_fm_block* const block)
+{
+	if (block->worker != NULL) {
+		block->worker->join();
+		delete block->worker;
+		block->worker = NULL;
+	}
+}
 
-// Helper routines for sparse matrix operations.
+void finish_pipelined_fm(MATRIX_DATA* const mat)
+{
+	// Drain the pipeline before solving.
+	for (int i = 0; i < mat->block_pipeline_depth; i++) wait_for_sparse_fm_block(&mat->pipelined_blocks[i]);
+	for (int i = 0; i < mat->block_pipeline_depth; i++) {
+		delete [] mat->pipelined_blocks[i].ll_sparse_matrix_row_heads;
+		delete [] mat->pipelined_blocks[i].dense_fm_rhs_vector;
+		delete mat->pipelined_blocks[i].dense_fm_matrix;
+		delete [] mat->pipelined_blocks[i].bootstrapping_weights;
+	}
+	delete [] mat->pipelined_blocks;
+	delete mat->pipeline_mutex;
+	delete mat->pipeline_ready;
+	mat->pipelined_blocks = NULL;
+	
+	mat->pipelined_finish_fm(mat);
+}
 
-// This function determines the number of non-zero matrix elements by walking the linked-list matrix and dense virial constraint data
+// Build the exact sparsity pattern of the normal matrix once from the interaction classes.
+// Two columns can only share a row of the FM matrix if their interactions act on a common
+// site type, so each force-matched interaction contributes a dense block of columns that
+// couples to every other interaction sharing one of its types. Density and three-body
+// columns and the virial constraint rows are conservatively coupled to all columns.
+// The pattern is stored as a full one-based CSR matrix with sorted rows.
 
-int get_n_nonzero_matrix_elements(MATRIX_DATA* const mat)
+void build_sparse_normal_matrix_pattern(MATRIX_DATA* const mat, CG_MODEL_DATA* const cg)
+{
+	std::vector<int> block_starts, block_ends;
+	std::vector< std::vector<int> > block_types;
+	int class_column_index = 0;
+	
+	std::list<InteractionClassSpec*>::iterator iclass_iterator;
+	for(iclass_iterator=cg->iclass_list.begin(); iclass_iterator != cg->iclass_list.end(); iclass_iterator++) {
+		add_interaction_class_pattern_blocks(*iclass_iterator, class_column_index, block_starts, block_ends, block_types);
+		class_column_index += (*iclass_iterator)->get_num_basis_func();
+	}
+	if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
+		add_interaction_class_pattern_blocks(&cg->three_body_nonbonded_interactions, class_column_index, block_starts, block_ends, block_types);
+	}
+	
+	// Determine which blocks can share a row.
+	int n_blocks = (int)(block_starts.size());
+	bool* coupled = new bool[n_blocks * n_blocks];
+	for (int a = 0; a < n_blocks; a++) {
+		for (int b = 0; b < n_blocks; b++) {
+			bool shared = (a == b) || (mat->virial_constraint_rows > 0) || block_types[a].empty() || block_types[b].empty();
+			for (unsigned i = 0; i < block_types[a].size() && !shared; i++) {
+				for (unsigned j = 0; j < block_types[b].size(); j++) {
+					if (block_types[a][i] == block_types[b][j]) {
+						shared = true;
+						break;
+					}
+				}
+			}
+			coupled[a * n_blocks + b] = shared;
+		}
+	}
+
+	// Count and fill the rows; blocks are in increasing column order so rows come out sorted.
+	long nnz = 0;
+	for (int a = 0; a < n_blocks; a++) {
+		int row_length = 0;
+		for (int b = 0; b < n_blocks; b++) {
+			if (coupled[a * n_blocks + b]) row_length += block_ends[b] - block_starts[b];
+		}
+		nnz += (long)(row_length) * (long)(block_ends[a] - block_starts[a]);
+	}
+	if (nnz > (long)(INT_MAX)) {
+		printf("Sparse normal matrix pattern has too many entries (%ld). Decrease the number of basis functions.\n", nnz);
+		exit(EXIT_FAILURE);
+	}
+	
+	csr_matrix* pattern = new csr_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns, (int)(nnz));
+	int count = 0;
+	for (int a = 0; a < n_blocks; a++) {
+		for (int row = block_starts[a]; row < block_ends[a]; row++) {
+			for (int b = 0; b < n_blocks; b++) {
+				if (!coupled[a * n_blocks + b]) continue;
+				for (int col = block_starts[b]; col < block_ends[b]; col++) {
+					pattern->column_indices[count] = col + 1;
+					count++;
+				}
+			}
+			pattern->row_sizes[row + 1] = count + 1;
+		}
+	}
+	delete [] coupled;
+	
+	mat->sparse_matrix = pattern;
+	mat->max_nonzero_normal_elements = (int)(nnz);
+	printf("Sparse normal matrix pattern has %d entries; sparsity is %.2lf percent.\n", mat->max_nonzero_normal_elements, 100.0 * (1.0 - (double) mat->max_nonzero_normal_elements / ((double) mat->fm_matrix_columns * (double) mat->fm_matrix_columns)) );
+}
+
+// Allocate a zeroed normal matrix with the same fixed pattern.
+
+csr_matrix* copy_sparse_normal_matrix_pattern(const csr_matrix* const pattern)
+{
+	csr_matrix* copy = new csr_matrix(pattern->n_rows, pattern->n_cols, pattern->max_entries);
+	for (int i = 0; i <= pattern->n_rows; i++) copy->row_sizes[i] = pattern->row_sizes[i];
+	for (int i = 0; i < pattern->max_entries; i++) copy->column_indices[i] = pattern->column_indices[i];
+	return copy;
+}
+
+// Add one column block per force-matched interaction of a class together with the site types it acts on.
+// An empty type list marks a block that may share rows with any other block.
+
+void add_interaction_class_pattern_blocks(InteractionClassSpec* const ispec, const int class_column_index, std::vector<int>& block_starts, std::vector<int>& block_ends, std::vector< std::vector<int> >& block_types)
+{
+	if (ispec->get_num_basis_func() == 0) return;
+	if ( (ispec->class_type == kDensity) || (ispec->class_type == kThreeBodyNonbonded) ) {
+		block_starts.push_back(class_column_index);
+		block_ends.push_back(class_column_index + ispec->get_num_basis_func());
+		block_types.push_back(std::vector<int>());
+		return;
+	}
+	
+	int first_block = (int)(block_starts.size());
+	for (int m = 0; m < ispec->n_to_force_match; m++) {
+		block_starts.push_back(class_column_index + ispec->interaction_column_indices[m]);
+		block_ends.push_back(class_column_index + ispec->interaction_column_indices[m + 1]);
+		block_types.push_back(std::vector<int>());
+	}
+	for (unsigned i = 0; i < ispec->defined_to_matched_intrxn_index_map.size(); i++) {
+		int m = ispec->defined_to_matched_intrxn_index_map[i];
+		if (m == 0) continue;
+		std::vector<int> types = ispec->get_interaction_types(i);
+		block_types[first_block + m - 1].insert(block_types[first_block + m - 1].end(), types.begin(), types.end());
+	}
+}
+
+// Add the normal form of a block's linked-list FM equations to a normal matrix
+// with fixed sparse pattern or to dense normal matrix values, and to a normal rhs vector.
+// The linked-list rows are freed as they are consumed.
+
+void accumulate_sparse_fm_normal_form(MATRIX_DATA* const mat, sparse_fm_block* const block, const double weight, csr_matrix* const sparse_normal_matrix, double* const normal_matrix_values, double* const normal_rhs_vector)
+{
+	struct linked_list_sparse_matrix_element* curr_elem, *prev_elem;
+	int* columns = new int[mat->fm_matrix_columns];
+	double* values = new double[mat->fm_matrix_columns * DIMENSION];
+	
+	for (int k = 0; k < mat->rows_less_constraint_rows; k++) {
+		// Gather the sorted row and free its elements.
+		int n_in_row = 0;
+		curr_elem = block->ll_sparse_matrix_row_heads[k].h;
+		while (curr_elem != NULL) {
+			columns[n_in_row] = curr_elem->col;
+			for (int d = 0; d < DIMENSION; d++) values[n_in_row * DIMENSION + d] = curr_elem->valx[d];
+			n_in_row++;
+			prev_elem = curr_elem;
+			curr_elem = prev_elem->next;
+			delete prev_elem;
+		}
+		block->ll_sparse_matrix_row_heads[k].h = NULL;
+		block->ll_sparse_matrix_row_heads[k].n = 0;
+		
+		accumulate_sparse_normal_row(mat, weight, n_in_row, DIMENSION, columns, values, block->dense_fm_rhs_vector + DIMENSION * k, sparse_normal_matrix, normal_matrix_values, normal_rhs_vector);
+	}
+	
+	// Virial constraint rows are stored densely.
+	for (int k = 0; k < mat->virial_constraint_rows; k++) {
+		int n_in_row = 0;
+		for (int l = 0; l < mat->fm_matrix_columns; l++) {
+			double value = block->dense_fm_matrix->values[l * mat->virial_constraint_rows + k];
+			if (value > VERYSMALL || value < -VERYSMALL) {
+				columns[n_in_row] = l;
+				values[n_in_row] = value;
+				n_in_row++;
+			}
+		}
+		accumulate_sparse_normal_row(mat, weight, n_in_row, 1, columns, values, block->dense_fm_rhs_vector + DIMENSION * mat->rows_less_constraint_rows + k, sparse_normal_matrix, normal_matrix_values, normal_rhs_vector);
+	}
+	
+	delete [] columns;
+	delete [] values;
+}
+
+// Add the outer products of a group of FM rows sharing the same sorted columns.
+// Each column holds n_components values, one for each row in the group.
+
+inline void accumulate_sparse_normal_row(MATRIX_DATA* const mat, const double weight, const int n_in_row, const int n_components, const int* const columns, const double* const values, const double* const rhs_values, csr_matrix* const sparse_normal_matrix, double* const normal_matrix_values, double* const normal_rhs_vector)
+{
+	for (int a = 0; a < n_in_row; a++) {
+		const double* value_a = values + a * n_components;
+		double rhs_sum = 0.0;
+		for (int d = 0; d < n_components; d++) rhs_sum += value_a[d] * rhs_values[d];
+		normal_rhs_vector[columns[a]] += weight * rhs_sum;
+		
+		// Walk the pattern row alongside the sorted FM row.
+		int position = 0;
+		int row_end = 0;
+		if (sparse_normal_matrix != NULL) {
+			position = sparse_normal_matrix->row_sizes[columns[a]] - 1;
+			row_end = sparse_normal_matrix->row_sizes[columns[a] + 1] - 1;
+		}
+		for (int b = 0; b < n_in_row; b++) {
+			const double* value_b = values + b * n_components;
+			double sum = 0.0;
+			for (int d = 0; d < n_components; d++) sum += value_a[d] * value_b[d];
+			
+			if (sparse_normal_matrix == NULL) {
+				add_normal_matrix_element(mat, normal_matrix_values, columns[a], columns[b], weight * sum);
+				continue;
+			}
+			while (position < row_end && sparse_normal_matrix->column_indices[position] - 1 < columns[b]) position++;
+			if (position == row_end || sparse_normal_matrix->column_indices[position] - 1 != columns[b]) {
+				printf("Normal matrix element (%d, %d) is outside of the sparse normal matrix pattern.\n", columns[a], columns[b]);
+				exit(EXIT_FAILURE);
+			}
+			sparse_normal_matrix->values[position] += weight * sum;
+		}
+	}
+}
+
+void do_nothing_to_fm_matrix(MATRIX_DATA* const mat) {}
+
+// Helper routines for sparse matrix operations.
+
+// This function determines the number of non-zero matrix elements by walking the linked-list matrix and dense virial constraint data
+
+int get_n_nonzero_matrix_elements(MATRIX_DATA* const mat)
 {
 	int n_nonzero_matrix_elements = 0;	
 	
@@ -1964,7 +3068,7 @@ void regularize_vector_sparse_matrix(MATRIX_DATA* const mat, csr_matrix* csr_nor
  
 // Wrapper function for PARDISO sparse matrix solver
 
-void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector)
+void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector, double* const solution)
 {
 	printf("Solving sparse normal matrix using PARDISO.\n");
 	fflush(stdout);
@@ -2015,7 +3119,7 @@ void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, doub
 	int phase = 13;
 	PARDISO(pt, &maxfct, &mnum, &mtype, &phase, &(mat->fm_matrix_columns), sparse_matrix->values,
 			sparse_matrix->row_sizes, sparse_matrix->column_indices,
-			perm, &nrhs, iparm, &msglvl, dense_fm_normal_rhs_vector, mat->block_fm_solution, &error);
+			perm, &nrhs, iparm, &msglvl, dense_fm_normal_rhs_vector, solution, &error);
     if(error != 0) {
     	printf ("\nError %d during PARDISO sparse matrix solving!\n", error);
     	exit(EXIT_FAILURE);
@@ -2024,7 +3128,7 @@ void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, doub
     phase = -1;
 	PARDISO(pt, &maxfct, &mnum, &mtype, &phase, &(mat->fm_matrix_columns), sparse_matrix->values,
 			sparse_matrix->row_sizes, sparse_matrix->column_indices,
-			perm, &nrhs, iparm, &msglvl, dense_fm_normal_rhs_vector, mat->block_fm_solution, &error);
+			perm, &nrhs, iparm, &msglvl, dense_fm_normal_rhs_vector, solution, &error);
     if(error != 0) {
     	printf ("\nError %d during PARDISO clean-up!\n", error);
     	exit(EXIT_FAILURE);
@@ -2036,6 +3140,162 @@ void pardiso_solve(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, doub
     #endif
 }
 
+// Solve the preconditioned, regularized sparse normal equations with the selected solver.
+// Either way, the solution of the column-preconditioned equations is left in block_fm_solution.
+
+void solve_sparse_normal_form(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector)
+{
+	solve_sparse_normal_form(mat, sparse_matrix, dense_fm_normal_rhs_vector, mat->h, mat->block_fm_solution);
+}
+
+// As above, with the preconditioner and solution passed explicitly for concurrent solves.
+
+void solve_sparse_normal_form(MATRIX_DATA* const mat, csr_matrix* const sparse_matrix, double* const dense_fm_normal_rhs_vector, double* const h, double* const solution)
+{
+	if (mat->sparse_solver_style == 1) {
+		printf("Solving sparse normal matrix using preconditioned conjugate gradient.\n");
+		fflush(stdout);
+		calculate_pcg_solution(mat, mat->fm_matrix_columns, sparse_matrix, NULL, dense_fm_normal_rhs_vector, h, solution);
+	} else {
+		pardiso_solve(mat, sparse_matrix, dense_fm_normal_rhs_vector, solution);
+	}
+}
+
+// Multiply by the column-preconditioned normal matrix C (sparse or dense) with its rows 
+// rescaled by h, i.e. y = H C x. H C is symmetric since C = (N + D) H + lambda^2 I
+// for any diagonal regularization D applied before preconditioning. If upper_scaled is set,
+// the dense matrix already holds the upper triangle of H C, as out-of-core matrices do.
+
+inline void apply_scaled_normal_matrix(const int n, csr_matrix* const sparse_matrix, dense_matrix* const dense_normal_matrix, const int upper_scaled, const double* const h, const double* const x, double* const y)
+{
+	if (sparse_matrix != NULL) {
+		// Note: the CSR normal matrices use one-based indices.
+		for (int i = 0; i < n; i++) {
+			double sum = 0.0;
+			for (int l = sparse_matrix->row_sizes[i] - 1; l < sparse_matrix->row_sizes[i + 1] - 1; l++) {
+				sum += sparse_matrix->values[l] * x[sparse_matrix->column_indices[l] - 1];
+			}
+			y[i] = h[i] * sum;
+		}
+	} else if (upper_scaled) {
+		cblas_dsymv(CblasColMajor, CblasUpper, n, 1.0, dense_normal_matrix->values, n, x, 1, 0.0, y, 1);
+	} else {
+		cblas_dgemv(CblasColMajor, CblasNoTrans, n, n, 1.0, dense_normal_matrix->values, n, x, 1, 0.0, y, 1);
+		for (int i = 0; i < n; i++) y[i] *= h[i];
+	}
+}
+
+// Solve the column-preconditioned normal equations C z = b without factoring C by running
+// Jacobi-preconditioned conjugate gradient on the equivalent symmetric system H C z = H b.
+// Only matrix-vector products with C are needed. The relative residual norm of each 
+// iteration is written to krylov_history.out and the number of iterations is returned.
+
+int calculate_pcg_solution(MATRIX_DATA* const mat, const int n, csr_matrix* const sparse_matrix, dense_matrix* const dense_normal_matrix, const double* const rhs, const double* const h, double* const solution)
+{
+	int onei = 1;
+	double* residual = new double[n];
+	double* precond_residual = new double[n];
+	double* direction = new double[n];
+	double* product = new double[n];
+	double* inv_diagonal = new double[n];
+	int upper_scaled = (sparse_matrix == NULL) && (mat->normal_matrix_storage_style == 2);
+	
+	// Set up the Jacobi preconditioner from the diagonal of H C.
+	for (int i = 0; i < n; i++) {
+		double diagonal = 0.0;
+		if (sparse_matrix != NULL) {
+			for (int l = sparse_matrix->row_sizes[i] - 1; l < sparse_matrix->row_sizes[i + 1] - 1; l++) {
+				if (sparse_matrix->column_indices[l] == i + 1) diagonal += sparse_matrix->values[l];
+			}
+		} else {
+			diagonal = dense_normal_matrix->get_scalar(i, i);
+		}
+		if (!upper_scaled) diagonal *= h[i];
+		if (diagonal > VERYSMALL) inv_diagonal[i] = 1.0 / diagonal;
+		else inv_diagonal[i] = 1.0;
+	}
+	
+	// Start from zero or from the warm-start guess, which is stored unpreconditioned.
+	if (mat->krylov_warm_start_flag == 1) {
+		if (mat->krylov_initial_guess.empty()) {
+			mat->krylov_initial_guess = std::vector<double>(n);
+			FILE* guess_in = open_file("x0.in", "rb");
+			if ((int)fread(&mat->krylov_initial_guess[0], sizeof(double), n, guess_in) != n) {
+				printf("Could not read %d solution values from x0.in for the conjugate gradient warm start.\n", n);
+				exit(EXIT_FAILURE);
+			}
+			fclose(guess_in);
+		}
+		for (int i = 0; i < n; i++) solution[i] = mat->krylov_initial_guess[i] / h[i];
+	} else {
+		for (int i = 0; i < n; i++) solution[i] = 0.0;
+	}
+	
+	apply_scaled_normal_matrix(n, sparse_matrix, dense_normal_matrix, upper_scaled, h, solution, product);
+	double rhs_norm = 0.0;
+	for (int i = 0; i < n; i++) {
+		residual[i] = h[i] * rhs[i] - product[i];
+		rhs_norm += h[i] * rhs[i] * h[i] * rhs[i];
+		precond_residual[i] = inv_diagonal[i] * residual[i];
+		direction[i] = precond_residual[i];
+	}
+	rhs_norm = sqrt(rhs_norm);
+	if (rhs_norm < VERYSMALL) rhs_norm = 1.0;
+	double residual_dot = cblas_ddot(n, residual, onei, precond_residual, onei);
+	
+	int max_iterations = mat->krylov_max_iterations;
+	if (max_iterations == 0) max_iterations = 10 * n;
+	FILE* history_file = open_file("krylov_history.out", (mat->krylov_solve_count == 0) ? "w" : "a");
+	fprintf(history_file, "Solve %d:\n", mat->krylov_solve_count);
+	
+	int iteration = 0;
+	double relative_residual = sqrt(cblas_ddot(n, residual, onei, residual, onei)) / rhs_norm;
+	fprintf(history_file, "%d %le\n", iteration, relative_residual);
+	while (iteration < max_iterations && relative_residual > mat->krylov_tolerance) {
+		apply_scaled_normal_matrix(n, sparse_matrix, dense_normal_matrix, upper_scaled, h, direction, product);
+		double curvature = cblas_ddot(n, direction, onei, product, onei);
+		if (curvature <= 0.0) {
+			printf("Conjugate gradient stopped after %d iterations because the normal matrix is not positive definite along the search direction.\n", iteration);
+			break;
+		}
+		double step = residual_dot / curvature;
+		for (int i = 0; i < n; i++) {
+			solution[i] += step * direction[i];
+			residual[i] -= step * product[i];
+			precond_residual[i] = inv_diagonal[i] * residual[i];
+		}
+		double new_residual_dot = cblas_ddot(n, residual, onei, precond_residual, onei);
+		double direction_update = new_residual_dot / residual_dot;
+		residual_dot = new_residual_dot;
+		for (int i = 0; i < n; i++) {
+			direction[i] = precond_residual[i] + direction_update * direction[i];
+		}
+		iteration++;
+		relative_residual = sqrt(cblas_ddot(n, residual, onei, residual, onei)) / rhs_norm;
+		fprintf(history_file, "%d %le\n", iteration, relative_residual);
+	}
+	fclose(history_file);
+	
+	if (relative_residual > mat->krylov_tolerance) {
+		printf("Warning: conjugate gradient did not converge; relative residual %le after %d iterations.\n", relative_residual, iteration);
+	} else {
+		printf("Conjugate gradient converged to relative residual %le in %d iterations.\n", relative_residual, iteration);
+	}
+	
+	// Later solves start from this solution when warm starts are requested.
+	if (mat->krylov_warm_start_flag == 1) {
+		for (int i = 0; i < n; i++) mat->krylov_initial_guess[i] = solution[i] * h[i];
+	}
+	mat->krylov_solve_count++;
+	
+	delete [] residual;
+	delete [] precond_residual;
+	delete [] direction;
+	delete [] product;
+	delete [] inv_diagonal;
+	return iteration;
+}
+
 void solve_this_sparse_matrix(MATRIX_DATA* const mat)
 {
     // Convert from linked list format to CSR format
@@ -2099,7 +3359,7 @@ void solve_this_sparse_matrix(MATRIX_DATA* const mat)
     }
   
     // Solve the normal equations using PARDISO
-	pardiso_solve(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
+	solve_sparse_normal_form(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
 	   
    // CSR formatted FM temp matrix is freed by destructor at end of function
    // Free the CSR formatting normal matrix and rhs vector
@@ -2140,21 +3400,106 @@ inline void create_sparse_normal_form_matrix(MATRIX_DATA* const mat, const int n
    #endif  
 }
 
-inline void create_dense_normal_form(MATRIX_DATA* const mat, const double frame_weight, dense_matrix* const dense_fm_matrix, dense_matrix* normal_matrix, double* const dense_fm_rhs_vector, double* dense_fm_normal_rhs_vector)
+inline void create_dense_normal_form(MATRIX_DATA* const mat, const double frame_weight, dense_matrix* const dense_fm_matrix, double* const normal_matrix_values, double* const dense_fm_rhs_vector, double* dense_fm_normal_rhs_vector)
 {	
     double oned = 1.0;    
     // Take normal form of the current frame's matrix and add to the existing normal form matrix.
-    #if _mkl_flag == 1
-	char upper = 'u';
-	char trans = 't';
-	dsyrk(&upper, &trans, &mat->fm_matrix_columns, &mat->fm_matrix_rows, &frame_weight, dense_fm_matrix->values, &mat->fm_matrix_rows, &oned, normal_matrix->values, &mat->fm_matrix_columns);
-	#else
-	cblas_dsyrk(CblasColMajor, CblasUpper, CblasTrans, mat->fm_matrix_columns, mat->fm_matrix_rows, frame_weight, dense_fm_matrix->values, mat->fm_matrix_rows, oned, normal_matrix->values, mat->fm_matrix_columns);
-	#endif
+    // Packed normal matrices are updated in place by the rectangular full packed rank-k update.
+    if (mat->normal_matrix_storage_style == 1) {
+		char transr = 'n';
+		char upper = 'u';
+		char trans = 't';
+		dsfrk_(&transr, &upper, &trans, &mat->fm_matrix_columns, &mat->fm_matrix_rows, &frame_weight, dense_fm_matrix->values, &mat->fm_matrix_rows, &oned, normal_matrix_values);
+	} else if (mat->normal_matrix_storage_style == 2) {
+		// Out-of-core normal matrices are updated one panel of columns at a time, so each 
+		// panel's tiles are brought in, updated, and left for write-back before the next one.
+		int n = mat->fm_matrix_columns;
+		int panel_columns = std::max(1, (int)(OUT_OF_CORE_PANEL_BYTES / (sizeof(double) * n)));
+		for (int first = 0; first < n; first += panel_columns) {
+			int width = std::min(panel_columns, n - first);
+			double* panel_values = normal_matrix_values + (size_t)(first) * n;
+			double* panel_fm_values = dense_fm_matrix->values + (size_t)(first) * mat->fm_matrix_rows;
+			if (first > 0) cblas_dgemm(CblasColMajor, CblasTrans, CblasNoTrans, first, width, mat->fm_matrix_rows, frame_weight, dense_fm_matrix->values, mat->fm_matrix_rows, panel_fm_values, mat->fm_matrix_rows, oned, panel_values, n);
+			cblas_dsyrk(CblasColMajor, CblasUpper, CblasTrans, width, mat->fm_matrix_rows, frame_weight, panel_fm_values, mat->fm_matrix_rows, oned, panel_values + first, n);
+		}
+	} else {
+		#if _mkl_flag == 1
+		char upper = 'u';
+		char trans = 't';
+		dsyrk(&upper, &trans, &mat->fm_matrix_columns, &mat->fm_matrix_rows, &frame_weight, dense_fm_matrix->values, &mat->fm_matrix_rows, &oned, normal_matrix_values, &mat->fm_matrix_columns);
+		#else
+		cblas_dsyrk(CblasColMajor, CblasUpper, CblasTrans, mat->fm_matrix_columns, mat->fm_matrix_rows, frame_weight, dense_fm_matrix->values, mat->fm_matrix_rows, oned, normal_matrix_values, mat->fm_matrix_columns);
+		#endif
+	}
 	// Take normal form of the current frame's target vector and add to the existing normal form target vector.
 	cblas_dgemv(CblasColMajor, CblasTrans, mat->fm_matrix_rows, mat->fm_matrix_columns, frame_weight, dense_fm_matrix->values, mat->fm_matrix_rows, dense_fm_rhs_vector, 1, 1.0, dense_fm_normal_rhs_vector, 1);
 }
 
+// Compare the accumulated normal equations with the ones accumulated the default way,
+// overall and column by column, since small-magnitude columns lose the most precision.
+
+void write_accumulation_accuracy_report(MATRIX_DATA* const mat)
+{
+	int n = mat->fm_matrix_columns;
+	double* values = get_normal_matrix_values(mat);
+	double* reference_values = mat->reference_normal_values;
+	double* reference_rhs = reference_values + get_normal_matrix_size(mat);
+	double max_element = 0.0, max_difference = 0.0, max_rhs = 0.0, max_rhs_difference = 0.0;
+	double* column_max = new double[n]();
+	double* column_difference = new double[n]();
+	for (int j = 0; j < n; j++) {
+		for (int i = 0; i <= j; i++) {
+			int index = (mat->normal_matrix_storage_style == 1) ? get_packed_symmetric_index(n, i, j) : j * n + i;
+			double difference = fabs(values[index] - reference_values[index]);
+			column_max[j] = std::max(column_max[j], fabs(reference_values[index]));
+			column_difference[j] = std::max(column_difference[j], difference);
+			column_max[i] = std::max(column_max[i], fabs(reference_values[index]));
+			column_difference[i] = std::max(column_difference[i], difference);
+		}
+		max_element = std::max(max_element, column_max[j]);
+		max_rhs = std::max(max_rhs, fabs(reference_rhs[j]));
+		max_rhs_difference = std::max(max_rhs_difference, fabs(mat->dense_fm_normal_rhs_vector[j] - reference_rhs[j]));
+	}
+	for (int j = 0; j < n; j++) max_difference = std::max(max_difference, column_difference[j]);
+	
+	FILE* report_file = open_file("accumulation_accuracy.out", "w");
+	fprintf(report_file, "Accuracy of normal equations with normal_summation_style %d and frame_normal_form_precision %d relative to the default accumulation\n", mat->normal_summation_style, mat->frame_normal_form_precision);
+	fprintf(report_file, "Largest normal matrix difference:\n%le (%le relative to the largest element)\n", max_difference, (max_element > 0.0) ? max_difference / max_element : 0.0);
+	fprintf(report_file, "Largest normal rhs difference:\n%le (%le relative to the largest element)\n", max_rhs_difference, (max_rhs > 0.0) ? max_rhs_difference / max_rhs : 0.0);
+	fprintf(report_file, "Column, largest matrix element, largest difference relative to it, rhs element, rhs difference relative to it:\n");
+	for (int j = 0; j < n; j++) {
+		double rhs_difference = fabs(mat->dense_fm_normal_rhs_vector[j] - reference_rhs[j]);
+		fprintf(report_file, "%d %le %le %le %le\n", j, column_max[j], (column_max[j] > 0.0) ? column_difference[j] / column_max[j] : 0.0, reference_rhs[j], (reference_rhs[j] != 0.0) ? rhs_difference / fabs(reference_rhs[j]) : 0.0);
+	}
+	fclose(report_file);
+	delete [] column_max;
+	delete [] column_difference;
+}
+
+// Report how well the solution satisfies the normal equations accumulated the default way.
+
+void write_accumulation_accuracy_residual(MATRIX_DATA* const mat)
+{
+	int n = mat->fm_matrix_columns;
+	double* reference_rhs = mat->reference_normal_values + get_normal_matrix_size(mat);
+	double residual_norm = 0.0, rhs_norm = 0.0;
+	for (int i = 0; i < n; i++) {
+		double residual = -reference_rhs[i];
+		for (int j = 0; j < n; j++) {
+			int row = std::min(i, j), col = std::max(i, j);
+			int index = (mat->normal_matrix_storage_style == 1) ? get_packed_symmetric_index(n, row, col) : col * n + row;
+			residual += mat->reference_normal_values[index] * mat->fm_solution[j];
+		}
+		residual_norm += residual * residual;
+		rhs_norm += reference_rhs[i] * reference_rhs[i];
+	}
+	FILE* report_file = open_file("accumulation_accuracy.out", "a");
+	fprintf(report_file, "Relative residual of the solution in the default normal equations:\n%le\n", (rhs_norm > 0.0) ? sqrt(residual_norm / rhs_norm) : sqrt(residual_norm));
+	fclose(report_file);
+	delete [] mat->reference_normal_values;
+	mat->reference_normal_values = NULL;
+}
+
 // Calculate the residual for a dense matrix.
 inline double calculate_dense_residual(MATRIX_DATA* const mat, dense_matrix* const dense_fm_normal_matrix, double* const dense_fm_normal_rhs_vector, std::vector<double> &fm_solution, double normalization)
 {
@@ -2318,6 +3663,10 @@ inline double calculate_sparse_residual(MATRIX_DATA* const mat, csr_matrix* csr_
 inline void calculate_and_apply_dense_preconditioning(MATRIX_DATA* mat, dense_matrix* dense_fm_normal_matrix, double* h)
 {
 	int i, j;
+	if (mat->normal_matrix_storage_style == 2) {
+		calculate_and_apply_out_of_core_preconditioning(mat, dense_fm_normal_matrix, h);
+		return;
+	}
     for (i = 0; i < mat->fm_matrix_columns; i++) {
         h[i] = 0.0;
     }
@@ -2340,6 +3689,43 @@ inline void calculate_and_apply_dense_preconditioning(MATRIX_DATA* mat, dense_ma
    }
 }
 
+// Tikhonov regularization adds lambda^2 to the diagonal of the column-preconditioned matrix,
+// or lambda^2 h_i to that of H C when it is stored out of core.
+
+inline double get_tikhonov_diagonal_term(MATRIX_DATA* const mat, const double squared_regularization_parameter, const double h_i)
+{
+	if (mat->normal_matrix_storage_style == 2) return squared_regularization_parameter * h_i;
+	else return squared_regularization_parameter;
+}
+
+// Out-of-core normal matrices only hold their upper triangle, so the column norms are 
+// gathered in one pass over it and a second pass scales it on both sides to H N H.
+// The conjugate gradient solver multiplies by this symmetric matrix directly.
+
+inline void calculate_and_apply_out_of_core_preconditioning(MATRIX_DATA* mat, dense_matrix* dense_fm_normal_matrix, double* h)
+{
+	int n = mat->fm_matrix_columns;
+	for (int i = 0; i < n; i++) h[i] = 0.0;
+	for (int j = 0; j < n; j++) {
+		double* column = dense_fm_normal_matrix->values + (size_t)(j) * n;
+		for (int i = 0; i < j; i++) {
+			h[i] += column[i] * column[i];
+			h[j] += column[i] * column[i];
+		}
+		h[j] += column[j] * column[j];
+	}
+	
+	for (int i = 0; i < n; i++) {
+		if (h[i] < VERYSMALL) h[i] = 1.0;
+		else h[i] = 1.0 / sqrt(h[i]);
+	}
+	
+	for (int j = 0; j < n; j++) {
+		double* column = dense_fm_normal_matrix->values + (size_t)(j) * n;
+		for (int i = 0; i <= j; i++) column[i] *= h[i] * h[j];
+	}
+}
+
 inline void calculate_dense_svd(MATRIX_DATA* mat, int fm_matrix_columns, dense_matrix* dense_fm_normal_matrix, double* dense_fm_normal_rhs_vector, double* singular_values)
 {
 	int space_factor = 2;
@@ -2370,6 +3756,379 @@ inline void calculate_dense_svd(MATRIX_DATA* mat, int fm_matrix_columns, dense_m
 	delete [] iwork;
 }
 
+// Solve the column-preconditioned normal equations by the cheapest safe method.
+// Rescaling the rows by h gives back a symmetric matrix (H N H + H D for any diagonal
+// regularization D) with the same solution, which is factored by Cholesky if it is
+// well conditioned, by pivoted LDLT if it is not positive definite but still well
+// conditioned, and otherwise handed to the SVD solver. Preconditioned CG may be
+// requested instead. The return value is 0 for SVD, 1 for Cholesky, 2 for LDLT, and 3 for CG.
+inline int calculate_dense_factored_solution(MATRIX_DATA* mat, int fm_matrix_columns, dense_matrix* dense_fm_normal_matrix, double* dense_fm_normal_rhs_vector, double* h, double* singular_values, double* rcond_estimate)
+{
+	*rcond_estimate = -1.0;
+	if (mat->dense_solver_style == 0) {
+		calculate_dense_svd(mat, fm_matrix_columns, dense_fm_normal_matrix, dense_fm_normal_rhs_vector, singular_values);
+		return 0;
+	}
+	if (mat->dense_solver_style == 2) {
+		double* solution = new double[fm_matrix_columns];
+		calculate_pcg_solution(mat, fm_matrix_columns, NULL, dense_fm_normal_matrix, dense_fm_normal_rhs_vector, h, solution);
+		for (int i = 0; i < fm_matrix_columns; i++) dense_fm_normal_rhs_vector[i] = solution[i];
+		delete [] solution;
+		return 3;
+	}
+	
+	char uplo = 'U';
+	int onei = 1;
+	int info = 0;
+	int n = fm_matrix_columns;
+	int n_sq = n * n;
+	
+	// The factorizations are accepted only if the condition estimate is far enough from
+	// the SVD truncation threshold that SVD would not have discarded anything.
+	double threshold = sqrt(DBL_EPSILON);
+	if (mat->rcond > threshold) threshold = mat->rcond;
+	
+	double* scaled_matrix = new double[n_sq];
+	double* factor = new double[n_sq];
+	double* rhs = new double[n];
+	double anorm = 0.0;
+	for (int j = 0; j < n; j++) {
+		double column_sum = 0.0;
+		for (int i = 0; i < n; i++) {
+			scaled_matrix[j * n + i] = h[i] * dense_fm_normal_matrix->values[j * n + i];
+			column_sum += fabs(scaled_matrix[j * n + i]);
+		}
+		if (column_sum > anorm) anorm = column_sum;
+	}
+	
+	int* iwork = new int[n];
+	int* ipiv = new int[n];
+	double* work = new double[3 * n];
+	int solver_used = 0;
+	
+	// First try Cholesky.
+	for (int i = 0; i < n_sq; i++) factor[i] = scaled_matrix[i];
+	dpotrf_(&uplo, &n, factor, &n, &info);
+	if (info == 0) {
+		dpocon_(&uplo, &n, factor, &n, &anorm, rcond_estimate, work, iwork, &info);
+		if (info == 0 && *rcond_estimate > threshold) solver_used = 1;
+	}
+	
+	// Then try Bunch-Kaufman LDLT.
+	if (solver_used == 0) {
+		int lwork = -1;
+		double work_size;
+		for (int i = 0; i < n_sq; i++) factor[i] = scaled_matrix[i];
+		dsytrf_(&uplo, &n, factor, &n, ipiv, &work_size, &lwork, &info);
+		lwork = (int)work_size;
+		if (lwork < 1) lwork = 1;
+		double* lapack_temp_workspace = new double[lwork];
+		dsytrf_(&uplo, &n, factor, &n, ipiv, lapack_temp_workspace, &lwork, &info);
+		delete [] lapack_temp_workspace;
+		if (info == 0) {
+			dsycon_(&uplo, &n, factor, &n, ipiv, &anorm, rcond_estimate, work, iwork, &info);
+			if (info == 0 && *rcond_estimate > threshold) solver_used = 2;
+		}
+	}
+	
+	if (solver_used == 0) {
+		printf("Reciprocal condition estimate %le does not exceed %le; falling back to SVD.\n", *rcond_estimate, threshold);
+		calculate_dense_svd(mat, fm_matrix_columns, dense_fm_normal_matrix, dense_fm_normal_rhs_vector, singular_values);
+	} else {
+		for (int i = 0; i < n; i++) rhs[i] = h[i] * dense_fm_normal_rhs_vector[i];
+		if (solver_used == 1) dpotrs_(&uplo, &n, &onei, factor, &n, rhs, &n, &info);
+		else dsytrs_(&uplo, &n, &onei, factor, &n, ipiv, rhs, &n, &info);
+		for (int i = 0; i < n; i++) dense_fm_normal_rhs_vector[i] = rhs[i];
+	}
+	
+	// Clean up the heap-allocated temps.
+	delete [] scaled_matrix;
+	delete [] factor;
+	delete [] rhs;
+	delete [] iwork;
+	delete [] ipiv;
+	delete [] work;
+	return solver_used;
+}
+
+inline void print_dense_solver_info(FILE* solution_file, const int solver_used, const double rcond_estimate, const int fm_matrix_columns, double* singular_values)
+{
+	if (solver_used == 1) {
+		fprintf(solution_file, "Solved by Cholesky factorization; reciprocal condition estimate: %le\n", rcond_estimate);
+	} else if (solver_used == 2) {
+		fprintf(solution_file, "Solved by LDLT factorization; reciprocal condition estimate: %le\n", rcond_estimate);
+	} else if (solver_used == 3) {
+		fprintf(solution_file, "Solved by preconditioned conjugate gradient; see krylov_history.out\n");
+	} else {
+		for (int i = 0; i < fm_matrix_columns; i++) {
+			fprintf(solution_file, "%le\n", singular_values[i]);
+		}
+	}
+}
+
+// Compute everything a vector-alpha Bayesian iteration needs from one Cholesky factorization
+// of the regularized normal matrix N + R: the solution, the full inverse (left in inverse_matrix),
+// its diagonal, and trace((N + R)^-1 N), which equals n - sum_i R_ii [(N + R)^-1]_ii.
+inline void calculate_bayesian_cholesky_terms(const int n, dense_matrix* const normal_matrix, const double* const rhs, const double* const reg_vec, dense_matrix* const inverse_matrix, double* const solution, double* const inverse_diagonal, double* const trace_product)
+{
+	char uplo = 'U';
+	int onei = 1;
+	int info = 0;
+	double* scale = new double[n];
+	
+	// Copy the upper triangle of the regularized matrix with symmetric Jacobi scaling.
+	for (int i = 0; i < n; i++) {
+		double diagonal = normal_matrix->get_scalar(i, i) + reg_vec[i];
+		if (diagonal > VERYSMALL) scale[i] = 1.0 / sqrt(diagonal);
+		else scale[i] = 1.0;
+	}
+	for (int j = 0; j < n; j++) {
+		for (int i = 0; i <= j; i++) {
+			double value = normal_matrix->get_scalar(i, j);
+			if (i == j) value += reg_vec[i];
+			inverse_matrix->assign_scalar(i, j, scale[i] * scale[j] * value);
+		}
+	}
+	
+	dpotrf_(&uplo, &n, inverse_matrix->values, &n, &info);
+	if (info != 0) {
+		printf("Cholesky factorization of the regularized normal matrix failed (info %d) during Bayesian iterations.\n", info);
+		printf("Please use bayesian_solver_style 0 for this system.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (int i = 0; i < n; i++) solution[i] = scale[i] * rhs[i];
+	dpotrs_(&uplo, &n, &onei, inverse_matrix->values, &n, solution, &n, &info);
+	for (int i = 0; i < n; i++) solution[i] *= scale[i];
+	
+	// Invert from the factor, then undo the scaling and fill in the lower triangle.
+	dpotri_(&uplo, &n, inverse_matrix->values, &n, &info);
+	for (int j = 0; j < n; j++) {
+		for (int i = 0; i <= j; i++) {
+			double value = inverse_matrix->get_scalar(i, j) * scale[i] * scale[j];
+			inverse_matrix->assign_scalar(i, j, value);
+			inverse_matrix->assign_scalar(j, i, value);
+		}
+	}
+	*trace_product = (double)(n);
+	for (int i = 0; i < n; i++) {
+		inverse_diagonal[i] = inverse_matrix->get_scalar(i, i);
+		*trace_product -= reg_vec[i] * inverse_diagonal[i];
+	}
+	delete [] scale;
+}
+
+// Diagonalize the unregularized normal matrix once so that scalar-alpha Bayesian
+// iterations only need O(n^2) work each. The right-hand side is projected onto the eigenvectors.
+void calculate_dense_eigendecomposition(const int n, dense_matrix* const normal_matrix, const double* const rhs, dense_matrix* const eigenvectors, double* const eigenvalues, double* const projected_rhs)
+{
+	char jobz = 'V';
+	char uplo = 'U';
+	int info = 0;
+	int lwork = -1;
+	double work_size;
+	for (int i = 0; i < n * n; i++) eigenvectors->values[i] = normal_matrix->values[i];
+	
+	dsyev_(&jobz, &uplo, &n, eigenvectors->values, &n, eigenvalues, &work_size, &lwork, &info);
+	lwork = (int)work_size;
+	double* lapack_temp_workspace = new double[lwork];
+	dsyev_(&jobz, &uplo, &n, eigenvectors->values, &n, eigenvalues, lapack_temp_workspace, &lwork, &info);
+	delete [] lapack_temp_workspace;
+	if (info != 0) {
+		printf("Eigendecomposition of the normal matrix failed (info %d).\n", info);
+		exit(EXIT_FAILURE);
+	}
+	
+	// The normal matrix is positive semidefinite; clip roundoff below zero.
+	for (int k = 0; k < n; k++) {
+		if (eigenvalues[k] < 0.0) eigenvalues[k] = 0.0;
+	}
+	cblas_dgemv(CblasColMajor, CblasTrans, n, n, 1.0, eigenvectors->values, n, rhs, 1, 0.0, projected_rhs, 1);
+}
+
+// Evaluate the solution, the inverse diagonal, and trace((N + a I)^-1 N) for N + a I from the stored
+// eigenpairs of N. The full inverse is only formed when inverse_matrix is not NULL.
+inline void calculate_bayesian_eigen_terms(const int n, dense_matrix* const eigenvectors, const double* const eigenvalues, const double* const projected_rhs, const double regularization, double* const solution, double* const inverse_diagonal, double* const trace_product, dense_matrix* const inverse_matrix)
+{
+	double* inverse_eigenvalues = new double[n];
+	double* weights = new double[n];
+	*trace_product = 0.0;
+	for (int k = 0; k < n; k++) {
+		inverse_eigenvalues[k] = 1.0 / (eigenvalues[k] + regularization);
+		weights[k] = projected_rhs[k] * inverse_eigenvalues[k];
+		*trace_product += eigenvalues[k] * inverse_eigenvalues[k];
+	}
+	
+	for (int i = 0; i < n; i++) {
+		solution[i] = 0.0;
+		inverse_diagonal[i] = 0.0;
+	}
+	for (int k = 0; k < n; k++) {
+		for (int i = 0; i < n; i++) {
+			double value = eigenvectors->get_scalar(i, k);
+			solution[i] += value * weights[k];
+			inverse_diagonal[i] += value * value * inverse_eigenvalues[k];
+		}
+	}
+	
+	if (inverse_matrix != NULL) {
+		for (int j = 0; j < n; j++) {
+			for (int i = 0; i < n; i++) {
+				double value = 0.0;
+				for (int k = 0; k < n; k++) {
+					value += eigenvectors->get_scalar(i, k) * eigenvectors->get_scalar(j, k) * inverse_eigenvalues[k];
+				}
+				inverse_matrix->assign_scalar(i, j, value);
+			}
+		}
+	}
+	delete [] inverse_eigenvalues;
+	delete [] weights;
+}
+
+// Map coefficients in the eigenbasis of the symmetrically preconditioned normal matrix back to FM coefficients.
+inline void calculate_path_solution(const int n, dense_matrix* const eigenvectors, const double* const coefficients, const double* const sqrt_h, double* const solution)
+{
+	cblas_dgemv(CblasColMajor, CblasNoTrans, n, n, 1.0, eigenvectors->values, n, coefficients, 1, 0.0, solution, 1);
+	for (int i = 0; i < n; i++) solution[i] *= sqrt_h[i];
+}
+
+// Scan scalar Tikhonov parameters and truncation cutoffs using one eigendecomposition of
+// T = H^1/2 N H^1/2, where h holds the column scaling factors used by the dense solver.
+// Since (N H + lambda^2 I) y = b with x = H y is equivalent to (T + lambda^2 I) z = H^1/2 b
+// with x = H^1/2 z, each scan point is the regularization_style 1 solution for that lambda.
+// Residuals, solution norms, and generalized cross-validation (GCV) scores go to
+// regularization_path.out along with the GCV minimum and the L-curve corner.
+
+void calculate_regularization_path(MATRIX_DATA* const mat, dense_matrix* const normal_matrix, double* const rhs, const double* const h)
+{
+	int n = mat->fm_matrix_columns;
+	int n_points = mat->regularization_path_points;
+	printf("Scanning regularization path with %d Tikhonov parameters and %d truncation cutoffs.\n", n_points, n);
+	fflush(stdout);
+	
+	double* sqrt_h = new double[n];
+	double* scaled_rhs = new double[n];
+	dense_matrix* scaled_matrix = new dense_matrix(n, n);
+	for (int i = 0; i < n; i++) {
+		sqrt_h[i] = sqrt(h[i]);
+		scaled_rhs[i] = sqrt_h[i] * rhs[i];
+	}
+	for (int j = 0; j < n; j++) {
+		for (int i = 0; i < n; i++) {
+			scaled_matrix->assign_scalar(i, j, sqrt_h[i] * normal_matrix->get_scalar(i, j) * sqrt_h[j]);
+		}
+	}
+	dense_matrix* eigenvectors = new dense_matrix(n, n);
+	double* eigenvalues = new double[n];
+	double* projected_rhs = new double[n];
+	calculate_dense_eigendecomposition(n, scaled_matrix, scaled_rhs, eigenvectors, eigenvalues, projected_rhs);
+	delete scaled_matrix;
+	delete [] scaled_rhs;
+	
+	double n_data = (double)(DIMENSION) * (double)(mat->rows_less_constraint_rows / mat->frames_per_traj_block / DIMENSION) / mat->normalization;
+	double* coefficients = new double[n];
+	double* solution = new double[n];
+	double* lambdas = new double[n_points];
+	double* log_residuals = new double[n_points];
+	double* log_norms = new double[n_points];
+	double* gcv_scores = new double[n_points];
+	FILE* path_file = open_file("regularization_path.out", "w");
+	
+	// Tikhonov scan over log-spaced parameters.
+	fprintf(path_file, "# Tikhonov scan: regularization_scalar residual solution_norm effective_parameters gcv\n");
+	for (int p = 0; p < n_points; p++) {
+		lambdas[p] = mat->regularization_path_min * pow(mat->regularization_path_max / mat->regularization_path_min, (double)(p) / (double)(n_points - 1));
+		double lambda_sq = lambdas[p] * lambdas[p];
+		double quadratic = 0.0;
+		double effective_parameters = 0.0;
+		for (int k = 0; k < n; k++) {
+			coefficients[k] = projected_rhs[k] / (eigenvalues[k] + lambda_sq);
+			quadratic += eigenvalues[k] * coefficients[k] * coefficients[k] - 2.0 * coefficients[k] * projected_rhs[k];
+			effective_parameters += eigenvalues[k] / (eigenvalues[k] + lambda_sq);
+		}
+		calculate_path_solution(n, eigenvectors, coefficients, sqrt_h, solution);
+		double residual = quadratic / mat->normalization + mat->force_sq_total;
+		double solution_norm = sqrt(cblas_ddot(n, solution, 1, solution, 1));
+		gcv_scores[p] = n_data * residual / ((n_data - effective_parameters) * (n_data - effective_parameters));
+		log_residuals[p] = log(fabs(residual) + VERYSMALL);
+		log_norms[p] = log(solution_norm + VERYSMALL);
+		fprintf(path_file, "%le %le %le %le %le\n", lambdas[p], residual, solution_norm, effective_parameters, gcv_scores[p]);
+	}
+	
+	// The L-curve corner is the point of largest curvature of (log residual, log norm),
+	// estimated from the circle through each point and its two neighbors.
+	int gcv_choice = 0;
+	int lcurve_choice = 1;
+	double max_curvature = -1.0e300;
+	for (int p = 0; p < n_points; p++) {
+		if (gcv_scores[p] < gcv_scores[gcv_choice]) gcv_choice = p;
+		if (p == 0 || p == n_points - 1) continue;
+		double ax = log_residuals[p] - log_residuals[p - 1], ay = log_norms[p] - log_norms[p - 1];
+		double bx = log_residuals[p + 1] - log_residuals[p], by = log_norms[p + 1] - log_norms[p];
+		double cx = log_residuals[p + 1] - log_residuals[p - 1], cy = log_norms[p + 1] - log_norms[p - 1];
+		double lengths = sqrt((ax * ax + ay * ay) * (bx * bx + by * by) * (cx * cx + cy * cy));
+		if (lengths < VERYSMALL) continue;
+		double curvature = 2.0 * (ax * by - ay * bx) / lengths;
+		if (curvature > max_curvature) {
+			max_curvature = curvature;
+			lcurve_choice = p;
+		}
+	}
+	
+	// Truncation scan over every possible rank, largest eigenvalues first.
+	fprintf(path_file, "# Truncation scan: rcond rank residual solution_norm gcv\n");
+	double max_eigenvalue = eigenvalues[n - 1];
+	double quadratic = 0.0;
+	double best_truncation_gcv = 0.0;
+	double best_truncation_rcond = 0.0;
+	int best_truncation_rank = 0;
+	for (int i = 0; i < n; i++) solution[i] = 0.0;
+	for (int rank = 1; rank <= n; rank++) {
+		int k = n - rank;
+		if (eigenvalues[k] <= VERYSMALL * max_eigenvalue) break;
+		double coefficient = projected_rhs[k] / eigenvalues[k];
+		for (int i = 0; i < n; i++) solution[i] += sqrt_h[i] * eigenvectors->get_scalar(i, k) * coefficient;
+		quadratic -= projected_rhs[k] * coefficient;
+		double residual = quadratic / mat->normalization + mat->force_sq_total;
+		double gcv = n_data * residual / ((n_data - rank) * (n_data - rank));
+		double rcond = eigenvalues[k] / max_eigenvalue;
+		fprintf(path_file, "%le %d %le %le %le\n", rcond, rank, residual, sqrt(cblas_ddot(n, solution, 1, solution, 1)), gcv);
+		if (rank == 1 || gcv < best_truncation_gcv) {
+			best_truncation_gcv = gcv;
+			best_truncation_rcond = rcond;
+			best_truncation_rank = rank;
+		}
+	}
+	
+	fprintf(path_file, "# GCV choice: regularization_scalar %le\n", lambdas[gcv_choice]);
+	fprintf(path_file, "# L-curve choice: regularization_scalar %le\n", lambdas[lcurve_choice]);
+	fprintf(path_file, "# Truncation GCV choice: rcond %le (rank %d)\n", best_truncation_rcond, best_truncation_rank);
+	fclose(path_file);
+	printf("GCV choice: regularization_scalar %le; L-curve choice: regularization_scalar %le; truncation GCV choice: rcond %le (rank %d).\n", lambdas[gcv_choice], lambdas[lcurve_choice], best_truncation_rcond, best_truncation_rank);
+	
+	// Replace the solution with the selected Tikhonov solution if requested.
+	if (mat->regularization_path_flag >= 2) {
+		int choice = (mat->regularization_path_flag == 2) ? gcv_choice : lcurve_choice;
+		printf("Using the Tikhonov-regularized solution with regularization_scalar %le.\n", lambdas[choice]);
+		for (int k = 0; k < n; k++) {
+			coefficients[k] = projected_rhs[k] / (eigenvalues[k] + lambdas[choice] * lambdas[choice]);
+		}
+		calculate_path_solution(n, eigenvectors, coefficients, sqrt_h, solution);
+		for (int i = 0; i < n; i++) mat->fm_solution[i] = solution[i];
+	}
+	
+	delete [] sqrt_h;
+	delete eigenvectors;
+	delete [] eigenvalues;
+	delete [] projected_rhs;
+	delete [] coefficients;
+	delete [] solution;
+	delete [] lambdas;
+	delete [] log_residuals;
+	delete [] log_norms;
+	delete [] gcv_scores;
+}
+
 inline void calculate_dense_svd(MATRIX_DATA* mat, int fm_matrix_columns, int fm_matrix_rows, dense_matrix* dense_fm_normal_matrix, double* dense_fm_rhs_vector, double* singular_values)
 {
 	int space_factor = 2;
@@ -2498,7 +4257,8 @@ void solve_sparse_fm_normal_equations(MATRIX_DATA* const mat)
         fprintf(csr_out, "%lf\n", 1.0/mat->normalization);
 		fclose(csr_out);
 	
-		FILE* mat_out = open_file("result.out", "wb");
+		binary_equations_writer mat_out;
+		open_binary_equations(mat, &mat_out, "result.out", mat->fm_matrix_columns, 1);
 		int counter = 0;
 		int low, high;
 		double zero = 0.0;
@@ -2508,18 +4268,17 @@ void solve_sparse_fm_normal_equations(MATRIX_DATA* const mat)
 			counter = low;
 			for (int j = 0; j <= i; j++){
 			  if( (j + 1) == mat->sparse_matrix->column_indices[counter]) {
-			 	  fwrite(&mat->sparse_matrix->values[counter], sizeof(double), 1, mat_out);
+			 	  write_binary_equations_values(&mat_out, &mat->sparse_matrix->values[counter], 1);
 				  counter++;
 			   } else {
-				  fwrite(&zero, sizeof(double), 1, mat_out);
+				  write_binary_equations_values(&mat_out, &zero, 1);
 			   }
 			}
 		}
-		double inv_norm = 1.0/mat->normalization;
-		fwrite(&mat->dense_fm_normal_rhs_vector[0], sizeof(double), mat->fm_matrix_columns, mat_out);
-		fwrite(&mat->force_sq_total, sizeof(double), 1, mat_out);
-        fwrite(&inv_norm, sizeof(double), 1, mat_out);
-        fclose(mat_out);
+		end_binary_equations_section(&mat_out);
+		write_binary_equations_values(&mat_out, &mat->dense_fm_normal_rhs_vector[0], mat->fm_matrix_columns);
+		end_binary_equations_section(&mat_out);
+		close_binary_equations(&mat_out);
 		
 		// If no other output was desired, terminate the program successfully.
 		if (mat->output_style == 3) exit(EXIT_SUCCESS);
@@ -2555,7 +4314,7 @@ void solve_sparse_fm_normal_equations(MATRIX_DATA* const mat)
     // Solve the normal equations using PARDISO
 	printf("Computing solution of FM normal equations using sparse matrix operations.\n");
 	mat->block_fm_solution = &(mat->fm_solution[0]);
-	pardiso_solve(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
+	solve_sparse_normal_form(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
     printf("Finished PARDISO solve.\n");
 	
    // Remove preconditioning effect from solution
@@ -2643,7 +4402,7 @@ void solve_sparse_fm_normal_equations(MATRIX_DATA* const mat)
 			precondition_sparse_matrix(mat->fm_matrix_columns, mat->h, mat->sparse_matrix);
 
     		// Solve the normal equations using PARDISO
-			pardiso_solve(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
+			solve_sparse_normal_form(mat, mat->sparse_matrix, mat->dense_fm_normal_rhs_vector);
     
    			// Remove preconditioning effect from solution
    			for (int k = 0; k < mat->fm_matrix_columns; k++) {
@@ -2744,9 +4503,21 @@ void solve_sparse_fm_bootstrapping_equations(MATRIX_DATA* const mat)
 {
    // Solve for master
    solve_sparse_fm_normal_equations(mat);
-   mat->h = new double[mat->fm_matrix_columns]();
    
-   for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
+   // Conjugate gradient solves share warm-start and history state, so they run one at a time.
+   int n_threads = mat->num_solver_threads;
+   if (mat->sparse_solver_style == 1) n_threads = 1;
+   run_concurrent_solves(mat, mat->bootstrapping_num_estimates, n_threads, solve_sparse_bootstrapping_estimate);
+   
+   delete mat->sparse_block_normal_matrix;
+   mat->sparse_block_normal_matrix = NULL;
+   delete [] mat->bootstrapping_sparse_fm_normal_matrices;
+   delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors;
+}
+
+void solve_sparse_bootstrapping_estimate(MATRIX_DATA* const mat, const int i)
+{
+      double* h = new double[mat->fm_matrix_columns]();
 
       // Apply vector regularization if requested by user.
       if (mat->regularization_style == 2) {
@@ -2757,7 +4528,7 @@ void solve_sparse_fm_bootstrapping_equations(MATRIX_DATA* const mat)
       
       // Precondition the normal equations by rescaling each of the columns by its 
       // root-of-sum-of-squares-of-elements value.
-      precondition_sparse_matrix(mat->fm_matrix_columns, mat->h, mat->bootstrapping_sparse_fm_normal_matrices[i]);
+      precondition_sparse_matrix(mat->fm_matrix_columns, h, mat->bootstrapping_sparse_fm_normal_matrices[i]);
 
       // Apply Tikhonov regularization if requested by user.
       if (mat->regularization_style == 1) {
@@ -2767,30 +4538,25 @@ void solve_sparse_fm_bootstrapping_equations(MATRIX_DATA* const mat)
        }
   
       // Solve the normal equations using PARDISO
-	   printf("Computing solution of FM normal equations using sparse matrix operations.\n");
-
-	   mat->block_fm_solution = &(mat->bootstrap_solutions[i][0]);
+	   printf("Computing solution of FM normal equations using sparse matrix operations (estimate %d).\n", i);
 
-	   pardiso_solve(mat, mat->bootstrapping_sparse_fm_normal_matrices[i], mat->bootstrapping_dense_fm_normal_rhs_vectors[i]);
-       printf("Finished PARDISO solve.\n");
+	   solve_sparse_normal_form(mat, mat->bootstrapping_sparse_fm_normal_matrices[i], mat->bootstrapping_dense_fm_normal_rhs_vectors[i], h, &(mat->bootstrap_solutions[i][0]));
+       printf("Finished PARDISO solve (estimate %d).\n", i);
 	
-       // Free the CSR formatted normal matrix
-       delete mat->bootstrapping_sparse_fm_normal_matrices[i];
-       delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors[i];
-       
       // Remove preconditioning effect from solution
       for (int k = 0; k < mat->fm_matrix_columns; k++) {
-         mat->bootstrap_solutions[i][k] *= mat->h[k];
+         mat->bootstrap_solutions[i][k] *= h[k];
       }
       
       if (mat->output_residual == 1) {
          double residual = calculate_sparse_residual(mat, mat->bootstrapping_sparse_fm_normal_matrices[i], mat->bootstrapping_dense_fm_normal_rhs_vectors[i], mat->bootstrap_solutions[i], mat->normalization);
          printf("estimate %d: residual %lf\n", i, residual);
       }
-   }
-   delete [] mat->h;
-   delete [] mat->bootstrapping_sparse_fm_normal_matrices;
-   delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors;
+      
+       // Free the CSR formatted normal matrix
+       delete mat->bootstrapping_sparse_fm_normal_matrices[i];
+       delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors[i];
+       delete [] h;
 }
 
 // The dense matrix equations are now in normal form and should be solved.
@@ -2819,20 +4585,29 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
         // Read in a stored normal form matrix and normal form target vector for
         // iterative calculations
 		double ttx;
-        FILE* mat_in = open_file("result.in", "rb");
         double* in_rhs = new double[mat->fm_matrix_columns];
-        
-        for (j = 0; j < mat->fm_matrix_columns; j++) {
-            for (k = 0; k <= j; k++) {
-                fread(&ttx, sizeof(double), 1, mat_in);
-                mat->dense_fm_normal_matrix->assign_scalar(k, j, ttx);
-            }
-        }
-        for (j = 0; j < mat->fm_matrix_columns; j++) {
-            fread(&ttx, sizeof(double), 1, mat_in);
-            in_rhs[j] = ttx;
-        }
-        fclose(mat_in);
+        binary_equations_file equations_in;
+        if (map_binary_equations(mat, &equations_in, "result.in", mat->fm_matrix_columns) == 1) {
+        	const double* upper_columns = get_binary_equations_matrix(&equations_in, 0);
+	        for (j = 0; j < mat->fm_matrix_columns; j++) {
+    	        for (k = 0; k <= j; k++) assign_normal_matrix_element(mat, k, j, upper_columns[j * (j + 1) / 2 + k]);
+        	}
+        	memcpy(in_rhs, get_binary_equations_rhs(&equations_in, 0), mat->fm_matrix_columns * sizeof(double));
+        	unmap_binary_equations(&equations_in);
+        } else {
+	        FILE* mat_in = open_file("result.in", "rb");
+	        for (j = 0; j < mat->fm_matrix_columns; j++) {
+	            for (k = 0; k <= j; k++) {
+	                fread(&ttx, sizeof(double), 1, mat_in);
+	                assign_normal_matrix_element(mat, k, j, ttx);
+	            }
+	        }
+	        for (j = 0; j < mat->fm_matrix_columns; j++) {
+	            fread(&ttx, sizeof(double), 1, mat_in);
+	            in_rhs[j] = ttx;
+	        }
+	        fclose(mat_in);
+	    }
         
         // The target for an iterative calculation is the difference between the targets
         // for this trajectory and the previous trajectory.
@@ -2843,32 +4618,55 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
     } else {
         // Save the results in binary form for parallel runs.
         if (mat->output_style >= 2) {
-            FILE* mat_out = open_file("result.out", "wb");
+            binary_equations_writer mat_out;
+            open_binary_equations(mat, &mat_out, "result.out", mat->fm_matrix_columns, 1);
             for (i = 0; i < mat->fm_matrix_columns; i++) {
-                fwrite(&mat->dense_fm_normal_matrix->values[i * mat->fm_matrix_columns], sizeof(double), i + 1, mat_out);
+            	if (mat->normal_matrix_storage_style == 1) {
+            		for (j = 0; j <= i; j++) {
+            			double matrix_element = mat->packed_fm_normal_matrix->get_scalar(j, i);
+            			write_binary_equations_values(&mat_out, &matrix_element, 1);
+            		}
+            	} else {
+                	write_binary_equations_values(&mat_out, &mat->dense_fm_normal_matrix->values[i * mat->fm_matrix_columns], i + 1);
+                }
             }
-       		double inv_norm = 1.0/mat->normalization;
-            fwrite(&mat->dense_fm_normal_rhs_vector[0], sizeof(double), mat->fm_matrix_columns, mat_out);
-        	fwrite(&mat->force_sq_total, sizeof(double), 1, mat_out);
-        	fwrite(&inv_norm, sizeof(double), 1, mat_out);
-            fclose(mat_out);
+            end_binary_equations_section(&mat_out);
+            write_binary_equations_values(&mat_out, &mat->dense_fm_normal_rhs_vector[0], mat->fm_matrix_columns);
+            end_binary_equations_section(&mat_out);
+            close_binary_equations(&mat_out);
             // If no other output was desired, terminate the program successfully.
             if (mat->output_style == 3) exit(EXIT_SUCCESS);
         }
     }
 
-	// Assign the upper diagonal to the lower lower diagonal (symmetric matrix)
-    for (i = 0; i < mat->fm_matrix_columns; i++) {
-        for (j = 0; j < i; j++) {
-            mat->dense_fm_normal_matrix->assign_scalar(i, j, mat->dense_fm_normal_matrix->get_scalar(j, i));
-        }
-    }
+	if (mat->reference_normal_values != NULL) write_accumulation_accuracy_report(mat);
+	
+	dense_matrix* backup_normal_matrix = NULL;
+	int backup_needed = ( (mat->regularization_path_flag != 0) || (mat->output_residual == 1) || (mat->bayesian_flag == 1) || (mat->bayesian_flag == 2) );
+	if (mat->normal_matrix_storage_style == 1) {
+		// Expand the packed matrix for the solver. The packed matrix serves as the backup 
+		// and is freed right away if nothing needs the unmodified matrix later.
+		printf("Expanding packed FM normal equations.\n"); fflush(stdout);
+		mat->dense_fm_normal_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
+		unpack_normal_matrix(mat->fm_matrix_columns, mat->packed_fm_normal_matrix, mat->dense_fm_normal_matrix);
+		if (backup_needed == 0) {
+			delete mat->packed_fm_normal_matrix;
+			mat->packed_fm_normal_matrix = NULL;
+		}
+	} else if (mat->normal_matrix_storage_style == 0) {
+		// Assign the upper diagonal to the lower lower diagonal (symmetric matrix)
+	    for (i = 0; i < mat->fm_matrix_columns; i++) {
+	        for (j = 0; j < i; j++) {
+	            mat->dense_fm_normal_matrix->assign_scalar(i, j, mat->dense_fm_normal_matrix->get_scalar(j, i));
+	        }
+	    }
 
-	// Store a temporary backup of the normal matrix since it is changed by the solver.
-	dense_matrix* backup_normal_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
-	for (i = 0; i < mat->fm_matrix_columns; i++) {
-		for (int z = 0; z < mat->fm_matrix_columns; z++) {
-			backup_normal_matrix->assign_scalar(z, i, mat->dense_fm_normal_matrix->get_scalar(z, i));
+		// Store a temporary backup of the normal matrix since it is changed by the solver.
+		backup_normal_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
+		for (i = 0; i < mat->fm_matrix_columns; i++) {
+			for (int z = 0; z < mat->fm_matrix_columns; z++) {
+				backup_normal_matrix->assign_scalar(z, i, mat->dense_fm_normal_matrix->get_scalar(z, i));
+			}
 		}
 	}
     
@@ -2892,22 +4690,24 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
         double squared_regularization_parameter;
         squared_regularization_parameter = mat->tikhonov_regularization_param * mat->tikhonov_regularization_param;
         for (i = 0; i < mat->fm_matrix_columns; i++) {
-            mat->dense_fm_normal_matrix->add_scalar(i, i, squared_regularization_parameter);
+            mat->dense_fm_normal_matrix->add_scalar(i, i, get_tikhonov_diagonal_term(mat, squared_regularization_parameter, h[i]));
         }
     }
     
-    // Solve the normal equation by singular value decomposition using LAPACK routines.
-    printf("Computing singular value decomposition of preconditioned, regularized FM normal equations.\n"); fflush(stdout);
+    // Solve the normal equation by singular value decomposition using LAPACK routines,
+    // or by a cheaper factorization if requested and the equations are well conditioned.
+    if (mat->dense_solver_style == 0) printf("Computing singular value decomposition of preconditioned, regularized FM normal equations.\n");
+    else printf("Solving preconditioned, regularized FM normal equations.\n");
+    fflush(stdout);
     double* singular_values = new double[mat->fm_matrix_columns];
-    calculate_dense_svd(mat, mat->fm_matrix_columns, mat->dense_fm_normal_matrix, mat->dense_fm_normal_rhs_vector, singular_values);
+    double rcond_estimate;
+    int solver_used = calculate_dense_factored_solution(mat, mat->fm_matrix_columns, mat->dense_fm_normal_matrix, mat->dense_fm_normal_rhs_vector, h, singular_values, &rcond_estimate);
     
     // Print singular values.
     printf("Printing FM singular values.\n"); fflush(stdout);
     FILE* solution_file = open_file("sol_info.out", "a");
-    fprintf(solution_file, "Singular vector:\n");
-    for (i = 0; i < mat->fm_matrix_columns; i++) {
-        fprintf(solution_file, "%le\n", singular_values[i]);
-    }
+    if (solver_used == 0) fprintf(solution_file, "Singular vector:\n");
+    print_dense_solver_info(solution_file, solver_used, rcond_estimate, mat->fm_matrix_columns, singular_values);
     fclose(solution_file);
     
     // Calculate the final results from the singular values.
@@ -2916,6 +4716,21 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
     for (i = 0; i < mat->fm_matrix_columns; i++) {
         mat->fm_solution[i] = mat->dense_fm_normal_rhs_vector[i] * h[i];
     }
+    if (mat->reference_normal_values != NULL) write_accumulation_accuracy_residual(mat);
+    
+    // The factored matrix is no longer needed, so its space holds the expanded backup.
+    if ( (mat->normal_matrix_storage_style == 1) && (backup_needed == 1) ) {
+    	unpack_normal_matrix(mat->fm_matrix_columns, mat->packed_fm_normal_matrix, mat->dense_fm_normal_matrix);
+    	delete mat->packed_fm_normal_matrix;
+    	mat->packed_fm_normal_matrix = NULL;
+    	backup_normal_matrix = mat->dense_fm_normal_matrix;
+    	mat->dense_fm_normal_matrix = NULL;
+    }
+    
+    // Scan Tikhonov parameters and truncation cutoffs if requested.
+    if (mat->regularization_path_flag != 0) {
+    	calculate_regularization_path(mat, backup_normal_matrix, backup_rhs, h);
+    }
    
     // Calculate and output the residual if requested.
     if (mat->output_residual == 1) {
@@ -2962,35 +4777,66 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
 			inv_fp   = fopen("inverse.out", "w");
 		}
 			
+		// The accelerated solvers need the diagonal of the inverse of the regularized matrix; 
+		// with a scalar alpha every iteration can reuse one eigendecomposition.
+		double* inverse_diagonal = new double[mat->fm_matrix_columns];
+		double* reg_vec = new double[mat->fm_matrix_columns];
+		double* eigenvalues = NULL;
+		double* projected_rhs = NULL;
+		dense_matrix* eigenvectors = NULL;
+		if (mat->bayesian_solver_style == 2) {
+			printf("Computing eigendecomposition of FM normal matrix for Bayesian iterations.\n"); fflush(stdout);
+			eigenvalues = new double[mat->fm_matrix_columns];
+			projected_rhs = new double[mat->fm_matrix_columns];
+			eigenvectors = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
+			calculate_dense_eigendecomposition(mat->fm_matrix_columns, backup_normal_matrix, backup_rhs, eigenvectors, eigenvalues, projected_rhs);
+		}
+		
 		while (iteration < mat->bayesian_max_iter) {
 		
-			// Initialize RHS vector and normal matrix from backups.
-			for(i = 0; i < mat->fm_matrix_columns; i++) {
-				mat->dense_fm_normal_rhs_vector[i] = backup_rhs[i];
-				for (j = 0; j < mat->fm_matrix_columns; j++) {
-					it_dense_normal_matrix->assign_scalar(i, j, backup_normal_matrix->get_scalar(i, j));
+			if (mat->bayesian_solver_style == 0) {
+				// Initialize RHS vector and normal matrix from backups.
+				for(i = 0; i < mat->fm_matrix_columns; i++) {
+					mat->dense_fm_normal_rhs_vector[i] = backup_rhs[i];
+					for (j = 0; j < mat->fm_matrix_columns; j++) {
+						it_dense_normal_matrix->assign_scalar(i, j, backup_normal_matrix->get_scalar(i, j));
+					}
 				}
-			}
 			
-			// Solve matrix with regularization
-			// // First, apply regularization alpha/beta
-			for(i = 0; i < mat->fm_matrix_columns; i++) {
-				it_dense_normal_matrix->add_scalar(i, i, alpha_vec[i] * mat->normalization/ beta);
-			}
+				// Solve matrix with regularization
+				// // First, apply regularization alpha/beta
+				for(i = 0; i < mat->fm_matrix_columns; i++) {
+					it_dense_normal_matrix->add_scalar(i, i, alpha_vec[i] * mat->normalization/ beta);
+				}
 			
-			// // Then, apply preconditioning
-			calculate_and_apply_dense_preconditioning(mat, it_dense_normal_matrix, h);
+				// // Then, apply preconditioning
+				calculate_and_apply_dense_preconditioning(mat, it_dense_normal_matrix, h);
 
-			// // Now, compute the SVD.
-			for (i = 0; i < mat->fm_matrix_columns; i++) {
-				singular_values[i] = 0.0;
-			}
-			calculate_dense_svd(mat, mat->fm_matrix_columns, it_dense_normal_matrix, mat->dense_fm_normal_rhs_vector, singular_values);
+				// // Now, compute the SVD.
+				for (i = 0; i < mat->fm_matrix_columns; i++) {
+					singular_values[i] = 0.0;
+				}
+				calculate_dense_factored_solution(mat, mat->fm_matrix_columns, it_dense_normal_matrix, mat->dense_fm_normal_rhs_vector, h, singular_values, &rcond_estimate);
 			
-			for (i = 0; i < mat->fm_matrix_columns; i++) {
-        		solution[i] = mat->dense_fm_normal_rhs_vector[i] * h[i];
-        		mat->fm_solution[i] = solution[i];
-    		}
+				for (i = 0; i < mat->fm_matrix_columns; i++) {
+	        		solution[i] = mat->dense_fm_normal_rhs_vector[i] * h[i];
+	        		mat->fm_solution[i] = solution[i];
+	    		}
+			} else {
+				// One factorization or the stored eigenpairs give the solution, 
+				// the inverse diagonal, and the trace term together.
+				if (mat->bayesian_solver_style == 1) {
+					for (i = 0; i < mat->fm_matrix_columns; i++) {
+						reg_vec[i] = alpha_vec[i] * mat->normalization / beta;
+					}
+					calculate_bayesian_cholesky_terms(mat->fm_matrix_columns, backup_normal_matrix, backup_rhs, reg_vec, it_dense_normal_matrix, solution, inverse_diagonal, &trace_product);
+				} else {
+					calculate_bayesian_eigen_terms(mat->fm_matrix_columns, eigenvectors, eigenvalues, projected_rhs, alpha_vec[0] * mat->normalization / beta, solution, inverse_diagonal, &trace_product, (mat->bayesian_flag == 2) ? it_dense_normal_matrix : NULL);
+				}
+				for (i = 0; i < mat->fm_matrix_columns; i++) {
+					mat->fm_solution[i] = solution[i];
+				}
+			}
 			
 			residual = calculate_dense_residual(mat, backup_normal_matrix, backup_rhs, mat->fm_solution, 1.0);
 			double* alpha_solution = new double[mat->fm_matrix_columns];
@@ -3007,49 +4853,69 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
 			iteration++;
 			residual = calculate_dense_residual(mat, backup_normal_matrix, backup_rhs, mat->fm_solution, mat->normalization);
 		
-			// Alpha needs matrix inverse and beta needs the product of the inverse with an unregularized normal matrix
-			it_dense_normal_matrix->reset_matrix();
-			product_reg_normal_matrix_inv_normal_matrix->reset_matrix();
+			if (mat->bayesian_solver_style == 0) {
+				// Alpha needs matrix inverse and beta needs the product of the inverse with an unregularized normal matrix
+				it_dense_normal_matrix->reset_matrix();
+				product_reg_normal_matrix_inv_normal_matrix->reset_matrix();
 		
-			// Actually calculate the inverse of the regularized normal matrix
-			// // First, restore the normal matrix with regularization
-			for (i = 0; i < mat->fm_matrix_columns; i++) {
-				for (j = 0; j < mat->fm_matrix_columns; j++) {
-					it_dense_normal_matrix->assign_scalar(i, j, backup_normal_matrix->get_scalar(i, j));
+				// Actually calculate the inverse of the regularized normal matrix
+				// // First, restore the normal matrix with regularization
+				for (i = 0; i < mat->fm_matrix_columns; i++) {
+					for (j = 0; j < mat->fm_matrix_columns; j++) {
+						it_dense_normal_matrix->assign_scalar(i, j, backup_normal_matrix->get_scalar(i, j));
+					}
+					it_dense_normal_matrix->add_scalar(i, i, alpha_vec[i] * mat->normalization / beta);
 				}
-				it_dense_normal_matrix->add_scalar(i, i, alpha_vec[i] * mat->normalization / beta);
-			}
 	
-			// // Then, invert the matrix.
-			// // This routine overwrites the input matrix (it_dense_normal_matrix).
-			int* ipiv = new int[mat->fm_matrix_columns]();
-			double* work = new double[mat->fm_matrix_columns * mat->fm_matrix_columns];
-			int lwork = mat->fm_matrix_columns * mat->fm_matrix_columns;
-			int info = 0;			
-			dgetrf_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, it_dense_normal_matrix->values, &mat->fm_matrix_columns, ipiv, &info);
-			dgetri_(&mat->fm_matrix_columns, it_dense_normal_matrix->values, &mat->fm_matrix_columns, ipiv, work, &lwork, &info);
-			delete [] ipiv;
-			delete [] work;
-			if (mat->bayesian_flag == 2) {
-				it_dense_normal_matrix->print_matrix(inv_fp);
-			}
+				// // Then, invert the matrix.
+				// // This routine overwrites the input matrix (it_dense_normal_matrix).
+				int* ipiv = new int[mat->fm_matrix_columns]();
+				double* work = new double[mat->fm_matrix_columns * mat->fm_matrix_columns];
+				int lwork = mat->fm_matrix_columns * mat->fm_matrix_columns;
+				int info = 0;			
+				dgetrf_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, it_dense_normal_matrix->values, &mat->fm_matrix_columns, ipiv, &info);
+				dgetri_(&mat->fm_matrix_columns, it_dense_normal_matrix->values, &mat->fm_matrix_columns, ipiv, work, &lwork, &info);
+				delete [] ipiv;
+				delete [] work;
+				if (mat->bayesian_flag == 2) {
+					it_dense_normal_matrix->print_matrix(inv_fp);
+				}
 					
-			// Calculate product using inverse of regularized matrix
-			// Note: it_dense_normal_matrix is now actually the inverse of that matrix.
-			double oned = 1.0;
-			cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, mat->fm_matrix_columns, mat->fm_matrix_columns, mat->fm_matrix_columns, oned,
-					it_dense_normal_matrix->values, mat->fm_matrix_columns, backup_normal_matrix->values, mat->fm_matrix_columns, oned,
-					product_reg_normal_matrix_inv_normal_matrix->values, mat->fm_matrix_columns);
+				// Calculate product using inverse of regularized matrix
+				// Note: it_dense_normal_matrix is now actually the inverse of that matrix.
+				double oned = 1.0;
+				cblas_dgemm(CblasColMajor, CblasNoTrans, CblasNoTrans, mat->fm_matrix_columns, mat->fm_matrix_columns, mat->fm_matrix_columns, oned,
+						it_dense_normal_matrix->values, mat->fm_matrix_columns, backup_normal_matrix->values, mat->fm_matrix_columns, oned,
+						product_reg_normal_matrix_inv_normal_matrix->values, mat->fm_matrix_columns);
 		
-			trace_product = 0.0;
-			for (i = 0; i < mat->fm_matrix_columns; i++) {
-				trace_product += product_reg_normal_matrix_inv_normal_matrix->get_scalar(i,i);
+				trace_product = 0.0;
+				for (i = 0; i < mat->fm_matrix_columns; i++) {
+					trace_product += product_reg_normal_matrix_inv_normal_matrix->get_scalar(i,i);
+				}
+			
+				// Note: it_dense_normal_matrix is now actually the inverse of that matrix.
+				for (i = 0; i < mat->fm_matrix_columns; i++) {
+					inverse_diagonal[i] = it_dense_normal_matrix->get_scalar(i,i);
+				}
+			} else if (mat->bayesian_flag == 2) {
+				it_dense_normal_matrix->print_matrix(inv_fp);
 			}
 			
 			// Alpha Vector
 			for (i = 0; i < mat->fm_matrix_columns; i++) {
-				// Note: it_dense_normal_matrix is now actually the inverse of that matrix.
-				alpha_vec[i] = 1.0 / (solution[i] * solution[i] + it_dense_normal_matrix->get_scalar(i,i) * mat->normalization / beta);
+				alpha_vec[i] = 1.0 / (solution[i] * solution[i] + inverse_diagonal[i] * mat->normalization / beta);
+			}
+			
+			// A scalar alpha takes the same update summed over all coefficients.
+			if (mat->bayesian_solver_style == 2) {
+				double alpha_denominator = 0.0;
+				for (i = 0; i < mat->fm_matrix_columns; i++) {
+					alpha_denominator += 1.0 / alpha_vec[i];
+				}
+				alpha = (double)(mat->fm_matrix_columns) / alpha_denominator;
+				for (i = 0; i < mat->fm_matrix_columns; i++) {
+					alpha_vec[i] = alpha;
+				}
 			}
 			
 			// Beta Scalar
@@ -3072,6 +4938,13 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
 		delete [] solution;
 		delete it_dense_normal_matrix;
 		delete product_reg_normal_matrix_inv_normal_matrix;
+		delete [] inverse_diagonal;
+		delete [] reg_vec;
+		if (mat->bayesian_solver_style == 2) {
+			delete [] eigenvalues;
+			delete [] projected_rhs;
+			delete eigenvectors;
+		}
     }
     
     // For iterative calculations, the solution is a difference, so the computed quantity
@@ -3102,32 +4975,41 @@ void solve_dense_fm_normal_equations(MATRIX_DATA* const mat)
  	delete backup_normal_matrix;
  	delete mat->dense_fm_normal_matrix;
     delete [] backup_rhs;
- 	if(mat->matrix_type == 3) delete [] mat->dense_fm_normal_rhs_vector;
 }
   
-void solve_this_BI_equation(MATRIX_DATA* const mat, int &solution_counter)
-{
-  // Output BI matrix and vector before solving.
-  FILE* BI_matrix = fopen("BI_matrix.dat","a");
-  FILE* BI_vector = fopen("BI_vector.dat","a");
-  mat->dense_fm_matrix->print_matrix(BI_matrix);
-  for(int i = 0; i < mat->fm_matrix_rows;i++)  {
-      fprintf(BI_vector,"%lf\n",mat->dense_fm_rhs_vector[i]);
-  }
-  fclose(BI_matrix);
-  fclose(BI_vector);
+// The BI systems of different interactions share no unknowns, so they are
+// solved independently on up to num_solver_threads threads.
+
+void solve_BI_systems(MATRIX_DATA* const mat)
+{
+  int n_systems = (int)(mat->BI_systems.size());
+  int thread_count = std::min(mat->num_solver_threads, n_systems);
+  printf("Solving %d BI systems", n_systems);
+  if (thread_count > 1) printf(" on %d threads", thread_count);
+  printf(".\n");
+  fflush(stdout);
+  run_concurrent_tasks(mat, n_systems, mat->num_solver_threads, solve_BI_system);
   
-  // Solve BI matrix
-  if (mat->fm_matrix_columns > 0 && mat->fm_matrix_rows > 0) {
-  	double* singular_values = new double[mat->fm_matrix_columns];
-	calculate_dense_svd(mat, mat->fm_matrix_columns, mat->fm_matrix_rows, mat->dense_fm_matrix, mat->dense_fm_rhs_vector, singular_values);
-  	for (int i = 0; i < mat->fm_matrix_columns; i++) {
-    	mat->fm_solution[solution_counter + i] = mat->dense_fm_rhs_vector[i];
-  	}
-  	delete [] singular_values;
-  	solution_counter += mat->fm_matrix_columns;
+  for (int i = 0; i < n_systems; i++) {
+    delete mat->BI_systems[i].matrix;
+    delete [] mat->BI_systems[i].rhs_vector;
+  }
+  mat->BI_systems.clear();
+  mat->dense_fm_matrix = NULL;
+  mat->dense_fm_rhs_vector = NULL;
+}
+
+void solve_BI_system(MATRIX_DATA* const mat, const int i)
+{
+  BI_system &system = mat->BI_systems[i];
+  if (system.columns > 0 && system.rows > 0) {
+    double* singular_values = new double[system.columns];
+    calculate_dense_svd(mat, system.columns, system.rows, system.matrix, system.rhs_vector, singular_values);
+    for (int k = 0; k < system.columns; k++) {
+      mat->fm_solution[system.solution_offset + k] = system.rhs_vector[k];
+    }
+    delete [] singular_values;
   }
-  delete mat->dense_fm_matrix;
 }
 
 void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
@@ -3136,13 +5018,14 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
     double ttx;
     double* dd1;
     
+    // Add any blocks still buffered to the normal equations.
+    combine_bootstrapping_block_buffer(mat);
+    delete mat->bootstrapping_block_buffer;
+    delete [] mat->bootstrapping_buffer_weights;
+    
     // Solve for master
     solve_dense_fm_normal_equations(mat);
     
-    //Solve for bootstrapping_estimates.
-    double* backup_rhs = new double[mat->fm_matrix_columns];
-    double* h = new double[mat->fm_matrix_columns];
-    
     // Store a temporary backup of the normal form target vector if it
     // should be output later, since it could be changed in this routine 
     // otherwise.
@@ -3159,121 +5042,86 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
     
     if (mat->iterative_calculation_flag == 1) {
         
-        // Read in a stored normal form matrix and normal form target vector for
-        // iterative calculations
-        
-        FILE* mat_in = open_file("result.in", "rb");
+        // Read in the stored normal form matrix and normal form target vector of
+        // each estimate for iterative calculations. The master equations have
+        // already been solved and freed, so each estimate's matrix is filled in turn.
+        dense_matrix* master_dense_matrix = mat->dense_fm_normal_matrix;
+        packed_symmetric_matrix* master_packed_matrix = mat->packed_fm_normal_matrix;
         dd1 = new double[mat->fm_matrix_columns];
+        binary_equations_file equations_in;
+        FILE* mat_in = NULL;
+        int mapped = map_binary_equations(mat, &equations_in, "result.in", mat->fm_matrix_columns);
+        if (mapped == 1 && equations_in.header.n_sets != mat->bootstrapping_num_estimates) {
+            printf("result.in holds %d sets of equations, but bootstrapping_num_estimates is %d.\n", equations_in.header.n_sets, mat->bootstrapping_num_estimates);
+            exit(EXIT_FAILURE);
+        }
+        if (mapped == 0) mat_in = open_file("result.in", "rb");
         
-        for (int j = 0; j < mat->fm_matrix_columns; j++) {
-            for (int k = 0; k <= j; k++) {
-                fread(&ttx, sizeof(double), 1, mat_in);
-                mat->dense_fm_normal_matrix->assign_scalar(k, j, ttx);
+        for (int e = 0; e < mat->bootstrapping_num_estimates; e++) {
+            if (mat->normal_matrix_storage_style == 1) mat->packed_fm_normal_matrix = mat->bootstrapping_packed_fm_normal_matrices[e];
+            else mat->dense_fm_normal_matrix = mat->bootstrapping_dense_fm_normal_matrices[e];
+            if (mapped == 1) {
+            	const double* upper_columns = get_binary_equations_matrix(&equations_in, e);
+            	for (int j = 0; j < mat->fm_matrix_columns; j++) {
+            		for (int k = 0; k <= j; k++) assign_normal_matrix_element(mat, k, j, upper_columns[j * (j + 1) / 2 + k]);
+            	}
+            	memcpy(dd1, get_binary_equations_rhs(&equations_in, e), mat->fm_matrix_columns * sizeof(double));
+            } else {
+            	for (int j = 0; j < mat->fm_matrix_columns; j++) {
+            		for (int k = 0; k <= j; k++) {
+            			fread(&ttx, sizeof(double), 1, mat_in);
+            			assign_normal_matrix_element(mat, k, j, ttx);
+            		}
+            	}
+            	for (int j = 0; j < mat->fm_matrix_columns; j++) {
+            		fread(&ttx, sizeof(double), 1, mat_in);
+            		dd1[j] = ttx;
+            	}
             }
+            
+            // The target for an iterative calculation is the difference between the targets
+            // for this trajectory and the previous trajectory.
+            for (int i = 0; i < mat->fm_matrix_columns; i++)
+                mat->bootstrapping_dense_fm_normal_rhs_vectors[e][i] = dd1[i] - mat->bootstrapping_dense_fm_normal_rhs_vectors[e][i];
         }
-        for (int j = 0; j < mat->fm_matrix_columns; j++) {
-            fread(&ttx, sizeof(double), 1, mat_in);
-            dd1[j] = ttx;
-        }
-        fclose(mat_in);
         
-        // The target for an iterative calculation is the difference between the targets
-        // for this trajectory and the previous trajectory.
-        for (int i = 0; i < mat->fm_matrix_columns; i++)
-            mat->dense_fm_normal_rhs_vector[i] = dd1[i] - mat->dense_fm_normal_rhs_vector[i];
+        if (mapped == 1) unmap_binary_equations(&equations_in);
+        else fclose(mat_in);
+        mat->dense_fm_normal_matrix = master_dense_matrix;
+        mat->packed_fm_normal_matrix = master_packed_matrix;
         delete [] dd1;
         
     } else {
     
         // Save the results in binary form for parallel runs.
         if (mat->output_style >= 2) {
-            FILE* mat_out = open_file("result.out", "wb");
+            binary_equations_writer mat_out;
+            open_binary_equations(mat, &mat_out, "result.out", mat->fm_matrix_columns, mat->bootstrapping_num_estimates);
             for (int j = 0; j < mat->bootstrapping_num_estimates; j++) {
             	for (int i = 0; i < mat->fm_matrix_columns; i++) {
-                	fwrite(&mat->bootstrapping_dense_fm_normal_matrices[j]->values[i * mat->fm_matrix_columns], sizeof(double), i + 1, mat_out);
+            		if (mat->normal_matrix_storage_style == 1) {
+            			for (int k = 0; k <= i; k++) {
+            				ttx = mat->bootstrapping_packed_fm_normal_matrices[j]->get_scalar(k, i);
+            				write_binary_equations_values(&mat_out, &ttx, 1);
+            			}
+            		} else {
+                		write_binary_equations_values(&mat_out, &mat->bootstrapping_dense_fm_normal_matrices[j]->values[i * mat->fm_matrix_columns], i + 1);
+                	}
             	}
-            	fwrite(&mat->bootstrapping_dense_fm_normal_rhs_vectors[j][0], sizeof(double), mat->fm_matrix_columns, mat_out);
+            	end_binary_equations_section(&mat_out);
+            	write_binary_equations_values(&mat_out, &mat->bootstrapping_dense_fm_normal_rhs_vectors[j][0], mat->fm_matrix_columns);
+            	end_binary_equations_section(&mat_out);
             }
-            double inv_norm = 1.0/mat->normalization;
-            fwrite(&mat->force_sq_total, sizeof(double), 1, mat_out);
-	        fwrite(&inv_norm, sizeof(double), 1, mat_out);
-            fclose(mat_out);
+            close_binary_equations(&mat_out);
             // If no other output was desired, terminate the program successfully.
             if (mat->output_style == 3) exit(EXIT_SUCCESS);
         }
     }
 	
-    for (int k = 0; k < mat->bootstrapping_num_estimates; k++) {
-    
-		// Copy over symmetric off-diagonal values in normal matrix;
-	    for (int i = 0; i < mat->fm_matrix_columns; i++) {
-	        for (int j = 0; j < i; j++) {
-    	        mat->bootstrapping_dense_fm_normal_matrices[k]->assign_scalar(i, j, mat->bootstrapping_dense_fm_normal_matrices[k]->get_scalar(j , i));
-        	}
-    	}
-
-    	// Apply vector regularization.
-    	if (mat->regularization_style == 2) {
-	    	printf("Regularizing FM normal equations (estimate %d).\n", k);
-    		fflush(stdout);
-        	for (int i = 0; i < mat->fm_matrix_columns; i++) {
-    	       	mat->bootstrapping_dense_fm_normal_matrices[k]->add_scalar(i, i, mat->regularization_vector[i]);
-        	}
-        }
-
-	    // Precondition the normal matrix using the root-of-sum-of-squares 
-    	// of the columns as column scaling factors.
-    	printf("Preconditioning FM normal equations (estimate %d).\n", k);
-    	fflush(stdout);
-		calculate_and_apply_dense_preconditioning(mat, mat->bootstrapping_dense_fm_normal_matrices[k], h);
-	    
-    	// Apply Tikhonov regularization.
-    	if (mat->regularization_style == 1) {
-	    	printf("Regularizing FM normal equations (estimate %d).\n", k);
-    		fflush(stdout);
-        	double squared_regularization_parameter;
-        	squared_regularization_parameter = mat->tikhonov_regularization_param * mat->tikhonov_regularization_param;
-        	for (int i = 0; i < mat->fm_matrix_columns; i++) {
-    	       	mat->bootstrapping_dense_fm_normal_matrices[k]->add_scalar(i, i, squared_regularization_parameter);
-        	}
-        }
-    
-    	// Solve the normal equation by singular value decomposition using LAPACK routines.
-    	printf("Computing singular value decomposition of preconditioned, regularized FM normal equations (estimate %d).\n", k);
-    	fflush(stdout);
-    	double* singular_values = new double[mat->fm_matrix_columns];
-    	calculate_dense_svd(mat, mat->fm_matrix_columns, mat->bootstrapping_dense_fm_normal_matrices[k], mat->bootstrapping_dense_fm_normal_rhs_vectors[k], singular_values);
-    	
-    	// Print singular values.
-    	printf("Printing FM singular values (estimate %d).\n", k);
-    	fflush(stdout);
-    	FILE* solution_file = open_file("sol_info.out", "a");
-    	fprintf(solution_file, "Singular vector %d:\n", k);
-    	for (int i = 0; i < mat->fm_matrix_columns; i++) {
-    	    fprintf(solution_file, "%le\n", singular_values[i]);
-    	}
-    	fclose(solution_file);
-   	
-   	   	// Clean up the heap-allocated temps.
-    	 delete [] singular_values;
-
-	    // Calculate the final results from the singular values.
-	    printf("Calculating final FM results (estimate %d).\n", k);
-    	fflush(stdout);    
-    	for (int i = 0; i < mat->fm_matrix_columns; i++) {
-    	    mat->bootstrap_solutions[k][i] = mat->bootstrapping_dense_fm_normal_rhs_vectors[k][i] * h[i];
-    	}
-    	
-    	// Calculate and output the residual if requested.
-    	if (mat->output_residual == 1) {
-	    	double residual = calculate_dense_residual(mat, mat->bootstrapping_dense_fm_normal_matrices[k], backup_rhs, mat->bootstrap_solutions[k], mat->normalization);
-	    	printf ("Estimate %d: residual %lf\n", k, residual);
-    	}
-	}
-	
-    // Free the preconditioner
-    delete [] h;
-    delete [] backup_rhs;
+    // Conjugate gradient solves share warm-start and history state, so they run one at a time.
+    int n_threads = mat->num_solver_threads;
+    if (mat->dense_solver_style == 2) n_threads = 1;
+    run_concurrent_solves(mat, mat->bootstrapping_num_estimates, n_threads, solve_dense_bootstrapping_estimate);
     
     // For iterative calculations, the solution is a difference, so the computed quantity
     // should be added on to the previous solution value to obtain the final solution.
@@ -3286,7 +5134,10 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
         for (int i = 0; i < mat->fm_matrix_columns; i++) x_in >> x0[i];
         x_in.close();
         
-        for (int i = 0; i < mat->fm_matrix_columns; i++) mat->fm_solution[i] = mat->fm_solution[i] * mat->iteration_step_size + x0[i];
+        // The master solution was already updated when it was solved.
+        for (int k = 0; k < mat->bootstrapping_num_estimates; k++) {
+            for (int i = 0; i < mat->fm_matrix_columns; i++) mat->bootstrap_solutions[k][i] = mat->bootstrap_solutions[k][i] * mat->iteration_step_size + x0[i];
+        }
         delete [] x0;
     }
 
@@ -3298,12 +5149,105 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
     }
     // Clean up the heap-allocated matrix temps required for 
     // optional more-detailed output.
-    for (int k = 0; k < mat->bootstrapping_num_estimates; k++) {
-	    delete mat->bootstrapping_dense_fm_normal_matrices[k];
-    	delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors[k];
-	}
 	delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors;
     delete [] mat->bootstrapping_dense_fm_normal_matrices;
+    if (mat->normal_matrix_storage_style == 1) delete [] mat->bootstrapping_packed_fm_normal_matrices;
+    delete mat->bootstrapping_normal_storage;
+    delete mat->bootstrapping_rhs_storage;
+    mat->bootstrapping_normal_storage = NULL;
+    mat->bootstrapping_rhs_storage = NULL;
+}
+
+// Solve one bootstrapping estimate; each call uses its own workspaces so that
+// estimates can be solved concurrently.
+
+void solve_dense_bootstrapping_estimate(MATRIX_DATA* const mat, const int k)
+{
+	double* backup_rhs = new double[mat->fm_matrix_columns];
+	double* h = new double[mat->fm_matrix_columns];
+	
+	if (mat->normal_matrix_storage_style == 1) {
+		// Expand this estimate's packed matrix; only the estimates being solved are held in full.
+		mat->bootstrapping_dense_fm_normal_matrices[k] = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
+		unpack_normal_matrix(mat->fm_matrix_columns, mat->bootstrapping_packed_fm_normal_matrices[k], mat->bootstrapping_dense_fm_normal_matrices[k]);
+		if (mat->bootstrapping_normal_storage != NULL) mat->bootstrapping_packed_fm_normal_matrices[k]->values = NULL;
+		delete mat->bootstrapping_packed_fm_normal_matrices[k];
+	} else if (mat->normal_matrix_storage_style == 0) {
+		// Copy over symmetric off-diagonal values in normal matrix;
+		for (int i = 0; i < mat->fm_matrix_columns; i++) {
+			for (int j = 0; j < i; j++) {
+				mat->bootstrapping_dense_fm_normal_matrices[k]->assign_scalar(i, j, mat->bootstrapping_dense_fm_normal_matrices[k]->get_scalar(j , i));
+			}
+		}
+	}
+	
+	// Apply vector regularization.
+	if (mat->regularization_style == 2) {
+		printf("Regularizing FM normal equations (estimate %d).\n", k);
+		fflush(stdout);
+		for (int i = 0; i < mat->fm_matrix_columns; i++) {
+			mat->bootstrapping_dense_fm_normal_matrices[k]->add_scalar(i, i, mat->regularization_vector[i]);
+		}
+	}
+	
+	// Precondition the normal matrix using the root-of-sum-of-squares 
+	// of the columns as column scaling factors.
+	printf("Preconditioning FM normal equations (estimate %d).\n", k);
+	fflush(stdout);
+	calculate_and_apply_dense_preconditioning(mat, mat->bootstrapping_dense_fm_normal_matrices[k], h);
+	
+	// Apply Tikhonov regularization.
+	if (mat->regularization_style == 1) {
+		printf("Regularizing FM normal equations (estimate %d).\n", k);
+		fflush(stdout);
+		double squared_regularization_parameter = mat->tikhonov_regularization_param * mat->tikhonov_regularization_param;
+		for (int i = 0; i < mat->fm_matrix_columns; i++) {
+			mat->bootstrapping_dense_fm_normal_matrices[k]->add_scalar(i, i, get_tikhonov_diagonal_term(mat, squared_regularization_parameter, h[i]));
+		}
+	}
+	
+	// Solve the normal equation by singular value decomposition using LAPACK routines,
+	// or by a cheaper factorization if requested and the equations are well conditioned.
+	if (mat->dense_solver_style == 0) printf("Computing singular value decomposition of preconditioned, regularized FM normal equations (estimate %d).\n", k);
+	else printf("Solving preconditioned, regularized FM normal equations (estimate %d).\n", k);
+	fflush(stdout);
+	for (int i = 0; i < mat->fm_matrix_columns; i++) backup_rhs[i] = mat->bootstrapping_dense_fm_normal_rhs_vectors[k][i];
+	double* singular_values = new double[mat->fm_matrix_columns];
+	double rcond_estimate;
+	int solver_used = calculate_dense_factored_solution(mat, mat->fm_matrix_columns, mat->bootstrapping_dense_fm_normal_matrices[k], mat->bootstrapping_dense_fm_normal_rhs_vectors[k], h, singular_values, &rcond_estimate);
+	
+	// Print singular values as soon as this estimate is finished.
+	printf("Printing FM singular values (estimate %d).\n", k);
+	fflush(stdout);
+	bootstrapping_output_mutex.lock();
+	FILE* solution_file = open_file("sol_info.out", "a");
+	if (solver_used == 0) fprintf(solution_file, "Singular vector %d:\n", k);
+	else fprintf(solution_file, "Estimate %d: ", k);
+	print_dense_solver_info(solution_file, solver_used, rcond_estimate, mat->fm_matrix_columns, singular_values);
+	fclose(solution_file);
+	bootstrapping_output_mutex.unlock();
+	delete [] singular_values;
+	
+	// Calculate the final results from the singular values.
+	printf("Calculating final FM results (estimate %d).\n", k);
+	fflush(stdout);
+	for (int i = 0; i < mat->fm_matrix_columns; i++) {
+		mat->bootstrap_solutions[k][i] = mat->bootstrapping_dense_fm_normal_rhs_vectors[k][i] * h[i];
+	}
+	
+	// Calculate and output the residual if requested.
+	if (mat->output_residual == 1) {
+		double residual = calculate_dense_residual(mat, mat->bootstrapping_dense_fm_normal_matrices[k], backup_rhs, mat->bootstrap_solutions[k], mat->normalization);
+		printf("Estimate %d: residual %lf\n", k, residual);
+	}
+	
+	// Free the preconditioner and this estimate's normal equations; estimates stored
+	// together are freed with their storage once all of them are solved.
+	delete [] h;
+	delete [] backup_rhs;
+	if ( (mat->bootstrapping_normal_storage != NULL) && (mat->normal_matrix_storage_style != 1) ) mat->bootstrapping_dense_fm_normal_matrices[k]->values = NULL;
+	delete mat->bootstrapping_dense_fm_normal_matrices[k];
+	if (mat->bootstrapping_rhs_storage == NULL) delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors[k];
 }
 
 // All the individual frame-block matrices have now been accumulated into a single matrix
@@ -3313,28 +5257,29 @@ void solve_dense_fm_normal_bootstrapping_equations(MATRIX_DATA* const mat)
 void solve_accumulation_form_fm_equations(MATRIX_DATA* const mat)
 {
     int i, j;
+    if (mat->accumulation_qr_lane_matrices != NULL) combine_accumulation_qr_lanes(mat);
+    int lda = mat->dense_fm_matrix->n_rows;
     for (i = 0; i < mat->accumulation_matrix_columns; i++) {
-        mat->dense_fm_normal_rhs_vector[i] = mat->dense_fm_matrix->values[mat->fm_matrix_columns * mat->accumulation_matrix_rows + i];
+        mat->dense_fm_normal_rhs_vector[i] = mat->dense_fm_matrix->values[mat->fm_matrix_columns * lda + i];
     }
-    set_accumulation_matrix_to_zero(mat);
+    set_accumulation_matrix_to_zero(mat, mat->dense_fm_matrix);
     
     // Save the results in binary form and exit if no other output is desired.
     if (mat->output_style >= 2) {
-        FILE* mat_out;
-        mat_out = open_file("final_equations.out", "wb");
+        binary_equations_writer mat_out;
+        open_binary_equations(mat, &mat_out, "final_equations.out", mat->accumulation_matrix_columns, 1);
         for (i = 0; i < mat->fm_matrix_columns; i++) {
-            fwrite(&mat->dense_fm_matrix->values[i * mat->accumulation_matrix_rows], sizeof(double), i + 1, mat_out);
+            write_binary_equations_values(&mat_out, &mat->dense_fm_matrix->values[i * lda], i + 1);
         }
-        fwrite(&mat->dense_fm_normal_rhs_vector[0], sizeof(double), mat->accumulation_matrix_columns, mat_out);
-        double inv_norm = 1.0/mat->normalization;
-        fwrite(&mat->force_sq_total, sizeof(double), 1, mat_out);
-        fwrite(&inv_norm, sizeof(double), 1, mat_out);
-        fclose(mat_out);
+        end_binary_equations_section(&mat_out);
+        write_binary_equations_values(&mat_out, &mat->dense_fm_normal_rhs_vector[0], mat->accumulation_matrix_columns);
+        end_binary_equations_section(&mat_out);
+        close_binary_equations(&mat_out);
         
         if (mat->output_style == 3) exit(EXIT_SUCCESS);
     }
     
-    double resid = mat->dense_fm_matrix->values[(mat->accumulation_matrix_columns - 1) * mat->accumulation_matrix_rows + mat->accumulation_matrix_columns - 1];
+    double resid = mat->dense_fm_matrix->values[(mat->accumulation_matrix_columns - 1) * lda + mat->accumulation_matrix_columns - 1];
     
     // Precondition the accumulation matrix using the root-of-sum-of-squares of the columns
     // as column scaling factors.
@@ -3344,7 +5289,7 @@ void solve_accumulation_form_fm_equations(MATRIX_DATA* const mat)
     
     for (i = 0; i < mat->fm_matrix_columns; i++) {
         for (j = 0; j < mat->fm_matrix_columns; j++) {
-            h[j] += mat->dense_fm_matrix->values[j * mat->accumulation_matrix_rows + i] * mat->dense_fm_matrix->values[j * mat->accumulation_matrix_rows + i];
+            h[j] += mat->dense_fm_matrix->values[j * lda + i] * mat->dense_fm_matrix->values[j * lda + i];
         }
     }
     
@@ -3355,7 +5300,7 @@ void solve_accumulation_form_fm_equations(MATRIX_DATA* const mat)
     
     for (i = 0; i < mat->fm_matrix_columns; i++) {
         for (j = 0; j < mat->fm_matrix_columns; j++) {
-            mat->dense_fm_matrix->values[j * mat->accumulation_matrix_rows + i] *= h[j];
+            mat->dense_fm_matrix->values[j * lda + i] *= h[j];
         }
     }
     
@@ -3369,11 +5314,11 @@ void solve_accumulation_form_fm_equations(MATRIX_DATA* const mat)
     int irank_in, info_in;
     int lapack_setup_flag = -1;
     double* lapack_temp_workspace = new double[1];
-    dgelss_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, &onei, mat->dense_fm_matrix->values, &mat->accumulation_matrix_rows, mat->dense_fm_normal_rhs_vector, &mat->fm_matrix_columns, singular_values, &mat->rcond, &irank_in, lapack_temp_workspace, &lapack_setup_flag, &info_in);
+    dgelss_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, &onei, mat->dense_fm_matrix->values, &lda, mat->dense_fm_normal_rhs_vector, &mat->fm_matrix_columns, singular_values, &mat->rcond, &irank_in, lapack_temp_workspace, &lapack_setup_flag, &info_in);
     lapack_setup_flag = lapack_temp_workspace[0];
     delete [] lapack_temp_workspace;
     lapack_temp_workspace = new double[lapack_setup_flag];
-    dgelss_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, &onei, mat->dense_fm_matrix->values, &mat->accumulation_matrix_rows, mat->dense_fm_normal_rhs_vector, &mat->fm_matrix_columns, singular_values, &mat->rcond, &irank_in, lapack_temp_workspace, &lapack_setup_flag, &info_in);
+    dgelss_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, &onei, mat->dense_fm_matrix->values, &lda, mat->dense_fm_normal_rhs_vector, &mat->fm_matrix_columns, singular_values, &mat->rcond, &irank_in, lapack_temp_workspace, &lapack_setup_flag, &info_in);
     delete [] lapack_temp_workspace;
     
     // Print singular values to file.
@@ -3408,104 +5353,372 @@ void solve_accumulation_form_fm_equations(MATRIX_DATA* const mat)
 
 void solve_accumulation_form_bootstrapping_equations(MATRIX_DATA* const mat)
 {
-    int i, j, k;
+    int i, k;
+    int lda = 2 * mat->accumulation_matrix_columns;
+    
+    // Solve for master using the full-trajectory factor in place of the last block.
+    delete mat->dense_fm_matrix;
+    mat->dense_fm_matrix = mat->accumulation_r_matrix;
+    solve_accumulation_form_fm_equations(mat);
 
  	for (k = 0; k < mat->bootstrapping_num_estimates; k++) {
 	    for (i = 0; i < mat->accumulation_matrix_columns; i++) {
-    	    mat->bootstrapping_dense_fm_normal_rhs_vectors[k][i] = mat->bootstrapping_dense_fm_normal_matrices[k]->values[mat->fm_matrix_columns * mat->accumulation_matrix_rows + i];
+    	    mat->bootstrapping_dense_fm_normal_rhs_vectors[k][i] = mat->bootstrapping_dense_fm_normal_matrices[k]->values[mat->fm_matrix_columns * lda + i];
     	}
     	set_accumulation_matrix_to_zero(mat, mat->bootstrapping_dense_fm_normal_matrices[k]);
 	}
 	    
    	if (mat->output_style >= 2) {
-       	FILE* mat_out = open_file("final_equations.out", "wb");
+       	binary_equations_writer mat_out;
+       	open_binary_equations(mat, &mat_out, "final_equations.out", mat->accumulation_matrix_columns, mat->bootstrapping_num_estimates);
 	
 		for (k = 0; k < mat->bootstrapping_num_estimates; k++) {
 			// Save the results in binary form and exit if no other output is desired.
     	   	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	   	fwrite(&mat->bootstrapping_dense_fm_normal_matrices[k]->values[i * mat->accumulation_matrix_rows], sizeof(double), i + 1, mat_out);
+        	   	write_binary_equations_values(&mat_out, &mat->bootstrapping_dense_fm_normal_matrices[k]->values[i * lda], i + 1);
        	 	}
-        	fwrite(&mat->bootstrapping_dense_fm_normal_rhs_vectors[k][0], sizeof(double), mat->accumulation_matrix_columns, mat_out);        
+       	 	end_binary_equations_section(&mat_out);
+        	write_binary_equations_values(&mat_out, &mat->bootstrapping_dense_fm_normal_rhs_vectors[k][0], mat->accumulation_matrix_columns);        
+        	end_binary_equations_section(&mat_out);
     	}    
-     	double inv_norm = 1.0/mat->normalization;
-        fwrite(&mat->force_sq_total, sizeof(double), 1, mat_out);
-        fwrite(&inv_norm, sizeof(double), 1, mat_out);
-    	fclose(mat_out);
+    	close_binary_equations(&mat_out);
 	    if (mat->output_style == 3) exit(EXIT_SUCCESS);
 	}
     	
-   	for (k = 0; k < mat->bootstrapping_num_estimates; k++) {
+   	run_concurrent_solves(mat, mat->bootstrapping_num_estimates, mat->num_solver_threads, solve_accumulation_bootstrapping_estimate);
+	delete [] mat->bootstrapping_dense_fm_normal_matrices;
+	delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors;
+}
 
-    	double resid = mat->bootstrapping_dense_fm_normal_matrices[k]->values[(mat->accumulation_matrix_columns - 1) * mat->accumulation_matrix_rows + mat->accumulation_matrix_columns - 1];
-    
-    	// Precondition the accumulation matrix using the root-of-sum-of-squares of the columns
-    	// as column scaling factors.
-    	double* h = new double[mat->fm_matrix_columns]();
-    
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	for (j = 0; j < mat->fm_matrix_columns; j++) {
-            	h[j] += mat->bootstrapping_dense_fm_normal_matrices[k]->values[j * mat->accumulation_matrix_rows + i] * mat->bootstrapping_dense_fm_normal_matrices[k]->values[j * mat->accumulation_matrix_rows + i];
-        	}
-    	}
-    
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	if (h[i] < VERYSMALL) h[i] = 1.0;
-        	else h[i] = 1.0 / sqrt(h[i]);
-    	}
-    
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	for (j = 0; j < mat->fm_matrix_columns; j++) {
-            	mat->bootstrapping_dense_fm_normal_matrices[k]->values[j * mat->accumulation_matrix_rows + i] *= h[j];
-        	}
-    	}
-    
-    	// Solve the normal equation by singular value decomposition using LAPACK routines.
-    	// The SVD routine works in two modes: first, the routine is run with a dummy workspace to
-	    // determine the size of the needed workspace, then that workspace is allocated, then the
-    	// routine is run again with a sufficient workspace to perform SVD.
-
-    	double* singular_values = new double[mat->fm_matrix_columns];
-    	int onei = 1;
-    	int irank_in, info_in;
-    	int lapack_setup_flag = -1;
-    	double* lapack_temp_workspace = new double[1];
-    	dgelss_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, &onei, mat->bootstrapping_dense_fm_normal_matrices[k]->values, &mat->accumulation_matrix_rows, mat->bootstrapping_dense_fm_normal_rhs_vectors[k], &mat->fm_matrix_columns, singular_values, &mat->rcond, &irank_in, lapack_temp_workspace, &lapack_setup_flag, &info_in);
-    	lapack_setup_flag = lapack_temp_workspace[0];
-    	delete [] lapack_temp_workspace;
-    	lapack_temp_workspace = new double[lapack_setup_flag];
-    	dgelss_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, &onei, mat->bootstrapping_dense_fm_normal_matrices[k]->values, &mat->accumulation_matrix_rows, mat->bootstrapping_dense_fm_normal_rhs_vectors[k], &mat->fm_matrix_columns, singular_values, &mat->rcond, &irank_in, lapack_temp_workspace, &lapack_setup_flag, &info_in);
-    	delete [] lapack_temp_workspace;
-    
-    	// Print singular values to file.
-    	FILE* solution_file;
-    	solution_file = open_file("sol_info.out", "a");
-    	fprintf(solution_file, "Singular vector:\n");
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	fprintf(solution_file, "%le\n", singular_values[i]);
-    	}
+// Solve one accumulation bootstrapping estimate; each call uses its own workspaces so
+// that estimates can be solved concurrently.
 
-    	// Calculate final results from the singular value decomposition.
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-    	    mat->bootstrap_solutions[k][i] = mat->bootstrapping_dense_fm_normal_rhs_vectors[k][i] * h[i];
-    	}
-    
-    	// Print the Euclidean norm of the solution and and print the residual
-    	double xnorm = 0.0;
-    	for (i = 0; i < mat->fm_matrix_columns; i++) {
-        	xnorm += mat->fm_solution[i] * mat->fm_solution[i];
-    	}
-    	fprintf(solution_file, "Solution 2-norm:\n%le\n", xnorm);    
-    	fprintf(solution_file, "Residual 2-norm:\n%le\n", resid);
-    
-    	// Deallocate the remaining temps.
-    	fclose(solution_file);
-    	delete [] singular_values;
-    	delete [] h;
-    	delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors[k];
-    	delete mat->bootstrapping_dense_fm_normal_matrices[k];
+void solve_accumulation_bootstrapping_estimate(MATRIX_DATA* const mat, const int k)
+{
+	int i, j;
+	int lda = 2 * mat->accumulation_matrix_columns;
+	double resid = mat->bootstrapping_dense_fm_normal_matrices[k]->values[(mat->accumulation_matrix_columns - 1) * lda + mat->accumulation_matrix_columns - 1];
+	
+	// Precondition the accumulation matrix using the root-of-sum-of-squares of the columns
+	// as column scaling factors.
+	double* h = new double[mat->fm_matrix_columns]();
+	
+	for (i = 0; i < mat->fm_matrix_columns; i++) {
+		for (j = 0; j < mat->fm_matrix_columns; j++) {
+			h[j] += mat->bootstrapping_dense_fm_normal_matrices[k]->values[j * lda + i] * mat->bootstrapping_dense_fm_normal_matrices[k]->values[j * lda + i];
+		}
 	}
-	delete [] mat->bootstrapping_dense_fm_normal_matrices;
-	delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors;
+	
+	for (i = 0; i < mat->fm_matrix_columns; i++) {
+		if (h[i] < VERYSMALL) h[i] = 1.0;
+		else h[i] = 1.0 / sqrt(h[i]);
+	}
+	
+	for (i = 0; i < mat->fm_matrix_columns; i++) {
+		for (j = 0; j < mat->fm_matrix_columns; j++) {
+			mat->bootstrapping_dense_fm_normal_matrices[k]->values[j * lda + i] *= h[j];
+		}
+	}
+	
+	// Solve the normal equation by singular value decomposition using LAPACK routines.
+	// The SVD routine works in two modes: first, the routine is run with a dummy workspace to
+	// determine the size of the needed workspace, then that workspace is allocated, then the
+	// routine is run again with a sufficient workspace to perform SVD.
+	double* singular_values = new double[mat->fm_matrix_columns];
+	int onei = 1;
+	int irank_in, info_in;
+	int lapack_setup_flag = -1;
+	double* lapack_temp_workspace = new double[1];
+	dgelss_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, &onei, mat->bootstrapping_dense_fm_normal_matrices[k]->values, &lda, mat->bootstrapping_dense_fm_normal_rhs_vectors[k], &mat->fm_matrix_columns, singular_values, &mat->rcond, &irank_in, lapack_temp_workspace, &lapack_setup_flag, &info_in);
+	lapack_setup_flag = lapack_temp_workspace[0];
+	delete [] lapack_temp_workspace;
+	lapack_temp_workspace = new double[lapack_setup_flag];
+	dgelss_(&mat->fm_matrix_columns, &mat->fm_matrix_columns, &onei, mat->bootstrapping_dense_fm_normal_matrices[k]->values, &lda, mat->bootstrapping_dense_fm_normal_rhs_vectors[k], &mat->fm_matrix_columns, singular_values, &mat->rcond, &irank_in, lapack_temp_workspace, &lapack_setup_flag, &info_in);
+	delete [] lapack_temp_workspace;
+	
+	// Calculate final results from the singular value decomposition.
+	for (i = 0; i < mat->fm_matrix_columns; i++) {
+		mat->bootstrap_solutions[k][i] = mat->bootstrapping_dense_fm_normal_rhs_vectors[k][i] * h[i];
+	}
+	double xnorm = 0.0;
+	for (i = 0; i < mat->fm_matrix_columns; i++) {
+		xnorm += mat->bootstrap_solutions[k][i] * mat->bootstrap_solutions[k][i];
+	}
+	
+	// Print the singular values, the Euclidean norm of the solution and the residual
+	// as soon as this estimate is finished.
+	bootstrapping_output_mutex.lock();
+	FILE* solution_file = open_file("sol_info.out", "a");
+	fprintf(solution_file, "Singular vector %d:\n", k);
+	for (i = 0; i < mat->fm_matrix_columns; i++) {
+		fprintf(solution_file, "%le\n", singular_values[i]);
+	}
+	fprintf(solution_file, "Solution 2-norm:\n%le\n", xnorm);
+	fprintf(solution_file, "Residual 2-norm:\n%le\n", resid);
+	fclose(solution_file);
+	bootstrapping_output_mutex.unlock();
+	
+	// Deallocate the remaining temps.
+	delete [] singular_values;
+	delete [] h;
+	delete [] mat->bootstrapping_dense_fm_normal_rhs_vectors[k];
+	delete mat->bootstrapping_dense_fm_normal_matrices[k];
+}
+
+//--------------------------------------------------------------------
+// Binary normal-equation file routines
+//--------------------------------------------------------------------
+
+// Start a binary equation file. The header is rewritten with the final
+// payload size and checksum when the file is closed.
+
+void open_binary_equations(MATRIX_DATA* const mat, binary_equations_writer* const writer, const char* filename, const int rhs_size, const int n_sets)
+{
+	memset(&writer->header, 0, sizeof(binary_equations_header));
+	strcpy(writer->header.magic, BINARY_EQUATIONS_MAGIC);
+	writer->header.version = BINARY_EQUATIONS_VERSION;
+	writer->header.header_size = sizeof(binary_equations_header);
+	writer->header.matrix_type = mat->matrix_type;
+	writer->header.n_columns = mat->fm_matrix_columns;
+	writer->header.rhs_size = rhs_size;
+	writer->header.n_sets = n_sets;
+	writer->header.n_frames = mat->n_frames;
+	writer->header.column_layout_hash = mat->column_layout_hash;
+	writer->header.payload_size = 0;
+	writer->header.checksum = 14695981039346656037ULL;
+	writer->header.total_frame_weight = 1.0 / mat->normalization;
+	writer->header.force_sq_total = mat->force_sq_total;
+	writer->section_size = 0;
+	writer->fh = open_file(filename, "wb");
+	fwrite(&writer->header, sizeof(binary_equations_header), 1, writer->fh);
+}
+
+void write_binary_equations_values(binary_equations_writer* const writer, const double* const values, const int n_values)
+{
+	fwrite(values, sizeof(double), n_values, writer->fh);
+	writer->header.checksum = hash_binary_words(writer->header.checksum, values, n_values);
+	writer->section_size += n_values * sizeof(double);
+}
+
+// Pad the current matrix or right-hand side section to the payload alignment.
+
+void end_binary_equations_section(binary_equations_writer* const writer)
+{
+	double zero = 0.0;
+	while (writer->section_size % BINARY_EQUATIONS_ALIGNMENT != 0) write_binary_equations_values(writer, &zero, 1);
+	writer->header.payload_size += writer->section_size;
+	writer->section_size = 0;
+}
+
+void close_binary_equations(binary_equations_writer* const writer)
+{
+	fseek(writer->fh, 0, SEEK_SET);
+	fwrite(&writer->header, sizeof(binary_equations_header), 1, writer->fh);
+	fclose(writer->fh);
+}
+
+// Map a binary equation file and check it against this calculation.
+// Returns 0 for files written without a header by earlier versions,
+// which the callers read sequentially instead.
+
+int map_binary_equations(MATRIX_DATA* const mat, binary_equations_file* const file, const char* filename, const int rhs_size)
+{
+	int fd = open(filename, O_RDONLY);
+	if (fd < 0) {
+		printf("Failed to open file %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	struct stat file_status;
+	fstat(fd, &file_status);
+	file->mapping_size = file_status.st_size;
+	if ( (file->mapping_size < sizeof(binary_equations_header)) || (pread(fd, &file->header, sizeof(binary_equations_header), 0) != (ssize_t)sizeof(binary_equations_header)) || 
+		 (strncmp(file->header.magic, BINARY_EQUATIONS_MAGIC, 8) != 0) ) {
+		close(fd);
+		return 0;
+	}
+	
+	// Check that the file describes equations for this model before reading any payload.
+	if (file->header.version != BINARY_EQUATIONS_VERSION) {
+		printf("%s has binary equation format version %d; this version reads version %d.\n", filename, file->header.version, BINARY_EQUATIONS_VERSION);
+		exit(EXIT_FAILURE);
+	}
+	if ( (file->header.matrix_type == kAccumulation) != (mat->matrix_type == kAccumulation) ) {
+		printf("%s was written with matrix_type %d, which cannot be combined with matrix_type %d.\n", filename, file->header.matrix_type, mat->matrix_type);
+		exit(EXIT_FAILURE);
+	}
+	if ( (file->header.n_columns != mat->fm_matrix_columns) || (file->header.rhs_size != rhs_size) ) {
+		printf("%s has %d columns, but this model has %d.\n", filename, file->header.n_columns, mat->fm_matrix_columns);
+		exit(EXIT_FAILURE);
+	}
+	if (file->header.column_layout_hash != mat->column_layout_hash) {
+		printf("%s was written for a different interaction model (column layout %016llx instead of %016llx).\n", filename, 
+			(unsigned long long)file->header.column_layout_hash, (unsigned long long)mat->column_layout_hash);
+		exit(EXIT_FAILURE);
+	}
+	
+	size_t alignment_doubles = BINARY_EQUATIONS_ALIGNMENT / sizeof(double);
+	size_t n_columns = file->header.n_columns;
+	file->matrix_stride = (n_columns * (n_columns + 1) / 2 + alignment_doubles - 1) / alignment_doubles * alignment_doubles;
+	file->rhs_stride = (file->header.rhs_size + alignment_doubles - 1) / alignment_doubles * alignment_doubles;
+	size_t payload_size = (file->matrix_stride + file->rhs_stride) * sizeof(double) * file->header.n_sets;
+	if ( (file->header.payload_size != payload_size) || (file->mapping_size != file->header.header_size + payload_size) ) {
+		printf("%s is truncated or corrupt: expected %lu payload bytes.\n", filename, payload_size);
+		exit(EXIT_FAILURE);
+	}
+	
+	file->mapping = mmap(NULL, file->mapping_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (file->mapping == MAP_FAILED) {
+		printf("Failed to map file %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	madvise(file->mapping, file->mapping_size, MADV_SEQUENTIAL);
+	file->payload = (const double*)((const char*)file->mapping + file->header.header_size);
+	
+	if (hash_binary_words(14695981039346656037ULL, file->payload, payload_size / sizeof(double)) != file->header.checksum) {
+		printf("Checksum mismatch in %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	return 1;
+}
+
+void unmap_binary_equations(binary_equations_file* const file)
+{
+	munmap(file->mapping, file->mapping_size);
+}
+
+inline const double* get_binary_equations_matrix(binary_equations_file* const file, const int set)
+{
+	return file->payload + set * (file->matrix_stride + file->rhs_stride);
+}
+
+inline const double* get_binary_equations_rhs(binary_equations_file* const file, const int set)
+{
+	return file->payload + set * (file->matrix_stride + file->rhs_stride) + file->matrix_stride;
+}
+
+// Add a weighted upper triangle stored column by column to the normal matrix.
+// Each column is contiguous in the file and a strided vector in either storage.
+
+void add_upper_columns_to_normal_matrix(MATRIX_DATA* const mat, const double* const upper_columns, const double weight)
+{
+	int n = mat->fm_matrix_columns;
+	for (int j = 0; j < n; j++) {
+		const double* column = upper_columns + j * (j + 1) / 2;
+		if (mat->normal_matrix_storage_style == 1) {
+			int stride = (j >= n / 2) ? 1 : ( (n % 2 == 0) ? n + 1 : n );
+			cblas_daxpy(j + 1, weight, column, 1, mat->packed_fm_normal_matrix->values + get_packed_symmetric_index(n, 0, j), stride);
+		} else {
+			cblas_daxpy(j + 1, weight, column, 1, mat->dense_fm_normal_matrix->values + j * n, 1);
+		}
+	}
+}
+
+// Add one file's un-normalized equations to a reader thread's partial sum.
+// Headerless files are streamed a column at a time after reading their
+// trailing force_sq_total and frame weight.
+
+void add_binary_equations_file_to_partial_sum(MATRIX_DATA* const mat, const char* filename, binary_equations_partial_sum* const partial)
+{
+	int n = mat->fm_matrix_columns;
+	double* partial_rhs = partial->upper_columns + n * (n + 1) / 2;
+	binary_equations_file equations_file;
+	if (map_binary_equations(mat, &equations_file, filename, n) == 1) {
+		if (equations_file.header.n_sets != 1) {
+			printf("%s holds %d sets of bootstrapping equations; only single sets can be combined.\n", filename, equations_file.header.n_sets);
+			exit(EXIT_FAILURE);
+		}
+		double inv_norm = equations_file.header.total_frame_weight;
+		cblas_daxpy(n * (n + 1) / 2, inv_norm, get_binary_equations_matrix(&equations_file, 0), 1, partial->upper_columns, 1);
+		cblas_daxpy(n, inv_norm, get_binary_equations_rhs(&equations_file, 0), 1, partial_rhs, 1);
+		partial->force_sq_total += equations_file.header.force_sq_total;
+		partial->total_frame_weight += inv_norm;
+		partial->n_frames += equations_file.header.n_frames;
+		unmap_binary_equations(&equations_file);
+		return;
+	}
+	
+	double trailer[2];
+	double* column = new double[n];
+	FILE* single_binary_matrix_input = open_file(filename, "rb");
+	fseek(single_binary_matrix_input, -2 * (long)sizeof(double), SEEK_END);
+	fread(trailer, sizeof(double), 2, single_binary_matrix_input);
+	rewind(single_binary_matrix_input);
+	for (int j = 0; j < n; j++) {
+		fread(column, sizeof(double), j + 1, single_binary_matrix_input);
+		cblas_daxpy(j + 1, trailer[1], column, 1, partial->upper_columns + j * (j + 1) / 2, 1);
+	}
+	fread(column, sizeof(double), n, single_binary_matrix_input);
+	cblas_daxpy(n, trailer[1], column, 1, partial_rhs, 1);
+	fclose(single_binary_matrix_input);
+	delete [] column;
+	partial->force_sq_total += trailer[0];
+	partial->total_frame_weight += trailer[1];
+}
+
+// Sum a contiguous range of files so that the order of additions,
+// and so the result, does not depend on thread timing.
+
+void read_binary_equations_file_range(MATRIX_DATA* const mat, std::string* const filenames, const int first_file, const int last_file, binary_equations_partial_sum* const partial)
+{
+	#if _mkl_flag == 1
+	mkl_set_num_threads_local(1);
+	#endif
+	for (int i = first_file; i < last_file; i++) add_binary_equations_file_to_partial_sum(mat, filenames[i].c_str(), partial);
+}
+
+void merge_binary_equations_partial_sums(const size_t n_values, binary_equations_partial_sum* const partial, binary_equations_partial_sum* const other)
+{
+	#if _mkl_flag == 1
+	mkl_set_num_threads_local(1);
+	#endif
+	cblas_daxpy(n_values, 1.0, other->upper_columns, 1, partial->upper_columns, 1);
+	partial->force_sq_total += other->force_sq_total;
+	partial->total_frame_weight += other->total_frame_weight;
+	partial->n_frames += other->n_frames;
+	delete [] other->upper_columns;
+}
+
+// Read the batch on num_reduction_threads threads, each summing its share of
+// the files into its own partial sum, then merge the partial sums pairwise.
+// At most one partial sum per thread is held, and each merge frees its source.
+// Returns the total frame weight of the batch.
+
+double reduce_binary_equations_in_parallel(MATRIX_DATA* const mat, std::string* const filenames, const int n_batch)
+{
+	int n = mat->fm_matrix_columns;
+	size_t n_values = (size_t)n * (n + 1) / 2 + n;
+	int n_partials = std::min(mat->num_reduction_threads, n_batch);
+	printf("Reducing %d files on %d threads (%.1f MB of partial sums).\n", n_batch, n_partials, (double)(n_partials * n_values * sizeof(double)) / 1048576.0);
+	fflush(stdout);
+	
+	binary_equations_partial_sum* partials = new binary_equations_partial_sum[n_partials];
+	std::vector<std::thread> threads;
+	for (int t = 0; t < n_partials; t++) {
+		partials[t].upper_columns = new double[n_values]();
+		partials[t].force_sq_total = 0.0;
+		partials[t].total_frame_weight = 0.0;
+		partials[t].n_frames = 0;
+		threads.push_back(std::thread(read_binary_equations_file_range, mat, filenames, (t * n_batch) / n_partials, ((t + 1) * n_batch) / n_partials, &partials[t]));
+	}
+	for (int t = 0; t < n_partials; t++) threads[t].join();
+	
+	for (int stride = 1; stride < n_partials; stride *= 2) {
+		threads.clear();
+		for (int t = 0; t + stride < n_partials; t += 2 * stride) {
+			threads.push_back(std::thread(merge_binary_equations_partial_sums, n_values, &partials[t], &partials[t + stride]));
+		}
+		for (unsigned t = 0; t < threads.size(); t++) threads[t].join();
+	}
+	
+	add_upper_columns_to_normal_matrix(mat, partials[0].upper_columns, 1.0);
+	cblas_daxpy(n, 1.0, partials[0].upper_columns + n * (n + 1) / 2, 1, mat->dense_fm_normal_rhs_vector, 1);
+	mat->force_sq_total += partials[0].force_sq_total;
+	mat->n_frames += partials[0].n_frames;
+	double total_frame_weight = partials[0].total_frame_weight;
+	delete [] partials[0].upper_columns;
+	delete [] partials;
+	return total_frame_weight;
 }
 
 //--------------------------------------------------------------------
@@ -3565,63 +5778,94 @@ void read_binary_dense_fm_matrix(MATRIX_DATA* const mat)
     std::string* filenames;
     int n_batch = read_res_av_file(filenames);
 
-    // Read each file's dense matrix, adding them together element-by-
-    // element to get a final set of normal form equations.
+    // Read each file's dense matrix, adding them together
+    // to get a final set of normal form equations.
     // Each matrix is "un-normalized" by its number of frames before accumulating.
     FILE* single_binary_matrix_input;
-	dense_matrix* read_matrix = new dense_matrix(mat->fm_matrix_columns, mat->fm_matrix_columns);
-	double* read_rhs = new double[mat->fm_matrix_columns];
-    for (int i = 0; i < n_batch; i++) {
-        // Read the new normal form matrix.
-        // Stored as an upper traingular matrix because it is symmetric.
-        single_binary_matrix_input = open_file(filenames[i].c_str(), "rb");
-        for (int j = 0; j < mat->fm_matrix_columns; j++) {
-            for (int k = 0; k <= j; k++) {
-                fread(&matrix_element, sizeof(double), 1, single_binary_matrix_input);
-                read_matrix->assign_scalar(k, j, matrix_element);
-            }
-        }
-
-        // Read the new normal form vector.
-        for (int j = 0; j < mat->fm_matrix_columns; j++) {
-            fread(&matrix_element, sizeof(double), 1, single_binary_matrix_input);
-            read_rhs[j] = matrix_element;
-        }
+    binary_equations_file equations_file;
+	packed_symmetric_matrix* read_matrix = NULL;
+	double* read_rhs = NULL;
+	mat->n_frames = 0;
+	if ( (mat->num_reduction_threads > 1) && (n_batch > 1) ) {
+		inv_norm_sum = reduce_binary_equations_in_parallel(mat, filenames, n_batch);
+	} else {
+	    for (int i = 0; i < n_batch; i++) {
+	    	if (map_binary_equations(mat, &equations_file, filenames[i].c_str(), mat->fm_matrix_columns) == 1) {
+	    		if (equations_file.header.n_sets != 1) {
+	    			printf("%s holds %d sets of bootstrapping equations; only single sets can be combined.\n", filenames[i].c_str(), equations_file.header.n_sets);
+	    			exit(EXIT_FAILURE);
+	    		}
+	    		mat->force_sq_total += equations_file.header.force_sq_total;
+	    		mat->n_frames += equations_file.header.n_frames;
+	    		inv_norm = equations_file.header.total_frame_weight;
+	    		inv_norm_sum += inv_norm;
+    		
+	    		// Add the mapped upper triangle and vector a column at a time, "unnormalizing" as they are added.
+	    		add_upper_columns_to_normal_matrix(mat, get_binary_equations_matrix(&equations_file, 0), inv_norm);
+	    		cblas_daxpy(mat->fm_matrix_columns, inv_norm, get_binary_equations_rhs(&equations_file, 0), 1, mat->dense_fm_normal_rhs_vector, 1);
+	    		unmap_binary_equations(&equations_file);
+	    		continue;
+	    	}
+    	
+	    	// Files without a header are read as raw values.
+	    	if (read_matrix == NULL) {
+				read_matrix = new packed_symmetric_matrix(mat->fm_matrix_columns);
+				read_rhs = new double[mat->fm_matrix_columns];
+			}
+		
+	        // Read the new normal form matrix.
+	        // Stored as an upper traingular matrix because it is symmetric.
+	        single_binary_matrix_input = open_file(filenames[i].c_str(), "rb");
+	        for (int j = 0; j < mat->fm_matrix_columns; j++) {
+	            for (int k = 0; k <= j; k++) {
+	                fread(&matrix_element, sizeof(double), 1, single_binary_matrix_input);
+	                read_matrix->assign_scalar(k, j, matrix_element);
+	            }
+	        }
+
+	        // Read the new normal form vector.
+	        for (int j = 0; j < mat->fm_matrix_columns; j++) {
+	            fread(&matrix_element, sizeof(double), 1, single_binary_matrix_input);
+	            read_rhs[j] = matrix_element;
+	        }
         
-        // Read the force_sq_total value
-        fread(&matrix_element, sizeof(double), 1, single_binary_matrix_input);
-        mat->force_sq_total += matrix_element;
+	        // Read the force_sq_total value
+	        fread(&matrix_element, sizeof(double), 1, single_binary_matrix_input);
+	        mat->force_sq_total += matrix_element;
         
-        // Read the inverse normalization
-        fread(&matrix_element, sizeof(double), 1, single_binary_matrix_input);
-        inv_norm = matrix_element;
-        inv_norm_sum += inv_norm;
+	        // Read the inverse normalization
+	        fread(&matrix_element, sizeof(double), 1, single_binary_matrix_input);
+	        inv_norm = matrix_element;
+	        inv_norm_sum += inv_norm;
         
-        // Add the new normal form matrix to the existing one.
-        // This process "unnormalizes" each element as it is added.
-        // Stored as an upper traingular matrix because it is symmetric.
-         for (int j = 0; j < mat->fm_matrix_columns; j++) {
-            for (int k = 0; k <= j; k++) {
-            	mat->dense_fm_normal_matrix->add_scalar(k, j, inv_norm * read_matrix->get_scalar(k, j));
-            }
-        }
+	        // Add the new normal form matrix to the existing one.
+	        // This process "unnormalizes" each element as it is added.
+	        // Stored as an upper traingular matrix because it is symmetric.
+	         for (int j = 0; j < mat->fm_matrix_columns; j++) {
+	            for (int k = 0; k <= j; k++) {
+	            	add_normal_matrix_element(mat, get_normal_matrix_values(mat), k, j, inv_norm * read_matrix->get_scalar(k, j));
+	            }
+	        }
         
-        // Add the new normal form vector to the existing one.
-        // This process "unnormalizes" each element as it is added.
-        for (int j = 0; j < mat->fm_matrix_columns; j++) {
-            mat->dense_fm_normal_rhs_vector[j] += inv_norm * read_rhs[j];
-        }
-        fclose(single_binary_matrix_input);
-    }
+	        // Add the new normal form vector to the existing one.
+	        // This process "unnormalizes" each element as it is added.
+	        for (int j = 0; j < mat->fm_matrix_columns; j++) {
+	            mat->dense_fm_normal_rhs_vector[j] += inv_norm * read_rhs[j];
+	        }
+	        fclose(single_binary_matrix_input);
+	    }
+	}
     delete [] filenames;
-    delete [] read_rhs;
-    delete read_matrix;
+    if (read_matrix != NULL) {
+	    delete [] read_rhs;
+    	delete read_matrix;
+    }
      
     // Normalize the normal matrix and RHS vector by the total number of frames.
  	set_normalization(mat, 1.0/inv_norm_sum);
 	for (int j = 0; j < mat->fm_matrix_columns; j++) {
 		for (int k = 0; k <= j; k++) {
-			mat->dense_fm_normal_matrix->assign_scalar(k, j, mat->normalization * mat->dense_fm_normal_matrix->get_scalar(k, j));
+			assign_normal_matrix_element(mat, k, j, mat->normalization * get_normal_matrix_element(mat, k, j));
 		}
 	}
 	for (int j = 0; j < mat->fm_matrix_columns; j++) {
@@ -3656,21 +5900,30 @@ void read_binary_accumulation_fm_matrix(MATRIX_DATA* const mat)
         exit(EXIT_FAILURE);
     }
     
-    FILE* single_binary_matrix_input = open_file(filenames[0].c_str(), "rb");
-    for (int j = 0; j < mat->fm_matrix_columns; j++) {
-        for (int k = 0; k <= j; k++) {
-            fread(&read_value, sizeof(double), 1, single_binary_matrix_input);
-            mat->dense_fm_matrix->assign_scalar(k, j, read_value);
-        }
-    }
-
+    binary_equations_file equations_file;
+    if (map_binary_equations(mat, &equations_file, filenames[0].c_str(), mat->accumulation_matrix_columns) == 1) {
+    	const double* upper_columns = get_binary_equations_matrix(&equations_file, 0);
+    	for (int j = 0; j < mat->fm_matrix_columns; j++) {
+    		for (int k = 0; k <= j; k++) mat->dense_fm_matrix->assign_scalar(k, j, upper_columns[j * (j + 1) / 2 + k]);
+    	}
+    	memcpy(mat->dense_fm_normal_rhs_vector, get_binary_equations_rhs(&equations_file, 0), mat->accumulation_matrix_columns * sizeof(double));
+    	unmap_binary_equations(&equations_file);
+    } else {
+	    FILE* single_binary_matrix_input = open_file(filenames[0].c_str(), "rb");
+	    for (int j = 0; j < mat->fm_matrix_columns; j++) {
+	        for (int k = 0; k <= j; k++) {
+	            fread(&read_value, sizeof(double), 1, single_binary_matrix_input);
+	            mat->dense_fm_matrix->assign_scalar(k, j, read_value);
+	        }
+	    }
+	
+	    for (int j = 0; j < mat->accumulation_matrix_columns; j++) {
+	        fread(&read_value, sizeof(double), 1, single_binary_matrix_input);
+	        mat->dense_fm_normal_rhs_vector[j] = read_value;
+	    }
+	    fclose(single_binary_matrix_input);
+	}
     for (int j = 0; j < mat->fm_matrix_columns; j++) mat->dense_fm_matrix->assign_scalar(mat->fm_matrix_columns, j, 0.0);
-
-    for (int j = 0; j < mat->accumulation_matrix_columns; j++) {
-        fread(&read_value, sizeof(double), 1, single_binary_matrix_input);
-        mat->dense_fm_normal_rhs_vector[j] = read_value;
-    }
-    fclose(single_binary_matrix_input);
     delete [] filenames;
 }
 
@@ -3722,6 +5975,439 @@ void read_regularization_vector(MATRIX_DATA* const mat)
     lambda_in.close();
 }
 
+//--------------------------------------------------------------------
+// Checkpoint routines
+//--------------------------------------------------------------------
+
+// Copy one section of the accumulated state to or from a checkpoint payload,
+// or only count its values if there is no payload.
+
+inline void copy_fm_checkpoint_section(double* const state, const size_t n, double* const checkpoint_values, size_t &n_values, const int restore)
+{
+	if (checkpoint_values != NULL) {
+		if (restore == 1) memcpy(state, checkpoint_values + n_values, n * sizeof(double));
+		else memcpy(checkpoint_values + n_values, state, n * sizeof(double));
+	}
+	n_values += n;
+}
+
+// Copy everything accumulated across frame blocks to (restore 0) or from (restore 1)
+// a checkpoint payload and return the number of values. The same routine is used
+// in both directions so that the payload layout cannot drift.
+
+size_t copy_fm_checkpoint_values(MATRIX_DATA* const mat, double* const checkpoint_values, const int restore)
+{
+	size_t n_values = 0;
+	int n = mat->fm_matrix_columns;
+	if (mat->matrix_type == kDense) {
+		copy_fm_checkpoint_section(get_normal_matrix_values(mat), get_normal_matrix_size(mat), checkpoint_values, n_values, restore);
+		copy_fm_checkpoint_section(mat->dense_fm_normal_rhs_vector, n, checkpoint_values, n_values, restore);
+		if (mat->bootstrapping_flag == 1) {
+			// The bootstrapping weights are random, so they are part of the state.
+			for (int i = 0; i < mat->bootstrapping_num_estimates; i++) {
+				copy_fm_checkpoint_section(get_bootstrapping_normal_matrix_values(mat, i), get_normal_matrix_size(mat), checkpoint_values, n_values, restore);
+				copy_fm_checkpoint_section(mat->bootstrapping_dense_fm_normal_rhs_vectors[i], n, checkpoint_values, n_values, restore);
+				copy_fm_checkpoint_section(mat->bootstrapping_weights[i], mat->n_frames, checkpoint_values, n_values, restore);
+			}
+			copy_fm_checkpoint_section(mat->bootstrapping_normalization, mat->bootstrapping_num_estimates, checkpoint_values, n_values, restore);
+			copy_fm_checkpoint_section(mat->bootstrapping_block_buffer->values, mat->bootstrapping_buffer_size * mat->bootstrapping_block_buffer->n_rows, checkpoint_values, n_values, restore);
+			copy_fm_checkpoint_section(mat->bootstrapping_buffer_weights, mat->bootstrapping_buffer_size * (mat->bootstrapping_num_estimates + 1), checkpoint_values, n_values, restore);
+		}
+	} else if (mat->matrix_type == kAccumulation) {
+		// Only the triangular factor of the accumulated equations survives between blocks.
+		for (int j = 0; j < mat->accumulation_matrix_columns; j++) {
+			copy_fm_checkpoint_section(mat->dense_fm_matrix->values + j * mat->accumulation_matrix_rows, j + 1, checkpoint_values, n_values, restore);
+		}
+	}
+	return n_values;
+}
+
+// Write a checkpoint snapshot to a temporary file and then rename it over the
+// previous checkpoint so that checkpoint.out is always complete.
+
+void write_fm_checkpoint_file(fm_checkpoint_state* const checkpoint)
+{
+	FILE* checkpoint_file = open_file("checkpoint.out.tmp", "wb");
+	if ( (fwrite(&checkpoint->header, sizeof(fm_checkpoint_header), 1, checkpoint_file) != 1) ||
+		 (fwrite(checkpoint->values, sizeof(double), checkpoint->header.n_values, checkpoint_file) != checkpoint->header.n_values) ||
+		 (fflush(checkpoint_file) != 0) || (fsync(fileno(checkpoint_file)) != 0) ) {
+		printf("Failed to write checkpoint after %d blocks; keeping the previous checkpoint.\n", checkpoint->header.blocks_done);
+		fclose(checkpoint_file);
+		return;
+	}
+	fclose(checkpoint_file);
+	if (rename("checkpoint.out.tmp", "checkpoint.out") != 0) {
+		printf("Failed to replace checkpoint.out after %d blocks.\n", checkpoint->header.blocks_done);
+	}
+}
+
+// Called after each frame block. When a checkpoint is due, snapshot the accumulated
+// state and write it on a background thread while frame parsing continues.
+// Only one checkpoint is written at a time, and no checkpoint follows the last block.
+
+void checkpoint_fm_equations(MATRIX_DATA* const mat, const int n_blocks)
+{
+	int blocks_done = mat->trajectory_block_index + 1;
+	if ( (mat->checkpoint_interval_blocks == 0) && (mat->checkpoint_interval_minutes == 0.0) ) return;
+	if (blocks_done >= n_blocks) return;
+	if (mat->checkpoint == NULL) {
+		mat->checkpoint = new fm_checkpoint_state;
+		mat->checkpoint->values = new double[copy_fm_checkpoint_values(mat, NULL, 0)];
+		mat->checkpoint->writer = NULL;
+		mat->checkpoint->last_checkpoint_time = time(NULL);
+	}
+	
+	int due = 0;
+	if ( (mat->checkpoint_interval_blocks > 0) && (blocks_done % mat->checkpoint_interval_blocks == 0) ) due = 1;
+	if ( (mat->checkpoint_interval_minutes > 0.0) && (difftime(time(NULL), mat->checkpoint->last_checkpoint_time) >= 60.0 * mat->checkpoint_interval_minutes) ) due = 1;
+	if (due == 0) return;
+	
+	// Wait for the previous checkpoint before reusing its snapshot.
+	if (mat->checkpoint->writer != NULL) {
+		mat->checkpoint->writer->join();
+		delete mat->checkpoint->writer;
+	}
+	
+	fm_checkpoint_header* header = &mat->checkpoint->header;
+	memset(header, 0, sizeof(fm_checkpoint_header));
+	strcpy(header->magic, FM_CHECKPOINT_MAGIC);
+	header->version = FM_CHECKPOINT_VERSION;
+	header->matrix_type = mat->matrix_type;
+	header->n_columns = mat->fm_matrix_columns;
+	header->normal_matrix_storage_style = mat->normal_matrix_storage_style;
+	header->bootstrapping_num_estimates = (mat->bootstrapping_flag == 1) ? mat->bootstrapping_num_estimates : 0;
+	header->bootstrapping_buffered_blocks = (mat->bootstrapping_flag == 1) ? mat->bootstrapping_buffered_blocks : 0;
+	header->frames_per_traj_block = mat->frames_per_traj_block;
+	header->n_frames = mat->n_frames;
+	header->blocks_done = blocks_done;
+	header->accumulation_row_shift = mat->accumulation_row_shift;
+	header->column_layout_hash = mat->column_layout_hash;
+	header->n_values = copy_fm_checkpoint_values(mat, mat->checkpoint->values, 0);
+	header->checksum = hash_binary_words(14695981039346656037ULL, mat->checkpoint->values, header->n_values);
+	header->normalization = mat->normalization;
+	header->force_sq_total = mat->force_sq_total;
+	mat->checkpoint->last_checkpoint_time = time(NULL);
+	mat->checkpoint->writer = new std::thread(write_fm_checkpoint_file, mat->checkpoint);
+}
+
+// Wait for any checkpoint still being written and free the snapshot.
+
+void finish_fm_checkpoints(MATRIX_DATA* const mat)
+{
+	if (mat->checkpoint == NULL) return;
+	if (mat->checkpoint->writer != NULL) {
+		mat->checkpoint->writer->join();
+		delete mat->checkpoint->writer;
+	}
+	delete [] mat->checkpoint->values;
+	delete mat->checkpoint;
+	mat->checkpoint = NULL;
+}
+
+// Restore the accumulated state from a checkpoint written by an identical calculation
+// and return the number of frame blocks it holds.
+
+int restart_fm_equations(MATRIX_DATA* const mat, const char* filename)
+{
+	if ( (mat->matrix_type != kDense) && (mat->matrix_type != kAccumulation) ) {
+		printf("Restarting from a checkpoint is only available for matrix_type 0 and 2.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	fm_checkpoint_header header;
+	FILE* checkpoint_file = open_file(filename, "rb");
+	if ( (fread(&header, sizeof(fm_checkpoint_header), 1, checkpoint_file) != 1) || (strncmp(header.magic, FM_CHECKPOINT_MAGIC, 8) != 0) ) {
+		printf("%s is not a checkpoint file.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	if (header.version != FM_CHECKPOINT_VERSION) {
+		printf("%s has checkpoint version %d; this version reads version %d.\n", filename, header.version, FM_CHECKPOINT_VERSION);
+		exit(EXIT_FAILURE);
+	}
+	
+	// The checkpoint must come from the same model, trajectory length, and matrix options.
+	// The dense matrix sets one frame per block when frame parsing begins.
+	int frames_per_traj_block = (mat->matrix_type == kDense) ? 1 : mat->frames_per_traj_block;
+	int bootstrapping_num_estimates = (mat->bootstrapping_flag == 1) ? mat->bootstrapping_num_estimates : 0;
+	if ( (header.matrix_type != mat->matrix_type) || (header.n_columns != mat->fm_matrix_columns) ||
+		 (header.column_layout_hash != mat->column_layout_hash) || (header.normal_matrix_storage_style != mat->normal_matrix_storage_style) ||
+		 (header.bootstrapping_num_estimates != bootstrapping_num_estimates) || (header.frames_per_traj_block != frames_per_traj_block) ||
+		 (header.n_frames != mat->n_frames) ) {
+		printf("%s was written by a different calculation (matrix_type %d, %d columns, %d frames in blocks of %d, %d bootstrapping estimates).\n", 
+			filename, header.matrix_type, header.n_columns, header.n_frames, header.frames_per_traj_block, header.bootstrapping_num_estimates);
+		exit(EXIT_FAILURE);
+	}
+	size_t n_values = copy_fm_checkpoint_values(mat, NULL, 1);
+	double* checkpoint_values = new double[n_values];
+	if ( (header.n_values != n_values) || (fread(checkpoint_values, sizeof(double), n_values, checkpoint_file) != n_values) ) {
+		printf("%s is truncated or corrupt: expected %lu values.\n", filename, n_values);
+		exit(EXIT_FAILURE);
+	}
+	fclose(checkpoint_file);
+	if (hash_binary_words(14695981039346656037ULL, checkpoint_values, n_values) != header.checksum) {
+		printf("Checksum mismatch in %s.\n", filename);
+		exit(EXIT_FAILURE);
+	}
+	copy_fm_checkpoint_values(mat, checkpoint_values, 1);
+	delete [] checkpoint_values;
+	
+	mat->normalization = header.normalization;
+	mat->force_sq_total = header.force_sq_total;
+	mat->accumulation_row_shift = header.accumulation_row_shift;
+	if (mat->bootstrapping_flag == 1) mat->bootstrapping_buffered_blocks = header.bootstrapping_buffered_blocks;
+	
+	// The QR workspace is normally sized on the first block.
+	if (mat->matrix_type == kAccumulation) {
+		int info_in;
+		double workspace_size;
+		mat->lapack_setup_flag = -1;
+		dgeqrf_(&mat->accumulation_matrix_rows, &mat->accumulation_matrix_columns, mat->dense_fm_matrix->values, &mat->accumulation_matrix_rows, mat->lapack_tau, &workspace_size, &mat->lapack_setup_flag, &info_in);
+		mat->lapack_setup_flag = workspace_size;
+		mat->lapack_temp_workspace = new double[mat->lapack_setup_flag];
+	}
+	printf("Restored %d frame blocks from %s.\n", header.blocks_done, filename);
+	return header.blocks_done;
+}
+
+//--------------------------------------------------------------------
+// Frame store routines
+//--------------------------------------------------------------------
+
+// Open frame_store.out. When recording, the matrix routines are wrapped so that every
+// element added to the equations is also appended to the current frame's record.
+// When replaying, the store must come from the same model and starting frame and
+// hold at least n_frames frames.
+
+void open_frame_store(MATRIX_DATA* const mat, const int n_sites, const int starting_frame, const int n_frames)
+{
+	frame_store* store = new frame_store;
+	mat->frame_store_data = store;
+	store->reference_forces = NULL;
+	
+	if (mat->frame_store_style == 1) {
+		memset(&store->header, 0, sizeof(frame_store_header));
+		strcpy(store->header.magic, FRAME_STORE_MAGIC);
+		store->header.version = FRAME_STORE_VERSION;
+		store->header.n_sites = n_sites;
+		store->header.n_columns = mat->fm_matrix_columns;
+		store->header.starting_frame = starting_frame;
+		store->header.column_layout_hash = mat->column_layout_hash;
+		store->file = open_file("frame_store.out", "wb");
+		fwrite(&store->header, sizeof(frame_store_header), 1, store->file);
+		
+		store->accumulate_fm_matrix_element = mat->accumulate_fm_matrix_element;
+		store->accumulate_target_force_element = mat->accumulate_target_force_element;
+		mat->accumulate_fm_matrix_element = record_fm_matrix_element;
+		mat->accumulate_target_force_element = record_target_force_element;
+		return;
+	}
+	
+	store->file = open_file("frame_store.out", "rb");
+	if ( (fread(&store->header, sizeof(frame_store_header), 1, store->file) != 1) || (strncmp(store->header.magic, FRAME_STORE_MAGIC, 8) != 0) ) {
+		printf("frame_store.out is not a frame store.\n");
+		exit(EXIT_FAILURE);
+	}
+	if (store->header.version != FRAME_STORE_VERSION) {
+		printf("frame_store.out has frame store version %d; this version reads version %d.\n", store->header.version, FRAME_STORE_VERSION);
+		exit(EXIT_FAILURE);
+	}
+	if ( (store->header.n_sites != n_sites) || (store->header.n_columns != mat->fm_matrix_columns) || (store->header.column_layout_hash != mat->column_layout_hash) ) {
+		printf("frame_store.out was recorded for a different model (%d sites, %d columns).\n", store->header.n_sites, store->header.n_columns);
+		exit(EXIT_FAILURE);
+	}
+	if ( (store->header.starting_frame != starting_frame) || (store->header.n_frames < n_frames) ) {
+		printf("frame_store.out holds %d frames from frame %d, but %d frames from frame %d were requested.\n", store->header.n_frames, store->header.starting_frame, n_frames, starting_frame);
+		exit(EXIT_FAILURE);
+	}
+	store->reference_forces = new std::array<double, DIMENSION>[n_sites];
+}
+
+// Note the first site row of the frame about to be recorded.
+
+void begin_stored_frame(MATRIX_DATA* const mat, const int trajectory_block_frame_index)
+{
+	frame_store* store = mat->frame_store_data;
+	store->frame_starting_row = trajectory_block_frame_index * store->header.n_sites;
+	store->n_target_elements = 0;
+	store->n_matrix_elements = 0;
+	store->last_target_row = 0;
+	store->last_matrix_row = 0;
+	store->last_matrix_column = 0;
+	store->target_elements.clear();
+	store->matrix_elements.clear();
+}
+
+void record_fm_matrix_element(const int i, const int j, double* const x, MATRIX_DATA* const mat)
+{
+	frame_store* store = mat->frame_store_data;
+	int row = i - store->frame_starting_row;
+	append_frame_store_index(store->matrix_elements, row - store->last_matrix_row);
+	append_frame_store_index(store->matrix_elements, j - store->last_matrix_column);
+	append_frame_store_bytes(store->matrix_elements, x, DIMENSION * sizeof(double));
+	store->last_matrix_row = row;
+	store->last_matrix_column = j;
+	store->n_matrix_elements++;
+	store->accumulate_fm_matrix_element(i, j, x, mat);
+}
+
+void record_target_force_element(MATRIX_DATA* mat, int particle_index, double* force_element)
+{
+	frame_store* store = mat->frame_store_data;
+	int row = particle_index - store->frame_starting_row;
+	append_frame_store_index(store->target_elements, row - store->last_target_row);
+	append_frame_store_bytes(store->target_elements, force_element, DIMENSION * sizeof(double));
+	store->last_target_row = row;
+	store->n_target_elements++;
+	store->accumulate_target_force_element(mat, particle_index, force_element);
+}
+
+// Append the record of the frame just processed.
+
+void write_stored_frame(MATRIX_DATA* const mat, const double volume, std::array<double, DIMENSION>* const &f)
+{
+	frame_store* store = mat->frame_store_data;
+	std::vector<unsigned char> &record = store->record;
+	record.clear();
+	append_frame_store_bytes(record, &volume, sizeof(double));
+	for (int i = 0; i < store->header.n_sites; i++) append_frame_store_bytes(record, &f[i][0], DIMENSION * sizeof(double));
+	append_frame_store_bytes(record, &store->n_target_elements, sizeof(int));
+	append_frame_store_bytes(record, &store->n_matrix_elements, sizeof(int));
+	record.insert(record.end(), store->target_elements.begin(), store->target_elements.end());
+	record.insert(record.end(), store->matrix_elements.begin(), store->matrix_elements.end());
+	
+	uint64_t record_size = record.size();
+	if ( (fwrite(&record_size, sizeof(uint64_t), 1, store->file) != 1) || (fwrite(&record[0], 1, record.size(), store->file) != record.size()) ) {
+		printf("Failed to write frame %d to frame_store.out.\n", store->header.n_frames);
+		exit(EXIT_FAILURE);
+	}
+	store->header.n_frames++;
+}
+
+// Add the next stored frame's equations at its place in the current block, weighting
+// them by its box volume if requested. The stored reference forces are used unless
+// others are given.
+
+void replay_stored_frame(MATRIX_DATA* const mat, const int trajectory_block_frame_index, std::array<double, DIMENSION>* const reference_forces)
+{
+	frame_store* store = mat->frame_store_data;
+	uint64_t record_size;
+	if (fread(&record_size, sizeof(uint64_t), 1, store->file) != 1) {
+		printf("frame_store.out is truncated.\n");
+		exit(EXIT_FAILURE);
+	}
+	store->record.resize(record_size);
+	if (fread(&store->record[0], 1, record_size, store->file) != record_size) {
+		printf("frame_store.out is truncated.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	int n_sites = store->header.n_sites;
+	int frame_starting_row = trajectory_block_frame_index * n_sites;
+	const unsigned char* position = &store->record[0];
+	double volume;
+	memcpy(&volume, position, sizeof(double));
+	position += sizeof(double);
+	memcpy(store->reference_forces, position, n_sites * DIMENSION * sizeof(double));
+	position += n_sites * DIMENSION * sizeof(double);
+	int n_target_elements, n_matrix_elements;
+	memcpy(&n_target_elements, position, sizeof(int));
+	position += sizeof(int);
+	memcpy(&n_matrix_elements, position, sizeof(int));
+	position += sizeof(int);
+	
+	if (mat->volume_weighting_flag == 1) mat->current_frame_weight *= volume * volume;
+	
+	std::array<double, DIMENSION>* f = (reference_forces != NULL) ? reference_forces : store->reference_forces;
+	for (int i = 0; i < n_sites; i++) add_target_force_from_trajectory(frame_starting_row, i, mat, f);
+	
+	// The elements are added in the order they were recorded, so the equations
+	// are the same as those built from the trajectory.
+	double x[DIMENSION];
+	int row = 0, column = 0;
+	for (int k = 0; k < n_target_elements; k++) {
+		row += read_frame_store_index(position);
+		memcpy(x, position, DIMENSION * sizeof(double));
+		position += DIMENSION * sizeof(double);
+		mat->accumulate_target_force_element(mat, row + frame_starting_row, x);
+	}
+	row = 0;
+	for (int k = 0; k < n_matrix_elements; k++) {
+		row += read_frame_store_index(position);
+		column += read_frame_store_index(position);
+		memcpy(x, position, DIMENSION * sizeof(double));
+		position += DIMENSION * sizeof(double);
+		(*mat->accumulate_fm_matrix_element)(row + frame_starting_row, column, x, mat);
+	}
+	if (position != &store->record[0] + record_size) {
+		printf("Corrupt frame record in frame_store.out.\n");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void skip_stored_frames(MATRIX_DATA* const mat, const int n_skipped_frames)
+{
+	frame_store* store = mat->frame_store_data;
+	for (int i = 0; i < n_skipped_frames; i++) {
+		uint64_t record_size;
+		if ( (fread(&record_size, sizeof(uint64_t), 1, store->file) != 1) || (fseek(store->file, record_size, SEEK_CUR) != 0) ) {
+			printf("frame_store.out is truncated.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// Close the store. A recorded store's header is rewritten with its number of frames,
+// and the wrapped matrix routines are restored.
+
+void close_frame_store(MATRIX_DATA* const mat)
+{
+	frame_store* store = mat->frame_store_data;
+	if (mat->frame_store_style == 1) {
+		mat->accumulate_fm_matrix_element = store->accumulate_fm_matrix_element;
+		mat->accumulate_target_force_element = store->accumulate_target_force_element;
+		fseek(store->file, 0, SEEK_SET);
+		fwrite(&store->header, sizeof(frame_store_header), 1, store->file);
+		printf("Recorded %d frames in frame_store.out.\n", store->header.n_frames);
+	}
+	fclose(store->file);
+	delete [] store->reference_forces;
+	delete store;
+	mat->frame_store_data = NULL;
+}
+
+// Zigzag-encode an index difference as a varint so that small differences of
+// either sign take a single byte.
+
+inline void append_frame_store_index(std::vector<unsigned char> &stream, const int difference)
+{
+	unsigned int bits = ((unsigned int)(difference) << 1) ^ (unsigned int)(difference >> 31);
+	while (bits >= 0x80) {
+		stream.push_back((unsigned char)(bits | 0x80));
+		bits >>= 7;
+	}
+	stream.push_back((unsigned char)(bits));
+}
+
+inline void append_frame_store_bytes(std::vector<unsigned char> &stream, const void* const values, const size_t n_bytes)
+{
+	const unsigned char* bytes = (const unsigned char*)(values);
+	stream.insert(stream.end(), bytes, bytes + n_bytes);
+}
+
+inline int read_frame_store_index(const unsigned char* &position)
+{
+	unsigned int bits = 0;
+	int shift = 0;
+	while (*position & 0x80) {
+		bits |= (unsigned int)(*position & 0x7f) << shift;
+		shift += 7;
+		position++;
+	}
+	bits |= (unsigned int)(*position) << shift;
+	position++;
+	return (int)(bits >> 1) ^ -(int)(bits & 1);
+}
+
 void write_iteration(const double* alpha_vec, const double beta, std::vector<double> fm_solution, const double residual, const int iteration, FILE* alpha_fp, FILE* beta_fp, FILE* sol_fp, FILE* res_fp)
 {
 	int size = fm_solution.size();
@@ -8,7 +8,13 @@
 #ifndef _matrix_h
 #define _matrix_h
 
+#include <cstdint>
+#include <condition_variable>
+#include <ctime>
+#include <mutex>
+#include <thread>
 #include <vector>
+#include <sys/mman.h>
 
 #include "external_matrix_routines.h"
 
@@ -22,8 +28,9 @@ struct ControlInputs;
 typedef void (*accumulate_forces)(InteractionClassComputer* const info, const int first_nonzero_basis_index, const std::vector<double> &basis_fn_vals, const int n_body, const int* particle_ids, std::array<double, DIMENSION>* const &derivatives, MATRIX_DATA * const mat);
 typedef void (*accumulate_table_forces)(InteractionClassComputer* const info, const double &table_fn_val, const int n_body, const int* particle_ids, std::array<double, DIMENSION>* const &derivatives, MATRIX_DATA * const mat);
 void initialize_first_BI_matrix(MATRIX_DATA* const mat, CG_MODEL_DATA* const cg);
-void initialize_next_BI_matrix(MATRIX_DATA* const mat, InteractionClassComputer* const icomp);
-void solve_this_BI_equation(MATRIX_DATA* const mat, int &solution_counter);
+void initialize_next_BI_system(MATRIX_DATA* const mat, const int rows, const int columns, const int solution_offset);
+void write_BI_equations(MATRIX_DATA* const mat, const int first_system, const int first_column, const int n_columns);
+void solve_BI_systems(MATRIX_DATA* const mat);
 
 //-------------------------------------------------------------
 // Matrix-equation-related type definitions
@@ -130,24 +137,29 @@ struct csr_matrix {
     }
 };
 
+// Bytes of a memory-mapped normal matrix updated at a time when it is stored out of core.
+#define OUT_OF_CORE_PANEL_BYTES (32 << 20)
+
 struct dense_matrix {
     int n_rows;
     int n_cols;
     double *values;
+    size_t mapped_size;		// Size in bytes of the file mapping holding values, or 0 if they are on the heap
 
     inline dense_matrix(const int new_n_rows, const int new_n_cols) : 
-        n_rows(new_n_rows), n_cols(new_n_cols) {
-        values = new double[n_rows * n_cols]();
+        n_rows(new_n_rows), n_cols(new_n_cols), mapped_size(0) {
+        values = new double[(size_t)(n_rows) * (size_t)(n_cols)]();
     }
 
     inline dense_matrix(const dense_matrix& copy_matrix) {
     	n_rows = copy_matrix.n_rows;
     	n_cols = copy_matrix.n_cols;
     	values = copy_matrix.values;
+    	mapped_size = copy_matrix.mapped_size;
     }
 
     inline dense_matrix(const int new_n_rows, const int new_n_cols, double* copy_values) :
-    	n_rows(new_n_rows), n_cols(new_n_cols), values(copy_values) {
+    	n_rows(new_n_rows), n_cols(new_n_cols), values(copy_values), mapped_size(0) {
     }
 
 	inline void print_matrix(FILE* fh) const {
@@ -248,10 +260,210 @@ struct dense_matrix {
 	}
 	
     inline ~dense_matrix() {
+    	if (mapped_size > 0) munmap(values, mapped_size);
+        else delete [] values;
+	}
+};
+
+// Index of an element of a symmetric matrix of order n stored in rectangular full
+// packed format (LAPACK's TRANSR = 'N', UPLO = 'U'), which keeps only the upper triangle.
+
+inline int get_packed_symmetric_index(const int n, const int row, const int col) {
+	int i = (row < col) ? row : col;
+	int j = (row < col) ? col : row;
+	int n1 = n / 2;
+	int lda = (n % 2 == 0) ? n + 1 : n;
+	if (j >= n1) return (j - n1) * lda + i;
+	else return i * lda + j + lda - n1;
+}
+
+// Symmetric matrix in rectangular full packed format w/ constructor & destructor.
+
+struct packed_symmetric_matrix {
+    int n;
+    double *values;
+
+    inline packed_symmetric_matrix(const int new_n) : n(new_n) {
+        values = new double[n * (n + 1) / 2]();
+    }
+
+    inline packed_symmetric_matrix(const int new_n, double* copy_values) : n(new_n), values(copy_values) {
+    }
+
+	inline void add_scalar(const int row, const int col, const double x) {
+		values[get_packed_symmetric_index(n, row, col)] += x;
+	}
+
+	inline void assign_scalar(const int row, const int col, const double x) {
+		values[get_packed_symmetric_index(n, row, col)] = x;
+	}
+	
+	inline double get_scalar(const int row, const int col) const {
+		return values[get_packed_symmetric_index(n, row, col)];
+	}
+	
+    inline ~packed_symmetric_matrix() {
         delete [] values;
 	}
 };
 
+// Versioned binary normal-equation files (result.out and final_equations.out).
+// A fixed-size header is followed by a payload holding, for each set of equations,
+// the upper triangle of the matrix column by column and then the right-hand side.
+// Each section is padded to a multiple of 64 bytes so that a memory-mapped file can
+// be accumulated with aligned vector operations.
+
+#define BINARY_EQUATIONS_MAGIC "MSCGNEQ"
+#define BINARY_EQUATIONS_VERSION 2
+#define BINARY_EQUATIONS_ALIGNMENT 64
+
+struct binary_equations_header {
+	char magic[8];
+	int32_t version;
+	int32_t header_size;							// Bytes before the payload
+	int32_t matrix_type;							// matrix_type of the writing calculation
+	int32_t n_columns;								// Order of each matrix
+	int32_t rhs_size;								// Length of each right-hand side
+	int32_t n_sets;									// Number of matrix and right-hand side pairs (bootstrapping estimates)
+	int64_t n_frames;								// Number of trajectory frames accumulated
+	uint64_t column_layout_hash;					// Hash of the interaction model's basis function columns
+	uint64_t payload_size;							// Bytes of payload following the header
+	uint64_t checksum;								// 64-bit FNV-1a hash of the payload bytes
+	double total_frame_weight;						// Inverse of the normalization
+	double force_sq_total;
+	char reserved[48];
+};
+
+struct binary_equations_writer {
+	FILE* fh;
+	binary_equations_header header;
+	uint64_t section_size;							// Bytes written to the current section
+};
+
+struct binary_equations_file {
+	binary_equations_header header;
+	void* mapping;
+	size_t mapping_size;
+	const double* payload;
+	size_t matrix_stride;							// Doubles in each padded matrix section
+	size_t rhs_stride;								// Doubles in each padded right-hand side section
+};
+
+// Partial sum of the un-normalized equations read by one combinefm reader thread.
+
+struct binary_equations_partial_sum {
+	double* upper_columns;							// Upper triangle stored column by column, followed by the rhs
+	double force_sq_total;
+	double total_frame_weight;
+	long n_frames;
+};
+
+// Checkpoints of the equations accumulated by newfm (matrix_type 0 and 2).
+// The header identifies the calculation and records the number of frame blocks
+// already accumulated; the payload is the accumulated state in the order written
+// by copy_fm_checkpoint_values.
+
+#define FM_CHECKPOINT_MAGIC "MSCGCKP"
+#define FM_CHECKPOINT_VERSION 2
+
+struct fm_checkpoint_header {
+	char magic[8];
+	int32_t version;
+	int32_t matrix_type;
+	int32_t n_columns;
+	int32_t normal_matrix_storage_style;
+	int32_t bootstrapping_num_estimates;
+	int32_t bootstrapping_buffered_blocks;
+	int32_t frames_per_traj_block;
+	int32_t n_frames;
+	int32_t blocks_done;							// Frame blocks accumulated; the run resumes at this block
+	int32_t accumulation_row_shift;
+	uint64_t column_layout_hash;
+	uint64_t n_values;								// Doubles in the payload
+	uint64_t checksum;								// 64-bit FNV-1a hash of the payload bytes
+	double normalization;
+	double force_sq_total;
+};
+
+// Store of each frame's FM equations written by newfm (frame_store.out) so that later
+// runs can rebuild the equations with new frame weights or reference forces without
+// the trajectory or the geometry code. Each frame record is its size in bytes followed
+// by the box volume, the reference forces, the numbers of target and matrix elements,
+// and the elements in the order they were added. Element rows and columns are stored
+// as zigzag varint differences from the previous element; values are stored exactly.
+
+#define FRAME_STORE_MAGIC "MSCGFRS"
+#define FRAME_STORE_VERSION 1
+
+struct frame_store_header {
+	char magic[8];
+	int32_t version;
+	int32_t n_sites;
+	int32_t n_columns;
+	int32_t starting_frame;
+	int32_t n_frames;								// Number of frame records that follow
+	int32_t reserved;
+	uint64_t column_layout_hash;
+};
+
+struct frame_store {
+	frame_store_header header;
+	FILE* file;
+	int frame_starting_row;							// First site row of the current frame within its block
+	int n_target_elements;							// Elements of the frame being recorded
+	int n_matrix_elements;
+	int last_target_row;
+	int last_matrix_row;
+	int last_matrix_column;
+	std::vector<unsigned char> target_elements;
+	std::vector<unsigned char> matrix_elements;
+	std::vector<unsigned char> record;				// Encoded frame record being written or replayed
+	std::array<double, DIMENSION>* reference_forces;	// Stored reference forces of the frame being replayed
+	void (*accumulate_fm_matrix_element)(const int, const int, double* const, MATRIX_DATA*);	// Matrix routines wrapped while recording
+	void (*accumulate_target_force_element)(MATRIX_DATA*, int, double *);
+};
+
+// One frame block's linked-list FM equations detached from the matrix, so that its
+// normal form can be accumulated while the next block is assembled (matrix_type 3 and 4).
+
+struct sparse_fm_block {
+	struct linked_list_sparse_matrix_row_head* ll_sparse_matrix_row_heads;
+	double* dense_fm_rhs_vector;
+	dense_matrix* dense_fm_matrix;					// Virial constraint rows
+	double frame_weight;							// Frame weight times normalization
+	int block_index;								// Position of the block in the trajectory
+	double* bootstrapping_weights;					// Block weight for each bootstrapping estimate, if any
+	std::thread* worker;							// Pending accumulation of this block, if any
+};
+
+// One configuration considered by the memory planner.
+
+struct fm_matrix_plan {
+	int matrix_type;
+	int block_size;
+	double peak_bytes;								// Predicted peak memory while building or solving the equations
+	double frame_cost;								// Predicted floating point work per frame sample
+	double total_cost;								// Predicted work for the trajectory and the solve
+};
+
+// One interaction's Boltzmann inversion equations: a row for each histogram
+// bin and a column for each of its basis functions.
+
+struct BI_system {
+	int rows;
+	int columns;
+	int solution_offset;							// Position of the interaction's coefficients in fm_solution
+	dense_matrix* matrix;
+	double* rhs_vector;								// Also receives the solution, so it holds at least columns entries
+};
+
+struct fm_checkpoint_state {
+	fm_checkpoint_header header;
+	double* values;									// Snapshot being written by the background thread
+	std::thread* writer;
+	time_t last_checkpoint_time;
+};
+
 struct MATRIX_DATA {
     // Poor-man's polymorphism.
     MatrixType matrix_type;
@@ -278,9 +490,21 @@ struct MATRIX_DATA {
     // For dense-matrix-based calculations
     dense_matrix* dense_fm_matrix;
     dense_matrix* dense_fm_normal_matrix;           // Normal form of the force-matching matrix. Constructed one frame at a time.
+    packed_symmetric_matrix* packed_fm_normal_matrix;   // Upper triangle of the normal form when normal_matrix_storage_style is 1
+    int normal_matrix_storage_style;                // 0 to store dense normal matrices in full; 1 to store only their upper triangle in packed form; 2 to keep their upper triangle in memory-mapped files
+    int normal_summation_style;                     // 0 to add each frame's normal equations directly; 1 to use compensated (Kahan) summation
+    int frame_normal_form_precision;                // 0 to take each frame's normal form in double precision; 1 in single precision
+    int accumulation_accuracy_report_flag;          // 1 to also accumulate the default normal equations and report the difference
+    double* frame_normal_values;                    // Weighted normal matrix followed by normal rhs vector of the current frame
+    double* normal_compensation_values;             // Running compensation for each normal matrix and rhs element
+    double* reference_normal_values;                // Normal matrix followed by normal rhs vector accumulated the default way
+    float* single_fm_values;                        // Single precision copy of the frame's FM matrix followed by its target vector
+    float* single_normal_values;                    // Single precision normal matrix followed by normal rhs vector of the frame
     double* dense_fm_rhs_vector;
     double* dense_fm_normal_rhs_vector;             // Normal form of the target force vector. Constructed one frame at a time.
     double normalization;
+    int n_frames;                                   // Number of trajectory frames in the normal equations
+    uint64_t column_layout_hash;                    // Identifies the basis function columns in binary equation files
     double* fm_solution_normalization_factors;      // Weighted number of times each unknown has been found nonzero in the solution vectors of all blocks
     std::vector<double> fm_solution;                // Final answers averaged over all blocks
 	
@@ -288,6 +512,7 @@ struct MATRIX_DATA {
     double temperature;
     double iteration_step_size;
     double boltzmann;
+    std::vector<BI_system> BI_systems;				// Equations built so far, solved together by solve_BI_systems
     
     // Optional extras for any matrix_type
     int use_statistical_reweighting;        // 1 to use per-frame statistical reweighting; 0 otherwise
@@ -306,17 +531,32 @@ struct MATRIX_DATA {
 	double** bootstrapping_weights;
 	double** bootstrapping_dense_fm_normal_rhs_vectors;
 	dense_matrix** bootstrapping_dense_fm_normal_matrices;
+	packed_symmetric_matrix** bootstrapping_packed_fm_normal_matrices;
 	csr_matrix** bootstrapping_sparse_fm_normal_matrices;
 	std::vector<double>* bootstrap_solutions;
+	int bootstrapping_block_size;					// Number of consecutive frames resampled together
+	int bootstrapping_buffer_size;					// Number of resampling blocks buffered before they are combined into the estimates (matrix_type 0 and 3)
+	int bootstrapping_buffered_blocks;				// Number of resampling blocks currently buffered
+	double* bootstrapping_buffer_weights;			// Full-trajectory weight followed by the weight in each estimate for each buffered block
+	dense_matrix* bootstrapping_block_buffer;		// Unweighted normal matrix followed by normal rhs vector for each buffered block
+	dense_matrix* bootstrapping_normal_storage;		// Normal matrix of each estimate as one column, if the estimates are stored together (matrix_type 0 and 3)
+	dense_matrix* bootstrapping_rhs_storage;		// Normal rhs vector of each estimate as one column, if the estimates are stored together
 
     // For sparse-matrix-based calculations
-    int max_nonzero_normal_elements;                // Total number of nonzero values in the sparse normal matrix
+    int max_nonzero_normal_elements;                // Total number of nonzero values in the sparse normal matrix (exact pattern size for matrix_type = 4)
 	int min_nonzero_normal_elements;				// Lower bound for safe size of sparse normal matrix
 	int num_sparse_threads;							// Number of threads for sparse solver
+	int num_solver_threads;							// Number of bootstrapping estimates solved concurrently
+	int num_reduction_threads;						// Number of threads reading equation files in combinefm
+	int checkpoint_interval_blocks;					// Write a checkpoint after this many frame blocks; 0 for no block-based checkpoints
+	double checkpoint_interval_minutes;				// Write a checkpoint when this much wall time has passed since the last; 0 for no time-based checkpoints
+	fm_checkpoint_state* checkpoint;				// Pending background checkpoint, if any
+	int frame_store_style;							// 0 for no frame store; 1 to record frame_store.out; 2 to replay it; 3 to replay it with reference forces from the trajectory
+	frame_store* frame_store_data;
 	int itnlim;										// Maximum number of iterative refinement
-	double sparse_safety_factor;					// % to oversize the next frame-block's normal matrix from the current one (matrix_type = 4)
 	struct linked_list_sparse_matrix_row_head* ll_sparse_matrix_row_heads;      // A linked-list-based sparse matrix
    	csr_matrix* sparse_matrix;						// CSR matrix "object" (matrix_type = 4)
+	csr_matrix* sparse_block_normal_matrix;			// One block's normal matrix on the fixed pattern of sparse_matrix (matrix_type = 4 with bootstrapping)
 	double* block_fm_solution;                      // FM solutions from one single block
     double* h;                                      // Temp for preconditioning
 	
@@ -327,6 +567,24 @@ struct MATRIX_DATA {
     int accumulation_matrix_columns;
     int accumulation_row_shift;
     int accumulation_target_forces_location;
+    int accumulation_qr_threads;                    // Number of threads factoring frame blocks; above 1, blocks are dealt to per-thread triangular factors
+    int accumulation_qr_lane;                       // Per-thread factor receiving the current frame block
+    int* accumulation_qr_lane_blocks;               // Number of frame blocks in each per-thread factor
+    dense_matrix** accumulation_qr_lane_matrices;   // Per-thread triangular factors stacked above their next frame block
+    std::thread** accumulation_qr_lane_workers;     // Pending factorization of each per-thread factor
+    int accumulation_qr_merge_stride;               // Distance between the factors merged at the current level of the merge tree
+    int accumulation_qr_blas_threads;               // OpenBLAS thread count to restore once the per-thread factors are merged
+    
+    // For pipelined end-of-block processing (matrix_type 3 and 4)
+    int block_pipeline_depth;                       // Number of frame blocks accumulated in the background; 0 to accumulate in place
+    sparse_fm_block* pipelined_blocks;              // Block buffers handed to the background, one per block in flight
+    int pipelined_blocks_handed_off;                // Number of blocks handed to the background so far
+    int next_pipelined_block;                       // Index of the next block allowed to accumulate
+    std::mutex* pipeline_mutex;
+    std::condition_variable* pipeline_ready;
+    void (*accumulate_sparse_fm_block)(MATRIX_DATA* const, sparse_fm_block* const);    // Adds a detached block to the normal equations
+    void (*pipelined_finish_fm)(MATRIX_DATA*);      // finish_fm to call once the pipeline is drained
+    dense_matrix* accumulation_r_matrix;            // Full-trajectory factor stacked above the current block's factor (bootstrapping)
     int lapack_setup_flag;                          // Temp for LAPACK SVD and QR routines
     double* lapack_temp_workspace;                  // Temp for LAPACK SVD and QR routines
     double* lapack_tau;                             // Temp for LAPACK SVD and QR routines
@@ -336,17 +594,32 @@ struct MATRIX_DATA {
 	double force_sq_total;							
 	int bayesian_flag;								// 1 to use Bayesian MS-CG to calculate regularization and interactions
 	int bayesian_max_iter;
+	int bayesian_solver_style;						// 0 to re-solve by SVD each Bayesian iteration; 1 to use one Cholesky factorization per iteration; 2 to use scalar alpha and one eigendecomposition
     int regularization_style;                       // 0 to use no regularization; 1 to calculate results using single scalar regularization; 2 to calculate results using a set of regularization parameters in file lambda.in
 	double tikhonov_regularization_param;           // Parameter for Tikhonov regularization. (regularization_style = 1)
 	double* regularization_vector;					// Vector for regularization_style 2.
+	int regularization_path_flag;					// 1 to scan Tikhonov parameters and truncation cutoffs from one eigendecomposition; 2 (3) to also use the GCV (L-curve) choice
+	int regularization_path_points;					// Number of log-spaced Tikhonov parameters in the scan
+	double regularization_path_min;					// Smallest Tikhonov parameter in the scan
+	double regularization_path_max;					// Largest Tikhonov parameter in the scan
 
     // SVD routine parameter
     double rcond;                           // SVD condition number threshold
+    int dense_solver_style;                 // 0 to always solve dense normal equations by SVD; 1 to try Cholesky, then LDLT, then SVD; 2 for preconditioned CG
+    
+    // Krylov (preconditioned conjugate gradient) solver parameters
+    int sparse_solver_style;                // 0 to solve sparse normal equations with PARDISO; 1 for preconditioned CG
+    int krylov_max_iterations;              // Maximum number of CG iterations; 0 to use ten times the number of FM columns
+    double krylov_tolerance;                // Relative residual norm at which CG stops
+    int krylov_warm_start_flag;             // 1 to start CG from x0.in and then from the previous CG solution; 0 to start from zero
+    int krylov_solve_count;                 // Number of CG solves so far, used to label krylov_history.out
+    std::vector<double> krylov_initial_guess;
     
     // Output specifications for matrix-based routines
     int output_style;                       // 0 to output only tables; 2 to output tables and binary block equations; 3 to output only binary block equations
     int output_normal_equations_rhs_flag;   // 1 to output the final right hand side vector of the MS-CG normal equations as well as force tables; 0 otherwise
     int output_solution_flag;               // 0 to not output the solution vector; 1 to output the solution vector in x.out
+    int output_BI_equations_flag;           // 1 to output the Boltzmann inversion equations in BI_matrix.dat and BI_vector.dat; 0 otherwise
 
 	// Constructors and destructors
 	MATRIX_DATA(ControlInputs* const control_input, CG_MODEL_DATA *const cg);
@@ -413,7 +686,8 @@ struct MATRIX_DATA {
 		if (matrix_type == kDense) {
 		    delete dense_fm_matrix;
 		    dense_fm_matrix = new dense_matrix(fm_matrix_rows, fm_matrix_columns);
-		} else if ( (matrix_type == kSparse) || (matrix_type == kSparseNormal) || (matrix_type == kSparseSparse) ) {
+		} else if (matrix_type == kSparse) {
+			// The sparse normal matrices of matrix_type 3 and 4 only depend on the columns.
 			if (sparse_matrix != NULL) {
 				int max_entries = sparse_matrix->max_entries;
 				delete sparse_matrix;   		
@@ -443,6 +717,7 @@ inline void set_normalization(MATRIX_DATA* mat, const double new_normalization_c
 
 void set_bootstrapping_normalization(MATRIX_DATA* mat, double** const bootstrapping_weights, int const n_frames);
 void allocate_bootstrapping(MATRIX_DATA* mat, ControlInputs* const control_input, const int rows, const int cols);
+void allocate_bootstrapping_block_buffer(MATRIX_DATA* mat, ControlInputs* const control_input);
 
 // Target (RHS) vector calculation routines
 
@@ -453,4 +728,24 @@ void add_target_force_from_trajectory(int shift_i, int site_i, MATRIX_DATA* cons
 
 void read_binary_matrix(MATRIX_DATA* const mat);
 
+// Checkpoint and restart the equations accumulated during frame parsing
+
+void checkpoint_fm_equations(MATRIX_DATA* const mat, const int n_blocks);
+void finish_fm_checkpoints(MATRIX_DATA* const mat);
+int restart_fm_equations(MATRIX_DATA* const mat, const char* filename);
+
+// Record and replay the per-frame FM equations in frame_store.out
+
+void open_frame_store(MATRIX_DATA* const mat, const int n_sites, const int starting_frame, const int n_frames);
+void begin_stored_frame(MATRIX_DATA* const mat, const int trajectory_block_frame_index);
+void write_stored_frame(MATRIX_DATA* const mat, const double volume, std::array<double, DIMENSION>* const &f);
+void replay_stored_frame(MATRIX_DATA* const mat, const int trajectory_block_frame_index, std::array<double, DIMENSION>* const reference_forces);
+void skip_stored_frames(MATRIX_DATA* const mat, const int n_skipped_frames);
+void close_frame_store(MATRIX_DATA* const mat);
+
+// Plan memory use and cost of each matrix_type from the first frame's equations
+
+void initialize_plan_counting_matrix(MATRIX_DATA* const mat, CG_MODEL_DATA* const cg);
+void plan_fm_matrix(MATRIX_DATA* const mat, ControlInputs* const control_input, CG_MODEL_DATA* const cg);
+
 #endif
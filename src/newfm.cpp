@@ -9,7 +9,11 @@
 
 #include <cstdio>
 #include <cstdlib>
+#include <cstring>
 #include <ctime>
+#include <string>
+#include <vector>
+#include <unistd.h>
 #include "control_input.h"
 #include "force_computation.h"
 #include "fm_output.h"
@@ -17,9 +21,25 @@
 #include "interaction_model.h"
 #include "matrix.h"
 #include "misc.h"
+#include "range_finding.h"
 #include "trajectory_input.h"
 
-void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source);
+// A further model fit in the same pass over the trajectory; see model_variants_flag.
+struct ModelVariant {
+	std::string directory;
+	ControlInputs* control_input;
+	CG_MODEL_DATA* cg;
+	MATRIX_DATA* mat;
+};
+
+void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source, const int first_block, std::vector<ModelVariant> &variants);
+void read_model_variants(ControlInputs* const control_input, CG_MODEL_DATA* const cg, FrameSource* const frame_source, std::vector<ModelVariant> &variants);
+void finish_model_variants(std::vector<ModelVariant> &variants);
+void change_directory(const char* directory);
+void replay_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source, const int first_block);
+void plan_fm_matrix_from_first_frame(ControlInputs* const control_input, CG_MODEL_DATA* const cg, FrameSource* const frame_source);
+void find_ranges_from_leading_frames(ControlInputs* const control_input, FrameSource* const frame_source);
+void switch_off_matrix_options(ControlInputs* const dummy_input);
 
 int main(int argc, char* argv[])
 {
@@ -33,8 +53,18 @@ int main(int argc, char* argv[])
     
     // Parse the command-line arguments of the program; these are 
     // only used to set the trajectory input files and do nothing 
-    // else.
+    // else, apart from a trailing --restart to resume from checkpoint.out
+    // or a trailing --plan to only predict memory use from the first frame.
     printf("Parsing command line arguments.\n");
+    int restart_flag = 0;
+    int plan_flag = 0;
+    if ( (argc > 1) && (strcmp(argv[argc - 1], "--restart") == 0) ) {
+    	restart_flag = 1;
+    	argc--;
+    } else if ( (argc > 1) && (strcmp(argv[argc - 1], "--plan") == 0) ) {
+    	plan_flag = 1;
+    	argc--;
+    }
     parse_command_line_arguments(argc, argv, &frame_source); 
     
     // Read the file control.in to determine the values of many of
@@ -55,26 +85,6 @@ int main(int argc, char* argv[])
     printf("Reading topology file.\n");
     read_topology_file(&cg.topo_data, &cg);
     
-    // Read the range files rmin.in and rmax.in to determine the
-    // ranges over which the FM basis functions should be defined.
-    // These ranges are also used to record which interactions
-    // should be fit, which should be tabulated, and which are not 
-    // present in the model.
-    printf("Reading interaction ranges.\n");
-    read_all_interaction_ranges(&cg);
-
-    // The range files have specified which interactions should be
-    // read from file; read the tabulated potentials from table.in
-    // now if any were found.
-    if (cg.pair_nonbonded_interactions.n_tabulated > 0 ||
-        cg.pair_bonded_interactions.n_tabulated > 0 ||
-        cg.angular_interactions.n_tabulated > 0 ||
-        cg.dihedral_interactions.n_tabulated > 0 ||
-		cg.density_interactions.n_tabulated > 0) {
-        printf("Reading tabulated reference potentials.\n");
-        read_tabulated_interaction_file(&cg, cg.topo_data.n_cg_types);
-    } 
-    
     // Read statistical weights for each frame if the 
     // 'use_statistical_reweighting' flag is set in control.in.
     if (frame_source.use_statistical_reweighting == 1) {
@@ -97,18 +107,81 @@ int main(int argc, char* argv[])
         read_frame_values("p_con.in", control_input.starting_frame, control_input.n_frames, frame_source.pressure_constraint_rhs_vector);
     }
     
+    // With range_finding_frames, write rmin.in and rmin_b.in from the leading
+    // frames of the trajectory, which are kept to build the FM equations.
+    if (control_input.range_finding_frames > 0) {
+    	if ( (restart_flag == 1) || (control_input.frame_store_style == 2) ) {
+    		printf("Ranges cannot be found from the trajectory with --restart or frame_store_style 2.\n");
+    		exit(EXIT_FAILURE);
+    	}
+    	printf("Beginning to read frames.\n");
+    	printf("Finding first frame...\n");
+    	frame_source.get_first_frame(&frame_source, cg.topo_data.n_cg_sites, cg.topo_data.cg_site_types);
+    	find_ranges_from_leading_frames(&control_input, &frame_source);
+    }
+    
+    // Read the range files rmin.in and rmax.in to determine the
+    // ranges over which the FM basis functions should be defined.
+    // These ranges are also used to record which interactions
+    // should be fit, which should be tabulated, and which are not 
+    // present in the model.
+    printf("Reading interaction ranges.\n");
+    read_all_interaction_ranges(&cg);
+
+    // The range files have specified which interactions should be
+    // read from file; read the tabulated potentials from table.in
+    // now if any were found.
+    if (cg.pair_nonbonded_interactions.n_tabulated > 0 ||
+        cg.pair_bonded_interactions.n_tabulated > 0 ||
+        cg.angular_interactions.n_tabulated > 0 ||
+        cg.dihedral_interactions.n_tabulated > 0 ||
+		cg.density_interactions.n_tabulated > 0) {
+        printf("Reading tabulated reference potentials.\n");
+        read_tabulated_interaction_file(&cg, cg.topo_data.n_cg_types);
+    } 
+    
     // Use the trajectory type inferred from trajectory file 
     // extensions to specify how the trajectory files should be 
     // read.
-    printf("Beginning to read frames.\n");
-    printf("Finding first frame...\n");
-    frame_source.get_first_frame(&frame_source, cg.topo_data.n_cg_sites, cg.topo_data.cg_site_types);
-	if (frame_source.dynamic_state_sampling == 1) frame_source.sampleTypesFromProbs();
+    // A replayed frame store does not read the trajectory at all, and the
+    // first frame has already been read when ranges were found from it.
+    if ( (control_input.frame_store_style != 2) && (control_input.range_finding_frames == 0) ) {
+    	printf("Beginning to read frames.\n");
+    	printf("Finding first frame...\n");
+    	frame_source.get_first_frame(&frame_source, cg.topo_data.n_cg_sites, cg.topo_data.cg_site_types);
+    	
+    	// Reorder the sites along a space-filling curve for memory 
+    	// locality if the 'site_reordering_style' is set in control.in.
+    	if (frame_source.site_reordering_style != 0) {
+    	    set_up_site_reordering(&frame_source, cg.topo_data.cg_site_types);
+    	    reorder_topology_sites(&cg.topo_data, frame_source.site_order, frame_source.site_rank);
+    	}
+		if (frame_source.dynamic_state_sampling == 1) frame_source.sampleTypesFromProbs();
+	}
 	
     // Assign a host of function pointers in 'cg' new definitions
     // based on matrix implementation, basis set type, etc.
     set_up_force_computers(&cg);
 
+    // Predict the memory use and cost of each matrix_type from the first
+    // frame, then either stop or go on with the recommended configuration.
+    if ( (plan_flag == 1) || (control_input.plan_auto_select_flag == 1) ) {
+    	if (control_input.model_variants_flag == 1) {
+    		printf("Planning is not available with model_variants_flag.\n");
+    		exit(EXIT_FAILURE);
+    	}
+    	if (control_input.frame_store_style == 2) {
+    		printf("Planning needs the first trajectory frame; it is not available when replaying a frame store with frame_store_style 2.\n");
+    		exit(EXIT_FAILURE);
+    	}
+    	printf("Planning FM matrix memory use.\n");
+    	plan_fm_matrix_from_first_frame(&control_input, &cg, &frame_source);
+    	if (plan_flag == 1) {
+    		frame_source.cleanup(&frame_source);
+    		return 0;
+    	}
+    }
+
     // Initialize the force-matching matrix.
     printf("Initializing FM matrix.\n");
     MATRIX_DATA mat(&control_input, &cg);
@@ -124,6 +197,32 @@ int main(int argc, char* argv[])
     	set_bootstrapping_normalization(&mat, frame_source.bootstrapping_weights, frame_source.n_frames);
     }
         
+    // Restore the equations accumulated before an interrupted run.
+    int first_block = 0;
+    if (restart_flag == 1) {
+    	printf("Restarting from checkpoint.out.\n");
+    	first_block = restart_fm_equations(&mat, "checkpoint.out");
+    }
+    
+    // Set up the further models fit from the same trajectory read.
+    std::vector<ModelVariant> variants;
+    if (control_input.model_variants_flag == 1) {
+    	if (restart_flag == 1) {
+    		printf("Model variants cannot be restarted from checkpoint.out.\n");
+    		exit(EXIT_FAILURE);
+    	}
+    	read_model_variants(&control_input, &cg, &frame_source, variants);
+    }
+    
+    // Open frame_store.out to record or replay each frame's equations.
+    if (mat.frame_store_style != 0) {
+    	if ( (restart_flag == 1) && (mat.frame_store_style == 1) ) {
+    		printf("A frame store cannot be recorded by a restarted run.\n");
+    		exit(EXIT_FAILURE);
+    	}
+    	open_frame_store(&mat, cg.topo_data.n_cg_sites, control_input.starting_frame, control_input.n_frames);
+    }
+    
     // Record the dimensions of the matrix after initialization in a
     // solution file.
     FILE* solution_file = open_file("sol_info.out", "w");
@@ -138,7 +237,12 @@ int main(int argc, char* argv[])
     // Process the whole trajectory to build the force-matching matrix
     // of the appropriate type.
     printf("Constructing FM equations.\n");
-    construct_full_fm_matrix(&cg, &mat, &frame_source);
+    if (mat.frame_store_style >= 2) {
+    	replay_full_fm_matrix(&cg, &mat, &frame_source, first_block);
+    } else {
+    	construct_full_fm_matrix(&cg, &mat, &frame_source, first_block, variants);
+    }
+    if (mat.frame_store_style != 0) close_frame_store(&mat);
 
     // Free the space used to build the force-matching matrix that is
     // not necessary for finding a solution to the final matrix
@@ -159,6 +263,7 @@ int main(int argc, char* argv[])
     // coefficients found in the solution step.
     printf("Writing final output.\n"); fflush(stdout);
     write_fm_interaction_output_files(&cg, &mat);
+    if (variants.size() > 0) finish_model_variants(variants);
 	
     // Record the time and print total elapsed time for profiling purposes.
     double end_cputime = clock();
@@ -167,7 +272,7 @@ int main(int argc, char* argv[])
     return 0;
 }
 
-void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source)
+void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source, const int first_block, std::vector<ModelVariant> &variants)
 {
     int n_blocks;
     int read_stat = 1;
@@ -186,15 +291,28 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
     PairCellList pair_cell_list = PairCellList();
     ThreeBCellList three_body_cell_list = ThreeBCellList();
     
-    // Populate the cell linked lists.
-    pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff, frame_source);
-    if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
-    	double max_cutoff = 0.0;
+    // Populate the cell linked lists. With model variants, the lists are searched
+    // once per frame at the largest cutoff of any model and shared by all models.
+    double pair_cutoff = cg->pair_nonbonded_interactions.cutoff;
+    double three_body_cutoff = 0.0;
+    int three_body_flag = (cg->three_body_nonbonded_interactions.class_subtype > 0);
+    if (three_body_flag) {
         for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
-        	max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
+        	three_body_cutoff = fmax(three_body_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
         }
-    three_body_cell_list.init(max_cutoff, frame_source);
     }
+    for (unsigned v = 0; v < variants.size(); v++) {
+    	CG_MODEL_DATA* variant_cg = variants[v].cg;
+    	pair_cutoff = fmax(pair_cutoff, variant_cg->pair_nonbonded_interactions.cutoff);
+    	if (variant_cg->three_body_nonbonded_interactions.class_subtype > 0) {
+    		three_body_flag = 1;
+    		for (int i = 0; i < variant_cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
+    			three_body_cutoff = fmax(three_body_cutoff, variant_cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
+    		}
+    	}
+    }
+    pair_cell_list.init(pair_cutoff, frame_source);
+    if (three_body_flag) three_body_cell_list.init(three_body_cutoff, frame_source);
     
 	// Record this box's dimensions.
 	for (int i = 0; i < frame_source->position_dimension; i++) {
@@ -223,15 +341,31 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
 		n_blocks = total_frame_samples / mat->frames_per_traj_block;
 	}
 
-    mat->accumulation_row_shift = 0;
+    if (first_block == 0) mat->accumulation_row_shift = 0;
+    
+    // When restarting, skip the frames already accumulated in the checkpoint
+    // and read the first frame of the next block.
+    if (first_block > 0) {
+    	int n_skipped_frames = first_block * mat->frames_per_traj_block;
+    	printf("Skipping %d frames already in the checkpoint.\n", n_skipped_frames); fflush(stdout);
+    	for (int i = 0; i < n_skipped_frames - 1; i++) {
+    		if ((*frame_source->get_junk_frame)(frame_source) == 0) {
+    			printf("Failure attempting to skip frame %d. Check the trajectory file for errors.\n", i);
+    			exit(EXIT_FAILURE);
+    		}
+    	}
+    	read_stat = (*frame_source->get_next_frame)(frame_source);
+    	traj_frame_num = n_skipped_frames;
+    }
 
     // For each block of frame samples.
     printf("Entering primary matrix-building loop.\n"); fflush(stdout);
-    for (mat->trajectory_block_index = 0; mat->trajectory_block_index < n_blocks; mat->trajectory_block_index++) {
+    for (mat->trajectory_block_index = first_block; mat->trajectory_block_index < n_blocks; mat->trajectory_block_index++) {
         
         // Wipe the matrix, then calculate the target virial for all frames in this block.
         (*mat->set_fm_matrix_to_zero)(mat);
         add_target_virials_from_trajectory(mat, frame_source->pressure_constraint_rhs_vector);
+        for (unsigned v = 0; v < variants.size(); v++) (*variants[v].mat->set_fm_matrix_to_zero)(variants[v].mat);
 
         // For each frame sample in this block
         for (int trajectory_block_frame_index = 0; trajectory_block_frame_index < mat->frames_per_traj_block; trajectory_block_frame_index++) {
@@ -248,6 +382,7 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
                 int frame_index = mat->trajectory_block_index * mat->frames_per_traj_block + trajectory_block_frame_index;
                 printf("Reweighting entries for frame %d. ", frame_index);
                 mat->current_frame_weight = frame_source->frame_weights[frame_index];
+                for (unsigned v = 0; v < variants.size(); v++) variants[v].mat->current_frame_weight = mat->current_frame_weight;
             }
             
             //Skip processing frame if frame weight is 0.
@@ -268,14 +403,8 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
 	            	// Re-initialize the cell linked lists for finding neighbors in the provided frames;
   					pair_cell_list = PairCellList();
     				three_body_cell_list = ThreeBCellList();
-    				pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff, frame_source);
-    				if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
-        				double max_cutoff = 0.0;
-        				for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
-            				max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
-        				}
-        				three_body_cell_list.init(max_cutoff, frame_source);
-    				}
+    				pair_cell_list.init(pair_cutoff, frame_source);
+    				if (three_body_flag) three_body_cell_list.init(three_body_cutoff, frame_source);
     			
     				// Update the reference_box_half_lengths for this new box size.
     				for (int i = 0; i < frame_source->position_dimension; i++) {
@@ -284,16 +413,24 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
     			}
     			
     			// Modify frame weight if using volume weighting.
-    			if (mat->volume_weighting_flag == 1) {
-    				real* half_lengths = frame_source->frame_config->simulation_box_half_lengths;
-    				double volume = 1.0;
-    				for (int i = 0; i < mat->position_dimension; i++) volume *= 2.0 * half_lengths[i];
-    				mat->current_frame_weight *= volume * volume;
-    			}
+    			real* half_lengths = frame_source->frame_config->simulation_box_half_lengths;
+    			double volume = 1.0;
+    			for (int i = 0; i < mat->position_dimension; i++) volume *= 2.0 * half_lengths[i];
+    			if (mat->volume_weighting_flag == 1) mat->current_frame_weight *= volume * volume;
 				
-				// Process frame information.
+				// Process frame information, recording its equations if requested.
                 FrameConfig* frame_config = frame_source->getFrameConfig();
-    			calculate_frame_fm_matrix(cg, mat, frame_config, pair_cell_list, three_body_cell_list, trajectory_block_frame_index);
+                if (mat->frame_store_style == 1) begin_stored_frame(mat, trajectory_block_frame_index);
+                prepare_frame_cell_lists(frame_config, pair_cell_list, three_body_cell_list, three_body_flag);
+    			calculate_frame_fm_matrix_elements(cg, mat, frame_config, pair_cell_list, three_body_cell_list, trajectory_block_frame_index);
+    			
+    			// Add the same frame to every model variant.
+    			for (unsigned v = 0; v < variants.size(); v++) {
+    				MATRIX_DATA* variant_mat = variants[v].mat;
+    				if (variant_mat->volume_weighting_flag == 1) variant_mat->current_frame_weight *= volume * volume;
+    				calculate_frame_fm_matrix_elements(variants[v].cg, variant_mat, frame_config, pair_cell_list, three_body_cell_list, trajectory_block_frame_index);
+    			}
+    			if (mat->frame_store_style == 1) write_stored_frame(mat, volume, frame_config->f);
             }
 			
             // Read the next frame; the success of this read will be
@@ -329,7 +466,10 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
         printf("\r%d (%d) frames have been sampled. ", frame_source->current_frame_n, (mat->trajectory_block_index + 1) * mat->frames_per_traj_block);
         fflush(stdout);
         (*mat->do_end_of_frameblock_matrix_manipulations)(mat);
+        for (unsigned v = 0; v < variants.size(); v++) (*variants[v].mat->do_end_of_frameblock_matrix_manipulations)(variants[v].mat);
+        checkpoint_fm_equations(mat, n_blocks);
 	}
+	finish_fm_checkpoints(mat);
 
     printf("\nFinishing frame parsing.\n");
     
@@ -337,3 +477,305 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
     frame_source->cleanup(frame_source);
     delete [] ref_box_half_lengths;
 }
+
+// Rebuild the FM equations from the frames in frame_store.out instead of the trajectory.
+// Blocks, frame weights and end-of-block manipulations are the same as in
+// construct_full_fm_matrix, so the equations are those of a run over the trajectory.
+// With frame_store_style 3 the reference forces are read from the trajectory instead.
+
+void replay_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source, const int first_block)
+{
+    int n_blocks;
+    int read_stat = 1;
+    
+    // Only the reference forces are used from the trajectory.
+    if (mat->frame_store_style == 3) frame_source->move_to_start_frame(frame_source);
+    
+    if (mat->matrix_type == kDense) {
+        n_blocks = frame_source->n_frames;
+	    mat->frames_per_traj_block = 1;
+    } else {
+		if (frame_source->n_frames % mat->frames_per_traj_block != 0) {
+			printf("Total number of frame samples %d is not divisible by block size %d.\n", frame_source->n_frames, mat->frames_per_traj_block);
+			exit(EXIT_FAILURE);
+		}
+		n_blocks = frame_source->n_frames / mat->frames_per_traj_block;
+	}
+
+    if (first_block == 0) mat->accumulation_row_shift = 0;
+    
+    // When restarting, skip the frames already accumulated in the checkpoint.
+    if (first_block > 0) {
+    	int n_skipped_frames = first_block * mat->frames_per_traj_block;
+    	printf("Skipping %d frames already in the checkpoint.\n", n_skipped_frames); fflush(stdout);
+    	skip_stored_frames(mat, n_skipped_frames);
+    	if (mat->frame_store_style == 3) {
+    		for (int i = 0; i < n_skipped_frames - 1; i++) {
+    			if ((*frame_source->get_junk_frame)(frame_source) == 0) {
+    				printf("Failure attempting to skip frame %d. Check the trajectory file for errors.\n", i);
+    				exit(EXIT_FAILURE);
+    			}
+    		}
+    		read_stat = (*frame_source->get_next_frame)(frame_source);
+    	}
+    }
+
+    printf("Replaying frames from frame_store.out.\n"); fflush(stdout);
+    for (mat->trajectory_block_index = first_block; mat->trajectory_block_index < n_blocks; mat->trajectory_block_index++) {
+        (*mat->set_fm_matrix_to_zero)(mat);
+
+        for (int trajectory_block_frame_index = 0; trajectory_block_frame_index < mat->frames_per_traj_block; trajectory_block_frame_index++) {
+        	int frame_index = mat->trajectory_block_index * mat->frames_per_traj_block + trajectory_block_frame_index;
+    		if (read_stat == 0) {
+        		printf("Failure reading frame %d (%d). Check trajectory for errors.\n", frame_source->current_frame_n, frame_index);
+        		exit(EXIT_FAILURE);
+    		}
+    		
+            if (frame_source->use_statistical_reweighting) {
+                printf("Reweighting entries for frame %d. ", frame_index);
+                mat->current_frame_weight = frame_source->frame_weights[frame_index];
+            }
+            
+            // Skip the frame's record if its weight is 0.
+            if (frame_source->use_statistical_reweighting && mat->current_frame_weight == 0.0) {
+            	skip_stored_frames(mat, 1);
+            } else if (mat->frame_store_style == 3) {
+            	replay_stored_frame(mat, trajectory_block_frame_index, frame_source->getFrameConfig()->f);
+            } else {
+            	replay_stored_frame(mat, trajectory_block_frame_index, NULL);
+            }
+            
+            if ( (mat->frame_store_style == 3) && ( ((trajectory_block_frame_index + 1) < mat->frames_per_traj_block) ||
+			     ((mat->trajectory_block_index + 1) < n_blocks) ) ) {
+				read_stat = (*frame_source->get_next_frame)(frame_source);  
+			}
+		}
+		
+        printf("\r%d frames have been replayed. ", (mat->trajectory_block_index + 1) * mat->frames_per_traj_block);
+        fflush(stdout);
+        (*mat->do_end_of_frameblock_matrix_manipulations)(mat);
+        checkpoint_fm_equations(mat, n_blocks);
+	}
+	finish_fm_checkpoints(mat);
+
+    printf("\nFinishing frame replay.\n");
+    
+    // Close the trajectory if it was read; otherwise only the frame weights were read.
+    if (mat->frame_store_style == 3) {
+    	frame_source->cleanup(frame_source);
+    } else if (frame_source->use_statistical_reweighting == 1) {
+    	delete [] frame_source->frame_weights;
+    }
+}
+
+// Set up each model listed in model_variants.in from the control.in, top.in, and range
+// and table files in its own directory. All models share the trajectory read by the
+// main model, so they must use the same sites, frames, blocks and frame weights.
+
+void read_model_variants(ControlInputs* const control_input, CG_MODEL_DATA* const cg, FrameSource* const frame_source, std::vector<ModelVariant> &variants)
+{
+	char main_directory[4096];
+	if (getcwd(main_directory, sizeof(main_directory)) == NULL) {
+		printf("Failed to get the working directory.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	FILE* variants_file = open_file("model_variants.in", "r");
+	char directory[4096];
+	while (fscanf(variants_file, "%4095s", directory) == 1) {
+		ModelVariant variant;
+		variant.directory = directory;
+		printf("Setting up model variant in %s.\n", directory);
+		change_directory(directory);
+		
+		variant.control_input = new ControlInputs;
+		ControlInputs* variant_input = variant.control_input;
+		// The virial targets, sampled states and site order are only set up for the main
+		// model, which itself may not use them with model variants.
+		if ( (variant_input->model_variants_flag != 0) || (variant_input->frame_store_style != 0) ||
+			 (variant_input->checkpoint_interval_blocks > 0) || (variant_input->checkpoint_interval_minutes > 0.0) ||
+			 (variant_input->pressure_constraint_flag != 0) || (variant_input->dynamic_state_sampling != 0) || (variant_input->site_reordering_style != 0) ) {
+			printf("Model variant %s cannot set model_variants_flag, frame_store_style, checkpoints, constrain_pressure_flag, dynamic_state_sampling, or site_reordering_style.\n", directory);
+			exit(EXIT_FAILURE);
+		}
+		if ( (variant_input->matrix_type != control_input->matrix_type) || (variant_input->frames_per_traj_block != control_input->frames_per_traj_block) ||
+			 (variant_input->starting_frame != control_input->starting_frame) || (variant_input->n_frames != control_input->n_frames) ||
+			 (variant_input->use_statistical_reweighting != control_input->use_statistical_reweighting) || (variant_input->bootstrapping_flag != control_input->bootstrapping_flag) ||
+			 (variant_input->bootstrapping_num_estimates != control_input->bootstrapping_num_estimates) ) {
+			printf("Model variant %s must use the same matrix_type, block_size, start_frame, n_frames, use_statistical_reweighting, and bootstrapping as the main model.\n", directory);
+			exit(EXIT_FAILURE);
+		}
+		
+		variant.cg = new CG_MODEL_DATA(variant_input);
+		read_topology_file(&variant.cg->topo_data, variant.cg);
+		if (variant.cg->topo_data.n_cg_sites != cg->topo_data.n_cg_sites) {
+			printf("Model variant %s has %d sites; the main model has %d.\n", directory, variant.cg->topo_data.n_cg_sites, cg->topo_data.n_cg_sites);
+			exit(EXIT_FAILURE);
+		}
+		read_all_interaction_ranges(variant.cg);
+		if (variant.cg->pair_nonbonded_interactions.n_tabulated > 0 ||
+		    variant.cg->pair_bonded_interactions.n_tabulated > 0 ||
+		    variant.cg->angular_interactions.n_tabulated > 0 ||
+		    variant.cg->dihedral_interactions.n_tabulated > 0 ||
+		    variant.cg->density_interactions.n_tabulated > 0) {
+		    read_tabulated_interaction_file(variant.cg, variant.cg->topo_data.n_cg_types);
+		}
+		set_up_force_computers(variant.cg);
+		
+		variant.mat = new MATRIX_DATA(variant_input, variant.cg);
+		if (frame_source->use_statistical_reweighting == 1) {
+		    set_normalization(variant.mat, 1.0 / frame_source->total_frame_weights);
+		}
+		if (frame_source->bootstrapping_flag == 1) {
+			set_bootstrapping_normalization(variant.mat, frame_source->bootstrapping_weights, frame_source->n_frames);
+		}
+		FILE* solution_file = open_file("sol_info.out", "w");
+		fprintf(solution_file, "fm_matrix_rows:%d; fm_matrix_columns:%d;\n",
+		        variant.mat->fm_matrix_rows, variant.mat->fm_matrix_columns);
+		fclose(solution_file);
+		
+		variants.push_back(variant);
+		change_directory(main_directory);
+	}
+	fclose(variants_file);
+	printf("Fitting %d model variants in the same pass.\n", (int)(variants.size()));
+}
+
+// Solve each model variant and write its output to its own directory.
+
+void finish_model_variants(std::vector<ModelVariant> &variants)
+{
+	char main_directory[4096];
+	if (getcwd(main_directory, sizeof(main_directory)) == NULL) {
+		printf("Failed to get the working directory.\n");
+		exit(EXIT_FAILURE);
+	}
+	for (unsigned v = 0; v < variants.size(); v++) {
+		printf("Finishing FM for model variant %s.\n", variants[v].directory.c_str()); fflush(stdout);
+		change_directory(variants[v].directory.c_str());
+		variants[v].mat->finish_fm(variants[v].mat);
+		write_fm_interaction_output_files(variants[v].cg, variants[v].mat);
+		change_directory(main_directory);
+		
+		delete variants[v].mat;
+		delete variants[v].cg;
+		delete variants[v].control_input;
+	}
+	variants.clear();
+}
+
+void change_directory(const char* directory)
+{
+	if (chdir(directory) != 0) {
+		printf("Failed to change to directory %s.\n", directory);
+		exit(EXIT_FAILURE);
+	}
+}
+
+void plan_fm_matrix_from_first_frame(ControlInputs* const control_input, CG_MODEL_DATA* const cg, FrameSource* const frame_source)
+{
+	// Record the first frame's equations in a dummy matrix. Options that only
+	// apply to other matrix types are switched off for it.
+	ControlInputs counting_input = *control_input;
+	switch_off_matrix_options(&counting_input);
+	MATRIX_DATA counting_mat(&counting_input, cg);
+	initialize_plan_counting_matrix(&counting_mat, cg);
+	
+	PairCellList pair_cell_list = PairCellList();
+	ThreeBCellList three_body_cell_list = ThreeBCellList();
+	pair_cell_list.init(cg->pair_nonbonded_interactions.cutoff, frame_source);
+	if (cg->three_body_nonbonded_interactions.class_subtype > 0) {
+		double max_cutoff = 0.0;
+		for (int i = 0; i < cg->three_body_nonbonded_interactions.get_n_defined(); i++) {
+			max_cutoff = fmax(max_cutoff, cg->three_body_nonbonded_interactions.three_body_nonbonded_cutoffs[i]);
+		}
+		three_body_cell_list.init(max_cutoff, frame_source);
+	}
+	calculate_frame_fm_matrix(cg, &counting_mat, frame_source->getFrameConfig(), pair_cell_list, three_body_cell_list, 0);
+	
+	plan_fm_matrix(&counting_mat, control_input, cg);
+}
+
+// Find the interaction ranges sampled in the first range_finding_frames frames as
+// rangefinder does and write them to rmin.in and rmin_b.in. The frames are cached
+// and provided again to build the FM equations, after which the rest of the
+// trajectory is read, so the trajectory is only read once.
+
+void find_ranges_from_leading_frames(ControlInputs* const control_input, FrameSource* const frame_source)
+{
+	int n_range_frames = control_input->range_finding_frames;
+	if (n_range_frames > frame_source->n_frames) {
+		printf("range_finding_frames (%d) is larger than n_frames (%d).\n", n_range_frames, frame_source->n_frames);
+		exit(EXIT_FAILURE);
+	}
+	if ( (frame_source->dynamic_types != 0) || (frame_source->dynamic_state_sampling != 0) || (frame_source->site_reordering_style != 0) || (control_input->three_body_flag != 0) ) {
+		printf("range_finding_frames is not available with dynamic_types, dynamic_state_sampling, site_reordering_style, or three-body interactions.\n");
+		exit(EXIT_FAILURE);
+	}
+	
+	// Range finding uses its own model, whose interaction computers
+	// record the sampled ranges instead of matrix elements.
+	printf("Finding interaction ranges from the first %d frames.\n", n_range_frames);
+	CG_MODEL_DATA range_cg(control_input);
+	read_topology_file(&range_cg.topo_data, &range_cg);
+	initialize_range_finding_temps(&range_cg);
+	ControlInputs range_input = *control_input;
+	switch_off_matrix_options(&range_input);
+	MATRIX_DATA range_mat(&range_input, &range_cg);
+	
+	frame_source->move_to_start_frame(frame_source);
+	PairCellList pair_cell_list = PairCellList();
+	ThreeBCellList three_body_cell_list = ThreeBCellList();
+	pair_cell_list.init(range_cg.pair_nonbonded_interactions.cutoff, frame_source);
+	double ref_box_half_lengths[DIMENSION];
+	for (int i = 0; i < DIMENSION; i++) ref_box_half_lengths[i] = frame_source->frame_config->simulation_box_half_lengths[i];
+	
+	for (int frame_index = 0; frame_index < n_range_frames; frame_index++) {
+		if ( (frame_index > 0) && ((*frame_source->get_next_frame)(frame_source) == 0) ) {
+			printf("Failure reading frame %d (%d). Check trajectory for errors.\n", frame_source->current_frame_n, frame_index);
+			exit(EXIT_FAILURE);
+		}
+		cache_current_frame(frame_source);
+		
+		// Frames with zero weight are not used for ranges, as in rangefinder.
+		if ( (frame_source->use_statistical_reweighting == 1) && (frame_source->frame_weights[frame_index] == 0.0) ) continue;
+		
+		int box_change = 0;
+		for (int i = 0; i < DIMENSION; i++) {
+			if ( fabs(ref_box_half_lengths[i] - frame_source->frame_config->simulation_box_half_lengths[i]) > VERYSMALL_F ) box_change = 1;
+		}
+		if (box_change == 1) {
+			pair_cell_list = PairCellList();
+			pair_cell_list.init(range_cg.pair_nonbonded_interactions.cutoff, frame_source);
+			for (int i = 0; i < DIMENSION; i++) ref_box_half_lengths[i] = frame_source->frame_config->simulation_box_half_lengths[i];
+		}
+		calculate_frame_fm_matrix(&range_cg, &range_mat, frame_source->getFrameConfig(), pair_cell_list, three_body_cell_list, 0);
+	}
+	
+	printf("Writing interaction ranges to rmin.in and rmin_b.in.\n");
+	write_range_files(&range_cg, &range_mat);
+	free_name(&range_cg);
+	replay_frame_cache(frame_source);
+}
+
+// Switch off the options of control_input that do not apply to a dummy matrix.
+
+void switch_off_matrix_options(ControlInputs* const dummy_input)
+{
+	dummy_input->matrix_type = kDummy;
+	dummy_input->frames_per_traj_block = 1;
+	dummy_input->bootstrapping_flag = 0;
+	dummy_input->output_normal_equations_rhs_flag = 0;
+	dummy_input->normal_summation_style = 0;
+	dummy_input->frame_normal_form_precision = 0;
+	dummy_input->accumulation_accuracy_report_flag = 0;
+	dummy_input->block_pipeline_depth = 0;
+	dummy_input->checkpoint_interval_blocks = 0;
+	dummy_input->checkpoint_interval_minutes = 0.0;
+	dummy_input->regularization_path_flag = 0;
+	dummy_input->regularization_style = 0;
+	dummy_input->normal_matrix_storage_style = 0;
+	dummy_input->frame_store_style = 0;
+	dummy_input->model_variants_flag = 0;
+	dummy_input->range_finding_frames = 0;
+}
@@ -46,16 +46,21 @@ void write_one_body_iclass_range_specifications(InteractionClassComputer* const
 void write_single_range_specification(InteractionClassComputer* const icomp, char **name, MATRIX_DATA* const mat, FILE* const solution_spline_output_file, const int index_among_defined);
 
 void read_density_parameter_file(DensityClassSpec* const ispec);
-void read_interaction_file_and_build_matrix(MATRIX_DATA* mat, InteractionClassComputer* const icomp, double volume, TopologyData* const topo_data, char ** const name);
-void read_one_param_dist_file_pair(InteractionClassComputer* const icomp, char ** const name, MATRIX_DATA* mat, const int index_among_defined_intrxns, int &counter, double num_of_pairs, double volume);
-void read_one_param_dist_file_other(InteractionClassComputer* const icomp, char ** const name, MATRIX_DATA* mat, const int index_among_defined_intrxns, int &counter, double num_of_pairs);
+void build_BI_systems_for_class(MATRIX_DATA* mat, InteractionClassComputer* const icomp, double volume, TopologyData* const topo_data, char ** const name);
+void build_one_pair_BI_system(InteractionClassComputer* const icomp, char ** const name, MATRIX_DATA* mat, const int index_among_defined_intrxns, double num_of_pairs, double volume);
+void build_one_other_BI_system(InteractionClassComputer* const icomp, char ** const name, MATRIX_DATA* mat, const int index_among_defined_intrxns, double num_of_pairs);
+inline int start_BI_system(InteractionClassComputer* const icomp, MATRIX_DATA* mat, const int index_among_defined_intrxns, const int num_entries);
 
 // Output parameter distribution functions
 void open_parameter_distribution_files_for_class(InteractionClassComputer* const icomp, char **name); 
 void close_parameter_distribution_files_for_class(InteractionClassComputer* const icomp);
-void remove_dist_files(InteractionClassComputer* const icomp, char **name);
+inline void record_parameter_sample(InteractionClassSpec* const ispec, const int index_among_defined, const double param);
 void generate_parameter_distribution_histogram(InteractionClassComputer* const icomp, char **name);
 
+// Range trimming functions
+void trim_range_to_sampled_quantiles(InteractionClassSpec* const ispec, const int index_among_defined);
+unsigned long count_samples_between(const ParameterHistogram &histogram, const double lower, const double upper);
+
 // Dummy implementations
 void do_not_initialize_fm_matrix(MATRIX_DATA* const mat);
 
@@ -157,11 +162,13 @@ void initialize_single_class_range_finding_temps(InteractionClassSpec *iclass, I
     initialize_ranges(iclass->get_n_defined(), iclass->lower_cutoffs, iclass->upper_cutoffs, iclass->defined_to_matched_intrxn_index_map);
     iclass->n_to_force_match = iclass->get_n_defined();
     iclass->interaction_column_indices = std::vector<unsigned>(iclass->n_to_force_match + 1);
+    if (iclass->class_type != kDensity) icomp->set_up_type_index_table();
 	
 	char** name = select_name(iclass, topo_data->name);
-	if(iclass->output_parameter_distribution == 1 || iclass->output_parameter_distribution == 2 ){
+	if(iclass->output_parameter_distribution == 1 || iclass->output_parameter_distribution == 2 || iclass->trims_ranges() ){
 		if (iclass->class_type == kPairNonbonded || iclass->class_type == kPairBonded || 
-		           iclass->class_type == kAngularBonded || iclass->class_type == kDihedralBonded) {
+		           iclass->class_type == kAngularBonded || iclass->class_type == kDihedralBonded ||
+		           (iclass->class_type == kDensity && iclass->class_subtype > 0) ) {
 		    open_parameter_distribution_files_for_class(icomp, name);
 		} else {
 			// do nothing here
@@ -169,6 +176,23 @@ void initialize_single_class_range_finding_temps(InteractionClassSpec *iclass, I
 	}
 }
 
+void merge_range_finding_temps(CG_MODEL_DATA* const cg, CG_MODEL_DATA* const thread_cg)
+{
+	std::list<InteractionClassSpec*>::iterator iclass_iterator;
+	std::list<InteractionClassSpec*>::iterator thread_iclass_iterator;
+	for(iclass_iterator = cg->iclass_list.begin(), thread_iclass_iterator = thread_cg->iclass_list.begin(); iclass_iterator != cg->iclass_list.end(); iclass_iterator++, thread_iclass_iterator++) {
+		InteractionClassSpec* iclass = *iclass_iterator;
+		InteractionClassSpec* thread_iclass = *thread_iclass_iterator;
+		for (int i = 0; i < iclass->get_n_defined(); i++) {
+			if (iclass->lower_cutoffs[i] > thread_iclass->lower_cutoffs[i]) iclass->lower_cutoffs[i] = thread_iclass->lower_cutoffs[i];
+			if (iclass->upper_cutoffs[i] < thread_iclass->upper_cutoffs[i]) iclass->upper_cutoffs[i] = thread_iclass->upper_cutoffs[i];
+			if (iclass->parameter_histograms != NULL) iclass->parameter_histograms[i].merge(thread_iclass->parameter_histograms[i]);
+		}
+		delete [] thread_iclass->parameter_histograms;
+		thread_iclass->parameter_histograms = NULL;
+	}
+}
+
 void report_unrecognized_class_subtype(InteractionClassSpec *iclass)
 {
 	printf("Unrecognized %s class subtype!\n", iclass->get_full_name().c_str());
@@ -297,11 +321,11 @@ void calc_isotropic_two_body_sampling_range(InteractionClassComputer* const icom
     if (icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] > param) icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] = param;
     if (icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] < param) icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] = param;
 	
-	if (icomp->ispec->output_parameter_distribution == 1 || icomp->ispec->output_parameter_distribution == 2) {
+	if (icomp->ispec->parameter_histograms != NULL) {
 		if (icomp->ispec->class_type == kPairBonded || icomp->ispec->class_type == kAngularBonded || icomp->ispec->class_type == kDihedralBonded) {
-			fprintf(icomp->ispec->output_range_file_handles[icomp->index_among_defined_intrxns], "%lf\n", param);
+			record_parameter_sample(icomp->ispec, icomp->index_among_defined_intrxns, param);
 		} else if( (icomp->ispec->class_type == kPairNonbonded) && (param < icomp->ispec->cutoff)) {
-		 	fprintf(icomp->ispec->output_range_file_handles[icomp->index_among_defined_intrxns], "%lf\n", param);
+		 	record_parameter_sample(icomp->ispec, icomp->index_among_defined_intrxns, param);
 		}
 	}
 }
@@ -315,7 +339,7 @@ void calc_angular_three_body_sampling_range(InteractionClassComputer* const icom
     if (icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] > param) icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] = param;
     if (icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] < param) icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] = param;
 	
-	if (icomp->ispec->output_parameter_distribution == 1 || icomp->ispec->output_parameter_distribution == 2) fprintf(icomp->ispec->output_range_file_handles[icomp->index_among_defined_intrxns], "%lf\n", param);
+	if (icomp->ispec->parameter_histograms != NULL) record_parameter_sample(icomp->ispec, icomp->index_among_defined_intrxns, param);
 }
 
 void calc_dihedral_four_body_interaction_sampling_range(InteractionClassComputer* const icomp, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
@@ -332,7 +356,7 @@ void calc_dihedral_four_body_interaction_sampling_range(InteractionClassComputer
     if (icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] > param) icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] = param;
     if (icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] < param) icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] = param;
 	
-	if (icomp->ispec->output_parameter_distribution == 1 || icomp->ispec->output_parameter_distribution == 2) fprintf(icomp->ispec->output_range_file_handles[icomp->index_among_defined_intrxns], "%lf\n", param);
+	if (icomp->ispec->parameter_histograms != NULL) record_parameter_sample(icomp->ispec, icomp->index_among_defined_intrxns, param);
 }
 
 void evaluate_density_sampling_range(InteractionClassComputer* const info, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat)
@@ -344,7 +368,7 @@ void evaluate_density_sampling_range(InteractionClassComputer* const info, std::
 	if (icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] > param) icomp->ispec->lower_cutoffs[icomp->index_among_defined_intrxns] = param;
     if (icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] < param) icomp->ispec->upper_cutoffs[icomp->index_among_defined_intrxns] = param;
 	
-	if (icomp->ispec->output_parameter_distribution == 1 || icomp->ispec->output_parameter_distribution == 2) fprintf(icomp->ispec->output_range_file_handles[icomp->index_among_defined_intrxns], "%lf\n", param);
+	if (icomp->ispec->parameter_histograms != NULL) record_parameter_sample(icomp->ispec, icomp->index_among_defined_intrxns, param);
 }
 
 void calc_nothing(InteractionClassComputer* const icomp, std::array<double, DIMENSION>* const &x, const real *simulation_box_half_lengths, MATRIX_DATA* const mat) {
@@ -393,19 +417,10 @@ void write_iclass_range_specifications(InteractionClassComputer* const icomp, ch
         }
     }
 	
-	if (iclass->output_parameter_distribution == 1 || iclass->output_parameter_distribution == 2) {
-		if(iclass->class_type == kDensity && iclass->class_subtype > 0) {
-			close_parameter_distribution_files_for_class(icomp);
-			generate_parameter_distribution_histogram(icomp, name); // name is set correctly in write_interaction_range_data_to_file
-			remove_dist_files(icomp, name);
-		} else if (iclass->class_type == kPairNonbonded || iclass->class_type == kPairBonded || 
-		           iclass->class_type == kAngularBonded || iclass->class_type == kDihedralBonded) {
-			close_parameter_distribution_files_for_class(icomp);
-			generate_parameter_distribution_histogram(icomp, name);
-			remove_dist_files(icomp, name);
-		} else {
-			// do nothing for these
-		}
+	if (iclass->parameter_histograms != NULL) {
+		// name is set correctly in write_interaction_range_data_to_file
+		if (iclass->output_parameter_distribution == 1 || iclass->output_parameter_distribution == 2) generate_parameter_distribution_histogram(icomp, name);
+		close_parameter_distribution_files_for_class(icomp);
 	}
 }
 
@@ -426,6 +441,8 @@ void write_single_range_specification(InteractionClassComputer* const icomp, cha
 	
 	fprintf(solution_spline_output_file, "%s ", basename.c_str());
 
+	if (ispec->parameter_histograms != NULL && ispec->trims_ranges()) trim_range_to_sampled_quantiles(ispec, index_among_defined);
+
     if (fabs(ispec->upper_cutoffs[index_among_defined] + VERYLARGE) < VERYSMALL_F) {
         ispec->upper_cutoffs[index_among_defined] = -1.0;
         ispec->lower_cutoffs[index_among_defined] = -1.0;
@@ -485,13 +502,24 @@ void read_density_parameter_file(DensityClassSpec* const ispec)
 	delete [] elements;
 }
 
+// Set up a histogram of sampled values for each interaction of the class; with
+// output_*_parameter_distribution 2, the sampled values are also written to .dist files.
+// The histogram grid divides each .hist bin (half the FM binwidth) into
+// PARAMETER_HISTOGRAM_SUBDIVISIONS bins, since the .hist bins are only fixed
+// once the range is known.
+
 void open_parameter_distribution_files_for_class(InteractionClassComputer* const icomp, char **name) 
 {
 	// The correct name is selected in calling function initialize_single_class_range_finding_temps
     InteractionClassSpec* ispec = icomp->ispec;
 	std::string filename;
-	ispec->output_range_file_handles = new FILE*[ispec->get_n_defined()];
+	ispec->parameter_histograms = new ParameterHistogram[ispec->get_n_defined()];
+	for (int i = 0; i < ispec->get_n_defined(); i++) {
+		ispec->parameter_histograms[i].bin_width = 0.5 * ispec->get_fm_binwidth() / (double)(PARAMETER_HISTOGRAM_SUBDIVISIONS);
+	}
+	if (ispec->output_parameter_distribution != 2) return;
 	
+	ispec->output_range_file_handles = new FILE*[ispec->get_n_defined()];
 	for (int i = 0; i < ispec->get_n_defined(); i++) {
 	 	filename = ispec->get_basename(name, i,  "_") + ".dist";
   		ispec->output_range_file_handles[i] = open_file(filename.c_str(), "w");
@@ -501,23 +529,19 @@ void open_parameter_distribution_files_for_class(InteractionClassComputer* const
 void close_parameter_distribution_files_for_class(InteractionClassComputer* const icomp) 
 {
     InteractionClassSpec* ispec = icomp->ispec;	
+	delete [] ispec->parameter_histograms;
+	ispec->parameter_histograms = NULL;
+	if (ispec->output_parameter_distribution != 2) return;
 	for (int i = 0; i < ispec->get_n_defined(); i++) {
 		fclose(ispec->output_range_file_handles[i]);
 	}
 	delete [] ispec->output_range_file_handles;
 }
 
-void remove_dist_files(InteractionClassComputer* const icomp, char **name) 
+inline void record_parameter_sample(InteractionClassSpec* const ispec, const int index_among_defined, const double param)
 {
-	// Name is selected in calling function 2x up named write_interaction_range_data_to_file.
-    InteractionClassSpec* ispec = icomp->ispec;	
-    if(ispec->output_parameter_distribution != 1) return;
-    for (int i = 0; i < ispec->get_n_defined(); i++) {
-		// get name of dist file
-		std::string filename = ispec->get_basename(name, i, "_") + ".dist";
-		// remove file
-		remove(filename.c_str());
-	}
+	ispec->parameter_histograms[index_among_defined].add(param);
+	if (ispec->output_parameter_distribution == 2) fprintf(ispec->output_range_file_handles[index_among_defined], "%lf\n", param);
 }
 
 void generate_parameter_distribution_histogram(InteractionClassComputer* const icomp, char **name)
@@ -526,13 +550,12 @@ void generate_parameter_distribution_histogram(InteractionClassComputer* const i
     InteractionClassSpec* ispec = icomp->ispec;	
 	
 	std::string filename;
-	std::ifstream dist_stream;
 	std::ofstream hist_stream;
 	int num_bins = 0;
 	int	curr_bin;
 	double value; 
-	double* bin_centers;
-	unsigned long* bin_counts;
+	delete [] ispec->parameter_distributions;
+	ispec->parameter_distributions = new ParameterDistribution[ispec->get_n_defined()];
 	for (int i = 0; i < ispec->get_n_defined(); i++) {
 		
 		// Set-up histogram based on interaction binwidth
@@ -542,52 +565,115 @@ void generate_parameter_distribution_histogram(InteractionClassComputer* const i
 	     ispec->adjust_cutoffs_for_basis(i);
 		 num_bins = ( 2 * (int)( (ispec->upper_cutoffs[i] - ispec->lower_cutoffs[i]) / ispec->get_fm_binwidth() + 0.5 ));
 		}
-		bin_centers = new double[num_bins]();
-        bin_counts = new unsigned long[num_bins]();
+		// Keep the histogram for Boltzmann inversion.
+		std::vector<double> &bin_centers = ispec->parameter_distributions[i].bin_centers;
+		std::vector<unsigned long> &bin_counts = ispec->parameter_distributions[i].bin_counts;
+		bin_centers.resize(num_bins);
+		bin_counts.resize(num_bins, 0);
         
         bin_centers[0] = ispec->lower_cutoffs[i] + 0.25 * ispec->get_fm_binwidth();
         for (int j = 1; j < num_bins; j++) {
 	      bin_centers[j] = bin_centers[j - 1] + (0.5 * ispec->get_fm_binwidth());
         }
 		
-		// Open distribution file
-	 	filename = ispec->get_basename(name, i, "_") + ".dist";
-		check_and_open_in_stream(dist_stream, filename.c_str()); 
-		
-		// Populate histogram by reading distribution file
-		dist_stream >> value;
-		while (!dist_stream.fail()) {
+		// Populate histogram by adding the counts of the grid bins whose centers
+		// fall in each histogram bin.
+		ParameterHistogram &histogram = ispec->parameter_histograms[i];
+		for (unsigned j = 0; j < histogram.counts.size(); j++) {
+			if (histogram.counts[j] == 0) continue;
+			value = ((double)(histogram.first_bin + (int)(j)) + 0.5) * histogram.bin_width;
 		  curr_bin = (int)(floor((value - ispec->lower_cutoffs[i] + VERYSMALL_F) / (0.5 * ispec->get_fm_binwidth())));	
 			if( (curr_bin < num_bins) && (curr_bin >= 0) ) {
-				bin_counts[curr_bin]++;
-			} else if (curr_bin > num_bins) {
+				bin_counts[curr_bin] += histogram.counts[j];
+			} else if (curr_bin > num_bins && !ispec->trims_ranges()) {
 				printf("Warning: Bin %d is out-of-bounds. Array size: %d\n", curr_bin, num_bins);
 				fflush(stdout);
 			}
-			dist_stream >> value;
 		}
 
-		// Write histogram to file
+		// Write histogram to file. The kept bin centers are rounded to the
+		// precision written, as Boltzmann inversion used to read them from this file.
 		filename = ispec->get_basename(name, i, "_") + ".hist";
 		hist_stream.open(filename, std::ofstream::out);
 		hist_stream << "#center\tcounts\n";
 		for (int j = 0; j < num_bins; j++) {
+			char center_text[32];
+			snprintf(center_text, sizeof(center_text), "%g", bin_centers[j]);
+			sscanf(center_text, "%lf", &bin_centers[j]);
 			hist_stream << bin_centers[j] << "\t" << bin_counts[j] << "\n";
 		}
 		
 		// Close files
 		hist_stream.close();
-		dist_stream.close();
-		delete [] bin_centers;
-		delete [] bin_counts;
 	}
 }
 
+// Narrow the sampled range of an interaction using its histogram: first to the
+// range_lower_quantile and range_upper_quantile of the sampled values, then by
+// whole FM bins at either end holding fewer than range_min_bin_count samples.
+// The upper end of pair nonbonded ranges is left at the sampled maximum, since
+// it is set by the nonbonded cutoff.
+
+void trim_range_to_sampled_quantiles(InteractionClassSpec* const ispec, const int index_among_defined)
+{
+	ParameterHistogram &histogram = ispec->parameter_histograms[index_among_defined];
+	int n_grid_bins = (int)(histogram.counts.size());
+	unsigned long total_samples = 0;
+	for (int j = 0; j < n_grid_bins; j++) total_samples += histogram.counts[j];
+	if (total_samples == 0) return;
+	
+	// Find the first and last grid bins holding the desired quantiles.
+	unsigned long cumulative_samples = 0;
+	int first_kept = 0;
+	for (first_kept = 0; first_kept < n_grid_bins - 1; first_kept++) {
+		cumulative_samples += histogram.counts[first_kept];
+		if ((double)(cumulative_samples) > ispec->range_lower_quantile * (double)(total_samples)) break;
+	}
+	cumulative_samples = 0;
+	int last_kept = n_grid_bins - 1;
+	for (last_kept = n_grid_bins - 1; last_kept > first_kept; last_kept--) {
+		cumulative_samples += histogram.counts[last_kept];
+		if ((double)(cumulative_samples) > (1.0 - ispec->range_upper_quantile) * (double)(total_samples)) break;
+	}
+	
+	double lower = fmax(ispec->lower_cutoffs[index_among_defined], (double)(histogram.first_bin + first_kept) * histogram.bin_width);
+	double upper = ispec->upper_cutoffs[index_among_defined];
+	if (ispec->class_type != kPairNonbonded) upper = fmin(upper, (double)(histogram.first_bin + last_kept + 1) * histogram.bin_width);
+	
+	// Drop sparsely sampled FM bins from the ends of the range.
+	if (ispec->range_min_bin_count > 0) {
+		double binwidth = ispec->get_fm_binwidth();
+		while (upper - lower > binwidth && count_samples_between(histogram, lower, lower + binwidth) < (unsigned long)(ispec->range_min_bin_count)) {
+			lower += binwidth;
+		}
+		while (ispec->class_type != kPairNonbonded && upper - lower > binwidth && count_samples_between(histogram, upper - binwidth, upper) < (unsigned long)(ispec->range_min_bin_count)) {
+			upper -= binwidth;
+		}
+	}
+	ispec->lower_cutoffs[index_among_defined] = lower;
+	ispec->upper_cutoffs[index_among_defined] = upper;
+}
+
+// Count the samples in grid bins with centers in [lower, upper).
+
+unsigned long count_samples_between(const ParameterHistogram &histogram, const double lower, const double upper)
+{
+	unsigned long n_samples = 0;
+	for (unsigned j = 0; j < histogram.counts.size(); j++) {
+		double center = ((double)(histogram.first_bin + (int)(j)) + 0.5) * histogram.bin_width;
+		if (center >= lower && center < upper) n_samples += histogram.counts[j];
+	}
+	return n_samples;
+}
+
+// Boltzmann invert the parameter distributions kept in memory by
+// generate_parameter_distribution_histogram. Each interaction gets its own
+// small least squares system, and the systems are solved together at the end.
+
 void calculate_BI(CG_MODEL_DATA* const cg, MATRIX_DATA* mat, FrameSource* const fs)
 {
   initialize_first_BI_matrix(mat, cg);
   double volume = calculate_volume(fs->simulation_box_limits);
-  int solution_counter = 0;
   std::list<InteractionClassComputer*>::iterator icomp_iterator;
   for(icomp_iterator = cg->icomp_list.begin(); icomp_iterator != cg->icomp_list.end(); icomp_iterator++) {
     // For every defined interaction, 
@@ -596,26 +682,18 @@ void calculate_BI(CG_MODEL_DATA* const cg, MATRIX_DATA* mat, FrameSource* const
     
     // These interactions do not generate parameter distributions
     if((*icomp_iterator)->ispec->class_type == kThreeBodyNonbonded) continue;
-  
-  	// swap out icci so that matrix does not go out of bounds
-  	int icci = (*icomp_iterator)->interaction_class_column_index;
-  	(*icomp_iterator)->interaction_class_column_index = 0;
+    if((*icomp_iterator)->ispec->parameter_distributions == NULL) continue;
   	
-  	// Do BI for this interaction
+  	// Build BI equations for this interaction class
   	char** name = select_name((*icomp_iterator)->ispec, cg->name);
-    initialize_next_BI_matrix(mat, (*icomp_iterator));
-    read_interaction_file_and_build_matrix(mat, (*icomp_iterator), volume, &cg->topo_data, name);
-    solve_this_BI_equation(mat, solution_counter);
-    
-    // restore icci
-    (*icomp_iterator)->interaction_class_column_index = icci;
+    build_BI_systems_for_class(mat, (*icomp_iterator), volume, &cg->topo_data, name);
   }
+  solve_BI_systems(mat);
 }
 
-void read_interaction_file_and_build_matrix(MATRIX_DATA* mat, InteractionClassComputer* const icomp, double volume, TopologyData* topo_data, char ** const name)
+void build_BI_systems_for_class(MATRIX_DATA* mat, InteractionClassComputer* const icomp, double volume, TopologyData* topo_data, char ** const name)
 { 
   // Name is correctly selected by calling function calculate_BI.
-  int counter = 0;
   int* sitecounter;
   if (icomp->ispec->class_type == kPairNonbonded) {
     sitecounter = new int[topo_data->n_cg_types]();
@@ -624,6 +702,7 @@ void read_interaction_file_and_build_matrix(MATRIX_DATA* mat, InteractionClassCo
       sitecounter[type-1]++;
     }
   }
+  unsigned first_system = mat->BI_systems.size();
     
   // Otherwise, process the data
   for (unsigned i = 0; i < icomp->ispec->defined_to_matched_intrxn_index_map.size(); i++) {
@@ -636,48 +715,69 @@ void read_interaction_file_and_build_matrix(MATRIX_DATA* mat, InteractionClassCo
 	    num_pairs -= sitecounter[type_vector[0]-1];
 	  	num_pairs /= 2.0;
 	  }
-	  read_one_param_dist_file_pair(icomp, name, mat, i, counter,num_pairs, volume);
+	  build_one_pair_BI_system(icomp, name, mat, i, num_pairs, volume);
 	} else if ( icomp->ispec->class_type == kPairBonded ) {
-	  read_one_param_dist_file_pair(icomp, name, mat, i, counter, 1.0, 1.0);
+	  build_one_pair_BI_system(icomp, name, mat, i, 1.0, 1.0);
 	} else {
-	  read_one_param_dist_file_other(icomp, name, mat, i, counter, 1.0);
+	  build_one_other_BI_system(icomp, name, mat, i, 1.0);
 	}
-  }  
+  }
+  
+  int n_rows = 0;
+  for (unsigned k = first_system; k < mat->BI_systems.size(); k++) n_rows += mat->BI_systems[k].rows;
+  printf("%s matrix rows = %d, cols = %d\n", icomp->ispec->get_full_name().c_str(), n_rows, icomp->ispec->get_num_basis_func()); fflush(stdout);
+  if (mat->output_BI_equations_flag == 1) write_BI_equations(mat, first_system, icomp->interaction_class_column_index, icomp->ispec->get_num_basis_func());
+  
   if (icomp->ispec->class_type == kPairNonbonded) {
     delete [] sitecounter;
   }
 }
 
-// Read this hist file to process into Boltzmann inverted potential.
+// Start the BI system for the current interaction with a row for each of the first
+// num_entries bins of its distribution and a column for each of its basis functions.
+// Returns the number of rows.
+
+inline int start_BI_system(InteractionClassComputer* const icomp, MATRIX_DATA* mat, const int index_among_defined_intrxns, const int num_entries)
+{
+  int rows = std::min(num_entries, (int)(icomp->ispec->parameter_distributions[index_among_defined_intrxns].bin_centers.size()));
+  int first_column = icomp->ispec->interaction_column_indices[icomp->index_among_matched_interactions - 1];
+  int columns = icomp->ispec->interaction_column_indices[icomp->index_among_matched_interactions] - first_column;
+  initialize_next_BI_system(mat, rows, columns, icomp->interaction_class_column_index + first_column);
+  return rows;
+}
+
+// Boltzmann invert this interaction's distribution.
 // At the same time, output an RDF file (r, g(r)).
 
-void read_one_param_dist_file_pair(InteractionClassComputer* const icomp, char** const name, MATRIX_DATA* mat, const int index_among_defined_intrxns, int &counter, double num_of_pairs, double volume)
+void build_one_pair_BI_system(InteractionClassComputer* const icomp, char** const name, MATRIX_DATA* mat, const int index_among_defined_intrxns, double num_of_pairs, double volume)
 {
   // name is corrected selected by calling function 2x up named calculate_BI.
-  std::string filename = icomp->ispec->get_basename(name, index_among_defined_intrxns, "_") + ".hist";
   std::string rdf_name = icomp->ispec->get_basename(name, index_among_defined_intrxns, "_") + ".rdf";
-  FILE* curr_dist_input_file = open_file(filename.c_str(), "r");
   FILE* rdf_file = open_file(rdf_name.c_str(), "w");
   fprintf(rdf_file, "# r gofr\n"); // header.
   
-  int i, counts;
+  int i;
+  unsigned long counts;
   int *junk;
   double PI = 3.1415926;
   double r, potential;
   
-  if (icomp->ispec->upper_cutoffs[index_among_defined_intrxns] == -1.0) return; // There is no sampling here
+  if (icomp->ispec->upper_cutoffs[index_among_defined_intrxns] == -1.0) { // There is no sampling here
+    fclose(rdf_file);
+    return;
+  }
   
   int num_entries = (2 * (int)((icomp->ispec->upper_cutoffs[index_among_defined_intrxns] - icomp->ispec->lower_cutoffs[index_among_defined_intrxns])/icomp->ispec->get_fm_binwidth() + 0.5));
-  fflush(stdout);
+  num_entries = start_BI_system(icomp, mat, index_among_defined_intrxns, num_entries);
+  ParameterDistribution &distribution = icomp->ispec->parameter_distributions[index_among_defined_intrxns];
   
-  std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[num_entries - 1];
-  char buffer[100];
-  fgets(buffer,100,curr_dist_input_file); 
+  std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[num_entries];
   for(i = 0; i < num_entries; i++)
     {
       int first_nonzero_basis_index;
       double normalized_counts;
-      fscanf(curr_dist_input_file,"%lf %d\n",&r,&counts);
+      r = distribution.bin_centers[i];
+      counts = distribution.bin_counts[i];
       if (counts > 0) {
         double dr = r - 0.5 * icomp->ispec->get_fm_binwidth();
       	normalized_counts = (double)(counts) * 3.0 / ( 4.0*PI*( r*r*r - dr*dr*dr) );
@@ -695,40 +795,40 @@ void read_one_param_dist_file_pair(InteractionClassComputer* const icomp, char**
       fprintf(rdf_file, "%lf %lf\n", r, normalized_counts);
 
       icomp->fm_s_comp->calculate_basis_fn_vals(index_among_defined_intrxns, r, first_nonzero_basis_index, icomp->fm_basis_fn_vals);
-      mat->accumulate_matching_forces(icomp, first_nonzero_basis_index, icomp->fm_basis_fn_vals, counter, junk, derivatives, mat);
-      mat->accumulate_target_force_element(mat, counter, &potential);
-      counter++;
+      mat->accumulate_matching_forces(icomp, first_nonzero_basis_index, icomp->fm_basis_fn_vals, i, junk, derivatives, mat);
+      mat->accumulate_target_force_element(mat, i, &potential);
     }
   delete [] derivatives;
-  fclose(curr_dist_input_file);
   fclose(rdf_file);
 }
 
-void read_one_param_dist_file_other(InteractionClassComputer* const icomp, char** const name, MATRIX_DATA* mat, const int index_among_defined_intrxns, int &counter, double num_of_pairs)
+void build_one_other_BI_system(InteractionClassComputer* const icomp, char** const name, MATRIX_DATA* mat, const int index_among_defined_intrxns, double num_of_pairs)
 {
   // name is corrected selected by calling function 2x up named calculate_BI.
-  std::string filename = icomp->ispec->get_basename(name, index_among_defined_intrxns,  "_") + ".hist";
   std::string rdf_name = icomp->ispec->get_basename(name, index_among_defined_intrxns, "_") + ".rdf";
-  FILE* curr_dist_input_file = open_file(filename.c_str(), "r");
   FILE* rdf_file = open_file(rdf_name.c_str(), "w");
   fprintf(rdf_file, "# r gofr\n"); // header.
   
-  int counts;
+  unsigned long counts;
   int *junk;
   double r;
   double potential;
   
-  if (icomp->ispec->upper_cutoffs[index_among_defined_intrxns] == -1.0) return; // There is no sampling here
+  if (icomp->ispec->upper_cutoffs[index_among_defined_intrxns] == -1.0) { // There is no sampling here
+    fclose(rdf_file);
+    return;
+  }
   int num_entries = (2 * (int)((icomp->ispec->upper_cutoffs[index_among_defined_intrxns] - icomp->ispec->lower_cutoffs[index_among_defined_intrxns])/icomp->ispec->get_fm_binwidth()));
+  num_entries = start_BI_system(icomp, mat, index_among_defined_intrxns, num_entries);
+  ParameterDistribution &distribution = icomp->ispec->parameter_distributions[index_among_defined_intrxns];
   
-  std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[num_entries - 1];
-  char buffer[100];
-  fgets(buffer,100,curr_dist_input_file); 
+  std::array<double, DIMENSION>* derivatives = new std::array<double, DIMENSION>[num_entries];
   for(int i = 0; i < num_entries; i++)
     {
 	  int first_nonzero_basis_index;
 	  double normalized_counts;
-      fscanf(curr_dist_input_file,"%lf %d\n",&r,&counts);
+      r = distribution.bin_centers[i];
+      counts = distribution.bin_counts[i];
       if (counts > 0) {
 	      normalized_counts = (double)(counts) * 2.0 * mat->normalization / num_of_pairs;
     	  potential = -mat->temperature*mat->boltzmann*log(normalized_counts);
@@ -742,12 +842,10 @@ void read_one_param_dist_file_other(InteractionClassComputer* const icomp, char*
       }
       
       icomp->fm_s_comp->calculate_basis_fn_vals(index_among_defined_intrxns, r, first_nonzero_basis_index, icomp->fm_basis_fn_vals);
-      mat->accumulate_matching_forces(icomp, first_nonzero_basis_index, icomp->fm_basis_fn_vals, counter, junk, derivatives, mat);
-      mat->accumulate_target_force_element(mat, counter, &potential);
-      counter++;
+      mat->accumulate_matching_forces(icomp, first_nonzero_basis_index, icomp->fm_basis_fn_vals, i, junk, derivatives, mat);
+      mat->accumulate_target_force_element(mat, i, &potential);
     }
   delete [] derivatives;
-  fclose(curr_dist_input_file);
   fclose(rdf_file);
 }
 
@@ -14,6 +14,10 @@ struct MATRIX_DATA;
 // Initialization of storage for the range value arrays and their computation
 void initialize_range_finding_temps(CG_MODEL_DATA* const cg);
 
+// Combine the ranges and histograms found by a separate model over other frames;
+// the histograms of thread_cg are freed once merged.
+void merge_range_finding_temps(CG_MODEL_DATA* const cg, CG_MODEL_DATA* const thread_cg);
+
 // Main output function
 void write_range_files(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat);
 
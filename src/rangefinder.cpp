@@ -8,9 +8,12 @@
 //  Copyright (c) 2016 The Voth Group at The University of Chicago. All rights reserved.
 //
 
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <ctime>
+#include <thread>
+#include <vector>
 #include "control_input.h"
 #include "force_computation.h"
 #include "interaction_hashing.h"
@@ -21,7 +24,22 @@
 #include "trajectory_input.h"
 #include "fm_output.h"
 
+// Number of frames each thread takes from a batch read for parallel range finding.
+#define RANGE_FINDING_FRAMES_PER_THREAD 16
+
+// Model and cell lists of one thread finding ranges over its share of the frames.
+struct RangeFindingThread {
+	CG_MODEL_DATA* cg;
+	PairCellList pair_cell_list;
+	ThreeBCellList three_body_cell_list;
+	double ref_box_half_lengths[DIMENSION];
+	bool cell_list_set_up;
+};
+
 void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source);
+void find_ranges_in_parallel(ControlInputs* const control_input, CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source);
+void find_ranges_in_frame_batch(RangeFindingThread* const thread, MATRIX_DATA* const mat, FrameConfig** const frames, const int n_frames, const int first_frame, const int frame_stride);
+void join_range_finding_workers(std::vector<std::thread> &workers);
 
 int main(int argc, char* argv[])
 {
@@ -39,6 +57,10 @@ int main(int argc, char* argv[])
         printf("Rangefinder does not support three body nonbonded interaction ranges.\n");
         exit(EXIT_FAILURE);
     }
+    if (control_input.num_range_finding_threads < 1) {
+        printf("Invalid num_range_finding_threads (%d)!\n", control_input.num_range_finding_threads);
+        exit(EXIT_FAILURE);
+    }
     printf("Reading topology file.\n");
     read_topology_file(&cg.topo_data, &cg);
 
@@ -54,6 +76,10 @@ int main(int argc, char* argv[])
     printf("Reading first frame.\n");
     printf("Finding first frame ...\n");
     fs.get_first_frame(&fs, cg.n_cg_sites, cg.topo_data.cg_site_types);
+    if (fs.site_reordering_style != 0) {
+        set_up_site_reordering(&fs, cg.topo_data.cg_site_types);
+        reorder_topology_sites(&cg.topo_data, fs.site_order, fs.site_rank);
+    }
 
     printf("Reading interaction ranges.\n");
     initialize_range_finding_temps(&cg);
@@ -63,7 +89,11 @@ int main(int argc, char* argv[])
     MATRIX_DATA mat(&control_input, &cg);
 
     printf("Beginning range finding.\n");
-    construct_full_fm_matrix(&cg, &mat, &fs);
+    if (control_input.num_range_finding_threads > 1) {
+    	find_ranges_in_parallel(&control_input, &cg, &mat, &fs);
+    } else {
+    	construct_full_fm_matrix(&cg, &mat, &fs);
+    }
     printf("Ending range finding.\n");
     
     printf("Writing final output.\n"); fflush(stdout);
@@ -258,3 +288,129 @@ void construct_full_fm_matrix(CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, F
     delete [] ref_box_half_lengths;
     
 }
+
+// Find ranges with several threads. The trajectory is read in batches of frames,
+// each batch being split among the threads while the next one is read. Each thread
+// finds ranges with its own model, and the ranges and parameter histograms of
+// all threads are merged into the main model at the end.
+
+void find_ranges_in_parallel(ControlInputs* const control_input, CG_MODEL_DATA* const cg, MATRIX_DATA* const mat, FrameSource* const frame_source)
+{
+	int n_threads = control_input->num_range_finding_threads;
+	if ( (frame_source->dynamic_types != 0) || (frame_source->dynamic_state_sampling != 0) ) {
+		printf("num_range_finding_threads above 1 is not available with dynamic_types or dynamic_state_sampling.\n");
+		exit(EXIT_FAILURE);
+	}
+	std::list<InteractionClassSpec*>::iterator iclass_iterator;
+	for (iclass_iterator = cg->iclass_list.begin(); iclass_iterator != cg->iclass_list.end(); iclass_iterator++) {
+		if ((*iclass_iterator)->output_parameter_distribution == 2) {
+			printf("num_range_finding_threads above 1 is not available with output_*_parameter_distribution 2.\n");
+			exit(EXIT_FAILURE);
+		}
+	}
+	
+	// Thread 0 uses the main model.
+	std::vector<RangeFindingThread> threads(n_threads);
+	for (int t = 0; t < n_threads; t++) {
+		if (t == 0) {
+			threads[t].cg = cg;
+		} else {
+			printf("Setting up range finding thread %d.\n", t);
+			threads[t].cg = new CG_MODEL_DATA(control_input);
+			read_topology_file(&threads[t].cg->topo_data, threads[t].cg);
+			if (frame_source->site_reordering_style != 0) reorder_topology_sites(&threads[t].cg->topo_data, frame_source->site_order, frame_source->site_rank);
+			initialize_range_finding_temps(threads[t].cg);
+		}
+		threads[t].cell_list_set_up = false;
+	}
+	
+	// Two batches of frames are kept: one being read and one being processed.
+	int batch_size = n_threads * RANGE_FINDING_FRAMES_PER_THREAD;
+	int n_sites = frame_source->frame_config->current_n_sites;
+	FrameConfig** batches[2];
+	int n_batch_frames[2] = {0, 0};
+	for (int b = 0; b < 2; b++) {
+		batches[b] = new FrameConfig*[batch_size];
+		for (int i = 0; i < batch_size; i++) batches[b][i] = new FrameConfig(n_sites);
+	}
+	std::vector<std::thread> workers;
+	int current = 0;
+	
+    frame_source->move_to_start_frame(frame_source);
+    printf("Entering primary range-finding loop with %d threads.\n", n_threads); fflush(stdout);
+	for (int frame_index = 0; frame_index < frame_source->n_frames; frame_index++) {
+		if ( (frame_index > 0) && ((*frame_source->get_next_frame)(frame_source) == 0) ) {
+			printf("Failure reading frame %d (%d). Check trajectory for errors.\n", frame_source->current_frame_n, frame_index);
+			exit(EXIT_FAILURE);
+		}
+		
+		// Frames with zero weight are not used for ranges.
+		if ( (frame_source->use_statistical_reweighting == 0) || (frame_source->frame_weights[frame_index] != 0.0) ) {
+			FrameConfig* frame_config = frame_source->getFrameConfig();
+			FrameConfig* frame_copy = batches[current][n_batch_frames[current]];
+			if (frame_config->current_n_sites != n_sites) {
+				printf("num_range_finding_threads above 1 is not available with changing numbers of sites.\n");
+				exit(EXIT_FAILURE);
+			}
+			std::copy(frame_config->x, frame_config->x + n_sites, frame_copy->x);
+			for (int i = 0; i < DIMENSION; i++) frame_copy->simulation_box_half_lengths[i] = frame_config->simulation_box_half_lengths[i];
+			n_batch_frames[current]++;
+		}
+		
+		if ( (n_batch_frames[current] == batch_size) || (frame_index + 1 == frame_source->n_frames) ) {
+			join_range_finding_workers(workers);
+			for (int t = 0; t < n_threads; t++) {
+				workers.push_back(std::thread(find_ranges_in_frame_batch, &threads[t], mat, batches[current], n_batch_frames[current], t, n_threads));
+			}
+			current = 1 - current;
+			n_batch_frames[current] = 0;
+	        printf("\r%d (%d) frames have been sampled. ", frame_source->current_frame_n, frame_index + 1);
+    	    fflush(stdout);
+		}
+	}
+	join_range_finding_workers(workers);
+    printf("\nFinishing frame parsing.\n");
+    frame_source->cleanup(frame_source);
+	
+	for (int t = 1; t < n_threads; t++) {
+		merge_range_finding_temps(cg, threads[t].cg);
+		free_name(threads[t].cg);
+		delete threads[t].cg;
+	}
+	for (int b = 0; b < 2; b++) {
+		for (int i = 0; i < batch_size; i++) delete batches[b][i];
+		delete [] batches[b];
+	}
+}
+
+// Find ranges in every frame_stride-th frame of a batch, starting from first_frame.
+
+void find_ranges_in_frame_batch(RangeFindingThread* const thread, MATRIX_DATA* const mat, FrameConfig** const frames, const int n_frames, const int first_frame, const int frame_stride)
+{
+	for (int frame = first_frame; frame < n_frames; frame += frame_stride) {
+		FrameConfig* frame_config = frames[frame];
+		
+		// Set up the cell lists again if the simulation box has changed.
+		int box_change = 0;
+		if (thread->cell_list_set_up == false) {
+			box_change = 1;
+		} else {
+			for (int i = 0; i < DIMENSION; i++) {
+				if ( fabs(thread->ref_box_half_lengths[i] - frame_config->simulation_box_half_lengths[i]) > VERYSMALL_F ) box_change = 1;
+			}
+		}
+		if (box_change == 1) {
+			thread->pair_cell_list = PairCellList();
+			thread->pair_cell_list.init(thread->cg->pair_nonbonded_interactions.cutoff, frame_config);
+			for (int i = 0; i < DIMENSION; i++) thread->ref_box_half_lengths[i] = frame_config->simulation_box_half_lengths[i];
+			thread->cell_list_set_up = true;
+		}
+		calculate_frame_fm_matrix(thread->cg, mat, frame_config, thread->pair_cell_list, thread->three_body_cell_list, 0);
+	}
+}
+
+void join_range_finding_workers(std::vector<std::thread> &workers)
+{
+	for (unsigned i = 0; i < workers.size(); i++) workers[i].join();
+	workers.clear();
+}
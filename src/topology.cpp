@@ -33,6 +33,8 @@ bool new_excluded_partner(unsigned** const excluded_partners, const int location
 void report_topology_input_format_error(const int line, char *parameter_name);
 // Search function for molecular exclusion.
 void recursive_exclusion_search(TopologyData const* topo_data, TopoList* &exclusion_list, std::vector<int> &path_list);
+// Permute a single topology list to a new site order.
+void reorder_topo_list(TopoList* const topo_list, const std::vector<int> &site_order, const std::vector<int> &site_rank);
 
 //---------------------------------------------------------------
 // Functions for managing TopoList structs
@@ -878,6 +880,36 @@ void setup_excluded_list( TopologyData const* topo_data, TopoList* &exclusion_li
     }
 }
 
+// Reorder all per-site topology data after the sites have been reordered for locality.
+
+void reorder_topology_sites(TopologyData* const topo_data, const std::vector<int> &site_order, const std::vector<int> &site_rank)
+{
+	std::vector<int> temp_types(topo_data->cg_site_types, topo_data->cg_site_types + topo_data->n_cg_sites);
+	for (unsigned i = 0; i < topo_data->n_cg_sites; i++) topo_data->cg_site_types[i] = temp_types[site_order[i]];
+	
+	reorder_topo_list(topo_data->bond_list, site_order, site_rank);
+	reorder_topo_list(topo_data->angle_list, site_order, site_rank);
+	reorder_topo_list(topo_data->dihedral_list, site_order, site_rank);
+	reorder_topo_list(topo_data->exclusion_list, site_order, site_rank);
+	reorder_topo_list(topo_data->density_exclusion_list, site_order, site_rank);
+}
+
+void reorder_topo_list(TopoList* const topo_list, const std::vector<int> &site_order, const std::vector<int> &site_rank)
+{
+	if (topo_list == NULL) return;
+	
+	// Move each site's partner list to its new position, then relabel the partners.
+	std::vector<unsigned> temp_numbers(topo_list->partner_numbers_, topo_list->partner_numbers_ + topo_list->n_sites_);
+	std::vector<unsigned*> temp_partners(topo_list->partners_, topo_list->partners_ + topo_list->n_sites_);
+	for (unsigned i = 0; i < topo_list->n_sites_; i++) {
+		topo_list->partner_numbers_[i] = temp_numbers[site_order[i]];
+		topo_list->partners_[i] = temp_partners[site_order[i]];
+		for (unsigned j = 0; j < topo_list->partner_numbers_[i] * topo_list->partners_per_; j++) {
+			topo_list->partners_[i][j] = site_rank[topo_list->partners_[i][j]];
+		}
+	}
+}
+
 bool new_excluded_partner(unsigned** const excluded_partners, const int location, const unsigned current_size, const unsigned new_site) {
 	for(unsigned i = 0; i < current_size; i++) {
 		if (excluded_partners[location][i] == new_site)	return false;
@@ -8,6 +8,8 @@
 #ifndef _topology_h
 #define _topology_h
 
+#include <vector>
+
 struct CG_MODEL_DATA;
 
 struct TopoList {
@@ -92,4 +94,7 @@ void initialize_topology_data(TopologyData* const topo_data);
 
 // Determine appropriate non-bonded exclusions based on bonded topology and exclusion_style setting (used for LAMMPS fix).
 void setup_excluded_list(TopologyData const* topo_data,  TopoList* &exclusion_list, const int excluded_style);
+
+// Permute the site types and all topology lists to a new site order (site_order[new] = old, site_rank[old] = new).
+void reorder_topology_sites(TopologyData* const topo_data, const std::vector<int> &site_order, const std::vector<int> &site_rank);
 #endif
@@ -5,7 +5,9 @@
 //  Copyright (c) 2016 The Voth Group at The University of Chicago. All rights reserved.
 //
 
+#include <algorithm>
 #include <cassert>
+#include <cmath>
 #include <cstdio>
 #include <cstdlib>
 #include <cstring>
@@ -110,6 +112,12 @@ int next_nothing(FrameSource* const frame_source);
 // Read all frames up until a starting frame.
 void default_move_to_starting_frame(FrameSource* const frame_source);
 
+// Provide cached frames in place of the trajectory.
+int get_next_cached_frame(FrameSource* const frame_source);
+void load_cached_frame(FrameSource* const frame_source, const int frame);
+void do_not_move_to_start_frame(FrameSource* const frame_source);
+void free_frame_cache(FrameSource* const frame_source);
+
 // Read frame-wise entries into an array.
 inline void read_stream_into_array(std::ifstream &in_file, const int start_frame, const int n_frames, double* &values);
 
@@ -124,6 +132,11 @@ void read_lammps_header(LammpsData* const lammps_data, int* const current_n_site
 int read_dimension_lammps_body(LammpsData* const lammps_data, FrameConfig* const frame_config, const int dynamic_types, const int dynamic_state_sampling, const int no_forces);
 inline void set_random_number_seed(const uint_fast32_t random_num_seed);
 
+// Helpers for reordering sites along a space-filling curve
+void reorder_frame_sites(FrameSource* const frame_source);
+template <typename T> void apply_site_order(const std::vector<int> &site_order, T* const values);
+uint64_t calc_space_filling_curve_key(std::array<unsigned, DIMENSION> cell, const int bits_per_dimension, const int reordering_style);
+
 //-------------------------------------------------------------
 // Misc. small file-reading helper functions.
 //-------------------------------------------------------------
@@ -262,6 +275,7 @@ void xtc_setup(FrameSource* const frame_source, const char* filename1, const cha
 void copy_control_inputs_to_frd(ControlInputs* const control_input, FrameSource* const frame_source)
 {
     frame_source->use_statistical_reweighting = control_input->use_statistical_reweighting;
+    frame_source->frame_cache = NULL;
     frame_source->pressure_constraint_flag = control_input->pressure_constraint_flag;
     frame_source->dynamic_types = control_input->dynamic_types;
     frame_source->dynamic_state_sampling = control_input->dynamic_state_sampling;
@@ -269,8 +283,12 @@ void copy_control_inputs_to_frd(ControlInputs* const control_input, FrameSource*
 	frame_source->bootstrapping_flag = control_input->bootstrapping_flag;
 	frame_source->bootstrapping_num_subsamples = control_input->bootstrapping_num_subsamples;
 	frame_source->bootstrapping_num_estimates = control_input->bootstrapping_num_estimates;
+	frame_source->bootstrapping_block_size = control_input->bootstrapping_block_size;
+	frame_source->bootstrapping_weight_style = control_input->bootstrapping_weight_style;
     frame_source->random_num_seed = control_input->random_num_seed;
     frame_source->position_dimension = control_input->position_dimension;
+    frame_source->site_reordering_style = control_input->site_reordering_style;
+    frame_source->site_reordering_by_type = control_input->site_reordering_by_type;
     frame_source->starting_frame = control_input->starting_frame;
     frame_source->n_frames = control_input->n_frames;
     frame_source->no_forces = 0;
@@ -284,6 +302,7 @@ void copy_control_inputs_to_frd(ControlInputs* const control_input, FrameSource*
 inline void finish_general_reading(FrameSource *const frame_source)
 {
     delete frame_source->frame_config;
+    free_frame_cache(frame_source);
     if (frame_source->use_statistical_reweighting == 1) delete [] frame_source->frame_weights;
     if (frame_source->pressure_constraint_flag == 1) delete [] frame_source->pressure_constraint_rhs_vector;
 }
@@ -511,6 +530,7 @@ int read_next_trr_frame(FrameSource* const frame_source)
     for (int i = 0; i < DIMENSION; i++) frame_source->frame_config->simulation_box_half_lengths[i] = frame_source->simulation_box_limits[i][i] * 0.5;
     frame_source->current_frame_n += 1;
 	#endif
+    reorder_frame_sites(frame_source);
     
     // Return any relevant error codes.
     return return_val;
@@ -538,6 +558,7 @@ int read_next_xtc_frame(FrameSource* const frame_source)
     for (int i = 0; i < DIMENSION; i++) frame_source->frame_config->simulation_box_half_lengths[i] = frame_source->simulation_box_limits[i][i] * 0.5;
     frame_source->current_frame_n += 1;
 	#endif
+    reorder_frame_sites(frame_source);
 	
     // Return any relevant error codes.
     return return_val;
@@ -563,6 +584,7 @@ int read_next_lammps_frame(FrameSource* const frame_source)
     // Finish up by changing information simply determined by the data just read.
 	for (int i = 0; i < DIMENSION; i++) frame_source->frame_config->simulation_box_half_lengths[i] = frame_source->simulation_box_limits[i][i] * 0.5;
     frame_source->current_frame_n += 1;
+    reorder_frame_sites(frame_source);
 
  	// Return 1 if successful, 0 otherwise.
  	return return_value;
@@ -771,12 +793,14 @@ void FrameSource::sampleTypesFromProbs()
 	double rand;
         std::uniform_real_distribution<double> uniform_dist(0.0, 1.0);
 	// Determine each site's type/state by comparing the probability against a random number
+	// Probabilities are kept in trajectory order so that the same random numbers are drawn if sites are reordered.
 	for(int i = 0; i < frame_config->current_n_sites; i++) {
+		int site = (site_rank.size() > 0) ? site_rank[i] : i;
 		// Generate random number [0,1] using Mersenne Twister.
 		rand = uniform_dist(mt_rand_gen);
 		// Make state assignment based on comparison.
-		if (rand > lammps_data->cg_site_state_probabilities[i]) frame_config->cg_site_types[i] = 2;
-		else frame_config->cg_site_types[i] = 1;
+		if (rand > lammps_data->cg_site_state_probabilities[i]) frame_config->cg_site_types[site] = 2;
+		else frame_config->cg_site_types[site] = 1;
 	}
 }
 
@@ -833,9 +857,6 @@ inline void read_stream_into_array(std::ifstream &in_file, const int start_frame
 
 void generate_bootstrapping_weights(FrameSource* const frame_source, const int num_frames)
 {
-	std::uniform_int_distribution<int> uniform_dist(0, num_frames - 1);
-	int rand_frame;
-	
 	if (frame_source->bootstrapping_num_estimates < 1) {
 		printf("Cannot request 0 or negative bootstrapping estimates (%d).\n", frame_source->bootstrapping_num_estimates);
 		fflush(stdout);
@@ -847,20 +868,56 @@ void generate_bootstrapping_weights(FrameSource* const frame_source, const int n
 		exit(EXIT_FAILURE);
 	}
 	
+	if (frame_source->bootstrapping_block_size < 1) {
+		printf("Cannot request a bootstrapping block size less than 1 (%d).\n", frame_source->bootstrapping_block_size);
+		fflush(stdout);
+		exit(EXIT_FAILURE);
+	}
+	if ( (frame_source->bootstrapping_weight_style < 0) || (frame_source->bootstrapping_weight_style > 1) ) {
+		printf("Unrecognized bootstrapping_weight_style %d.\n", frame_source->bootstrapping_weight_style);
+		fflush(stdout);
+		exit(EXIT_FAILURE);
+	}
+	
 	// Allocate and initialize bootstrapping_weights
 	frame_source->bootstrapping_weights = new double*[frame_source->bootstrapping_num_estimates];
 	for (int i = 0; i < frame_source->bootstrapping_num_estimates; i++) {
 		frame_source->bootstrapping_weights[i] = new double[num_frames]();
 	}
 	
-	// For each estimate, generate num_subsamples discrete weights.
-	// Weights are assigned using random number generator.
+	// Frames are resampled in blocks of bootstrapping_block_size consecutive frames,
+	// and every frame in a block receives the weight of that block.
+	int block_size = frame_source->bootstrapping_block_size;
+	int num_blocks = (num_frames + block_size - 1) / block_size;
+	double* block_weights = new double[num_blocks];
+	std::uniform_int_distribution<int> uniform_dist(0, num_blocks - 1);
+	std::poisson_distribution<int> poisson_dist((double)(frame_source->bootstrapping_num_subsamples) / (double)(num_blocks));
+	
 	for (int estimate = 0; estimate < frame_source->bootstrapping_num_estimates; estimate++) {
-		for (int sample = 0; sample < frame_source->bootstrapping_num_subsamples; sample++) {
-			rand_frame = uniform_dist(frame_source->mt_rand_gen);
-			frame_source->bootstrapping_weights[estimate][rand_frame] += 1.0;
+		for (int block = 0; block < num_blocks; block++) block_weights[block] = 0.0;
+		
+		if (frame_source->bootstrapping_weight_style == 0) {
+			// Distribute num_subsamples discrete weights using the random number generator.
+			for (int sample = 0; sample < frame_source->bootstrapping_num_subsamples; sample++) {
+				block_weights[uniform_dist(frame_source->mt_rand_gen)] += 1.0;
+			}
+		} else {
+			// Draw each block weight independently so that the expected total weight is num_subsamples,
+			// redrawing the rare estimate that would receive no weight at all.
+			double total_weight = 0.0;
+			while (total_weight == 0.0) {
+				for (int block = 0; block < num_blocks; block++) {
+					block_weights[block] = (double)(poisson_dist(frame_source->mt_rand_gen));
+					total_weight += block_weights[block];
+				}
+			}
+		}
+		
+		for (int frame = 0; frame < num_frames; frame++) {
+			frame_source->bootstrapping_weights[estimate][frame] = block_weights[frame / block_size];
 		}
 	}
+	delete [] block_weights;
 }
 
 void combine_reweighting_and_boostrapping_weights(FrameSource* const frame_source) {
@@ -878,6 +935,229 @@ void free_bootstrapping_weights(FrameSource* const frame_source)
 	}
 	delete [] frame_source->bootstrapping_weights;
 }
+//-------------------------------------------------------------
+// Reordering of CG sites along a space-filling curve
+//-------------------------------------------------------------
+
+// Sort key for a single site: optionally its type, then its position along the curve.
+
+struct SiteOrderingKey {
+	int type;
+	uint64_t curve_key;
+	int site;
+	
+	inline bool operator<(const SiteOrderingKey &other) const {
+		if (type != other.type) return type < other.type;
+		if (curve_key != other.curve_key) return curve_key < other.curve_key;
+		return site < other.site;
+	}
+};
+
+// Sites that are close in space end up close in memory, and so do the FM matrix
+// rows they contribute to. The ordering is fixed by the first frame; everything
+// reported per interaction is independent of the order of the sites.
+
+void set_up_site_reordering(FrameSource* const frame_source, const int* const cg_site_types)
+{
+	if (frame_source->site_reordering_style == 0) return;
+	if ((frame_source->site_reordering_style != 1) && (frame_source->site_reordering_style != 2)) {
+		printf("Unrecognized site_reordering_style %d!\n", frame_source->site_reordering_style);
+		exit(EXIT_FAILURE);
+	}
+	
+	FrameConfig* const frame_config = frame_source->frame_config;
+	const int n_sites = frame_config->current_n_sites;
+	const int bits_per_dimension = std::min(16, 63 / DIMENSION);
+	const unsigned n_cells_per_dimension = 1u << bits_per_dimension;
+	
+	// Map each site into the periodic box and compute its key along the curve.
+	std::vector<SiteOrderingKey> keys(n_sites);
+	for (int i = 0; i < n_sites; i++) {
+		std::array<unsigned, DIMENSION> cell;
+		for (int j = 0; j < DIMENSION; j++) {
+			double box_length = 2.0 * frame_config->simulation_box_half_lengths[j];
+			double fraction = frame_config->x[i][j] / box_length;
+			fraction -= floor(fraction);
+			cell[j] = std::min(unsigned(fraction * n_cells_per_dimension), n_cells_per_dimension - 1);
+		}
+		keys[i].type = (frame_source->site_reordering_by_type == 1) ? cg_site_types[i] : 0;
+		keys[i].curve_key = calc_space_filling_curve_key(cell, bits_per_dimension, frame_source->site_reordering_style);
+		keys[i].site = i;
+	}
+	std::sort(keys.begin(), keys.end());
+	
+	frame_source->site_order = std::vector<int>(n_sites);
+	frame_source->site_rank = std::vector<int>(n_sites);
+	for (int i = 0; i < n_sites; i++) {
+		frame_source->site_order[i] = keys[i].site;
+		frame_source->site_rank[keys[i].site] = i;
+	}
+	
+	// Site types of the first frame are permuted with the rest of the topology.
+	apply_site_order(frame_source->site_order, frame_config->x);
+	if (frame_source->no_forces == 0) apply_site_order(frame_source->site_order, frame_config->f);
+	
+	printf("Reordered %d sites along a %s curve%s.\n", n_sites, (frame_source->site_reordering_style == 1) ? "Morton" : "Hilbert", 
+		(frame_source->site_reordering_by_type == 1) ? " within each site type" : "");
+}
+
+// Apply the site ordering to the positions, forces, and (if read from the
+// trajectory) types of the frame that was just read.
+
+void reorder_frame_sites(FrameSource* const frame_source)
+{
+	if (frame_source->site_order.size() == 0) return;
+	FrameConfig* const frame_config = frame_source->frame_config;
+	apply_site_order(frame_source->site_order, frame_config->x);
+	if (frame_source->no_forces == 0) apply_site_order(frame_source->site_order, frame_config->f);
+	if ((frame_source->dynamic_types == 1) && (frame_source->dynamic_state_sampling == 0)) apply_site_order(frame_source->site_order, frame_config->cg_site_types);
+}
+
+template <typename T> void apply_site_order(const std::vector<int> &site_order, T* const values)
+{
+	std::vector<T> temp_values(values, values + site_order.size());
+	for (unsigned i = 0; i < site_order.size(); i++) values[i] = temp_values[site_order[i]];
+}
+
+// Calculate the index of a grid cell along a Morton (style 1) or Hilbert (style 2) curve.
+// The Hilbert transform follows J. Skilling, AIP Conf. Proc. 707, 381 (2004).
+
+uint64_t calc_space_filling_curve_key(std::array<unsigned, DIMENSION> cell, const int bits_per_dimension, const int reordering_style)
+{
+	if (reordering_style == 2) {
+		unsigned highest_bit = 1u << (bits_per_dimension - 1);
+		// Undo excess work.
+		for (unsigned q = highest_bit; q > 1; q >>= 1) {
+			unsigned p = q - 1;
+			for (int i = 0; i < DIMENSION; i++) {
+				if (cell[i] & q) {
+					cell[0] ^= p;
+				} else {
+					unsigned t = (cell[0] ^ cell[i]) & p;
+					cell[0] ^= t;
+					cell[i] ^= t;
+				}
+			}
+		}
+		// Gray encode.
+		for (int i = 1; i < DIMENSION; i++) cell[i] ^= cell[i - 1];
+		unsigned t = 0;
+		for (unsigned q = highest_bit; q > 1; q >>= 1) {
+			if (cell[DIMENSION - 1] & q) t ^= q - 1;
+		}
+		for (int i = 0; i < DIMENSION; i++) cell[i] ^= t;
+	}
+	
+	// Interleave the bits of each dimension, most significant first.
+	uint64_t key = 0;
+	for (int b = bits_per_dimension - 1; b >= 0; b--) {
+		for (int i = 0; i < DIMENSION; i++) {
+			key = (key << 1) | ((cell[i] >> b) & 1u);
+		}
+	}
+	return key;
+}
+
+//-------------------------------------------------------------
+// Caching of frames
+//-------------------------------------------------------------
+
+// Positions, forces, and box of each cached frame, and the trajectory reading
+// functions to go back to once they have all been provided again.
+
+struct FrameCache {
+	int n_sites;
+	int n_frames;
+	int next_frame;
+	std::vector<std::array<double, DIMENSION> > x;
+	std::vector<std::array<double, DIMENSION> > f;
+	std::vector<real> simulation_box_half_lengths;
+	std::vector<int> timesteps;
+	std::vector<real> times;
+	std::vector<int> frame_numbers;
+	int (*get_next_frame)(FrameSource * const frame_source);
+	int (*get_junk_frame)(FrameSource * const frame_source);
+};
+
+void cache_current_frame(FrameSource* const frame_source)
+{
+	if (frame_source->frame_cache == NULL) {
+		frame_source->frame_cache = new FrameCache;
+		frame_source->frame_cache->n_sites = frame_source->frame_config->current_n_sites;
+		frame_source->frame_cache->n_frames = 0;
+	}
+	FrameCache* cache = frame_source->frame_cache;
+	FrameConfig* frame_config = frame_source->frame_config;
+	if (frame_config->current_n_sites != cache->n_sites) {
+		printf("Cannot cache frames with changing numbers of sites.\n");
+		exit(EXIT_FAILURE);
+	}
+	cache->x.insert(cache->x.end(), frame_config->x, frame_config->x + cache->n_sites);
+	cache->f.insert(cache->f.end(), frame_config->f, frame_config->f + cache->n_sites);
+	cache->simulation_box_half_lengths.insert(cache->simulation_box_half_lengths.end(), frame_config->simulation_box_half_lengths, frame_config->simulation_box_half_lengths + DIMENSION);
+	cache->timesteps.push_back(frame_source->current_timestep);
+	cache->times.push_back(frame_source->time);
+	cache->frame_numbers.push_back(frame_source->current_frame_n);
+	cache->n_frames++;
+}
+
+// Load the first cached frame and switch the frame source over to the cache.
+// The trajectory has already been moved to the start frame, so moving there
+// again does nothing.
+
+void replay_frame_cache(FrameSource* const frame_source)
+{
+	FrameCache* cache = frame_source->frame_cache;
+	cache->get_next_frame = frame_source->get_next_frame;
+	cache->get_junk_frame = frame_source->get_junk_frame;
+	frame_source->get_next_frame = get_next_cached_frame;
+	frame_source->get_junk_frame = get_next_cached_frame;
+	frame_source->move_to_start_frame = do_not_move_to_start_frame;
+	load_cached_frame(frame_source, 0);
+	cache->next_frame = 1;
+}
+
+int get_next_cached_frame(FrameSource* const frame_source)
+{
+	FrameCache* cache = frame_source->frame_cache;
+	if (cache->next_frame < cache->n_frames) {
+		load_cached_frame(frame_source, cache->next_frame);
+		cache->next_frame++;
+		return 1;
+	}
+	
+	// Once all cached frames have been provided, free the cache and go on
+	// with the trajectory from the frame after the last one cached.
+	frame_source->current_frame_n = cache->frame_numbers[cache->n_frames - 1];
+	frame_source->get_next_frame = cache->get_next_frame;
+	frame_source->get_junk_frame = cache->get_junk_frame;
+	free_frame_cache(frame_source);
+	return (*frame_source->get_next_frame)(frame_source);
+}
+
+void load_cached_frame(FrameSource* const frame_source, const int frame)
+{
+	FrameCache* cache = frame_source->frame_cache;
+	FrameConfig* frame_config = frame_source->frame_config;
+	std::copy(cache->x.begin() + frame * cache->n_sites, cache->x.begin() + (frame + 1) * cache->n_sites, frame_config->x);
+	std::copy(cache->f.begin() + frame * cache->n_sites, cache->f.begin() + (frame + 1) * cache->n_sites, frame_config->f);
+	for (int i = 0; i < DIMENSION; i++) {
+		frame_config->simulation_box_half_lengths[i] = cache->simulation_box_half_lengths[frame * DIMENSION + i];
+		frame_source->simulation_box_limits[i][i] = 2.0 * frame_config->simulation_box_half_lengths[i];
+	}
+	frame_source->current_timestep = cache->timesteps[frame];
+	frame_source->time = cache->times[frame];
+	frame_source->current_frame_n = cache->frame_numbers[frame];
+}
+
+void do_not_move_to_start_frame(FrameSource* const frame_source) {}
+
+void free_frame_cache(FrameSource* const frame_source)
+{
+	delete frame_source->frame_cache;
+	frame_source->frame_cache = NULL;
+}
+
 //--------------------------------------------------------------------
 // Cell list routines for two- or three-body nonbonded interactions
 //--------------------------------------------------------------------
@@ -894,7 +1174,12 @@ int add_3B_stencil_element(const std::vector<int>& cell_number, const std::vecto
 
 void BaseCellList::init(const double cutoff, const FrameSource* const fr)
 {
-    setUpCellListCells(cutoff, fr->frame_config->simulation_box_half_lengths, fr->frame_config->current_n_sites);
+    init(cutoff, fr->frame_config);
+}
+
+void BaseCellList::init(const double cutoff, const FrameConfig* const frame_config)
+{
+    setUpCellListCells(cutoff, frame_config->simulation_box_half_lengths, frame_config->current_n_sites);
     setUpCellListStencil();
 }
 
@@ -30,6 +30,7 @@
 struct ControlInputs;
 struct LammpsData;
 struct XRDData;
+struct FrameCache;
 
 typedef real matrix[3][3];
 
@@ -86,12 +87,18 @@ struct FrameSource {
     int bootstrapping_flag;					// 1 to use bootstrapping; 0 otherwise
 	int bootstrapping_num_subsamples;		// Number of subsamples per estimate (amount of discrete frame weight to distribute) if bootstrapping_flag is 1
 	int bootstrapping_num_estimates;		// Number of estimates (separate bootstrap estimates constructed) if bootstrapping_flag is 1
+	int bootstrapping_block_size;			// Number of consecutive frames resampled together if bootstrapping_flag is 1
+	int bootstrapping_weight_style;			// 0 to draw bootstrapping_num_subsamples blocks with replacement; 1 for Poisson block weights
 	uint_fast32_t random_num_seed;			// Random number seed only used if dynamic_state_sampling or bootstrapping_flag is 1
     int starting_frame;                     // Trajectory frame number to start from
     int n_frames;                           // Total number of frames to read for this force matching
     char trajectory_filename[1000];         // Trajectory file name (positions for .xtc, forces and positions for .trr)
     std::mt19937 mt_rand_gen;    			// A Mersenne Twister random number generator for dynamic state sampling.
 	int position_dimension;					// The number of elements in each particle's position vector.
+	int site_reordering_style;				// 0 to keep trajectory site order; 1 to reorder sites along a Morton curve; 2 to reorder along a Hilbert curve
+	int site_reordering_by_type;			// 1 to group reordered sites by type before ordering them spatially; 0 otherwise
+	std::vector<int> site_order;			// The trajectory index of each reordered site (empty if sites are not reordered)
+	std::vector<int> site_rank;				// The reordered index of each trajectory site (the inverse of site_order)
 	
     // Type-dependent source data and functions
     TrajectoryType trajectory_type;         // 0 to use .trr format trajectories; 1 to use .xtc format trajectories; 2 to use LAMMPS trajectories
@@ -126,6 +133,7 @@ struct FrameSource {
 	double** bootstrapping_weights;
 	
 	FrameConfig* frame_config;
+	FrameCache* frame_cache;						// Frames kept to be provided again, if any
     inline FrameConfig* getFrameConfig() { return frame_config;}
     void sampleTypesFromProbs();
 };
@@ -138,6 +146,25 @@ void parse_command_line_arguments(const int num_arg, char** arg, FrameSource* co
 // Copy trajectory-reading specifications from ControlInputs to FRAME_DATA.
 void copy_control_inputs_to_frd(struct ControlInputs* const control_input, FrameSource* const frame_source);
 
+//-------------------------------------------------------------
+// Optional reordering of CG sites for memory locality.
+//-------------------------------------------------------------
+
+// Determine a space-filling-curve ordering of the sites from the current frame 
+// and apply it to that frame; all later frames are reordered as they are read.
+void set_up_site_reordering(FrameSource* const frame_source, const int* const cg_site_types);
+
+//-------------------------------------------------------------
+// Caching of frames so that they can be provided again without
+// rereading the trajectory.
+//-------------------------------------------------------------
+
+// Keep a copy of the current frame.
+void cache_current_frame(FrameSource* const frame_source);
+// Provide the cached frames again, starting with the first, then go on 
+// reading the trajectory after the last frame that was cached.
+void replay_frame_cache(FrameSource* const frame_source);
+
 //-------------------------------------------------------------
 // Auxiliary-trajectory reading functions.
 //-------------------------------------------------------------
@@ -177,6 +204,7 @@ class BaseCellList {
 
 public:
     void init(const double cutoff, const FrameSource* const fr);
+    void init(const double cutoff, const FrameConfig* const frame_config);
     void populateList(const int n_particles, std::array<double, DIMENSION>* const &particle_positions);
     inline int get_stencil_size() const { return stencil_size; };
     inline double get_cell_size(int i) const {return cell_size[i]; };